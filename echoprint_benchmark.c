@@ -0,0 +1,604 @@
+/*
+ * Copyright (c) 2016 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+  echoprint-benchmark: time the build, load and queries of an index,
+  made either of synthetic songs or of the echoprint strings of a
+  directory (the test fingerprints over and over). Synthetic codes
+  follow a Zipf distribution of exponent `skew` over 2^`vocabulary`
+  codes, so that a few codes have long codeblocks as in real
+  fingerprints. Queries are random windows of indexed songs with some
+  random codes added. Everything is drawn from a seeded generator, so
+  that runs with the same options time the same work.
+
+  One JSON object per measurement is written per line, for regression
+  tracking; a readable summary goes to stderr.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include "libechoprintserver.h"
+
+#define MAX_LIST 16
+
+typedef struct
+{
+  uint32_t **songs_codes;
+  uint32_t *song_lengths;
+  uint32_t n_songs;
+} Songs;
+
+static uint64_t random_state;
+
+// xorshift64*
+static uint64_t next_random(void)
+{
+  random_state ^= random_state >> 12;
+  random_state ^= random_state << 25;
+  random_state ^= random_state >> 27;
+  return random_state * 2685821657736338717ULL;
+}
+
+static double next_uniform(void)
+{
+  return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/*
+  Songs.
+ */
+
+// cumulative Zipf distribution over 2^vocabulary_log2 ranks
+static double *zipf_cdf(int vocabulary_log2, double skew)
+{
+  uint32_t r, n = 1u << vocabulary_log2;
+  double *cdf = (double *) malloc(sizeof(double) * n), total = 0;
+  for(r = 0; r < n; r++)
+    cdf[r] = (total += pow(r + 1, -skew));
+  for(r = 0; r < n; r++)
+    cdf[r] /= total;
+  return cdf;
+}
+
+// a code drawn from `cdf`; ranks are spread over the code space by a
+// multiplication by an odd constant, a bijection modulo 2^vocabulary
+static uint32_t next_code(const double *cdf, int vocabulary_log2)
+{
+  uint32_t lo = 0, hi = (1u << vocabulary_log2) - 1, mid;
+  double u = next_uniform();
+  while(lo < hi)
+  {
+    mid = lo + (hi - lo) / 2;
+    if(cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return (lo * 2654435761u) & ((1u << vocabulary_log2) - 1);
+}
+
+static void synthetic_songs(Songs *songs, uint32_t n_songs,
+                            uint32_t codes_per_song, const double *cdf,
+                            int vocabulary_log2)
+{
+  uint32_t s, c;
+  songs->songs_codes = (uint32_t **) malloc(sizeof(uint32_t *) * n_songs);
+  songs->song_lengths = (uint32_t *) malloc(sizeof(uint32_t) * n_songs);
+  songs->n_songs = n_songs;
+  for(s = 0; s < n_songs; s++)
+  {
+    // lengths vary by +-50% around the mean, as those of fingerprints
+    uint32_t length = codes_per_song / 2 +
+      (uint32_t) (next_random() % (codes_per_song + 1));
+    songs->songs_codes[s] = (uint32_t *) malloc(sizeof(uint32_t) * length);
+    songs->song_lengths[s] = length;
+    for(c = 0; c < length; c++)
+      songs->songs_codes[s][c] = next_code(cdf, vocabulary_log2);
+  }
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// the echoprint strings of the `*.echoprint` files of `dir`, in name
+// order, repeated up to `n_songs` songs (sharing the code arrays)
+static int fingerprint_songs(Songs *songs, uint32_t n_songs, const char *dir)
+{
+  DIR *d = opendir(dir);
+  struct dirent *entry;
+  char **names = 0, path[4096], *line = 0;
+  size_t n_names = 0, line_capacity = 0, f;
+  ssize_t length;
+  uint32_t s, n_distinct = 0;
+  if(d == 0)
+    return 1;
+  while((entry = readdir(d)) != 0)
+  {
+    size_t name_length = strlen(entry->d_name);
+    if(name_length < 10 ||
+       strcmp(entry->d_name + name_length - 10, ".echoprint") != 0)
+      continue;
+    names = (char **) realloc(names, sizeof(char *) * (n_names + 1));
+    names[n_names++] = strdup(entry->d_name);
+  }
+  closedir(d);
+  if(n_names == 0)
+    return 1;
+  qsort(names, n_names, sizeof(char *), compare_strings);
+  songs->songs_codes = (uint32_t **) malloc(sizeof(uint32_t *) * n_songs);
+  songs->song_lengths = (uint32_t *) malloc(sizeof(uint32_t) * n_songs);
+  songs->n_songs = n_songs;
+  for(f = 0; f < n_names && f < n_songs; f++)
+  {
+    FILE *fp;
+    uint32_t *codes, *offsets;
+    long n_codes;
+    snprintf(path, sizeof(path), "%s/%s", dir, names[f]);
+    fp = fopen(path, "r");
+    if(fp == 0 || (length = getline(&line, &line_capacity, fp)) == -1)
+      return 1;
+    fclose(fp);
+    while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+      line[--length] = '\0';
+    codes = (uint32_t *) malloc(sizeof(uint32_t) * (length + 1));
+    offsets = (uint32_t *) malloc(sizeof(uint32_t) * (length + 1));
+    n_codes = echoprint_decode(line, length, codes, offsets, length + 1);
+    free(offsets);
+    if(n_codes < 0 || n_codes > length + 1)
+    {
+      fprintf(stderr, "could not decode %s\n", path);
+      return 1;
+    }
+    songs->songs_codes[n_distinct] = codes;
+    songs->song_lengths[n_distinct++] = (uint32_t) n_codes;
+  }
+  for(s = n_distinct; s < n_songs; s++)
+  {
+    songs->songs_codes[s] = songs->songs_codes[s % n_distinct];
+    songs->song_lengths[s] = songs->song_lengths[s % n_distinct];
+  }
+  for(f = 0; f < n_names; f++)
+    free(names[f]);
+  free(names);
+  free(line);
+  return 0;
+}
+
+/*
+  Queries: a window of `fraction` of the codes of a random song, then
+  `noise` times as many codes drawn from the distribution (or taken
+  from other songs when there is none). Concatenated in `codes`.
+ */
+typedef struct
+{
+  uint32_t n_queries;
+  uint32_t *lengths;
+  uint64_t *offsets;
+  uint32_t *codes;
+} Queries;
+
+static void make_queries(Queries *queries, uint32_t n_queries,
+                         const Songs *songs, double fraction, double noise,
+                         const double *cdf, int vocabulary_log2)
+{
+  uint32_t q, c;
+  uint64_t total = 0, capacity = 1024;
+  queries->n_queries = n_queries;
+  queries->lengths = (uint32_t *) malloc(sizeof(uint32_t) * n_queries);
+  queries->offsets = (uint64_t *) malloc(sizeof(uint64_t) * n_queries);
+  queries->codes = (uint32_t *) malloc(sizeof(uint32_t) * capacity);
+  for(q = 0; q < n_queries; q++)
+  {
+    uint32_t s = (uint32_t) (next_random() % songs->n_songs);
+    uint32_t song_length = songs->song_lengths[s];
+    uint32_t window = (uint32_t) (song_length * fraction) + 1;
+    uint32_t n_noise = (uint32_t) (window * noise), start;
+    if(window > song_length)
+      window = song_length;
+    start = (uint32_t) (next_random() % (song_length - window + 1));
+    while(total + window + n_noise > capacity)
+      capacity *= 2;
+    queries->codes = (uint32_t *)
+      realloc(queries->codes, sizeof(uint32_t) * capacity);
+    queries->offsets[q] = total;
+    memcpy(queries->codes + total, songs->songs_codes[s] + start,
+           sizeof(uint32_t) * window);
+    for(c = 0; c < n_noise; c++)
+      if(cdf)
+        queries->codes[total + window + c] = next_code(cdf, vocabulary_log2);
+      else
+      {
+        uint32_t other = (uint32_t) (next_random() % songs->n_songs);
+        queries->codes[total + window + c] = songs->songs_codes[other][
+          next_random() % songs->song_lengths[other]];
+      }
+    queries->lengths[q] = window + n_noise;
+    total += window + n_noise;
+  }
+}
+
+/*
+  Measurements.
+ */
+
+static FILE *output;
+
+static int parse_list(char *s, int *values)
+{
+  int n = 0;
+  char *saveptr, *token;
+  for(token = strtok_r(s, ",", &saveptr); token && n < MAX_LIST;
+      token = strtok_r(0, ",", &saveptr))
+    if((values[n] = atoi(token)) > 0)
+      n++;
+  return n;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, uint32_t n, double p)
+{
+  return sorted[(size_t) (p * (n - 1) + 0.5)];
+}
+
+static int benchmark_build(const Songs *songs, uint32_t n_blocks,
+                           char **paths, int postings_format,
+                           int n_threads)
+{
+  uint32_t ***blocks_songs_codes, **blocks_song_lengths, *blocks_n_songs, b;
+  double start, elapsed;
+  int error;
+  blocks_songs_codes = (uint32_t ***) malloc(sizeof(uint32_t **) * n_blocks);
+  blocks_song_lengths = (uint32_t **) malloc(sizeof(uint32_t *) * n_blocks);
+  blocks_n_songs = (uint32_t *) malloc(sizeof(uint32_t) * n_blocks);
+  for(b = 0; b < n_blocks; b++)
+  {
+    uint32_t first = (uint32_t) ((uint64_t) songs->n_songs * b / n_blocks);
+    uint32_t last = (uint32_t) ((uint64_t) songs->n_songs * (b + 1) / n_blocks);
+    blocks_songs_codes[b] = songs->songs_codes + first;
+    blocks_song_lengths[b] = songs->song_lengths + first;
+    blocks_n_songs[b] = last - first;
+  }
+  start = now();
+  error = echoprint_inverted_index_build_write_blocks(
+    n_blocks, blocks_songs_codes, blocks_song_lengths, blocks_n_songs, paths,
+    0, postings_format, n_threads);
+  elapsed = now() - start;
+  free(blocks_songs_codes);
+  free(blocks_song_lengths);
+  free(blocks_n_songs);
+  if(error)
+    return 1;
+  fprintf(output, "{\"benchmark\": \"build\", \"songs\": %u, \"blocks\": %u, "
+          "\"threads\": %d, \"seconds\": %.6f, \"songs_per_second\": %.1f}\n",
+          songs->n_songs, n_blocks, n_threads, elapsed,
+          songs->n_songs / elapsed);
+  fprintf(stderr, "build: %u block(s), %d thread(s): %.3f s, %.0f songs/s\n",
+          n_blocks, n_threads, elapsed, songs->n_songs / elapsed);
+  return 0;
+}
+
+static EchoprintInvertedIndex *benchmark_load(char **paths, uint32_t n_blocks,
+                                              int flags, const char *name)
+{
+  double start = now(), elapsed;
+  EchoprintInvertedIndex *index =
+    echoprint_inverted_index_load_from_paths_with_flags(paths, n_blocks,
+                                                        flags);
+  elapsed = now() - start;
+  if(index == 0)
+    return 0;
+  fprintf(output, "{\"benchmark\": \"load\", \"mode\": \"%s\", "
+          "\"seconds\": %.6f}\n", name, elapsed);
+  fprintf(stderr, "load (%s): %.3f s\n", name, elapsed);
+  return index;
+}
+
+static void benchmark_queries(EchoprintInvertedIndex *index,
+                              const Queries *queries, similarity_function sim,
+                              const char *sim_name, uint32_t n_results,
+                              int n_threads,
+                              const EchoprintQueryOptions *options)
+{
+  uint32_t q, *indices;
+  float *scores;
+  double *latencies, start, total;
+  EchoprintQueryContext *context = echoprint_query_context_new();
+  indices = (uint32_t *) malloc(sizeof(uint32_t) * n_results);
+  scores = (float *) malloc(sizeof(float) * n_results);
+  latencies = (double *) malloc(sizeof(double) * queries->n_queries);
+  total = 0;
+  for(q = 0; q < queries->n_queries; q++)
+  {
+    start = now();
+    echoprint_inverted_index_query_with_context(
+      context, queries->lengths[q], queries->codes + queries->offsets[q],
+      index, n_results, indices, scores, sim, options);
+    latencies[q] = now() - start;
+    total += latencies[q];
+  }
+  qsort(latencies, queries->n_queries, sizeof(double), compare_doubles);
+  fprintf(output, "{\"benchmark\": \"query\", \"similarity\": \"%s\", "
+          "\"n_results\": %u, \"threads\": %d, \"queries\": %u, "
+          "\"max_code_frequency\": %g, \"frequent_codes\": \"%s\", "
+          "\"qps\": %.1f, \"mean_ms\": %.4f, \"p50_ms\": %.4f, "
+          "\"p90_ms\": %.4f, \"p99_ms\": %.4f, \"max_ms\": %.4f}\n",
+          sim_name, n_results, n_threads, queries->n_queries,
+          options->max_code_frequency,
+          options->frequent_codes == ECHOPRINT_FREQUENT_CODES_SKIP ?
+          "skip" : "defer",
+          queries->n_queries / total, total * 1e3 / queries->n_queries,
+          percentile(latencies, queries->n_queries, 0.5) * 1e3,
+          percentile(latencies, queries->n_queries, 0.9) * 1e3,
+          percentile(latencies, queries->n_queries, 0.99) * 1e3,
+          latencies[queries->n_queries - 1] * 1e3);
+  fprintf(stderr, "query %s, %u result(s), %d thread(s): %.0f queries/s, "
+          "p50 %.3f ms, p99 %.3f ms\n", sim_name, n_results, n_threads,
+          queries->n_queries / total,
+          percentile(latencies, queries->n_queries, 0.5) * 1e3,
+          percentile(latencies, queries->n_queries, 0.99) * 1e3);
+  free(indices);
+  free(scores);
+  free(latencies);
+  echoprint_query_context_free(context);
+}
+
+static void usage(char *name)
+{
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -s  number of songs (default: 20000)\n"
+          "  -c  mean number of codes per synthetic song (default: 1000)\n"
+          "  -v  log2 of the number of distinct synthetic codes (default: 20)\n"
+          "  -z  Zipf exponent of the synthetic codes, 0 for uniform "
+          "(default: 1.0)\n"
+          "  -f  directory of *.echoprint files to index instead of "
+          "synthetic songs\n"
+          "  -q  number of queries (default: 1000)\n"
+          "  -w  fraction of a song taken by each query (default: 0.3)\n"
+          "  -e  random codes added to a query, per query code "
+          "(default: 0.2)\n"
+          "  -t  comma-separated thread counts (default: 1,2,4)\n"
+          "  -n  comma-separated result counts (default: 1,10,100)\n"
+          "  -b  number of blocks (default: as few as possible)\n"
+          "  -l  large blocks, of more than 65535 songs if need be\n"
+          "  -p  compressed (version 2) blocks\n"
+          "  -x  max_code_frequency of the queries (default: 0, all codes "
+          "scored)\n"
+          "  -k  skip frequent codes rather than defer them\n"
+          "  -r  random seed (default: 1)\n"
+          "  -d  directory for the index files (default: /tmp)\n"
+          "  -o  JSON output file (default: stdout)\n",
+          name);
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  int opt, vocabulary_log2 = 20, postings_format = ECHOPRINT_POSTINGS_RAW16;
+  int threads[MAX_LIST] = {1, 2, 4}, n_threads = 3;
+  int results[MAX_LIST] = {1, 10, 100}, n_n_results = 3, t, r, m;
+  uint32_t n_songs = 20000, codes_per_song = 1000, n_queries = 1000;
+  uint32_t n_blocks = 0, b, max_block_songs = ECHOPRINT_RAW16_MAX_SONGS;
+  uint64_t n_postings = 0;
+  double skew = 1.0, fraction = 0.3, noise = 0.2, *cdf = 0;
+  char *fingerprints = 0, *temp_parent = "/tmp", temp_dir[4096], **paths;
+  Songs songs;
+  Queries queries;
+  EchoprintInvertedIndex *index = 0;
+  const int load_flags[3] = {
+    0, ECHOPRINT_LOAD_MMAP | ECHOPRINT_LOAD_PREFETCH,
+    ECHOPRINT_LOAD_CODE_DIRECTORY};
+  const char *load_names[3] = {"read", "mmap", "code_directory"};
+  const similarity_function sims[3] = {
+    JACCARD, SET_INT, SET_INT_NORM_LENGTH_FIRST};
+  const char *sim_names[3] = {
+    "jaccard", "set_int", "set_int_norm_length_first"};
+  EchoprintQueryOptions options;
+
+  output = stdout;
+  random_state = 1;
+  memset(&options, 0, sizeof(EchoprintQueryOptions));
+  while((opt = getopt(argc, argv, "s:c:v:z:f:q:w:e:t:n:b:lpx:kr:d:o:h")) != -1)
+    switch(opt)
+    {
+    case 's':
+      n_songs = (uint32_t) strtoul(optarg, 0, 10);
+      break;
+    case 'c':
+      codes_per_song = (uint32_t) strtoul(optarg, 0, 10);
+      break;
+    case 'v':
+      vocabulary_log2 = atoi(optarg);
+      break;
+    case 'z':
+      skew = atof(optarg);
+      break;
+    case 'f':
+      fingerprints = optarg;
+      break;
+    case 'q':
+      n_queries = (uint32_t) strtoul(optarg, 0, 10);
+      break;
+    case 'w':
+      fraction = atof(optarg);
+      break;
+    case 'e':
+      noise = atof(optarg);
+      break;
+    case 't':
+      n_threads = parse_list(optarg, threads);
+      break;
+    case 'n':
+      n_n_results = parse_list(optarg, results);
+      break;
+    case 'b':
+      n_blocks = (uint32_t) strtoul(optarg, 0, 10);
+      break;
+    case 'l':
+      max_block_songs = UINT32_MAX;
+      break;
+    case 'p':
+      postings_format = ECHOPRINT_POSTINGS_STREAMVBYTE;
+      break;
+    case 'x':
+      options.max_code_frequency = (float) atof(optarg);
+      break;
+    case 'k':
+      options.frequent_codes = ECHOPRINT_FREQUENT_CODES_SKIP;
+      break;
+    case 'r':
+      random_state = strtoull(optarg, 0, 10) | 1;
+      break;
+    case 'd':
+      temp_parent = optarg;
+      break;
+    case 'o':
+      if((output = fopen(optarg, "w")) == 0)
+      {
+        fprintf(stderr, "could not open %s\n", optarg);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+    }
+  if(optind != argc || n_songs == 0 || n_queries == 0 || n_threads == 0 ||
+     n_n_results == 0 || codes_per_song == 0 || vocabulary_log2 < 1 ||
+     vocabulary_log2 > 31 || fraction <= 0 || fraction > 1 || noise < 0)
+    usage(argv[0]);
+  if(n_blocks == 0)
+    n_blocks = (uint32_t)
+      (((uint64_t) n_songs + max_block_songs - 1) / max_block_songs);
+  if((n_songs + n_blocks - 1) / n_blocks > max_block_songs ||
+     n_blocks > n_songs)
+    usage(argv[0]);
+
+  if(fingerprints)
+  {
+    if(fingerprint_songs(&songs, n_songs, fingerprints))
+    {
+      fprintf(stderr, "could not read fingerprints from %s\n", fingerprints);
+      return 1;
+    }
+  }
+  else
+  {
+    cdf = zipf_cdf(vocabulary_log2, skew);
+    synthetic_songs(&songs, n_songs, codes_per_song, cdf, vocabulary_log2);
+  }
+  make_queries(&queries, n_queries, &songs, fraction, noise, cdf,
+               vocabulary_log2);
+
+  snprintf(temp_dir, sizeof(temp_dir), "%s/echoprint-benchmark-XXXXXX",
+           temp_parent);
+  if(mkdtemp(temp_dir) == 0)
+  {
+    perror("mkdtemp");
+    return 1;
+  }
+  paths = (char **) malloc(sizeof(char *) * n_blocks);
+  for(b = 0; b < n_blocks; b++)
+  {
+    paths[b] = (char *) malloc(strlen(temp_dir) + 24);
+    snprintf(paths[b], strlen(temp_dir) + 24, "%s/block_%04u", temp_dir, b);
+  }
+
+  for(t = 0; t < n_threads; t++)
+    if(benchmark_build(&songs, n_blocks, paths, postings_format, threads[t]))
+    {
+      fprintf(stderr, "could not build the index in %s\n", temp_dir);
+      return 1;
+    }
+
+  for(m = 0; m < 3; m++)
+  {
+    if(index)
+      echoprint_inverted_index_free(index);
+    if((index = benchmark_load(paths, n_blocks, load_flags[m],
+                               load_names[m])) == 0)
+    {
+      fprintf(stderr, "could not load the index\n");
+      return 1;
+    }
+  }
+  for(b = 0; b < index->n_blocks; b++)
+  {
+    uint32_t c;
+    for(c = 0; c < index->blocks[b].n_codes; c++)
+      n_postings += index->blocks[b].code_lengths[c];
+  }
+  // as loaded: raw blocks of too many songs have 32-bit postings
+  postings_format = index->blocks[0].postings_format;
+  fprintf(output, "{\"benchmark\": \"index\", \"source\": \"%s\", "
+          "\"songs\": %u, \"blocks\": %u, \"postings\": %llu, "
+          "\"postings_format\": %d, \"codes_per_song\": %u, "
+          "\"vocabulary_log2\": %d, \"skew\": %g}\n",
+          fingerprints ? "fingerprints" : "synthetic", n_songs, n_blocks,
+          (unsigned long long) n_postings, postings_format,
+          fingerprints ? 0 : codes_per_song, vocabulary_log2, skew);
+  fprintf(stderr, "index: %u songs, %llu postings\n", n_songs,
+          (unsigned long long) n_postings);
+
+  // queries run on the last index loaded, with a code directory
+  for(t = 0; t < n_threads; t++)
+  {
+    if(echoprint_inverted_index_set_n_threads(index, threads[t]))
+    {
+      fprintf(stderr, "could not start %d threads\n", threads[t]);
+      return 1;
+    }
+    for(m = 0; m < 3; m++)
+      for(r = 0; r < n_n_results; r++)
+        benchmark_queries(index, &queries, sims[m], sim_names[m],
+                          (uint32_t) results[r], threads[t], &options);
+  }
+
+  echoprint_inverted_index_free(index);
+  for(b = 0; b < n_blocks; b++)
+  {
+    unlink(paths[b]);
+    free(paths[b]);
+  }
+  free(paths);
+  rmdir(temp_dir);
+  if(output != stdout)
+    fclose(output);
+  return 0;
+}
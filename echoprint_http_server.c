@@ -0,0 +1,1053 @@
+/*
+ * Copyright (c) 2016 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+  echoprint-http-server: native counterpart of bin/echoprint-rest-service,
+  answering `POST /query/<method>` (with a form-encoded `echoprint`
+  parameter) with the same JSON. One thread runs an epoll loop that
+  accepts connections and reads and writes them without blocking;
+  complete requests are handed to a pool of worker threads, which
+  decode and query the single loaded index concurrently and pass the
+  responses back to the loop through an eventfd. Connections are kept
+  alive as HTTP/1.1 asks.
+
+  With -s, the server is a router in front of shard servers instead of
+  loading an index: each shard is an echoprint-http-server holding a
+  contiguous range of the blocks, started with -b set to the global
+  index of its first song. A query is sent to all the shards at once
+  and their top results merged, as a single index holding all the
+  blocks would rank them. Shards that fail or do not answer in time
+  are left out, and the response is then marked as partial.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "libechoprintserver.h"
+
+#define MAX_HEADER_LENGTH (64 * 1024)
+#define MAX_BODY_LENGTH (64 * 1024 * 1024)
+#define READ_CHUNK 65536
+#define MAX_EVENTS 256
+#define MAX_RESULTS 1000
+
+typedef struct _Connection
+{
+  int fd;
+  char *in;                 // bytes read and not yet served
+  size_t in_length;
+  size_t in_capacity;
+  size_t request_length;    // bytes of `in` taken by the current request
+  char *method;             // of the current request, pointing into `in`
+  char *path;
+  char *body;
+  size_t body_length;
+  int keep_alive;
+  char *out;                // response being sent
+  size_t out_length;
+  size_t out_sent;
+  struct _Connection *next; // in the job or done queue
+} Connection;
+
+// a queue of connections guarded by its own lock
+typedef struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  Connection *head;
+  Connection *tail;
+} Queue;
+
+static Queue jobs = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0};
+static Queue done = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0};
+static int epoll_fd, done_fd;
+static EchoprintInvertedIndex *inverted_index;
+static char **ids;
+static uint32_t n_ids;
+static uint32_t n_results = 10;
+static uint32_t song_index_base = 0;
+
+typedef struct
+{
+  char *name;               // host:port, as given
+  struct sockaddr_storage address;
+  socklen_t address_length;
+} Shard;
+
+static Shard *shards;
+static int n_shards;
+static int shard_timeout_ms = 1000;
+
+static void queue_push(Queue *queue, Connection *conn)
+{
+  conn->next = 0;
+  pthread_mutex_lock(&queue->lock);
+  if(queue->tail)
+    queue->tail->next = conn;
+  else
+    queue->head = conn;
+  queue->tail = conn;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+// pop a connection, waiting for one if `wait`, else 0 if empty
+static Connection *queue_pop(Queue *queue, int wait)
+{
+  Connection *conn;
+  pthread_mutex_lock(&queue->lock);
+  while(wait && queue->head == 0)
+    pthread_cond_wait(&queue->not_empty, &queue->lock);
+  conn = queue->head;
+  if(conn)
+  {
+    queue->head = conn->next;
+    if(queue->head == 0)
+      queue->tail = 0;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return conn;
+}
+
+/*
+  Responses.
+ */
+
+static void append(Connection *conn, size_t *capacity, const char *data,
+                   size_t length)
+{
+  if(conn->out_length + length > *capacity)
+  {
+    while(conn->out_length + length > *capacity)
+      *capacity *= 2;
+    conn->out = (char *) realloc(conn->out, *capacity);
+  }
+  memcpy(conn->out + conn->out_length, data, length);
+  conn->out_length += length;
+}
+
+static void append_json_string(Connection *conn, size_t *capacity,
+                               const char *s)
+{
+  char escaped[8];
+  append(conn, capacity, "\"", 1);
+  for(; *s; s++)
+    if(*s == '"' || *s == '\\')
+    {
+      escaped[0] = '\\';
+      escaped[1] = *s;
+      append(conn, capacity, escaped, 2);
+    }
+    else if((unsigned char) *s < 0x20)
+      append(conn, capacity, escaped,
+             sprintf(escaped, "\\u%04x", (unsigned char) *s));
+    else
+      append(conn, capacity, s, 1);
+  append(conn, capacity, "\"", 1);
+}
+
+// set the response of `conn` to `status` with a JSON `body`
+static void respond(Connection *conn, const char *status, const char *body,
+                    size_t body_length)
+{
+  char header[256];
+  size_t capacity = 256 + body_length;
+  conn->out = (char *) malloc(capacity);
+  conn->out_length = 0;
+  conn->out_sent = 0;
+  append(conn, &capacity, header, sprintf(
+           header, "HTTP/1.1 %s\r\nContent-Type: application/json\r\n"
+           "Content-Length: %lu\r\nConnection: %s\r\n\r\n", status,
+           (unsigned long) body_length, conn->keep_alive ? "keep-alive" :
+           "close"));
+  append(conn, &capacity, body, body_length);
+}
+
+static void respond_error(Connection *conn, const char *status,
+                          const char *message)
+{
+  char body[256];
+  respond(conn, status, body,
+          snprintf(body, sizeof(body), "{\"error\": \"%s\"}", message));
+}
+
+/*
+  Queries, run by the workers.
+ */
+
+static int hex_value(char ch)
+{
+  if(ch >= '0' && ch <= '9')
+    return ch - '0';
+  if((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f')
+    return (ch | 0x20) - 'a' + 10;
+  return -1;
+}
+
+// URL-decode the value of `key` in a form-encoded body into a
+// malloc-ed string; 0 if there is no such key
+static char *form_value(const char *body, size_t length, const char *key,
+                        size_t *value_length)
+{
+  size_t i = 0, key_length = strlen(key), n;
+  char *value;
+  while(i < length)
+  {
+    size_t end = i;
+    while(end < length && body[end] != '&')
+      end++;
+    if(end - i > key_length && body[i + key_length] == '=' &&
+       memcmp(body + i, key, key_length) == 0)
+    {
+      value = (char *) malloc(end - i);
+      for(i += key_length + 1, n = 0; i < end; i++)
+        if(body[i] == '+')
+          value[n++] = ' ';
+        else if(body[i] == '%' && i + 2 < end &&
+                hex_value(body[i + 1]) >= 0 && hex_value(body[i + 2]) >= 0)
+        {
+          value[n++] = (char) (hex_value(body[i + 1]) * 16 +
+                               hex_value(body[i + 2]));
+          i += 2;
+        }
+        else
+          value[n++] = body[i];
+      value[n] = '\0';
+      *value_length = n;
+      return value;
+    }
+    i = end + 1;
+  }
+  return 0;
+}
+
+// respond with the results, the song indices shifted by `index_base`;
+// `extra` is added to the JSON object
+static void respond_results(Connection *conn, uint32_t n_found,
+                            uint32_t *indices, float *scores,
+                            uint32_t index_base, const char *extra)
+{
+  char number[64];
+  size_t capacity = 64 + 128 * n_found + strlen(extra);
+  uint32_t n;
+  Connection body;
+
+  // the JSON body is built in a scratch connection's output
+  body.out = (char *) malloc(capacity);
+  body.out_length = 0;
+  append(&body, &capacity, "{\"results\": [", 13);
+  for(n = 0; n < n_found; n++)
+  {
+    if(n > 0)
+      append(&body, &capacity, ", ", 2);
+    append(&body, &capacity, "{", 1);
+    if(ids != 0 && indices[n] < n_ids)
+    {
+      append(&body, &capacity, "\"id\": ", 6);
+      append_json_string(&body, &capacity, ids[indices[n]]);
+      append(&body, &capacity, ", ", 2);
+    }
+    append(&body, &capacity, number, sprintf(
+             number, "\"index\": %u, \"score\": %.17g}",
+             indices[n] + index_base, (double) scores[n]));
+  }
+  append(&body, &capacity, "]", 1);
+  append(&body, &capacity, extra, strlen(extra));
+  append(&body, &capacity, "}", 1);
+  respond(conn, "200 OK", body.out, body.out_length);
+  free(body.out);
+}
+
+// number of results asked for by the optional `results` parameter, or
+// the default; 0 if invalid
+static uint32_t requested_results(Connection *conn)
+{
+  size_t length;
+  char *value = form_value(conn->body, conn->body_length, "results",
+                           &length), *end;
+  unsigned long n;
+  if(value == 0)
+    return n_results;
+  n = strtoul(value, &end, 10);
+  if(end == value || *end != '\0' || n > MAX_RESULTS)
+    n = 0;
+  free(value);
+  return (uint32_t) n;
+}
+
+static void serve_query(Connection *conn, EchoprintQueryContext *context,
+                        similarity_function sim, uint32_t n)
+{
+  char *echoprint;
+  size_t echoprint_length;
+  long n_codes;
+  uint32_t n_found, *codes, *offsets, *indices;
+  float *scores;
+
+  echoprint = form_value(conn->body, conn->body_length, "echoprint",
+                         &echoprint_length);
+  if(echoprint == 0)
+  {
+    respond_error(conn, "400 Bad Request", "no echoprint parameter");
+    return;
+  }
+  n_codes = (long) echoprint_length + 1;
+  for(;;)
+  {
+    long capacity_codes = n_codes;
+    codes = (uint32_t *) malloc(sizeof(uint32_t) * capacity_codes);
+    offsets = (uint32_t *) malloc(sizeof(uint32_t) * capacity_codes);
+    n_codes = echoprint_decode(echoprint, echoprint_length, codes, offsets,
+                               capacity_codes);
+    free(offsets);
+    if(n_codes <= capacity_codes)
+      break;
+    free(codes);
+  }
+  free(echoprint);
+  if(n_codes < 0)
+  {
+    free(codes);
+    respond_error(conn, "400 Bad Request", "invalid echoprint string");
+    return;
+  }
+
+  indices = (uint32_t *) malloc(sizeof(uint32_t) * n);
+  scores = (float *) malloc(sizeof(float) * n);
+  n_found = echoprint_inverted_index_query_with_context(
+    context, (uint32_t) n_codes, codes, inverted_index, n, indices, scores,
+    sim, 0);
+  free(codes);
+  respond_results(conn, n_found, indices, scores, song_index_base, "");
+  free(indices);
+  free(scores);
+}
+
+/*
+  Routing to the shards.
+ */
+
+enum
+{
+  SHARD_SENDING,
+  SHARD_RECEIVING,
+  SHARD_DONE,
+  SHARD_FAILED
+};
+
+typedef struct
+{
+  int fd;
+  int state;
+  size_t sent;
+  char *response;
+  size_t response_length;
+  size_t response_capacity;
+} ShardCall;
+
+typedef struct
+{
+  uint32_t index;
+  float score;
+} Result;
+
+// as the library ranks them: by decreasing score, ties won by the
+// larger index
+static int compare_results(const void *a, const void *b)
+{
+  const Result *x = (const Result *) a, *y = (const Result *) b;
+  if(x->score != y->score)
+    return x->score > y->score ? -1 : 1;
+  return x->index > y->index ? -1 : x->index < y->index;
+}
+
+static double now_ms(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e3 + t.tv_nsec * 1e-6;
+}
+
+// append the results of a shard's response to `results`; return 1 if
+// it is not a successful response of a shard
+static int parse_shard_response(ShardCall *call, Result **results,
+                                uint32_t *n_results_found,
+                                uint32_t *capacity)
+{
+  char *p, *end;
+  if(call->response_length < 12 ||
+     strncmp(call->response, "HTTP/1.1 200", 12) != 0)
+    return 1;
+  call->response[call->response_length] = '\0';
+  p = strstr(call->response, "\r\n\r\n");
+  if(p == 0 || (p = strstr(p, "{\"results\": [")) == 0)
+    return 1;
+  while((p = strstr(p, "\"index\": ")) != 0)
+  {
+    Result result;
+    result.index = (uint32_t) strtoul(p + 9, &end, 10);
+    if(end == p + 9 || strncmp(end, ", \"score\": ", 11) != 0)
+      return 1;
+    p = end + 11;
+    result.score = (float) strtod(p, &end);
+    if(end == p)
+      return 1;
+    if(*n_results_found == *capacity)
+    {
+      *capacity *= 2;
+      *results = (Result *) realloc(*results, sizeof(Result) * *capacity);
+    }
+    (*results)[(*n_results_found)++] = result;
+    p = end;
+  }
+  return 0;
+}
+
+// send the query to all the shards and wait for their responses, until
+// the timeout; the calls not done by then are failed
+static void call_shards(ShardCall *calls, const char *request,
+                        size_t request_length)
+{
+  struct pollfd *fds = (struct pollfd *)
+    malloc(sizeof(struct pollfd) * n_shards);
+  int *fd_shards = (int *) malloc(sizeof(int) * n_shards);
+  double deadline = now_ms() + shard_timeout_ms;
+  int i, n_fds;
+
+  for(i = 0; i < n_shards; i++)
+  {
+    ShardCall *call = calls + i;
+    memset(call, 0, sizeof(ShardCall));
+    call->fd = socket(shards[i].address.ss_family,
+                      SOCK_STREAM | SOCK_NONBLOCK, 0);
+    call->state = SHARD_SENDING;
+    if(call->fd < 0 ||
+       (connect(call->fd, (struct sockaddr *) &(shards[i].address),
+                shards[i].address_length) && errno != EINPROGRESS))
+      call->state = SHARD_FAILED;
+  }
+
+  for(;;)
+  {
+    double remaining = deadline - now_ms();
+    n_fds = 0;
+    for(i = 0; i < n_shards; i++)
+      if(calls[i].state == SHARD_SENDING || calls[i].state == SHARD_RECEIVING)
+      {
+        fds[n_fds].fd = calls[i].fd;
+        fds[n_fds].events =
+          calls[i].state == SHARD_SENDING ? POLLOUT : POLLIN;
+        fds[n_fds].revents = 0;
+        fd_shards[n_fds++] = i;
+      }
+    if(n_fds == 0 || remaining <= 0)
+      break;
+    if(poll(fds, n_fds, (int) remaining + 1) < 0 && errno != EINTR)
+      break;
+    for(i = 0; i < n_fds; i++)
+    {
+      ShardCall *call = calls + fd_shards[i];
+      ssize_t n;
+      if(fds[i].revents == 0)
+        continue;
+      if(call->state == SHARD_SENDING)
+      {
+        n = send(call->fd, request + call->sent, request_length - call->sent,
+                 MSG_NOSIGNAL);
+        if(n < 0 && errno != EAGAIN && errno != EINTR)
+          call->state = SHARD_FAILED;
+        else if(n > 0 && (call->sent += n) == request_length)
+          call->state = SHARD_RECEIVING;
+        continue;
+      }
+      if(call->response_capacity - call->response_length < READ_CHUNK)
+      {
+        call->response_capacity = call->response_length + 2 * READ_CHUNK;
+        call->response = (char *)
+          realloc(call->response, call->response_capacity + 1);
+      }
+      n = recv(call->fd, call->response + call->response_length,
+               call->response_capacity - call->response_length, 0);
+      if(n == 0)
+        call->state = SHARD_DONE;
+      else if(n > 0)
+        call->response_length += n;
+      else if(errno != EAGAIN && errno != EINTR)
+        call->state = SHARD_FAILED;
+    }
+  }
+
+  for(i = 0; i < n_shards; i++)
+  {
+    if(calls[i].state != SHARD_DONE)
+      calls[i].state = SHARD_FAILED;
+    if(calls[i].fd >= 0)
+      close(calls[i].fd);
+  }
+  free(fds);
+  free(fd_shards);
+}
+
+static void route_query(Connection *conn, const char *method, uint32_t n)
+{
+  char *request, *extra, parameter[32];
+  size_t request_length, parameter_length, extra_length = 64;
+  ShardCall *calls;
+  Result *results;
+  uint32_t i, n_found = 0, capacity = 64, *indices;
+  float *scores;
+  int s, n_failed = 0;
+
+  // the number of results is set first, so that it wins over the one
+  // of the client
+  parameter_length = sprintf(parameter, "results=%u&", n);
+  request = (char *) malloc(256 + strlen(method) + conn->body_length);
+  request_length = sprintf(
+    request, "POST /query/%s HTTP/1.1\r\nHost: shard\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "Content-Length: %lu\r\nConnection: close\r\n\r\n%s", method,
+    (unsigned long) (parameter_length + conn->body_length), parameter);
+  memcpy(request + request_length, conn->body, conn->body_length);
+  request_length += conn->body_length;
+
+  calls = (ShardCall *) malloc(sizeof(ShardCall) * n_shards);
+  call_shards(calls, request, request_length);
+  free(request);
+
+  results = (Result *) malloc(sizeof(Result) * capacity);
+  extra = (char *) malloc(extra_length + 16 * n_shards);
+  strcpy(extra, ", \"partial\": true, \"failed_shards\": [");
+  for(s = 0; s < n_shards; s++)
+  {
+    if(calls[s].state == SHARD_DONE &&
+       parse_shard_response(calls + s, &results, &n_found, &capacity))
+      calls[s].state = SHARD_FAILED;
+    if(calls[s].state == SHARD_FAILED)
+    {
+      fprintf(stderr, "shard %s failed or timed out\n", shards[s].name);
+      sprintf(extra + strlen(extra), n_failed++ ? ", %d" : "%d", s);
+    }
+    free(calls[s].response);
+  }
+  free(calls);
+  strcat(extra, "]");
+
+  if(n_failed == n_shards)
+    respond_error(conn, "502 Bad Gateway", "no shard answered");
+  else
+  {
+    qsort(results, n_found, sizeof(Result), compare_results);
+    if(n_found > n)
+      n_found = n;
+    indices = (uint32_t *) malloc(sizeof(uint32_t) * (n_found + 1));
+    scores = (float *) malloc(sizeof(float) * (n_found + 1));
+    for(i = 0; i < n_found; i++)
+    {
+      indices[i] = results[i].index;
+      scores[i] = results[i].score;
+    }
+    respond_results(conn, n_found, indices, scores, 0,
+                    n_failed > 0 ? extra : "");
+    free(indices);
+    free(scores);
+  }
+  free(results);
+  free(extra);
+}
+
+static void serve(Connection *conn, EchoprintQueryContext *context)
+{
+  const char *method;
+  similarity_function sim;
+  uint32_t n;
+  if(strncmp(conn->path, "/query/", 7) != 0)
+  {
+    respond_error(conn, "404 Not Found", "no such endpoint");
+    return;
+  }
+  if(strcmp(conn->method, "POST") != 0)
+  {
+    respond_error(conn, "405 Method Not Allowed", "use POST");
+    return;
+  }
+  method = conn->path + 7;
+  if(strcmp(method, "jaccard") == 0)
+    sim = JACCARD;
+  else if(strcmp(method, "set_int") == 0)
+    sim = SET_INT;
+  else if(strcmp(method, "set_int_norm_length_first") == 0)
+    sim = SET_INT_NORM_LENGTH_FIRST;
+  else
+  {
+    respond_error(conn, "400 Bad Request", "unknown similarity method");
+    return;
+  }
+  if((n = requested_results(conn)) == 0)
+    respond_error(conn, "400 Bad Request", "invalid number of results");
+  else if(n_shards > 0)
+    route_query(conn, method, n);
+  else
+    serve_query(conn, context, sim, n);
+}
+
+// each worker reuses its own query scratch space
+static void *worker_run(void *arg)
+{
+  uint64_t one = 1;
+  EchoprintQueryContext *context = echoprint_query_context_new();
+  (void) arg;
+  for(;;)
+  {
+    Connection *conn = queue_pop(&jobs, 1);
+    serve(conn, context);
+    queue_push(&done, conn);
+    if(write(done_fd, &one, sizeof(one)) < 0)
+      perror("write");
+  }
+  return 0;
+}
+
+/*
+  The event loop.
+ */
+
+static void watch(Connection *conn, uint32_t events)
+{
+  struct epoll_event event;
+  event.events = events | EPOLLONESHOT;
+  event.data.ptr = conn;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+static void close_connection(Connection *conn)
+{
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, 0);
+  close(conn->fd);
+  free(conn->in);
+  free(conn->out);
+  free(conn);
+}
+
+// value of a header (case-insensitive name) in the `length` bytes of
+// headers at `headers`, as a pointer into them, or 0
+static char *find_header(char *headers, size_t length, const char *name)
+{
+  char *line = headers, *end = headers + length;
+  size_t name_length = strlen(name);
+  while(line < end)
+  {
+    char *next = memmem(line, end - line, "\r\n", 2);
+    if(next == 0)
+      next = end;
+    if((size_t) (next - line) > name_length && line[name_length] == ':' &&
+       strncasecmp(line, name, name_length) == 0)
+    {
+      line += name_length + 1;
+      while(line < next && (*line == ' ' || *line == '\t'))
+        line++;
+      return line;
+    }
+    line = next + 2;
+  }
+  return 0;
+}
+
+// parse the request at the start of `in`: 1 if complete, 0 if more
+// bytes are needed, -1 if invalid (a response is then set). The
+// request line and headers are only modified once complete.
+static int parse_request(Connection *conn)
+{
+  char *end, *connection, *content_length_value, *saveptr, *version, *eol;
+  size_t header_length, content_length;
+  end = memmem(conn->in, conn->in_length, "\r\n\r\n", 4);
+  if(end == 0)
+  {
+    if(conn->in_length <= MAX_HEADER_LENGTH)
+      return 0;
+    conn->keep_alive = 0;
+    respond_error(conn, "431 Request Header Fields Too Large",
+                  "headers too large");
+    return -1;
+  }
+  header_length = end + 4 - conn->in;
+  content_length_value = find_header(conn->in, end - conn->in,
+                                     "Content-Length");
+  content_length = content_length_value ?
+    strtoul(content_length_value, 0, 10) : 0;
+  if(content_length > MAX_BODY_LENGTH)
+  {
+    conn->keep_alive = 0;
+    respond_error(conn, "413 Payload Too Large", "body too large");
+    return -1;
+  }
+  if(conn->in_length < header_length + content_length)
+    return 0;
+
+  connection = find_header(conn->in, end - conn->in, "Connection");
+  *end = '\0';
+  if((eol = strstr(conn->in, "\r\n")) != 0)
+    *eol = '\0';
+  conn->method = strtok_r(conn->in, " ", &saveptr);
+  conn->path = conn->method ? strtok_r(0, " ", &saveptr) : 0;
+  version = conn->path ? strtok_r(0, " ", &saveptr) : 0;
+  if(version == 0)
+  {
+    conn->keep_alive = 0;
+    respond_error(conn, "400 Bad Request", "invalid request line");
+    return -1;
+  }
+  // HTTP/1.1 keeps connections alive unless told otherwise, 1.0 only
+  // when told
+  conn->keep_alive = strcmp(version, "HTTP/1.1") == 0 ?
+    !(connection && strncasecmp(connection, "close", 5) == 0) :
+    connection && strncasecmp(connection, "keep-alive", 10) == 0;
+  conn->body = conn->in + header_length;
+  conn->body_length = content_length;
+  conn->request_length = header_length + content_length;
+  return 1;
+}
+
+// send the response, waiting for the socket when it is full; once all
+// sent, go on with the next request or close
+static void send_response(Connection *conn);
+
+static void next_request(Connection *conn)
+{
+  int status;
+  if(conn->out == 0 || !conn->keep_alive)
+  {
+    close_connection(conn);
+    return;
+  }
+  free(conn->out);
+  conn->out = 0;
+  memmove(conn->in, conn->in + conn->request_length,
+          conn->in_length - conn->request_length);
+  conn->in_length -= conn->request_length;
+  conn->request_length = 0;
+  status = parse_request(conn);
+  if(status == 1)
+    queue_push(&jobs, conn);
+  else if(status == 0)
+    watch(conn, EPOLLIN);
+  else
+    send_response(conn);
+}
+
+static void send_response(Connection *conn)
+{
+  while(conn->out_sent < conn->out_length)
+  {
+    ssize_t n = send(conn->fd, conn->out + conn->out_sent,
+                     conn->out_length - conn->out_sent, MSG_NOSIGNAL);
+    if(n < 0 && errno == EAGAIN)
+    {
+      watch(conn, EPOLLOUT);
+      return;
+    }
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+    {
+      close_connection(conn);
+      return;
+    }
+    conn->out_sent += n;
+  }
+  next_request(conn);
+}
+
+static void receive_request(Connection *conn)
+{
+  int status;
+  for(;;)
+  {
+    ssize_t n;
+    if(conn->in_capacity - conn->in_length < READ_CHUNK)
+    {
+      conn->in_capacity = conn->in_length + 2 * READ_CHUNK;
+      conn->in = (char *) realloc(conn->in, conn->in_capacity + 1);
+    }
+    n = recv(conn->fd, conn->in + conn->in_length,
+             conn->in_capacity - conn->in_length, 0);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0 && errno == EAGAIN)
+      break;
+    if(n <= 0)
+    {
+      close_connection(conn);
+      return;
+    }
+    conn->in_length += n;
+  }
+  status = parse_request(conn);
+  if(status == 1)
+    queue_push(&jobs, conn);
+  else if(status == 0)
+    watch(conn, EPOLLIN);
+  else
+    send_response(conn);
+}
+
+static void accept_connections(int listen_fd)
+{
+  struct epoll_event event;
+  int fd;
+  while((fd = accept4(listen_fd, 0, 0, SOCK_NONBLOCK)) >= 0)
+  {
+    Connection *conn = (Connection *) calloc(1, sizeof(Connection));
+    conn->fd = fd;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = conn;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event))
+    {
+      close(fd);
+      free(conn);
+    }
+  }
+}
+
+static void usage(char *name)
+{
+  fprintf(stderr,
+          "usage: %s [-p port] [-w workers] [-t threads] [-n results] [-m] "
+          "[-d] [-i ids_file]\n          [-b base] index-file-1 "
+          "[index-file-2 ...]\n"
+          "       %s -s host:port[,host:port...] [-T timeout_ms] [-p port] "
+          "[-w workers]\n          [-n results] [-i ids_file]\n"
+          "  -p  port (default: 5678)\n"
+          "  -w  worker threads serving requests (default: number of CPUs)\n"
+          "  -t  threads used by each query (default: 1)\n"
+          "  -n  number of results per query (default: 10)\n"
+          "  -m  map the index files instead of reading them\n"
+          "  -d  build a code lookup table for each index block\n"
+          "  -i  text file with an id per line for the indexed songs\n"
+          "  -b  global index of the first song, when serving a shard\n"
+          "  -s  route the queries to these shards\n"
+          "  -T  time given to the shards to answer (default: 1000 ms)\n"
+          "The index files may be a single consolidated index.\n"
+          "A query may ask for `results` results (at most %d).\n",
+          name, name, MAX_RESULTS);
+  exit(2);
+}
+
+// resolve a comma-separated list of host:port
+static int parse_shards(char *list)
+{
+  char *saveptr, *name;
+  for(name = strtok_r(list, ",", &saveptr); name;
+      name = strtok_r(0, ",", &saveptr))
+  {
+    struct addrinfo hints, *info;
+    char *colon = strrchr(name, ':');
+    Shard *shard;
+    if(colon == 0)
+      return 1;
+    *colon = '\0';
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(name, colon + 1, &hints, &info))
+    {
+      fprintf(stderr, "could not resolve %s\n", name);
+      return 1;
+    }
+    *colon = ':';
+    shards = (Shard *) realloc(shards, sizeof(Shard) * (n_shards + 1));
+    shard = shards + n_shards++;
+    shard->name = strdup(name);
+    memcpy(&(shard->address), info->ai_addr, info->ai_addrlen);
+    shard->address_length = info->ai_addrlen;
+    freeaddrinfo(info);
+  }
+  return n_shards == 0;
+}
+
+static char **read_ids(const char *path, uint32_t *n)
+{
+  FILE *fp = fopen(path, "r");
+  char *line = 0, **lines;
+  size_t line_capacity = 0, capacity = 1024;
+  ssize_t length;
+  if(fp == 0)
+    return 0;
+  lines = (char **) malloc(sizeof(char *) * capacity);
+  *n = 0;
+  while((length = getline(&line, &line_capacity, fp)) != -1)
+  {
+    while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'
+                         || line[length - 1] == ' '))
+      line[--length] = '\0';
+    if(*n == capacity)
+    {
+      capacity *= 2;
+      lines = (char **) realloc(lines, sizeof(char *) * capacity);
+    }
+    lines[(*n)++] = strdup(line);
+  }
+  free(line);
+  fclose(fp);
+  return lines;
+}
+
+int main(int argc, char **argv)
+{
+  int opt, port = 5678, n_workers, n_threads = 1, flags = 0, listen_fd;
+  int one = 1, n, n_events;
+  char *ids_path = 0;
+  struct sockaddr_in address;
+  struct epoll_event event, events[MAX_EVENTS];
+  pthread_t thread;
+
+  n_workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  while((opt = getopt(argc, argv, "p:w:t:n:mdi:b:s:T:")) != -1)
+    switch(opt)
+    {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'w':
+      n_workers = atoi(optarg);
+      break;
+    case 't':
+      n_threads = atoi(optarg);
+      break;
+    case 'n':
+      n_results = (uint32_t) atoi(optarg);
+      break;
+    case 'm':
+      flags |= ECHOPRINT_LOAD_MMAP | ECHOPRINT_LOAD_PREFETCH;
+      break;
+    case 'd':
+      flags |= ECHOPRINT_LOAD_CODE_DIRECTORY;
+      break;
+    case 'i':
+      ids_path = optarg;
+      break;
+    case 'b':
+      song_index_base = (uint32_t) strtoul(optarg, 0, 10);
+      break;
+    case 's':
+      if(parse_shards(optarg))
+        usage(argv[0]);
+      break;
+    case 'T':
+      shard_timeout_ms = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  if((optind >= argc) == (n_shards == 0) || n_workers < 1 ||
+     n_results < 1 || n_results > MAX_RESULTS || shard_timeout_ms < 1)
+    usage(argv[0]);
+
+  if(n_shards == 0)
+  {
+    inverted_index = echoprint_inverted_index_load_from_paths_with_flags(
+      argv + optind, argc - optind, flags);
+    if(inverted_index == 0 ||
+       echoprint_inverted_index_set_n_threads(inverted_index, n_threads))
+    {
+      fprintf(stderr, "loading inverted index failed\n");
+      return 1;
+    }
+    fprintf(stderr, "loaded inverted index (%u songs)\n",
+            echoprint_inverted_index_get_n_songs(inverted_index));
+  }
+  else
+    fprintf(stderr, "routing to %d shards\n", n_shards);
+  if(ids_path && (ids = read_ids(ids_path, &n_ids)) == 0)
+  {
+    fprintf(stderr, "could not read %s\n", ids_path);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  if(listen_fd < 0 ||
+     bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) ||
+     listen(listen_fd, SOMAXCONN))
+  {
+    perror("listen");
+    return 1;
+  }
+
+  epoll_fd = epoll_create1(0);
+  done_fd = eventfd(0, EFD_NONBLOCK);
+  event.events = EPOLLIN;
+  event.data.ptr = &listen_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+  event.data.ptr = &done_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, done_fd, &event);
+  for(n = 0; n < n_workers; n++)
+    if(pthread_create(&thread, 0, worker_run, 0))
+    {
+      fprintf(stderr, "could not start the worker threads\n");
+      return 1;
+    }
+  fprintf(stderr, "listening on port %d with %d workers\n", port, n_workers);
+
+  for(;;)
+  {
+    n_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    for(n = 0; n < n_events; n++)
+    {
+      if(events[n].data.ptr == &listen_fd)
+        accept_connections(listen_fd);
+      else if(events[n].data.ptr == &done_fd)
+      {
+        uint64_t count;
+        Connection *conn;
+        if(read(done_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+          perror("read");
+        while((conn = queue_pop(&done, 0)) != 0)
+          send_response(conn);
+      }
+      else
+      {
+        Connection *conn = (Connection *) events[n].data.ptr;
+        if(conn->out != 0)
+          send_response(conn);
+        else
+          receive_request(conn);
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2016 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+  echoprint-inverted-index-build: native counterpart of
+  bin/echoprint-inverted-index. Songs (echoprint strings, or
+  comma-separated codes with -p) are read one per line from the input
+  files or stdin and gathered into blocks, which are built and written
+  by background threads while the next ones are read. A block is
+  closed when it holds `block_songs` songs (65535 by default, more
+  making large blocks with 32-bit postings) or its share of the memory
+  budget, so that at most `threads` blocks being written and the one
+  being read are in memory at once.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "libechoprintserver.h"
+
+// bytes of memory used per code of a block: the code itself, then its
+// posting and share of the block arrays while building
+#define BYTES_PER_CODE 8
+
+typedef struct
+{
+  uint32_t **songs_codes;
+  uint32_t *song_lengths;
+  uint32_t n_songs;
+  uint32_t capacity;
+  uint64_t n_codes;
+  char *path;
+} Block;
+
+typedef struct
+{
+  pthread_t thread;
+  int running;
+  int done;
+  int error;
+  Block block;
+} Writer;
+
+static pthread_mutex_t writers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_done = PTHREAD_COND_INITIALIZER;
+static int postings_format = ECHOPRINT_POSTINGS_RAW16;
+
+static void block_init(Block *block)
+{
+  block->capacity = 1024;
+  block->songs_codes = (uint32_t **)
+    malloc(sizeof(uint32_t *) * block->capacity);
+  block->song_lengths = (uint32_t *)
+    malloc(sizeof(uint32_t) * block->capacity);
+  block->n_songs = 0;
+  block->n_codes = 0;
+  block->path = 0;
+}
+
+static void block_add(Block *block, uint32_t *codes, uint32_t n_codes)
+{
+  if(block->n_songs == block->capacity)
+  {
+    block->capacity *= 2;
+    block->songs_codes = (uint32_t **) realloc(
+      block->songs_codes, sizeof(uint32_t *) * block->capacity);
+    block->song_lengths = (uint32_t *) realloc(
+      block->song_lengths, sizeof(uint32_t) * block->capacity);
+  }
+  block->songs_codes[block->n_songs] = codes;
+  block->song_lengths[block->n_songs++] = n_codes;
+  block->n_codes += n_codes;
+}
+
+static void block_free(Block *block)
+{
+  uint32_t n;
+  for(n = 0; n < block->n_songs; n++)
+    free(block->songs_codes[n]);
+  free(block->songs_codes);
+  free(block->song_lengths);
+  free(block->path);
+}
+
+static void *writer_run(void *arg)
+{
+  Writer *writer = (Writer *) arg;
+  int error = echoprint_inverted_index_build_write_block_with_format(
+    writer->block.songs_codes, writer->block.song_lengths,
+    writer->block.n_songs, writer->block.path, 0, postings_format);
+  pthread_mutex_lock(&writers_lock);
+  writer->error = error;
+  writer->done = 1;
+  pthread_cond_signal(&writer_done);
+  pthread_mutex_unlock(&writers_lock);
+  return 0;
+}
+
+// wait for a running writer to finish and return it, or 0 if none is
+// running; exit if its block could not be written
+static Writer *join_writer(Writer *writers, int n_writers)
+{
+  int w, any_running;
+  pthread_mutex_lock(&writers_lock);
+  for(;;)
+  {
+    any_running = 0;
+    for(w = 0; w < n_writers; w++)
+      if(writers[w].running)
+      {
+        any_running = 1;
+        if(writers[w].done)
+          break;
+      }
+    if(w < n_writers || !any_running)
+      break;
+    pthread_cond_wait(&writer_done, &writers_lock);
+  }
+  pthread_mutex_unlock(&writers_lock);
+  if(w == n_writers)
+    return 0;
+  pthread_join(writers[w].thread, 0);
+  writers[w].running = 0;
+  if(writers[w].error)
+  {
+    fprintf(stderr, "could not write %s\n", writers[w].block.path);
+    exit(1);
+  }
+  block_free(&(writers[w].block));
+  return writers + w;
+}
+
+// hand `block` over to a free writer, waiting for one if needed
+static void write_block(Writer *writers, int n_writers, Block *block)
+{
+  int w;
+  Writer *writer = 0;
+  for(w = 0; w < n_writers && writer == 0; w++)
+    if(!writers[w].running)
+      writer = writers + w;
+  if(writer == 0)
+    writer = join_writer(writers, n_writers);
+  writer->block = *block;
+  writer->running = 1;
+  writer->done = 0;
+  writer->error = 0;
+  if(pthread_create(&(writer->thread), 0, writer_run, writer))
+  {
+    fprintf(stderr, "could not start a writer thread\n");
+    exit(1);
+  }
+  block_init(block);
+}
+
+// codes of a comma-separated line, in a malloc-ed array; -1 if invalid
+static long parse_codes(char *line, uint32_t **codes)
+{
+  long n = 0, capacity = 64;
+  char *end;
+  *codes = (uint32_t *) malloc(sizeof(uint32_t) * capacity);
+  while(*line != '\0' && *line != '\n')
+  {
+    unsigned long code = strtoul(line, &end, 10);
+    if(end == line || (*end != ',' && *end != '\n' && *end != '\0'))
+    {
+      free(*codes);
+      return -1;
+    }
+    if(n == capacity)
+    {
+      capacity *= 2;
+      *codes = (uint32_t *) realloc(*codes, sizeof(uint32_t) * capacity);
+    }
+    (*codes)[n++] = (uint32_t) code;
+    line = *end == ',' ? end + 1 : end;
+  }
+  return n;
+}
+
+// codes of an echoprint string, in a malloc-ed array; -1 if invalid
+static long decode_codes(char *line, size_t length, uint32_t **codes)
+{
+  uint32_t *offsets;
+  long n_codes, capacity = (long) length + 1;
+  for(;;)
+  {
+    *codes = (uint32_t *) malloc(sizeof(uint32_t) * capacity);
+    offsets = (uint32_t *) malloc(sizeof(uint32_t) * capacity);
+    n_codes = echoprint_decode(line, length, *codes, offsets, capacity);
+    free(offsets);
+    if(n_codes <= capacity)
+      break;
+    free(*codes);
+    capacity = n_codes;
+  }
+  if(n_codes < 0)
+    free(*codes);
+  return n_codes;
+}
+
+static void usage(char *name)
+{
+  fprintf(stderr,
+          "usage: %s [-p] [-c] [-t threads] [-m memory_mb] "
+          "[-b block_songs] output [input ...]\n"
+          "  -p  input is comma-separated lists of integer codes\n"
+          "  -c  write compressed (version 2) index blocks\n"
+          "  -b  maximum number of songs per block (default: 65535); "
+          "larger blocks\n"
+          "      are written with 32-bit postings unless compressed\n"
+          "  -t  number of blocks written at once (default: 2)\n"
+          "  -m  memory budget in MB for the songs being indexed "
+          "(default: 4096)\n"
+          "Reads stdin when no input file is given. Blocks are written to "
+          "output_0000,\noutput_0001... or to output if there is only one.\n",
+          name);
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  int opt, already_parsed = 0, n_writers = 2, n_inputs, i;
+  uint64_t memory_mb = 4096, max_block_codes;
+  uint32_t n_blocks = 0, max_block_songs = ECHOPRINT_RAW16_MAX_SONGS;
+  uint64_t n_songs = 0;
+  char *output, *line = 0;
+  size_t line_capacity = 0;
+  ssize_t line_length;
+  Writer *writers;
+  Block block;
+
+  while((opt = getopt(argc, argv, "pct:m:b:")) != -1)
+    switch(opt)
+    {
+    case 'p':
+      already_parsed = 1;
+      break;
+    case 'c':
+      postings_format = ECHOPRINT_POSTINGS_STREAMVBYTE;
+      break;
+    case 't':
+      n_writers = atoi(optarg);
+      break;
+    case 'm':
+      memory_mb = strtoull(optarg, 0, 10);
+      break;
+    case 'b':
+      max_block_songs = (uint32_t) strtoul(optarg, 0, 10);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  if(optind >= argc || n_writers < 1 || memory_mb == 0 ||
+     max_block_songs == 0)
+    usage(argv[0]);
+  output = argv[optind++];
+  n_inputs = argc - optind;
+
+  max_block_codes =
+    memory_mb * 1024 * 1024 / BYTES_PER_CODE / (n_writers + 1);
+  writers = (Writer *) calloc(n_writers, sizeof(Writer));
+  block_init(&block);
+
+  for(i = 0; i < (n_inputs > 0 ? n_inputs : 1); i++)
+  {
+    FILE *input = n_inputs > 0 ? fopen(argv[optind + i], "r") : stdin;
+    if(input == 0)
+    {
+      fprintf(stderr, "could not open %s\n", argv[optind + i]);
+      return 1;
+    }
+    while((line_length = getline(&line, &line_capacity, input)) != -1)
+    {
+      uint32_t *codes;
+      long n_codes;
+      while(line_length > 0 && (line[line_length - 1] == '\n' ||
+                                line[line_length - 1] == '\r'))
+        line[--line_length] = '\0';
+      if(line_length == 0)
+        continue;
+      n_codes = already_parsed ? parse_codes(line, &codes) :
+        decode_codes(line, line_length, &codes);
+      if(n_codes < 0)
+      {
+        fprintf(stderr, "invalid song on line %llu\n",
+                (unsigned long long) n_songs + 1);
+        return 1;
+      }
+      if(block.n_songs == max_block_songs ||
+         (block.n_songs > 0 && block.n_codes + n_codes > max_block_codes))
+      {
+        block.path = (char *) malloc(strlen(output) + 16);
+        sprintf(block.path, "%s_%04u", output, n_blocks++);
+        write_block(writers, n_writers, &block);
+      }
+      block_add(&block, codes, (uint32_t) n_codes);
+      n_songs++;
+    }
+    if(input != stdin)
+      fclose(input);
+  }
+  free(line);
+
+  // the last block, named after the output if it is the only one
+  block.path = (char *) malloc(strlen(output) + 16);
+  if(n_blocks == 0)
+    strcpy(block.path, output);
+  else
+    sprintf(block.path, "%s_%04u", output, n_blocks);
+  n_blocks++;
+  write_block(writers, n_writers, &block);
+  while(join_writer(writers, n_writers) != 0)
+    ;
+  block_free(&block);
+  free(writers);
+
+  fprintf(stderr, "indexed %llu songs in %u block(s)\n",
+          (unsigned long long) n_songs, n_blocks);
+  return 0;
+}
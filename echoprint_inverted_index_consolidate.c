@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2016 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+  echoprint-inverted-index-consolidate: convert the block files of an
+  inverted index (in order, in any of their formats) into a single
+  consolidated index file, which the query tools and servers load in
+  place of the block files.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "libechoprintserver.h"
+
+int main(int argc, char **argv)
+{
+  EchoprintInvertedIndex *index;
+  if(argc < 3)
+  {
+    fprintf(stderr,
+            "usage: %s output block [block ...]\n"
+            "Writes the index made of the block files, in order, to output "
+            "as a single\nconsolidated index.\n", argv[0]);
+    return 2;
+  }
+  if(echoprint_inverted_index_consolidate(argv + 2, argc - 2, argv[1]))
+  {
+    fprintf(stderr, "could not consolidate the index into %s\n", argv[1]);
+    return 1;
+  }
+  // check what was written, checksums included
+  index = echoprint_inverted_index_load_from_paths(argv + 1, 1);
+  if(index == 0)
+  {
+    fprintf(stderr, "%s does not load back\n", argv[1]);
+    return 1;
+  }
+  fprintf(stderr, "consolidated %u songs in %u block(s)\n",
+          echoprint_inverted_index_get_n_songs(index), index->n_blocks);
+  echoprint_inverted_index_free(index);
+  return 0;
+}
@@ -19,8 +19,18 @@
  * under the License.
 '''
 from .lib import \
-    decode_echoprint, create_inverted_index, \
-    parsed_code_streamer, parsing_code_streamer
+    decode_echoprint, create_inverted_index, create_forward_index, \
+    create_inverted_and_forward_index, \
+    parsed_code_streamer, parsing_code_streamer, \
+    parsing_code_offset_streamer
 from echoprint_server_c import \
     load_inverted_index, inverted_index_size, \
-    query_inverted_index
+    query_inverted_index, query_inverted_index_batch, \
+    query_inverted_index_with_stats, query_counters, reset_query_counters, \
+    inverted_index_set_threads, \
+    inverted_index_insert, inverted_index_delete, \
+    inverted_index_compact, inverted_index_start_compaction, \
+    load_index_handle, index_handle_swap, \
+    load_forward_index, query_inverted_index_rerank, \
+    consolidate_inverted_index, \
+    LOAD_MMAP, LOAD_PREFETCH, LOAD_CODE_DIRECTORY, LOAD_NO_CHECKSUMS
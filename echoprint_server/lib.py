@@ -18,11 +18,14 @@
  * specific language governing permissions and limitations
  * under the License.
 '''
-import base64
-import zlib
 import shutil
 import itertools
-from echoprint_server_c import _create_index_block
+from echoprint_server_c import _create_index_blocks, \
+    _create_forward_index_block, _decode_echoprint, \
+    POSTINGS_RAW16, POSTINGS_RAW32, POSTINGS_STREAMVBYTE
+
+# songs per block above which raw blocks need 32-bit postings
+RAW16_MAX_SONGS = 65535
 
 
 def split_seq(iterable, size):
@@ -37,29 +40,85 @@ def decode_echoprint(echoprint_b64_zipped):
     '''
     Decode an echoprint string as output by `echoprint-codegen`.
     The function returns offsets and codes as list of integers.
+    Raises ValueError if the string is invalid.
     '''
-    zipped = base64.urlsafe_b64decode(echoprint_b64_zipped)
-    unzipped = zlib.decompress(zipped)
-    N = len(unzipped)
-    offsets = [int(''.join(o), 16) for o in split_seq(unzipped[:N/2], 5)]
-    codes = [int(''.join(o), 16) for o in split_seq(unzipped[N/2:], 5)]
-    return offsets, codes
+    return _decode_echoprint(echoprint_b64_zipped)
+
 
+def _create_blocks(songs, output_paths, create_blocks, max_block_songs,
+                   blocks_at_once=1):
+    # create_blocks gets up to blocks_at_once batches of songs and, for
+    # each of output_paths, their paths
+    n_blocks = 0
+    for batches in split_seq(split_seq(songs, max_block_songs),
+                             blocks_at_once):
+        create_blocks(batches, *[
+            [output_path + ('_%04d' % (n_blocks + i))
+             for i in xrange(len(batches))]
+            for output_path in output_paths])
+        n_blocks += len(batches)
+    if n_blocks == 1:
+        for output_path in output_paths:
+            shutil.move(output_path + '_0000', output_path)
 
-def create_inverted_index(songs, output_path):
+
+def create_inverted_index(songs, output_path, compressed=False, threads=1,
+                          presorted=False, max_block_songs=RAW16_MAX_SONGS):
     '''
-    Create an inverted index from an iterable of song codes.
-    For large number of songs (>= 65535) several files will be created,
+    Create an inverted index from an iterable of song codes (sequences of
+    integers, or buffers of 32-bit integers such as numpy uint32 arrays).
+    For more than `max_block_songs` songs several files will be created,
     output_path_0001, output_path_0002, ...
+    If `compressed` is set, the blocks are written in the compressed
+    (version 2) format; otherwise blocks of more than 65535 songs are
+    written with 32-bit postings. With several `threads`, that many blocks are
+    built at once, or the songs of a single block are split among them;
+    the GIL is released meanwhile. If `presorted` is set, the codes of each
+    song must already be sorted and distinct, and buffers are then used
+    without being copied.
+    '''
+    postings_format = POSTINGS_STREAMVBYTE if compressed else POSTINGS_RAW16
+    _create_blocks(
+        songs, [output_path],
+        lambda batches, paths: _create_index_blocks(
+            batches, paths, postings_format, threads, presorted),
+        max_block_songs, threads)
+
+
+def create_forward_index(songs, output_path,
+                         max_block_songs=RAW16_MAX_SONGS):
+    '''
+    Create a forward index from an iterable of (offsets, codes) pairs, as
+    returned by `decode_echoprint`, for the temporal re-ranking of
+    `query_inverted_index_rerank`. Files are split and named as by
+    `create_inverted_index` with the same `max_block_songs`, to go with
+    the inverted index of the same songs.
+    '''
+    def create_blocks(batches, paths):
+        for batch, path in zip(batches, paths):
+            _create_forward_index_block(batch, path)
+    _create_blocks(songs, [output_path], create_blocks, max_block_songs)
+
+
+def create_inverted_and_forward_index(songs, output_path, forward_output_path,
+                                      compressed=False, threads=1,
+                                      max_block_songs=RAW16_MAX_SONGS):
     '''
-    n_batches = 0
+    Create an inverted index and the forward index that goes with it, as
+    by `create_inverted_index` and `create_forward_index`, from an
+    iterable of (offsets, codes) pairs read only once: the songs are
+    held in memory a batch of blocks at a time.
+    '''
+    postings_format = POSTINGS_STREAMVBYTE if compressed else POSTINGS_RAW16
 
-    for batch_index, batch in enumerate(split_seq(songs, 65535)):
-        batch_output_path = output_path + ('_%04d' % batch_index)
-        _create_index_block(list(batch), batch_output_path)
-        n_batches += 1
-    if n_batches == 1:
-        shutil.move(batch_output_path, output_path)
+    def create_blocks(batches, paths, forward_paths):
+        _create_index_blocks(
+            [[codes for offsets, codes in batch] for batch in batches],
+            paths, postings_format, threads)
+        for batch, path in zip(batches, forward_paths):
+            _create_forward_index_block(batch, path)
+    _create_blocks(songs, [output_path, forward_output_path], create_blocks,
+                   max_block_songs, threads)
 
 
 def parsed_code_streamer(fstream):
@@ -76,3 +135,12 @@ def parsing_code_streamer(fstream):
     '''
     for line in fstream:
         yield decode_echoprint(line.strip())[1]
+
+
+def parsing_code_offset_streamer(fstream):
+    '''
+    Convenience generator for converting echoprint strings into
+    (offsets, codes) pairs
+    '''
+    for line in fstream:
+        yield decode_echoprint(line.strip())
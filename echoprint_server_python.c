@@ -26,22 +26,119 @@
 static char module_docstring[] =
   "This module provides an interface for decoding musicbrainz fingerprints.";
 static char load_inverted_index_docstring[] =
-  "Load the inverted index from a (ordered) list of file paths.";
+  "Load the inverted index from a (ordered) list of file paths. An optional\n"
+  "second argument combines LOAD_MMAP and LOAD_PREFETCH to map the block\n"
+  "files instead of reading them into private memory,\n"
+  "LOAD_CODE_DIRECTORY to build a code lookup table for each block, and\n"
+  "LOAD_NO_CHECKSUMS not to check the arrays of a consolidated index.";
 static char query_inverted_index_docstring[] =
-  "query inverted index"; // TODO complete docstring
+  "query_inverted_index(query, index, similarity, min_score=0., n_results=10,\n"
+  "as_arrays=False, max_code_frequency=0., skip_frequent_codes=False):\n"
+  "query the index with a sequence of codes, or any buffer of 32-bit\n"
+  "integers (e.g. a numpy uint32 array); the GIL is released while the\n"
+  "index is scanned. Return a list of {\"index\": ..., \"score\": ...}\n"
+  "dicts, best first, or with as_arrays an (array('I') of indices,\n"
+  "array('f') of scores) pair. Codes held by more than max_code_frequency\n"
+  "of the songs of a block are only looked up for the songs found by the\n"
+  "other codes, or ignored with skip_frequent_codes.";
+static char query_inverted_index_with_stats_docstring[] =
+  "same as query_inverted_index, returning a (results, stats) pair where\n"
+  "stats is a dict of what the query did and how long it took";
+static char query_counters_docstring[] =
+  "return a dict of the totals of the statistics of all the queries made\n"
+  "so far, with a latency histogram (queries taking less than 2^b\n"
+  "microseconds, for each b)";
+static char reset_query_counters_docstring[] =
+  "reset the totals returned by query_counters";
+static char query_inverted_index_batch_docstring[] =
+  "query inverted index with a list of queries at once, returning a list of\n"
+  "results (one per query, as returned by query_inverted_index); takes the\n"
+  "same keyword arguments";
 static char inverted_index_size_docstring[] =
   "return the number of songs present in the index";
-static char inverted_index_create_block_docstring[] =
-  "create an index block";
+static char inverted_index_set_threads_docstring[] =
+  "set the number of threads used to query the index (1 = sequential)";
+static char inverted_index_create_blocks_docstring[] =
+  "create index blocks from a list of blocks (lists of songs) and a list\n"
+  "of paths (optionally with the given postings format and number of\n"
+  "threads); songs may be buffers of 32-bit integers, used in place if\n"
+  "`presorted` is set (their codes already sorted and distinct)";
+static char load_forward_index_docstring[] =
+  "Load a forward index from a list of file paths, one per block of the\n"
+  "inverted index it goes with. An optional second argument combines\n"
+  "LOAD_MMAP and LOAD_PREFETCH.";
+static char query_inverted_index_rerank_docstring[] =
+  "query inverted index with codes and offsets, re-ranking the best\n"
+  "n_candidates (default 100) by temporal alignment using a forward index\n"
+  "into n_results (default 10) results; the score of a result is its\n"
+  "number of aligned codes. Codes and offsets may be sequences of\n"
+  "integers or buffers of 32-bit integers";
+static char forward_index_create_block_docstring[] =
+  "create a forward index block from a list of (offsets, codes) pairs";
+static char load_index_handle_docstring[] =
+  "Load an index as the first version of a handle, which every function\n"
+  "taking an index accepts; optional arguments are load flags and the\n"
+  "number of query threads.";
+static char index_handle_swap_docstring[] =
+  "Load an index from a list of paths (optional flags and number of\n"
+  "query threads) and make it the current version of the handle; queries\n"
+  "running on the previous version finish on it.";
+static char decode_echoprint_docstring[] =
+  "decode an echoprint string into its (offsets, codes) lists";
+static char inverted_index_insert_docstring[] =
+  "add a song (list of codes) to a loaded index, return its index";
+static char inverted_index_delete_docstring[] =
+  "mark the song with the given index as deleted";
+static char inverted_index_compact_docstring[] =
+  "move the songs inserted so far to new index blocks";
+static char inverted_index_start_compaction_docstring[] =
+  "compact the index from a background thread every period_ms\n"
+  "milliseconds (0 stops it)";
+static char consolidate_inverted_index_docstring[] =
+  "write the index made of a (ordered) list of block files to a single\n"
+  "consolidated index file, which load_inverted_index loads when given\n"
+  "as the only path";
 
 /* Available functions */
 static PyObject *echoprint_py_load_inverted_index(
   PyObject *self, PyObject *args);
 static PyObject *echoprint_py_query_inverted_index(
+  PyObject *self, PyObject *args, PyObject *kwargs);
+static PyObject *echoprint_py_query_inverted_index_with_stats(
+  PyObject *self, PyObject *args, PyObject *kwargs);
+static PyObject *echoprint_py_query_counters(
   PyObject *self, PyObject *args);
+static PyObject *echoprint_py_reset_query_counters(
+  PyObject *self, PyObject *args);
+static PyObject *echoprint_py_query_inverted_index_batch(
+  PyObject *self, PyObject *args, PyObject *kwargs);
 static PyObject *echoprint_py_inverted_index_size(
   PyObject *self, PyObject *args);
-static PyObject *echoprint_py_inverted_index_create_block(
+static PyObject *echoprint_py_inverted_index_set_threads(
+  PyObject *self, PyObject *args);
+static PyObject *echoprint_py_inverted_index_create_blocks(
+  PyObject *self, PyObject *args, PyObject *kwargs);
+static PyObject *echoprint_py_load_forward_index(
+  PyObject *self, PyObject *args);
+static PyObject *echoprint_py_query_inverted_index_rerank(
+  PyObject *self, PyObject *args, PyObject *kwargs);
+static PyObject *echoprint_py_forward_index_create_block(
+  PyObject *self, PyObject *args);
+static PyObject *echoprint_py_load_index_handle(
+  PyObject *self, PyObject *args);
+static PyObject *echoprint_py_index_handle_swap(
+  PyObject *self, PyObject *args);
+static PyObject *echoprint_py_decode_echoprint(
+  PyObject *self, PyObject *args);
+static PyObject *echoprint_py_inverted_index_insert(
+  PyObject *self, PyObject *args);
+static PyObject *echoprint_py_inverted_index_delete(
+  PyObject *self, PyObject *args);
+static PyObject *echoprint_py_inverted_index_compact(
+  PyObject *self, PyObject *args);
+static PyObject *echoprint_py_inverted_index_start_compaction(
+  PyObject *self, PyObject *args);
+static PyObject *echoprint_py_consolidate_inverted_index(
   PyObject *self, PyObject *args);
 
 /* Module specification */
@@ -50,10 +147,47 @@ static PyMethodDef module_methods[] = {
    METH_VARARGS, load_inverted_index_docstring},
   {"inverted_index_size", echoprint_py_inverted_index_size,
    METH_VARARGS, inverted_index_size_docstring},
-  {"query_inverted_index", echoprint_py_query_inverted_index,
-   METH_VARARGS, query_inverted_index_docstring},
-  {"_create_index_block", echoprint_py_inverted_index_create_block,
-   METH_VARARGS, inverted_index_create_block_docstring},
+  {"query_inverted_index", (PyCFunction) echoprint_py_query_inverted_index,
+   METH_VARARGS | METH_KEYWORDS, query_inverted_index_docstring},
+  {"query_inverted_index_with_stats",
+   (PyCFunction) echoprint_py_query_inverted_index_with_stats,
+   METH_VARARGS | METH_KEYWORDS, query_inverted_index_with_stats_docstring},
+  {"query_counters", echoprint_py_query_counters,
+   METH_VARARGS, query_counters_docstring},
+  {"reset_query_counters", echoprint_py_reset_query_counters,
+   METH_VARARGS, reset_query_counters_docstring},
+  {"query_inverted_index_batch",
+   (PyCFunction) echoprint_py_query_inverted_index_batch,
+   METH_VARARGS | METH_KEYWORDS, query_inverted_index_batch_docstring},
+  {"inverted_index_set_threads", echoprint_py_inverted_index_set_threads,
+   METH_VARARGS, inverted_index_set_threads_docstring},
+  {"_create_index_blocks",
+   (PyCFunction) echoprint_py_inverted_index_create_blocks,
+   METH_VARARGS | METH_KEYWORDS, inverted_index_create_blocks_docstring},
+  {"load_forward_index", echoprint_py_load_forward_index,
+   METH_VARARGS, load_forward_index_docstring},
+  {"query_inverted_index_rerank",
+   (PyCFunction) echoprint_py_query_inverted_index_rerank,
+   METH_VARARGS | METH_KEYWORDS, query_inverted_index_rerank_docstring},
+  {"_create_forward_index_block", echoprint_py_forward_index_create_block,
+   METH_VARARGS, forward_index_create_block_docstring},
+  {"load_index_handle", echoprint_py_load_index_handle,
+   METH_VARARGS, load_index_handle_docstring},
+  {"index_handle_swap", echoprint_py_index_handle_swap,
+   METH_VARARGS, index_handle_swap_docstring},
+  {"_decode_echoprint", echoprint_py_decode_echoprint,
+   METH_VARARGS, decode_echoprint_docstring},
+  {"inverted_index_insert", echoprint_py_inverted_index_insert,
+   METH_VARARGS, inverted_index_insert_docstring},
+  {"inverted_index_delete", echoprint_py_inverted_index_delete,
+   METH_VARARGS, inverted_index_delete_docstring},
+  {"inverted_index_compact", echoprint_py_inverted_index_compact,
+   METH_VARARGS, inverted_index_compact_docstring},
+  {"inverted_index_start_compaction",
+   echoprint_py_inverted_index_start_compaction,
+   METH_VARARGS, inverted_index_start_compaction_docstring},
+  {"consolidate_inverted_index", echoprint_py_consolidate_inverted_index,
+   METH_VARARGS, consolidate_inverted_index_docstring},
   {NULL, NULL, 0, NULL}
 };
 
@@ -64,6 +198,16 @@ PyMODINIT_FUNC initechoprint_server_c(void)
     "echoprint_server_c", module_methods, module_docstring);
   if (m == NULL)
     return;
+  PyModule_AddIntConstant(m, "LOAD_MMAP", ECHOPRINT_LOAD_MMAP);
+  PyModule_AddIntConstant(m, "LOAD_PREFETCH", ECHOPRINT_LOAD_PREFETCH);
+  PyModule_AddIntConstant(
+    m, "LOAD_CODE_DIRECTORY", ECHOPRINT_LOAD_CODE_DIRECTORY);
+  PyModule_AddIntConstant(
+    m, "LOAD_NO_CHECKSUMS", ECHOPRINT_LOAD_NO_CHECKSUMS);
+  PyModule_AddIntConstant(m, "POSTINGS_RAW16", ECHOPRINT_POSTINGS_RAW16);
+  PyModule_AddIntConstant(m, "POSTINGS_RAW32", ECHOPRINT_POSTINGS_RAW32);
+  PyModule_AddIntConstant(
+    m, "POSTINGS_STREAMVBYTE", ECHOPRINT_POSTINGS_STREAMVBYTE);
 }
 
 // destructor
@@ -74,35 +218,48 @@ static void echoprint_py_free_inverted_index(PyObject *object)
   echoprint_inverted_index_free(index);
 }
 
-// constructor
-static PyObject *echoprint_py_load_inverted_index(
-  PyObject *self, PyObject *args)
+// malloc-ed array of the paths in a list of strings (0 on error)
+static char **_parse_paths(PyObject *arg_file_list, int *n_paths)
 {
-  PyObject *arg_index_file_list;
-  EchoprintInvertedIndex *index;
-  char **index_file_paths;
-  int n, n_blocks;
-  if(!PyArg_ParseTuple(args, "O", &arg_index_file_list))
-    return NULL;
-  if(!PyList_Check(arg_index_file_list))
+  char **paths;
+  int n;
+  if(!PyList_Check(arg_file_list))
   {
     PyErr_SetString(PyExc_TypeError, "parameter must be a list");
     return NULL;
   }
-  n_blocks = PyList_Size(arg_index_file_list);
-  index_file_paths = (char **) malloc(sizeof(char *) * n_blocks);
-  for(n = 0; n < n_blocks; n++)
+  *n_paths = PyList_Size(arg_file_list);
+  paths = (char **) malloc(sizeof(char *) * (*n_paths > 0 ? *n_paths : 1));
+  for(n = 0; n < *n_paths; n++)
   {
-    PyObject *py_path = PyList_GetItem(arg_index_file_list, n);
+    PyObject *py_path = PyList_GetItem(arg_file_list, n);
     if(!PyString_Check(py_path))
     {
       PyErr_SetString(PyExc_TypeError, "argument's items must be strings");
+      free(paths);
       return NULL;
     }
-    index_file_paths[n] = PyString_AsString(
-      PyList_GetItem(arg_index_file_list, n));
+    paths[n] = PyString_AsString(py_path);
   }
-  index = echoprint_inverted_index_load_from_paths(index_file_paths, n_blocks);
+  return paths;
+}
+
+// constructor
+static PyObject *echoprint_py_load_inverted_index(
+  PyObject *self, PyObject *args)
+{
+  PyObject *arg_index_file_list;
+  EchoprintInvertedIndex *index;
+  char **index_file_paths;
+  int n_blocks, flags;
+  flags = 0;
+  if(!PyArg_ParseTuple(args, "O|i", &arg_index_file_list, &flags))
+    return NULL;
+  index_file_paths = _parse_paths(arg_index_file_list, &n_blocks);
+  if(index_file_paths == NULL)
+    return NULL;
+  index = echoprint_inverted_index_load_from_paths_with_flags(
+    index_file_paths, n_blocks, flags);
   free(index_file_paths);
   if(index == NULL)
   {
@@ -112,92 +269,212 @@ static PyObject *echoprint_py_load_inverted_index(
   return PyCapsule_New(index, NULL, echoprint_py_free_inverted_index);
 }
 
+#define INDEX_HANDLE_CAPSULE "echoprint_server.index_handle"
+
+static void echoprint_py_free_index_handle(PyObject *object)
+{
+  EchoprintInvertedIndexHandle *handle = (EchoprintInvertedIndexHandle *)
+    PyCapsule_GetPointer(object, INDEX_HANDLE_CAPSULE);
+  echoprint_inverted_index_handle_free(handle);
+}
+
+// the index an argument refers to, either an index or an index handle
+// (whose current version is then pinned until _release_index); 0 and
+// an exception set if it is neither
+static EchoprintInvertedIndex *_acquire_index(
+  PyObject *arg_index, EchoprintInvertedIndexHandle **handle)
+{
+  EchoprintInvertedIndex *index;
+  *handle = 0;
+  if(PyCapsule_IsValid(arg_index, INDEX_HANDLE_CAPSULE))
+  {
+    *handle = (EchoprintInvertedIndexHandle *)
+      PyCapsule_GetPointer(arg_index, INDEX_HANDLE_CAPSULE);
+    return echoprint_inverted_index_handle_acquire(*handle);
+  }
+  index = PyCapsule_IsValid(arg_index, NULL) ?
+    (EchoprintInvertedIndex *) PyCapsule_GetPointer(arg_index, NULL) : 0;
+  if(!index)
+    PyErr_SetString(PyExc_Exception, "the argument is not a valid index");
+  return index;
+}
+
+static void _release_index(
+  EchoprintInvertedIndexHandle *handle, EchoprintInvertedIndex *index)
+{
+  if(handle)
+    echoprint_inverted_index_handle_release(handle, index);
+}
+
+// load an index (without holding the GIL, so that other threads keep
+// serving queries meanwhile) and start its query threads
+static EchoprintInvertedIndex *_load_index(
+  PyObject *arg_file_list, int flags, int n_threads)
+{
+  EchoprintInvertedIndex *index;
+  char **paths;
+  int n_blocks;
+  paths = _parse_paths(arg_file_list, &n_blocks);
+  if(paths == NULL)
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  index = echoprint_inverted_index_load_from_paths_with_flags(
+    paths, n_blocks, flags);
+  if(index && echoprint_inverted_index_set_n_threads(index, n_threads))
+  {
+    echoprint_inverted_index_free(index);
+    index = 0;
+  }
+  Py_END_ALLOW_THREADS
+  free(paths);
+  if(index == NULL)
+    PyErr_SetString(PyExc_Exception, "could not load the index");
+  return index;
+}
+
+static PyObject *echoprint_py_load_index_handle(
+  PyObject *self, PyObject *args)
+{
+  PyObject *arg_file_list;
+  EchoprintInvertedIndex *index;
+  EchoprintInvertedIndexHandle *handle;
+  int flags = 0, n_threads = 1;
+  if(!PyArg_ParseTuple(args, "O|ii", &arg_file_list, &flags, &n_threads))
+    return NULL;
+  index = _load_index(arg_file_list, flags, n_threads);
+  if(index == NULL)
+    return NULL;
+  handle = echoprint_inverted_index_handle_new(index);
+  if(handle == NULL)
+  {
+    echoprint_inverted_index_free(index);
+    return PyErr_NoMemory();
+  }
+  return PyCapsule_New(
+    handle, INDEX_HANDLE_CAPSULE, echoprint_py_free_index_handle);
+}
+
+static PyObject *echoprint_py_index_handle_swap(
+  PyObject *self, PyObject *args)
+{
+  PyObject *arg_handle, *arg_file_list;
+  EchoprintInvertedIndex *index;
+  EchoprintInvertedIndexHandle *handle;
+  int flags = 0, n_threads = 1, error;
+  if(!PyArg_ParseTuple(args, "OO|ii", &arg_handle, &arg_file_list,
+                       &flags, &n_threads))
+    return NULL;
+  handle = (EchoprintInvertedIndexHandle *)
+    PyCapsule_GetPointer(arg_handle, INDEX_HANDLE_CAPSULE);
+  if(!handle)
+    return NULL;
+  index = _load_index(arg_file_list, flags, n_threads);
+  if(index == NULL)
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  error = echoprint_inverted_index_handle_swap(handle, index);
+  Py_END_ALLOW_THREADS
+  if(error)
+  {
+    echoprint_inverted_index_free(index);
+    return PyErr_NoMemory();
+  }
+  Py_RETURN_NONE;
+}
+
 // size of the inverted index
 static PyObject *echoprint_py_inverted_index_size(
   PyObject *self, PyObject *args)
 {
   PyObject *arg_index;
   EchoprintInvertedIndex *index;
+  EchoprintInvertedIndexHandle *handle;
+  uint32_t n_songs;
   if(!PyArg_ParseTuple(args, "O", &arg_index))
     return NULL;
-  index = (EchoprintInvertedIndex *) PyCapsule_GetPointer(arg_index, NULL);
+  index = _acquire_index(arg_index, &handle);
   if(!index)
-  {
-    PyErr_SetString(PyExc_Exception, "the argument is not a valid index");
     return NULL;
-  }
-  return PyInt_FromLong((long) echoprint_inverted_index_get_n_songs(index));
+  n_songs = echoprint_inverted_index_get_n_songs(index);
+  _release_index(handle, index);
+  return PyInt_FromLong((long) n_songs);
 }
 
-// query
-static PyObject *echoprint_py_query_inverted_index(
+// number of query threads
+static PyObject *echoprint_py_inverted_index_set_threads(
   PyObject *self, PyObject *args)
 {
-  PyObject *arg_query, *arg_index, *arg_sim_fun;
+  PyObject *arg_index;
   EchoprintInvertedIndex *index;
-  uint32_t n;
-  uint32_t query_length, n_results, N_MAX_RESULTS;
-  uint32_t *query, *output_indices;
-  float *output_scores;
-  similarity_function sf;
-  PyObject *results;
-
-  if(!PyArg_ParseTuple(args, "OOS", &arg_query, &arg_index, &arg_sim_fun))
+  EchoprintInvertedIndexHandle *handle;
+  int n_threads, error;
+  if(!PyArg_ParseTuple(args, "Oi", &arg_index, &n_threads))
     return NULL;
-  if(!PyList_Check(arg_query))
+  index = _acquire_index(arg_index, &handle);
+  if(!index)
+    return NULL;
+  error = echoprint_inverted_index_set_n_threads(index, n_threads);
+  _release_index(handle, index);
+  if(error)
+  {
+    PyErr_SetString(PyExc_Exception, "could not start the query threads");
     return NULL;
+  }
+  Py_RETURN_NONE;
+}
 
+// similarity function from its name; return 0 if all ok
+static int _parse_similarity(PyObject *arg_sim_fun, similarity_function *sf)
+{
   if(strcmp(PyString_AsString(arg_sim_fun), "jaccard") == 0)
-    sf = JACCARD;
+    *sf = JACCARD;
   else if(strcmp(PyString_AsString(arg_sim_fun), "set_int") == 0)
-    sf = SET_INT;
+    *sf = SET_INT;
   else if(strcmp(PyString_AsString(arg_sim_fun),
 		 "set_int_norm_length_first") == 0)
-    sf = SET_INT_NORM_LENGTH_FIRST;
+    *sf = SET_INT_NORM_LENGTH_FIRST;
   else
   {
     PyErr_SetString(PyExc_Exception, "similarity must be one of: \"jaccard\", \"set_int\", \"set_int_norm_length_first\"");
-    return NULL;
-  }
-
-  index = (EchoprintInvertedIndex *) PyCapsule_GetPointer(arg_index, NULL);
-  if(!index)
-  {
-    PyErr_SetString(PyExc_Exception, "the argument is not a valid index");
-    return NULL;
+    return 1;
   }
+  return 0;
+}
 
-  query_length = PySequence_Length(arg_query);
-  query = (uint32_t *) malloc(sizeof(uint32_t) * query_length);
-  for(n = 0; n < query_length; n++)
+// copy a sequence of integer codes to `codes` (which must hold
+// PySequence_Length(arg_codes) elements); return 0 if all ok
+static int _parse_codes(PyObject *arg_codes, uint32_t *codes)
+{
+  uint32_t n, length;
+  length = PySequence_Length(arg_codes);
+  for(n = 0; n < length; n++)
   {
     PyObject *code_obj;
     long code;
-    code_obj = PySequence_GetItem(arg_query, n);
+    code_obj = PySequence_GetItem(arg_codes, n);
     if(!PyInt_Check(code_obj))
     {
       PyErr_SetString(
 	PyExc_TypeError, "all the codes in the query must be integers");
       Py_DECREF(code_obj);
-      free(query);
-      return NULL;
+      return 1;
     }
     code = (uint32_t) PyInt_AsLong(code_obj);
     Py_DECREF(code_obj);
-    query[n] = (int) code;
+    codes[n] = (int) code;
   }
+  return 0;
+}
 
-  N_MAX_RESULTS = 10;
-  output_indices = (uint32_t *) malloc(sizeof(uint32_t) * N_MAX_RESULTS);
-  output_scores = (float *) malloc(sizeof(float) * N_MAX_RESULTS);
-  n_results = echoprint_inverted_index_query(
-    query_length, query, index,
-    N_MAX_RESULTS, output_indices, output_scores, sf);
-
-  results = PyList_New(n_results);
+// list of {"index": ..., "score": ...} dicts
+static PyObject *_results_as_list(
+  uint32_t n_results, uint32_t *output_indices, float *output_scores)
+{
+  uint32_t n;
+  PyObject *results = PyList_New(n_results);
   for(n = 0; n < n_results; n++)
   {
-    PyObject *r = PyDict_New();                                                                                                                                                                                                        
+    PyObject *r = PyDict_New();
     PyStringObject* score_k = (PyStringObject*)PyString_FromString("score");
     PyFloatObject* score_v = (PyFloatObject*)PyFloat_FromDouble((float) output_scores[n]);
     PyDict_SetItem(r, (PyObject*)score_k, (PyObject*)score_v);
@@ -208,96 +485,901 @@ static PyObject *echoprint_py_query_inverted_index(
     PyDict_SetItem(r, (PyObject*)index_k, (PyObject*)index_v);
     Py_DECREF(index_k);
     Py_DECREF(index_v);
-    PyList_SetItem(results, n, r); 
+    PyList_SetItem(results, n, r);
+  }
+  return results;
+}
+
+// codes given to a query or build: either borrowed from an object
+// exporting a C-contiguous buffer of 32-bit integers (numpy uint32 or
+// int32 arrays, ctypes arrays...) or converted from a sequence of
+// integers into a malloc-ed array
+typedef struct
+{
+  uint32_t *codes;
+  uint32_t length;
+  int borrowed;
+  Py_buffer view;
+} Codes;
+
+// whether a struct-module format describes native 32-bit integers
+static int _is_code_format(const char *format)
+{
+  if(format == NULL)
+    return 0;
+  if(*format == '@' || *format == '=')
+    format++;
+#ifndef WORDS_BIGENDIAN
+  else if(*format == '<')
+    format++;
+#else
+  else if(*format == '>' || *format == '!')
+    format++;
+#endif
+  return (*format == 'I' || *format == 'i') && format[1] == '\0';
+}
+
+// the codes of `arg_codes`, borrowed from its buffer unless `copy` is
+// set (for the library to sort and deduplicate them in place); return
+// 0 if all ok, 1 (with an exception set) otherwise
+static int _get_codes(PyObject *arg_codes, Codes *codes, int copy)
+{
+  PyObject *seq, **items;
+  Py_ssize_t n, length;
+  codes->borrowed = 0;
+  if(PyObject_CheckBuffer(arg_codes) &&
+     PyObject_GetBuffer(arg_codes, &codes->view,
+                        PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) == 0)
+  {
+    if(codes->view.ndim <= 1 && codes->view.itemsize == 4 &&
+       _is_code_format(codes->view.format))
+    {
+      codes->length = (uint32_t) (codes->view.len / 4);
+      if(!copy)
+      {
+        codes->codes = (uint32_t *) codes->view.buf;
+        codes->borrowed = 1;
+        return 0;
+      }
+      codes->codes =
+        (uint32_t *) malloc(sizeof(uint32_t) * (codes->length + 1));
+      memcpy(codes->codes, codes->view.buf, codes->view.len);
+      PyBuffer_Release(&codes->view);
+      return 0;
+    }
+    // e.g. an array of 64-bit integers: go through its items
+    PyBuffer_Release(&codes->view);
+  }
+  PyErr_Clear();
+
+  seq = PySequence_Fast(arg_codes, "the codes must be a sequence");
+  if(seq == NULL)
+    return 1;
+  length = PySequence_Fast_GET_SIZE(seq);
+  items = PySequence_Fast_ITEMS(seq);
+  codes->length = (uint32_t) length;
+  codes->codes = (uint32_t *) malloc(sizeof(uint32_t) * (length + 1));
+  for(n = 0; n < length; n++)
+  {
+    if(PyInt_Check(items[n]))
+      codes->codes[n] = (uint32_t) PyInt_AS_LONG(items[n]);
+    else if(PyLong_Check(items[n]))
+      codes->codes[n] = (uint32_t) PyLong_AsUnsignedLongMask(items[n]);
+    else
+    {
+      PyErr_SetString(PyExc_TypeError, "all the codes must be integers");
+      free(codes->codes);
+      Py_DECREF(seq);
+      return 1;
+    }
+  }
+  Py_DECREF(seq);
+  return 0;
+}
+
+static void _release_codes(Codes *codes)
+{
+  if(codes->borrowed)
+    PyBuffer_Release(&codes->view);
+  else
+    free(codes->codes);
+}
+
+// the results as a list of {"index": ..., "score": ...} dicts, or as a
+// pair of array.array('I') of indices and array.array('f') of scores
+static PyObject *_results(uint32_t n_results, uint32_t *output_indices,
+                          float *output_scores, int as_arrays)
+{
+  PyObject *array_module, *indices, *scores;
+  if(!as_arrays)
+    return _results_as_list(n_results, output_indices, output_scores);
+  array_module = PyImport_ImportModule("array");
+  if(array_module == NULL)
+    return NULL;
+  indices = PyObject_CallMethod(
+    array_module, "array", "cs#", 'I', (char *) output_indices,
+    (int) (sizeof(uint32_t) * n_results));
+  scores = PyObject_CallMethod(
+    array_module, "array", "cs#", 'f', (char *) output_scores,
+    (int) (sizeof(float) * n_results));
+  Py_DECREF(array_module);
+  if(indices == NULL || scores == NULL)
+  {
+    Py_XDECREF(indices);
+    Py_XDECREF(scores);
+    return NULL;
+  }
+  return Py_BuildValue("(NN)", indices, scores);
+}
+
+// query, filling in `stats` if not 0; the scan runs without the GIL
+static PyObject *_query_inverted_index(PyObject *args, PyObject *kwargs,
+                                       EchoprintQueryStats *stats)
+{
+  static char *keywords[] = {
+    "query", "index", "similarity", "min_score", "n_results", "as_arrays",
+    "max_code_frequency", "skip_frequent_codes", NULL};
+  PyObject *arg_query, *arg_index, *arg_sim_fun;
+  EchoprintInvertedIndex *index;
+  EchoprintInvertedIndexHandle *handle;
+  int max_results, as_arrays, skip_frequent_codes;
+  uint32_t n_results, *output_indices;
+  float *output_scores;
+  similarity_function sf;
+  EchoprintQueryOptions options;
+  Codes query;
+  PyObject *results;
+
+  memset(&options, 0, sizeof(EchoprintQueryOptions));
+  options.stats = stats;
+  max_results = 10;
+  as_arrays = 0;
+  skip_frequent_codes = 0;
+  if(!PyArg_ParseTupleAndKeywords(
+       args, kwargs, "OOS|fiifi", keywords, &arg_query, &arg_index,
+       &arg_sim_fun, &options.min_score, &max_results, &as_arrays,
+       &options.max_code_frequency, &skip_frequent_codes))
+    return NULL;
+  options.frequent_codes = skip_frequent_codes ?
+    ECHOPRINT_FREQUENT_CODES_SKIP : ECHOPRINT_FREQUENT_CODES_DEFER;
+  if(max_results < 1)
+  {
+    PyErr_SetString(PyExc_ValueError, "n_results must be positive");
+    return NULL;
   }
+  if(_parse_similarity(arg_sim_fun, &sf))
+    return NULL;
+
+  if(_get_codes(arg_query, &query, 0))
+    return NULL;
+
+  index = _acquire_index(arg_index, &handle);
+  if(!index)
+  {
+    _release_codes(&query);
+    return NULL;
+  }
+  output_indices = (uint32_t *) malloc(sizeof(uint32_t) * max_results);
+  output_scores = (float *) malloc(sizeof(float) * max_results);
+  Py_BEGIN_ALLOW_THREADS
+  n_results = echoprint_inverted_index_query_with_options(
+    query.length, query.codes, index,
+    max_results, output_indices, output_scores, sf, &options);
+  _release_index(handle, index);
+  Py_END_ALLOW_THREADS
+
+  results = _results(n_results, output_indices, output_scores, as_arrays);
 
   free(output_indices);
   free(output_scores);
-  free(query);
+  _release_codes(&query);
 
   return results;
 }
 
+static PyObject *echoprint_py_query_inverted_index(
+  PyObject *self, PyObject *args, PyObject *kwargs)
+{
+  return _query_inverted_index(args, kwargs, 0);
+}
 
-static PyObject *echoprint_py_inverted_index_create_block(
-  PyObject *self, PyObject *args)
+static void _set_item(PyObject *dict, const char *key, PyObject *value)
 {
-  // input is a list of lists, each item of the outer list being a
-  // song (list of codes); second argument is the output path
+  PyDict_SetItemString(dict, key, value);
+  Py_DECREF(value);
+}
 
-  PyObject *arg_songs, *arg_output_path;
-  int n, m, n_songs, error_parsing_input, error_writing_blocks;
-  char *path_out;
-  uint32_t **block_songs_codes;
-  uint32_t *block_song_lengths;
+static PyObject *echoprint_py_query_inverted_index_with_stats(
+  PyObject *self, PyObject *args, PyObject *kwargs)
+{
+  EchoprintQueryStats stats;
+  PyObject *results, *py_stats, *pair;
+  results = _query_inverted_index(args, kwargs, &stats);
+  if(!results)
+    return NULL;
+  py_stats = PyDict_New();
+  _set_item(py_stats, "query_codes", PyInt_FromLong(stats.query_codes));
+  _set_item(py_stats, "distinct_codes", PyInt_FromLong(stats.distinct_codes));
+  _set_item(py_stats, "matched_codes", PyInt_FromLong(stats.matched_codes));
+  _set_item(py_stats, "frequent_codes", PyInt_FromLong(stats.frequent_codes));
+  _set_item(py_stats, "blocks_scanned", PyInt_FromLong(stats.blocks_scanned));
+  _set_item(py_stats, "blocks_skipped", PyInt_FromLong(stats.blocks_skipped));
+  _set_item(py_stats, "delta_songs", PyInt_FromLong(stats.delta_songs));
+  _set_item(py_stats, "postings_visited",
+            PyLong_FromUnsignedLongLong(stats.postings_visited));
+  _set_item(py_stats, "postings_searched",
+            PyLong_FromUnsignedLongLong(stats.postings_searched));
+  _set_item(py_stats, "dedup_seconds", PyFloat_FromDouble(stats.dedup_seconds));
+  _set_item(py_stats, "scoring_seconds",
+            PyFloat_FromDouble(stats.scoring_seconds));
+  _set_item(py_stats, "topk_seconds", PyFloat_FromDouble(stats.topk_seconds));
+  _set_item(py_stats, "total_seconds", PyFloat_FromDouble(stats.total_seconds));
+  pair = PyTuple_Pack(2, results, py_stats);
+  Py_DECREF(results);
+  Py_DECREF(py_stats);
+  return pair;
+}
 
-  if(!PyArg_ParseTuple(args, "OS", &arg_songs, &arg_output_path))
+static PyObject *echoprint_py_query_counters(PyObject *self, PyObject *args)
+{
+  EchoprintQueryCounters counters;
+  PyObject *py_counters, *histogram;
+  int b;
+  if(!PyArg_ParseTuple(args, ""))
     return NULL;
+  echoprint_query_counters_get(&counters);
+  py_counters = PyDict_New();
+  _set_item(py_counters, "n_queries",
+            PyLong_FromUnsignedLongLong(counters.n_queries));
+  _set_item(py_counters, "query_codes",
+            PyLong_FromUnsignedLongLong(counters.query_codes));
+  _set_item(py_counters, "distinct_codes",
+            PyLong_FromUnsignedLongLong(counters.distinct_codes));
+  _set_item(py_counters, "matched_codes",
+            PyLong_FromUnsignedLongLong(counters.matched_codes));
+  _set_item(py_counters, "frequent_codes",
+            PyLong_FromUnsignedLongLong(counters.frequent_codes));
+  _set_item(py_counters, "blocks_scanned",
+            PyLong_FromUnsignedLongLong(counters.blocks_scanned));
+  _set_item(py_counters, "blocks_skipped",
+            PyLong_FromUnsignedLongLong(counters.blocks_skipped));
+  _set_item(py_counters, "postings_visited",
+            PyLong_FromUnsignedLongLong(counters.postings_visited));
+  _set_item(py_counters, "postings_searched",
+            PyLong_FromUnsignedLongLong(counters.postings_searched));
+  _set_item(py_counters, "total_seconds",
+            PyFloat_FromDouble(counters.total_seconds));
+  histogram = PyList_New(ECHOPRINT_LATENCY_BUCKETS);
+  for(b = 0; b < ECHOPRINT_LATENCY_BUCKETS; b++)
+    PyList_SetItem(histogram, b, PyLong_FromUnsignedLongLong(
+                     counters.latency_histogram[b]));
+  _set_item(py_counters, "latency_histogram", histogram);
+  return py_counters;
+}
 
-  error_parsing_input = 0;
-  if(!PyList_Check(arg_songs))
+static PyObject *echoprint_py_reset_query_counters(
+  PyObject *self, PyObject *args)
+{
+  if(!PyArg_ParseTuple(args, ""))
+    return NULL;
+  echoprint_query_counters_reset();
+  Py_RETURN_NONE;
+}
+
+// batch query: list of queries in, list of result lists out
+static PyObject *echoprint_py_query_inverted_index_batch(
+  PyObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *keywords[] = {
+    "queries", "index", "similarity", "min_score", "n_results", "as_arrays",
+    "max_code_frequency", "skip_frequent_codes", NULL};
+  PyObject *arg_queries, *arg_index, *arg_sim_fun;
+  EchoprintInvertedIndex *index;
+  EchoprintInvertedIndexHandle *handle;
+  EchoprintQueryOptions options;
+  uint32_t n, n_queries, n_codes;
+  uint32_t *queries, *query_lengths, *output_indices, *output_n_results;
+  int max_results, as_arrays, skip_frequent_codes;
+  float *output_scores;
+  similarity_function sf;
+  Codes *query_codes;
+  PyObject *results;
+
+  memset(&options, 0, sizeof(EchoprintQueryOptions));
+  max_results = 10;
+  as_arrays = 0;
+  skip_frequent_codes = 0;
+  if(!PyArg_ParseTupleAndKeywords(
+       args, kwargs, "OOS|fiifi", keywords, &arg_queries, &arg_index,
+       &arg_sim_fun, &options.min_score, &max_results, &as_arrays,
+       &options.max_code_frequency, &skip_frequent_codes))
+    return NULL;
+  options.frequent_codes = skip_frequent_codes ?
+    ECHOPRINT_FREQUENT_CODES_SKIP : ECHOPRINT_FREQUENT_CODES_DEFER;
+  if(!PyList_Check(arg_queries))
   {
     PyErr_SetString(
       PyExc_TypeError, "first argument must be a list (of lists of codes)");
     return NULL;
   }
+  if(max_results < 1)
+  {
+    PyErr_SetString(PyExc_ValueError, "n_results must be positive");
+    return NULL;
+  }
+  if(_parse_similarity(arg_sim_fun, &sf))
+    return NULL;
+
+  // the library takes the queries concatenated into one array
+  n_queries = PyList_Size(arg_queries);
+  query_codes = (Codes *) malloc(sizeof(Codes) * (n_queries + 1));
+  query_lengths = (uint32_t *) malloc(sizeof(uint32_t) * (n_queries + 1));
+  n_codes = 0;
+  for(n = 0; n < n_queries; n++)
+  {
+    if(_get_codes(PyList_GetItem(arg_queries, n), query_codes + n, 0))
+    {
+      while(n-- > 0)
+        _release_codes(query_codes + n);
+      free(query_codes);
+      free(query_lengths);
+      return NULL;
+    }
+    query_lengths[n] = query_codes[n].length;
+    n_codes += query_lengths[n];
+  }
+  queries = (uint32_t *) malloc(sizeof(uint32_t) * (n_codes + 1));
+  n_codes = 0;
+  for(n = 0; n < n_queries; n++)
+  {
+    memcpy(queries + n_codes, query_codes[n].codes,
+           sizeof(uint32_t) * query_lengths[n]);
+    n_codes += query_lengths[n];
+    _release_codes(query_codes + n);
+  }
+  free(query_codes);
+
+  index = _acquire_index(arg_index, &handle);
+  if(!index)
+  {
+    free(queries);
+    free(query_lengths);
+    return NULL;
+  }
+  output_indices = (uint32_t *) malloc(
+    sizeof(uint32_t) * max_results * (n_queries + 1));
+  output_scores = (float *) malloc(
+    sizeof(float) * max_results * (n_queries + 1));
+  output_n_results = (uint32_t *) malloc(sizeof(uint32_t) * (n_queries + 1));
+  Py_BEGIN_ALLOW_THREADS
+  echoprint_inverted_index_query_batch(
+    n_queries, query_lengths, queries, index, max_results,
+    output_indices, output_scores, output_n_results, sf, &options);
+  _release_index(handle, index);
+  Py_END_ALLOW_THREADS
+
+  results = PyList_New(n_queries);
+  for(n = 0; n < n_queries && results; n++)
+  {
+    PyObject *query_results = _results(
+      output_n_results[n], output_indices + n * max_results,
+      output_scores + n * max_results, as_arrays);
+    if(query_results)
+      PyList_SetItem(results, n, query_results);
+    else
+      Py_CLEAR(results);
+  }
+
+  free(output_indices);
+  free(output_scores);
+  free(output_n_results);
+  free(queries);
+  free(query_lengths);
+
+  return results;
+}
 
-  path_out = PyString_AsString(arg_output_path);
-  n_songs = PyList_Size(arg_songs);
 
-  block_song_lengths = (uint32_t*) malloc(sizeof(uint32_t) * n_songs);
-  block_songs_codes = (uint32_t **) malloc(sizeof(uint32_t *) * n_songs);
+// the songs of a list, each a sequence or buffer of codes (used in
+// place if `presorted`, as the library then leaves them untouched);
+// return 0 if all ok, 1 (with an exception set, the songs parsed so
+// far left to release) otherwise
+static int _parse_songs(PyObject *arg_songs, Codes *songs,
+                        uint32_t **songs_codes, uint32_t *song_lengths,
+                        int presorted, uint32_t *n_parsed)
+{
+  uint32_t n_songs = PyList_Size(arg_songs);
+  for(*n_parsed = 0; *n_parsed < n_songs; (*n_parsed)++)
+  {
+    Codes *song = songs + *n_parsed;
+    if(_get_codes(PyList_GetItem(arg_songs, *n_parsed), song, !presorted))
+      return 1;
+    songs_codes[*n_parsed] = song->codes;
+    song_lengths[*n_parsed] = song->length;
+  }
+  return 0;
+}
+
+static PyObject *echoprint_py_inverted_index_create_blocks(
+  PyObject *self, PyObject *args, PyObject *kwargs)
+{
+  // input is a list of blocks, each a list of songs (sequences of
+  // codes), and a list of output paths, one per block
+
+  static char *keywords[] = {
+    "blocks", "paths", "format", "n_threads", "presorted", NULL};
+  PyObject *arg_blocks, *arg_output_paths;
+  int n_paths, error, postings_format, n_threads, presorted;
+  uint32_t b, n, n_blocks;
+  char **paths_out;
+  Codes **blocks_songs;
+  uint32_t ***blocks_songs_codes;
+  uint32_t **blocks_song_lengths;
+  uint32_t *blocks_n_songs, *blocks_n_parsed;
+
+  postings_format = ECHOPRINT_POSTINGS_RAW16;
+  n_threads = 1;
+  presorted = 0;
+  if(!PyArg_ParseTupleAndKeywords(
+       args, kwargs, "OO|iii", keywords, &arg_blocks, &arg_output_paths,
+       &postings_format, &n_threads, &presorted))
+    return NULL;
+  if(!PyList_Check(arg_blocks))
+  {
+    PyErr_SetString(
+      PyExc_TypeError, "first argument must be a list (of lists of songs)");
+    return NULL;
+  }
+  paths_out = _parse_paths(arg_output_paths, &n_paths);
+  if(paths_out == NULL)
+    return NULL;
+  n_blocks = PyList_Size(arg_blocks);
+  if(n_paths != n_blocks)
+  {
+    PyErr_SetString(PyExc_ValueError, "there must be one path per block");
+    free(paths_out);
+    return NULL;
+  }
 
-  for(n = 0; n < n_songs; n++)
-    block_songs_codes[n] = 0;
-  for(n = 0; n < n_songs; n++)
+  blocks_songs = (Codes **) malloc(sizeof(Codes *) * (n_blocks + 1));
+  blocks_songs_codes =
+    (uint32_t ***) malloc(sizeof(uint32_t **) * (n_blocks + 1));
+  blocks_song_lengths =
+    (uint32_t **) malloc(sizeof(uint32_t *) * (n_blocks + 1));
+  blocks_n_songs = (uint32_t *) malloc(sizeof(uint32_t) * (n_blocks + 1));
+  blocks_n_parsed = (uint32_t *) calloc(n_blocks + 1, sizeof(uint32_t));
+  error = 0;
+  for(b = 0; b < n_blocks; b++)
   {
-    if(error_parsing_input)
+    PyObject *py_songs = PyList_GetItem(arg_blocks, b);
+    if(!PyList_Check(py_songs))
+    {
+      PyErr_SetString(PyExc_TypeError, "each block must be a list of songs");
+      error = 1;
       break;
-    else
+    }
+    blocks_n_songs[b] = PyList_Size(py_songs);
+    blocks_songs[b] = (Codes *)
+      malloc(sizeof(Codes) * (blocks_n_songs[b] + 1));
+    blocks_songs_codes[b] = (uint32_t **)
+      malloc(sizeof(uint32_t *) * (blocks_n_songs[b] + 1));
+    blocks_song_lengths[b] = (uint32_t *)
+      malloc(sizeof(uint32_t) * (blocks_n_songs[b] + 1));
+    if(_parse_songs(py_songs, blocks_songs[b], blocks_songs_codes[b],
+                    blocks_song_lengths[b], presorted, blocks_n_parsed + b))
     {
-      PyObject * py_song_seq = PySequence_GetItem(arg_songs, n);
-      uint32_t song_length = PyList_Size(py_song_seq);
-      block_songs_codes[n] = (uint32_t *) malloc(
-	sizeof(uint32_t) * song_length);
-      for(m = 0; m < song_length; m++)
-      {
-	PyObject *code = PyList_GetItem(py_song_seq, m);
-	if(!PyInt_Check(code))
-	{
-	  PyErr_SetString(
-	    PyExc_TypeError, "all codes in input songs must be integers");
-	  error_parsing_input = 1;
-	  break;
-	}
-	else
-	  block_songs_codes[n][m] = (uint32_t) PyInt_AsLong(code);
-      }
-      block_song_lengths[n] = song_length;
-      Py_DECREF(py_song_seq);
+      b++;
+      error = 1;
+      break;
     }
   }
 
-  error_writing_blocks = 0;
-  if(!error_parsing_input)
+  if(!error)
+  {
+    Py_BEGIN_ALLOW_THREADS
+    error = echoprint_inverted_index_build_write_blocks(
+      n_blocks, blocks_songs_codes, blocks_song_lengths, blocks_n_songs,
+      paths_out, presorted, postings_format, n_threads);
+    Py_END_ALLOW_THREADS
+    if(error)
+      PyErr_SetString(PyExc_IOError, "could not write the index blocks");
+    b = n_blocks;
+  }
+
+  while(b-- > 0)
+  {
+    for(n = 0; n < blocks_n_parsed[b]; n++)
+      _release_codes(blocks_songs[b] + n);
+    free(blocks_songs[b]);
+    free(blocks_songs_codes[b]);
+    free(blocks_song_lengths[b]);
+  }
+  free(blocks_songs);
+  free(blocks_songs_codes);
+  free(blocks_song_lengths);
+  free(blocks_n_songs);
+  free(blocks_n_parsed);
+  free(paths_out);
+
+  if(error)
+    return NULL;
+  Py_RETURN_NONE;
+}
+
+
+#define FORWARD_INDEX_CAPSULE "echoprint_server.forward_index"
+
+static void echoprint_py_free_forward_index(PyObject *object)
+{
+  EchoprintForwardIndex *index = (EchoprintForwardIndex *)
+    PyCapsule_GetPointer(object, FORWARD_INDEX_CAPSULE);
+  echoprint_forward_index_free(index);
+}
+
+static PyObject *echoprint_py_load_forward_index(
+  PyObject *self, PyObject *args)
+{
+  PyObject *arg_file_list;
+  EchoprintForwardIndex *index;
+  char **paths;
+  int n_blocks, flags;
+  flags = 0;
+  if(!PyArg_ParseTuple(args, "O|i", &arg_file_list, &flags))
+    return NULL;
+  paths = _parse_paths(arg_file_list, &n_blocks);
+  if(paths == NULL)
+    return NULL;
+  index = echoprint_forward_index_load_from_paths(paths, n_blocks, flags);
+  free(paths);
+  if(index == NULL)
+  {
+    PyErr_SetString(PyExc_Exception, "could not load the forward index");
+    return NULL;
+  }
+  return PyCapsule_New(
+    index, FORWARD_INDEX_CAPSULE, echoprint_py_free_forward_index);
+}
+
+// two-stage query; the query and re-ranking run without the GIL
+static PyObject *echoprint_py_query_inverted_index_rerank(
+  PyObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *keywords[] = {
+    "codes", "offsets", "index", "forward_index", "similarity",
+    "n_candidates", "min_score", "n_results", NULL};
+  PyObject *arg_codes, *arg_offsets, *arg_index, *arg_forward, *arg_sim_fun;
+  EchoprintInvertedIndex *index;
+  EchoprintInvertedIndexHandle *handle;
+  EchoprintForwardIndex *forward_index;
+  uint32_t n_results, *output_indices;
+  int n_candidates, max_results;
+  float *output_scores;
+  similarity_function sf;
+  EchoprintQueryOptions options;
+  Codes codes, offsets;
+  PyObject *results;
+
+  memset(&options, 0, sizeof(EchoprintQueryOptions));
+  n_candidates = 100;
+  max_results = 10;
+  if(!PyArg_ParseTupleAndKeywords(
+       args, kwargs, "OOOOS|ifi", keywords, &arg_codes, &arg_offsets,
+       &arg_index, &arg_forward, &arg_sim_fun, &n_candidates,
+       &options.min_score, &max_results))
+    return NULL;
+  if(n_candidates < 1)
+  {
+    PyErr_SetString(PyExc_ValueError, "n_candidates must be positive");
+    return NULL;
+  }
+  if(max_results < 1)
+  {
+    PyErr_SetString(PyExc_ValueError, "n_results must be positive");
+    return NULL;
+  }
+  if(_parse_similarity(arg_sim_fun, &sf))
+    return NULL;
+  forward_index = (EchoprintForwardIndex *)
+    PyCapsule_GetPointer(arg_forward, FORWARD_INDEX_CAPSULE);
+  if(!forward_index)
+  {
+    PyErr_SetString(
+      PyExc_Exception, "the argument is not a valid forward index");
+    return NULL;
+  }
+
+  if(_get_codes(arg_codes, &codes, 0))
+    return NULL;
+  if(_get_codes(arg_offsets, &offsets, 0))
+  {
+    _release_codes(&codes);
+    return NULL;
+  }
+  if(codes.length != offsets.length)
+  {
+    PyErr_SetString(PyExc_ValueError,
+                    "codes and offsets must have the same length");
+    _release_codes(&codes);
+    _release_codes(&offsets);
+    return NULL;
+  }
+
+  index = _acquire_index(arg_index, &handle);
+  if(!index)
+  {
+    _release_codes(&codes);
+    _release_codes(&offsets);
+    return NULL;
+  }
+  output_indices = (uint32_t *) malloc(sizeof(uint32_t) * max_results);
+  output_scores = (float *) malloc(sizeof(float) * max_results);
+  Py_BEGIN_ALLOW_THREADS
+  n_results = echoprint_inverted_index_query_rerank(
+    codes.length, codes.codes, offsets.codes, index, forward_index,
+    n_candidates, max_results, output_indices, output_scores, sf,
+    &options);
+  _release_index(handle, index);
+  Py_END_ALLOW_THREADS
+
+  results = _results_as_list(n_results, output_indices, output_scores);
+
+  free(output_indices);
+  free(output_scores);
+  _release_codes(&codes);
+  _release_codes(&offsets);
+
+  return results;
+}
+
+static PyObject *echoprint_py_forward_index_create_block(
+  PyObject *self, PyObject *args)
+{
+  // input is a list of (offsets, codes) pairs, one per song; second
+  // argument is the output path
+
+  PyObject *arg_songs, *arg_output_path;
+  uint32_t n, n_songs, n_parsed;
+  int error;
+  uint32_t **songs_codes, **songs_offsets, *song_lengths;
+
+  if(!PyArg_ParseTuple(args, "OS", &arg_songs, &arg_output_path))
+    return NULL;
+  if(!PyList_Check(arg_songs))
+  {
+    PyErr_SetString(
+      PyExc_TypeError, "first argument must be a list of (offsets, codes)");
+    return NULL;
+  }
+
+  n_songs = PyList_Size(arg_songs);
+  songs_codes = (uint32_t **) malloc(sizeof(uint32_t *) * (n_songs + 1));
+  songs_offsets = (uint32_t **) malloc(sizeof(uint32_t *) * (n_songs + 1));
+  song_lengths = (uint32_t *) malloc(sizeof(uint32_t) * (n_songs + 1));
+  error = 0;
+  for(n_parsed = 0; n_parsed < n_songs && !error; n_parsed++)
   {
-    if(echoprint_inverted_index_build_write_block(
-	 block_songs_codes, block_song_lengths, n_songs, path_out, 0))
+    PyObject *py_song = PyList_GetItem(arg_songs, n_parsed);
+    PyObject *py_offsets, *py_codes;
+    uint32_t length;
+    if(!PyTuple_Check(py_song) || PyTuple_Size(py_song) != 2 ||
+       !PyList_Check(py_offsets = PyTuple_GetItem(py_song, 0)) ||
+       !PyList_Check(py_codes = PyTuple_GetItem(py_song, 1)) ||
+       PyList_Size(py_offsets) != PyList_Size(py_codes))
     {
-      error_writing_blocks = 1;
-      PyErr_SetString(PyExc_TypeError, "could not write the index block");
+      PyErr_SetString(PyExc_TypeError, "each song must be a pair of lists "
+                      "(offsets, codes) of the same length");
+      error = 1;
+      break;
     }
+    length = PyList_Size(py_codes);
+    song_lengths[n_parsed] = length;
+    songs_codes[n_parsed] = (uint32_t *) malloc(sizeof(uint32_t) * (length + 1));
+    songs_offsets[n_parsed] =
+      (uint32_t *) malloc(sizeof(uint32_t) * (length + 1));
+    error = _parse_codes(py_codes, songs_codes[n_parsed]) ||
+      _parse_codes(py_offsets, songs_offsets[n_parsed]);
+  }
+
+  if(!error && echoprint_forward_index_build_write_block(
+       songs_codes, songs_offsets, song_lengths, n_songs,
+       PyString_AsString(arg_output_path)))
+  {
+    PyErr_SetString(PyExc_IOError, "could not write the forward index block");
+    error = 1;
+  }
+
+  for(n = 0; n < n_parsed; n++)
+  {
+    free(songs_codes[n]);
+    free(songs_offsets[n]);
+  }
+  free(songs_codes);
+  free(songs_offsets);
+  free(song_lengths);
+
+  if(error)
+    return NULL;
+  Py_RETURN_NONE;
+}
+
+static PyObject *_uint32_list(uint32_t *values, uint32_t n)
+{
+  uint32_t i;
+  PyObject *list = PyList_New(n);
+  for(i = 0; i < n; i++)
+    PyList_SET_ITEM(list, i, PyInt_FromLong((long) values[i]));
+  return list;
+}
+
+static PyObject *echoprint_py_decode_echoprint(
+  PyObject *self, PyObject *args)
+{
+  const char *echoprint;
+  int length;
+  long n_codes;
+  uint32_t max_codes, *codes, *offsets;
+  PyObject *result;
+  if(!PyArg_ParseTuple(args, "s#", &echoprint, &length))
+    return NULL;
+  // each code (and offset) usually takes a few characters of the
+  // string; decode again if there are more
+  max_codes = (uint32_t) length + 1;
+  for(;;)
+  {
+    codes = (uint32_t *) malloc(sizeof(uint32_t) * max_codes);
+    offsets = (uint32_t *) malloc(sizeof(uint32_t) * max_codes);
+    n_codes = echoprint_decode(echoprint, length, codes, offsets, max_codes);
+    if(n_codes <= (long) max_codes)
+      break;
+    free(codes);
+    free(offsets);
+    max_codes = (uint32_t) n_codes;
+  }
+  if(n_codes < 0)
+  {
+    PyErr_SetString(PyExc_ValueError, "invalid echoprint string");
+    result = NULL;
+  }
+  else
+    result = Py_BuildValue(
+      "(NN)", _uint32_list(offsets, n_codes), _uint32_list(codes, n_codes));
+  free(codes);
+  free(offsets);
+  return result;
+}
+
+static PyObject *echoprint_py_inverted_index_insert(
+  PyObject *self, PyObject *args)
+{
+  PyObject *arg_index, *arg_codes;
+  EchoprintInvertedIndex *index;
+  EchoprintInvertedIndexHandle *handle;
+  uint32_t *codes, n_codes, song_index;
+  if(!PyArg_ParseTuple(args, "OO", &arg_index, &arg_codes))
+    return NULL;
+  if(!PySequence_Check(arg_codes))
+  {
+    PyErr_SetString(PyExc_TypeError, "the codes must be a sequence");
+    return NULL;
+  }
+  n_codes = PySequence_Length(arg_codes);
+  codes = (uint32_t *) malloc(sizeof(uint32_t) * (n_codes > 0 ? n_codes : 1));
+  if(_parse_codes(arg_codes, codes))
+  {
+    free(codes);
+    return NULL;
+  }
+  index = _acquire_index(arg_index, &handle);
+  if(!index)
+  {
+    free(codes);
+    return NULL;
   }
+  Py_BEGIN_ALLOW_THREADS
+  song_index = echoprint_inverted_index_insert(index, codes, n_codes);
+  _release_index(handle, index);
+  Py_END_ALLOW_THREADS
+  free(codes);
+  if(song_index == (uint32_t) -1)
+  {
+    PyErr_SetString(PyExc_Exception, "could not insert the song");
+    return NULL;
+  }
+  return PyInt_FromLong((long) song_index);
+}
 
-  for(n = 0; n < n_songs; n++)
-    if(block_songs_codes[n] != 0)
-      free(block_songs_codes[n]);
-  free(block_songs_codes);
-  free(block_song_lengths);
+static PyObject *echoprint_py_inverted_index_delete(
+  PyObject *self, PyObject *args)
+{
+  PyObject *arg_index;
+  EchoprintInvertedIndex *index;
+  EchoprintInvertedIndexHandle *handle;
+  unsigned int song_index;
+  int error;
+  if(!PyArg_ParseTuple(args, "OI", &arg_index, &song_index))
+    return NULL;
+  index = _acquire_index(arg_index, &handle);
+  if(!index)
+    return NULL;
+  error = echoprint_inverted_index_delete(index, song_index);
+  _release_index(handle, index);
+  if(error)
+  {
+    PyErr_SetString(PyExc_IndexError, "no such song in the index");
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
 
-  if(error_parsing_input || error_writing_blocks)
+static PyObject *echoprint_py_inverted_index_compact(
+  PyObject *self, PyObject *args)
+{
+  PyObject *arg_index;
+  EchoprintInvertedIndex *index;
+  EchoprintInvertedIndexHandle *handle;
+  int error;
+  if(!PyArg_ParseTuple(args, "O", &arg_index))
+    return NULL;
+  index = _acquire_index(arg_index, &handle);
+  if(!index)
+    return NULL;
+  // compaction builds whole blocks: let the other threads run meanwhile
+  Py_BEGIN_ALLOW_THREADS
+  error = echoprint_inverted_index_compact(index);
+  _release_index(handle, index);
+  Py_END_ALLOW_THREADS
+  if(error)
+  {
+    PyErr_SetString(PyExc_Exception, "could not compact the index");
     return NULL;
+  }
+  Py_RETURN_NONE;
+}
 
-  return Py_None;
+static PyObject *echoprint_py_inverted_index_start_compaction(
+  PyObject *self, PyObject *args)
+{
+  PyObject *arg_index;
+  EchoprintInvertedIndex *index;
+  EchoprintInvertedIndexHandle *handle;
+  unsigned int period_ms;
+  int error;
+  if(!PyArg_ParseTuple(args, "OI", &arg_index, &period_ms))
+    return NULL;
+  index = _acquire_index(arg_index, &handle);
+  if(!index)
+    return NULL;
+  error = echoprint_inverted_index_start_compaction(index, period_ms);
+  _release_index(handle, index);
+  if(error)
+  {
+    PyErr_SetString(PyExc_Exception, "could not start the compaction thread");
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
 
+static PyObject *echoprint_py_consolidate_inverted_index(
+  PyObject *self, PyObject *args)
+{
+  PyObject *arg_index_file_list;
+  char **index_file_paths;
+  char *path_out;
+  int n_blocks, error;
+  if(!PyArg_ParseTuple(args, "Os", &arg_index_file_list, &path_out))
+    return NULL;
+  index_file_paths = _parse_paths(arg_index_file_list, &n_blocks);
+  if(index_file_paths == NULL)
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  error = echoprint_inverted_index_consolidate(
+    index_file_paths, n_blocks, path_out);
+  Py_END_ALLOW_THREADS
+  free(index_file_paths);
+  if(error)
+  {
+    PyErr_SetString(PyExc_Exception, "could not consolidate the index");
+    return NULL;
+  }
+  Py_RETURN_NONE;
 }
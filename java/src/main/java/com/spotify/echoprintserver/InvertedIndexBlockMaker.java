@@ -31,18 +31,23 @@ import java.util.*;
  */
 public class InvertedIndexBlockMaker {
 
+  /** Largest number of songs a block with 16-bit postings can hold. */
+  public static final int RAW16_MAX_SONGS = 65535;
+
+  private static final int BLOCK_MAGIC = 0x4b4c4245;
+  private static final int BLOCK_VERSION = 2;
+  private static final int POSTINGS_RAW32 = 2;
+
   /**
-   * Construct an index block from a list of code sequences.
+   * Construct an index block from a list of code sequences. Blocks of more than
+   * {@link #RAW16_MAX_SONGS} songs are written in the version 2 format, with
+   * 32-bit song indices.
    *
    * @return binary index representation, to be serialized as-is on disk.
-   * @throws IOException An index block cannot contain more than 65535 songs, any attempt to
-   *                     do that will result in an exception being thrown.
    */
   public static byte[] fromCodeSequences(List<Integer[]> codeSequences) throws IOException, IndexCreationException {
 
-    if(codeSequences.size() > 65535)
-      throw new IndexCreationException("an index block cannot contain more than 2^16 - 1 songs");
-
+    boolean wide = codeSequences.size() > RAW16_MAX_SONGS;
     List<Integer[]> sortedUniqueCodeSequences = new LinkedList<>();
     for (Integer[] codeSequence : codeSequences) {
       TreeSet<Integer> codeSet = new TreeSet<>(Arrays.asList(codeSequence));
@@ -77,13 +82,21 @@ public class InvertedIndexBlockMaker {
       songLengths.add(codes.length);
 
     ByteArrayOutputStream out = new ByteArrayOutputStream();
+    if (wide) {
+      out.write(ByteFunctions.asUint32Array(BLOCK_MAGIC));
+      out.write(ByteFunctions.asUint32Array(BLOCK_VERSION));
+      out.write(ByteFunctions.asUint32Array(POSTINGS_RAW32));
+    }
     out.write(ByteFunctions.asUint32Array(nCodes));
     out.write(ByteFunctions.asUint32Array(nSongs));
     out.write(ByteFunctions.asUint32Array(codeSet));
     out.write(ByteFunctions.asUint32Array(codeLengths));
     out.write(ByteFunctions.asUint32Array(songLengths));
     for (Integer c : codeSet)
-      out.write(ByteFunctions.asUint16Array(code2songs.get(c)));
+      if (wide)
+        out.write(ByteFunctions.asUint32Array(code2songs.get(c)));
+      else
+        out.write(ByteFunctions.asUint16Array(code2songs.get(c)));
 
     return out.toByteArray();
   }
@@ -22,6 +22,7 @@ package com.spotify.echoprintserver.nativelib;
 
 import com.sun.jna.Library;
 import com.sun.jna.Native;
+import com.sun.jna.NativeLong;
 import com.sun.jna.Pointer;
 
 
@@ -36,14 +37,55 @@ public interface EchoprintServerLib extends Library {
   Pointer echoprint_inverted_index_load_from_paths(
     String[] paths, int n_files);
 
+  Pointer echoprint_inverted_index_load_from_paths_with_flags(
+    String[] paths, int n_files, int flags);
+
   void echoprint_inverted_index_free(
     Pointer index);
 
+  Pointer echoprint_inverted_index_handle_new(Pointer index);
+
+  Pointer echoprint_inverted_index_handle_acquire(Pointer handle);
+
+  void echoprint_inverted_index_handle_release(Pointer handle, Pointer index);
+
+  int echoprint_inverted_index_handle_swap(Pointer handle, Pointer index);
+
+  void echoprint_inverted_index_handle_free(Pointer handle);
+
   int echoprint_inverted_index_query(
     int query_length, int[] query, Pointer index,
     int n_results, int[] output_indices, float[] output_scores,
     int comparisonFunction);
 
+  int echoprint_inverted_index_query_with_options(
+    int query_length, int[] query, Pointer index,
+    int n_results, int[] output_indices, float[] output_scores,
+    int comparisonFunction, QueryOptions options);
+
+  void echoprint_inverted_index_query_batch(
+    int n_queries, int[] query_lengths, int[] queries, Pointer index,
+    int n_results, int[] output_indices, float[] output_scores,
+    int[] output_n_results, int comparisonFunction, QueryOptions options);
+
+  void echoprint_query_counters_get(QueryCounters counters);
+
+  void echoprint_query_counters_reset();
+
   int echoprint_inverted_index_get_n_songs(Pointer index);
 
+  int echoprint_inverted_index_set_n_threads(Pointer index, int n_threads);
+
+  int echoprint_inverted_index_insert(Pointer index, int[] codes, int n_codes);
+
+  int echoprint_inverted_index_delete(Pointer index, int song_index);
+
+  int echoprint_inverted_index_compact(Pointer index);
+
+  int echoprint_inverted_index_start_compaction(Pointer index, int period_ms);
+
+  NativeLong echoprint_decode(
+    String echoprint, NativeLong length, int[] output_codes, int[] output_offsets,
+    int max_codes);
+
 }
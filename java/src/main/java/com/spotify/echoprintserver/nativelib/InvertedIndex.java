@@ -26,11 +26,15 @@ import java.util.*;
 
 /**
  * Inverted Index structure. Wraps the C library methods.
+ * <p>
+ * The loaded index can be replaced with {@link #swap} while queries run on it: each
+ * method works on the version of the index that is current when it is called.
  */
 public class InvertedIndex {
 
-  private Pointer index;
+  private Pointer handle;
   private String[] paths;
+  private int nThreads;
 
   /**
    * Constructor. Note that no significant operation is done at this time
@@ -41,7 +45,8 @@ public class InvertedIndex {
   public InvertedIndex(List<String> blockFilePaths) {
     paths = new String[blockFilePaths.size()];
     blockFilePaths.toArray(paths);
-    index = null;
+    handle = null;
+    nThreads = 1;
   }
 
   /**
@@ -50,26 +55,175 @@ public class InvertedIndex {
    * @throws IndexLoadingException if the index cannot be loaded.
    */
   public void load() throws IndexLoadingException {
-    index = EchoprintServerLib.INSTANCE.echoprint_inverted_index_load_from_paths(
-            paths, paths.length);
+    load(0);
+  }
+
+  /**
+   * Load the index into memory.
+   *
+   * @param flags combination of {@link LoadFlags} values, e.g. to memory-map the block files.
+   * @throws IndexLoadingException if the index cannot be loaded.
+   */
+  public void load(int flags) throws IndexLoadingException {
+    Pointer index = loadIndex(paths, flags);
+    handle = EchoprintServerLib.INSTANCE.echoprint_inverted_index_handle_new(index);
+    if (handle == Pointer.NULL) {
+      EchoprintServerLib.INSTANCE.echoprint_inverted_index_free(index);
+      handle = null;
+      throw new IndexLoadingException("could not load inverted index");
+    }
+  }
+
+  /**
+   * Load the index from other block files and make it the current one. Queries
+   * started before keep running on the previous index, which is freed once they are
+   * all done. Songs inserted into the previous index are not carried over.
+   *
+   * @param blockFilePaths List of file paths; order is relevant.
+   * @param flags          combination of {@link LoadFlags} values.
+   * @throws IndexLoadingException if the index cannot be loaded; the current one
+   *                               is then left in place.
+   */
+  public void swap(List<String> blockFilePaths, int flags) throws IndexLoadingException {
+    if (handle == null)
+      throw new NullPointerException("load() must be called before swapping");
+    String[] newPaths = new String[blockFilePaths.size()];
+    blockFilePaths.toArray(newPaths);
+    Pointer index = loadIndex(newPaths, flags);
+    if (EchoprintServerLib.INSTANCE.echoprint_inverted_index_handle_swap(handle, index) != 0) {
+      EchoprintServerLib.INSTANCE.echoprint_inverted_index_free(index);
+      throw new IndexLoadingException("could not swap the inverted index");
+    }
+    paths = newPaths;
+  }
+
+  private Pointer loadIndex(String[] blockFilePaths, int flags) throws IndexLoadingException {
+    Pointer index = EchoprintServerLib.INSTANCE
+            .echoprint_inverted_index_load_from_paths_with_flags(
+                    blockFilePaths, blockFilePaths.length, flags);
     if (index == Pointer.NULL)
       throw new IndexLoadingException("could not load inverted index");
+    if (EchoprintServerLib.INSTANCE.echoprint_inverted_index_set_n_threads(
+            index, nThreads) != 0) {
+      EchoprintServerLib.INSTANCE.echoprint_inverted_index_free(index);
+      throw new IndexLoadingException("could not start the query threads");
+    }
+    return index;
+  }
+
+  private Pointer pin(String operation) {
+    if (handle == null)
+      throw new NullPointerException("load() must be called before " + operation);
+    return EchoprintServerLib.INSTANCE.echoprint_inverted_index_handle_acquire(handle);
+  }
+
+  private void unpin(Pointer index) {
+    EchoprintServerLib.INSTANCE.echoprint_inverted_index_handle_release(handle, index);
   }
 
   /**
    * Free the memory held by the underlying C library.
    * Forgetting to call this function will cause significant memory leaks.
+   * Must not be called while queries are running.
    */
   public void release() {
-    if (index != null)
-      EchoprintServerLib.INSTANCE.echoprint_inverted_index_free(index);
+    if (handle != null)
+      EchoprintServerLib.INSTANCE.echoprint_inverted_index_handle_free(handle);
+    handle = null;
   }
 
   /**
    * Get the number of songs indexed.
    */
   public int getNSongs() {
-    return EchoprintServerLib.INSTANCE.echoprint_inverted_index_get_n_songs(index);
+    Pointer index = pin("counting the songs");
+    try {
+      return EchoprintServerLib.INSTANCE.echoprint_inverted_index_get_n_songs(index);
+    } finally {
+      unpin(index);
+    }
+  }
+
+  /**
+   * Score the index blocks on up to nThreads threads per query (1 = sequential),
+   * also for the indices swapped in later. Must not be called while queries are running.
+   */
+  public void setNThreads(int nThreads) {
+    Pointer index = pin("setting the threads");
+    try {
+      if (EchoprintServerLib.INSTANCE.echoprint_inverted_index_set_n_threads(
+              index, nThreads) != 0)
+        throw new IllegalStateException("could not start the query threads");
+      this.nThreads = nThreads;
+    } finally {
+      unpin(index);
+    }
+  }
+
+  /**
+   * Add a song to the loaded index. It can be queried right away, and gets the index
+   * following those of all the songs already in the index.
+   *
+   * @param codes sequence of echoprint codes of the song
+   * @return the index of the song
+   */
+  public int insert(List<Integer> codes) {
+    int _i = 0;
+    int[] _codes = new int[codes.size()];
+    for (Integer code : codes)
+      _codes[_i++] = code;
+    int songIndex;
+    Pointer index = pin("inserting");
+    try {
+      songIndex = EchoprintServerLib.INSTANCE.echoprint_inverted_index_insert(
+              index, _codes, _codes.length);
+    } finally {
+      unpin(index);
+    }
+    if (songIndex == -1)
+      throw new IllegalStateException("could not insert the song");
+    return songIndex;
+  }
+
+  /**
+   * Mark a song as deleted: it is never returned by queries anymore.
+   */
+  public void delete(int songIndex) {
+    Pointer index = pin("deleting");
+    try {
+      if (EchoprintServerLib.INSTANCE.echoprint_inverted_index_delete(index, songIndex) != 0)
+        throw new IndexOutOfBoundsException("no song " + songIndex + " in the index");
+    } finally {
+      unpin(index);
+    }
+  }
+
+  /**
+   * Move the inserted songs to new index blocks, so that they are searched as fast
+   * as the loaded ones. Song indices do not change.
+   */
+  public void compact() {
+    Pointer index = pin("compacting");
+    try {
+      if (EchoprintServerLib.INSTANCE.echoprint_inverted_index_compact(index) != 0)
+        throw new IllegalStateException("could not compact the index");
+    } finally {
+      unpin(index);
+    }
+  }
+
+  /**
+   * Compact the index from a background thread every periodMs milliseconds (0 stops it).
+   */
+  public void startCompaction(int periodMs) {
+    Pointer index = pin("compacting");
+    try {
+      if (EchoprintServerLib.INSTANCE.echoprint_inverted_index_start_compaction(
+              index, periodMs) != 0)
+        throw new IllegalStateException("could not start the compaction thread");
+    } finally {
+      unpin(index);
+    }
   }
 
   /**
@@ -81,9 +235,79 @@ public class InvertedIndex {
    * @return
    */
   public List<QueryResult> query(List<Integer> query, int nResults, int comparisonFunction) {
+    return query(query, nResults, comparisonFunction, new QueryOptions());
+  }
+
+  /**
+   * Perform a query, returning only the songs scoring at least minScore.
+   *
+   * @param query              sequence of echoprint codes
+   * @param nResults           maximum number of results to be returned
+   * @param comparisonFunction similarity function, to be chosen among {@link ComparisonFunctions}
+   * @param minScore           songs with a lower similarity are never returned
+   * @return
+   */
+  public List<QueryResult> query(
+          List<Integer> query, int nResults, int comparisonFunction, float minScore) {
+    QueryOptions options = new QueryOptions();
+    options.min_score = minScore;
+    return query(query, nResults, comparisonFunction, options);
+  }
+
+  /**
+   * Perform a query treating the codes held by more than maxCodeFrequency of the songs of a
+   * block as frequent: they are only searched for the songs found by the other codes (when
+   * that is cheaper than scanning them), or ignored if skipFrequentCodes is set.
+   *
+   * @param query              sequence of echoprint codes
+   * @param nResults           number of results to be returned
+   * @param comparisonFunction similarity function, to be chosen among {@link ComparisonFunctions}
+   * @param maxCodeFrequency   fraction of the songs of a block, 0 for no frequent codes
+   * @param skipFrequentCodes  ignore the frequent codes rather than defer them
+   * @return
+   */
+  public List<QueryResult> query(
+          List<Integer> query, int nResults, int comparisonFunction, float maxCodeFrequency,
+          boolean skipFrequentCodes) {
+    QueryOptions options = new QueryOptions();
+    options.max_code_frequency = maxCodeFrequency;
+    options.frequent_codes = skipFrequentCodes ?
+            QueryOptions.FREQUENT_CODES_SKIP : QueryOptions.FREQUENT_CODES_DEFER;
+    return query(query, nResults, comparisonFunction, options);
+  }
+
+  /**
+   * Perform a query, filling in stats with what it did and how long it took.
+   *
+   * @param query              sequence of echoprint codes
+   * @param nResults           number of results to be returned
+   * @param comparisonFunction similarity function, to be chosen among {@link ComparisonFunctions}
+   * @param stats              filled in with the statistics of the query
+   * @return
+   */
+  public List<QueryResult> query(
+          List<Integer> query, int nResults, int comparisonFunction, QueryStats stats) {
+    QueryOptions options = new QueryOptions();
+    options.stats = stats;
+    return query(query, nResults, comparisonFunction, options);
+  }
+
+  /**
+   * Totals of the statistics of all the queries made by the process (batches excepted)
+   * since it started or since {@link #resetQueryCounters()}.
+   */
+  public static QueryCounters queryCounters() {
+    QueryCounters counters = new QueryCounters();
+    EchoprintServerLib.INSTANCE.echoprint_query_counters_get(counters);
+    return counters;
+  }
+
+  public static void resetQueryCounters() {
+    EchoprintServerLib.INSTANCE.echoprint_query_counters_reset();
+  }
 
-    if (index == null)
-      throw new NullPointerException("load() must be called before querying");
+  private List<QueryResult> query(
+          List<Integer> query, int nResults, int comparisonFunction, QueryOptions options) {
 
     int[] resultsIndices = new int[nResults];
     float[] resultsScores = new float[nResults];
@@ -93,8 +317,15 @@ public class InvertedIndex {
     for (Integer code : query)
       _query[_i++] = code;
 
-    int nActualResults = EchoprintServerLib.INSTANCE.echoprint_inverted_index_query(
-            _query.length, _query, index, nResults, resultsIndices, resultsScores, comparisonFunction);
+    int nActualResults;
+    Pointer index = pin("querying");
+    try {
+      nActualResults = EchoprintServerLib.INSTANCE.echoprint_inverted_index_query_with_options(
+              _query.length, _query, index, nResults, resultsIndices, resultsScores,
+              comparisonFunction, options);
+    } finally {
+      unpin(index);
+    }
 
     List<QueryResult> results = new ArrayList(nActualResults);
     for (int i = 0; i < nActualResults; i++)
@@ -103,4 +334,55 @@ public class InvertedIndex {
     return results;
   }
 
+  /**
+   * Perform several queries at once. Each index block is scanned once for a group of
+   * queries rather than once per query, which is faster than calling {@link #query}
+   * repeatedly when many queries are available at the same time.
+   *
+   * @param queries            sequences of echoprint codes
+   * @param nResults           number of results to be returned for each query
+   * @param comparisonFunction similarity function, to be chosen among {@link ComparisonFunctions}
+   * @return one list of results per query, in the same order as the queries
+   */
+  public List<List<QueryResult>> queryBatch(
+          List<List<Integer>> queries, int nResults, int comparisonFunction) {
+
+    int nQueries = queries.size();
+    int[] queryLengths = new int[nQueries];
+    int nCodes = 0;
+    for (int q = 0; q < nQueries; q++) {
+      queryLengths[q] = queries.get(q).size();
+      nCodes += queryLengths[q];
+    }
+    int _i = 0;
+    int[] _queries = new int[nCodes];
+    for (List<Integer> query : queries)
+      for (Integer code : query)
+        _queries[_i++] = code;
+
+    int[] resultsIndices = new int[nResults * nQueries];
+    float[] resultsScores = new float[nResults * nQueries];
+    int[] nActualResults = new int[nQueries];
+
+    Pointer index = pin("querying");
+    try {
+      EchoprintServerLib.INSTANCE.echoprint_inverted_index_query_batch(
+              nQueries, queryLengths, _queries, index, nResults,
+              resultsIndices, resultsScores, nActualResults, comparisonFunction, null);
+    } finally {
+      unpin(index);
+    }
+
+    List<List<QueryResult>> results = new ArrayList<List<QueryResult>>(nQueries);
+    for (int q = 0; q < nQueries; q++) {
+      List<QueryResult> queryResults = new ArrayList<QueryResult>(nActualResults[q]);
+      for (int i = 0; i < nActualResults[q]; i++)
+        queryResults.add(new QueryResult(
+                resultsIndices[q * nResults + i], resultsScores[q * nResults + i]));
+      results.add(queryResults);
+    }
+
+    return results;
+  }
+
 }
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2016 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+package com.spotify.echoprintserver.nativelib;
+
+/**
+ * Flags controlling how {@link InvertedIndex#load(int)} brings the index into memory.
+ * N.B. the values of the constants must match the ECHOPRINT_LOAD_* macros in libechoprintserver.h
+ */
+public class LoadFlags {
+
+  /** Map the block files read-only instead of copying them to the heap. */
+  public static final int MMAP = 1;
+  /** Populate the mapping at load time (only meaningful together with MMAP). */
+  public static final int PREFETCH = 2;
+  /** Build a code lookup table for each block, trading a little memory for faster queries. */
+  public static final int CODE_DIRECTORY = 4;
+  /** Do not check the arrays of a consolidated index against their checksums. */
+  public static final int NO_CHECKSUMS = 8;
+
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2016 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+package com.spotify.echoprintserver.nativelib;
+
+import com.sun.jna.Structure;
+
+import java.util.Arrays;
+import java.util.List;
+
+/**
+ * Totals of the statistics of all the queries made by the process, mapping
+ * EchoprintQueryCounters in libechoprintserver.h. See {@link InvertedIndex#queryCounters()}.
+ */
+public class QueryCounters extends Structure {
+
+  public static final int LATENCY_BUCKETS = 32;
+
+  public long n_queries;
+  public long query_codes;
+  public long distinct_codes;
+  public long matched_codes;
+  public long frequent_codes;
+  public long blocks_scanned;
+  public long blocks_skipped;
+  public long postings_visited;
+  public long postings_searched;
+  public double total_seconds;
+  /** Bucket b counts the queries that took less than 2^b microseconds. */
+  public long[] latency_histogram = new long[LATENCY_BUCKETS];
+
+  @Override
+  protected List getFieldOrder() {
+    return Arrays.asList(
+            "n_queries", "query_codes", "distinct_codes", "matched_codes",
+            "frequent_codes", "blocks_scanned", "blocks_skipped", "postings_visited",
+            "postings_searched", "total_seconds", "latency_histogram");
+  }
+
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2016 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+package com.spotify.echoprintserver.nativelib;
+
+import com.sun.jna.Structure;
+
+import java.util.Arrays;
+import java.util.List;
+
+/**
+ * Optional query parameters, mapping EchoprintQueryOptions in libechoprintserver.h.
+ * A default-constructed instance gives the default behaviour.
+ */
+public class QueryOptions extends Structure {
+
+  /** Frequent codes are only searched for the songs found by the other codes. */
+  public static final int FREQUENT_CODES_DEFER = 0;
+  /** Frequent codes are ignored. */
+  public static final int FREQUENT_CODES_SKIP = 1;
+
+  /** Songs scoring less than this are never returned. */
+  public float min_score;
+
+  /** Filled in with the statistics of the query when not null. */
+  public QueryStats stats;
+
+  /**
+   * Codes held by more than this fraction of the songs of a block are frequent there;
+   * 0 for none.
+   */
+  public float max_code_frequency;
+
+  /** One of FREQUENT_CODES_DEFER and FREQUENT_CODES_SKIP. */
+  public int frequent_codes;
+
+  @Override
+  protected List getFieldOrder() {
+    return Arrays.asList("min_score", "stats", "max_code_frequency", "frequent_codes");
+  }
+
+}
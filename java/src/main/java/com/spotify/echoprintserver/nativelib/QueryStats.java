@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2016 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+package com.spotify.echoprintserver.nativelib;
+
+import com.sun.jna.Structure;
+
+import java.util.Arrays;
+import java.util.List;
+
+/**
+ * What a query did and where its time went, mapping EchoprintQueryStats in
+ * libechoprintserver.h. Filled in by {@link InvertedIndex#query(List, int, int, QueryStats)}.
+ */
+public class QueryStats extends Structure implements Structure.ByReference {
+
+  /** Number of codes of the query, as given. */
+  public int query_codes;
+  /** Number of codes once duplicates are removed. */
+  public int distinct_codes;
+  /** Query codes found in a block, summed over the blocks. */
+  public int matched_codes;
+  /** Matched codes deferred or skipped as frequent. */
+  public int frequent_codes;
+  public int blocks_scanned;
+  /** Blocks where no song could score enough to enter the results. */
+  public int blocks_skipped;
+  /** Inserted songs compared with the query. */
+  public int delta_songs;
+  /** Song indices read from the codeblocks. */
+  public long postings_visited;
+  /** Songs looked up in long codeblocks. */
+  public long postings_searched;
+  public double dedup_seconds;
+  public double scoring_seconds;
+  public double topk_seconds;
+  public double total_seconds;
+
+  @Override
+  protected List getFieldOrder() {
+    return Arrays.asList(
+            "query_codes", "distinct_codes", "matched_codes", "frequent_codes",
+            "blocks_scanned", "blocks_skipped", "delta_songs", "postings_visited",
+            "postings_searched",
+            "dedup_seconds", "scoring_seconds", "topk_seconds", "total_seconds");
+  }
+
+}
@@ -20,8 +20,6 @@
  */
 package com.spotify.echoprintserver.nativelib;
 
-import java.io.ByteArrayInputStream;
-import java.io.ByteArrayOutputStream;
 import java.io.IOException;
 import java.util.ArrayList;
 import java.util.Collections;
@@ -29,9 +27,8 @@ import java.util.List;
 import java.util.Set;
 import java.util.TreeSet;
 
+import com.sun.jna.NativeLong;
 import org.apache.commons.codec.binary.Base64;
-import org.apache.commons.compress.compressors.deflate.DeflateCompressorInputStream;
-import org.apache.commons.io.IOUtils;
 
 public class Util {
 
@@ -50,32 +47,35 @@ public class Util {
 
   /**
    * Decode an Echoprint string into its list of codes (temporal offsets are not returned).
+   * The string is decoded by the native library.
+   *
+   * @throws IOException if the string is not a valid Echoprint string.
    */
   public static List<Integer> decodeEchoprintString(String echoprintString)
           throws IOException {
 
-    byte[] decoded = b64SafeDecode(echoprintString);
-
-    DeflateCompressorInputStream is = new DeflateCompressorInputStream(
-            new ByteArrayInputStream(decoded));
-
-    ByteArrayOutputStream os = new ByteArrayOutputStream();
-    IOUtils.copy(is, os);
-    String decodedEchoprintString = os.toString();
-
-    // skip the first half of the string (offsets)
-    // take every 5 chars, parse int in base 16
-
-    List<Integer> codes = new ArrayList<Integer>();
-
-    int N = decodedEchoprintString.length();
-    for (int n = N / 2; n < N; n += 5) {
-      String s = decodedEchoprintString.substring(n, n + 5);
-      Integer c = Integer.parseInt(s, 16);
-      codes.add(c);
+    // each code usually takes a few characters of the string; decode again if there
+    // are more
+    int maxCodes = echoprintString.length() + 1;
+    int[] codes, offsets;
+    long nCodes;
+    for (;;) {
+      codes = new int[maxCodes];
+      offsets = new int[maxCodes];
+      nCodes = EchoprintServerLib.INSTANCE.echoprint_decode(
+              echoprintString, new NativeLong(echoprintString.length()), codes, offsets,
+              maxCodes).longValue();
+      if (nCodes <= maxCodes)
+        break;
+      maxCodes = (int) nCodes;
     }
+    if (nCodes < 0)
+      throw new IOException("invalid echoprint string");
 
-    return codes;
+    List<Integer> result = new ArrayList<Integer>((int) nCodes);
+    for (int n = 0; n < nCodes; n++)
+      result.add(codes[n]);
+    return result;
 
   }
 }
@@ -27,6 +27,9 @@ import org.junit.Test;
 
 import java.io.IOException;
 import java.io.InputStream;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.ArrayList;
 import java.util.List;
 
 public class InvertedIndexBlockMakerTest {
@@ -45,4 +48,27 @@ public class InvertedIndexBlockMakerTest {
     Assert.assertArrayEquals(referenceInvertedIndex, invertedIndex);
 
   }
+
+  @Test
+  public void testLargeInvertedIndexCreation() throws IOException, IndexCreationException {
+
+    // song i has the codes i % 10 and 100 + i % 7
+    int nSongs = InvertedIndexBlockMaker.RAW16_MAX_SONGS + 10;
+    List<Integer[]> codes = new ArrayList<>(nSongs);
+    for (int i = 0; i < nSongs; i++)
+      codes.add(new Integer[]{i % 10, 100 + i % 7});
+    byte[] invertedIndex = InvertedIndexBlockMaker.fromCodeSequences(codes);
+
+    ByteBuffer words = ByteBuffer.wrap(invertedIndex).order(ByteOrder.LITTLE_ENDIAN);
+    Assert.assertEquals(0x4b4c4245, words.getInt(0));
+    Assert.assertEquals(2, words.getInt(4));
+    Assert.assertEquals(2, words.getInt(8));
+    Assert.assertEquals(17, words.getInt(12));
+    Assert.assertEquals(nSongs, words.getInt(16));
+    // header, codes, code lengths, song lengths, then 32-bit postings
+    Assert.assertEquals(4 * (5 + 17 + 17 + nSongs + 2 * nSongs), invertedIndex.length);
+    // the last posting of the last code (106) is the last song it holds
+    Assert.assertEquals(nSongs - 1 - (nSongs - 1 - 6) % 7,
+                        words.getInt(invertedIndex.length - 4));
+  }
 }
@@ -23,7 +23,10 @@ package com.spotify.echoprintserver;
 import com.spotify.echoprintserver.nativelib.ComparisonFunctions;
 import com.spotify.echoprintserver.nativelib.IndexLoadingException;
 import com.spotify.echoprintserver.nativelib.InvertedIndex;
+import com.spotify.echoprintserver.nativelib.LoadFlags;
+import com.spotify.echoprintserver.nativelib.QueryCounters;
 import com.spotify.echoprintserver.nativelib.QueryResult;
+import com.spotify.echoprintserver.nativelib.QueryStats;
 import org.junit.Assert;
 import org.junit.Test;
 
@@ -51,6 +54,146 @@ public class NativeTest {
     index.release();
   }
 
+  @Test
+  /**
+   * Same as testInvertedIndexQuerying, with the index memory-mapped.
+   */
+  public void testMappedInvertedIndexQuerying() throws IOException, IndexLoadingException {
+    List<String> paths = new ArrayList<String>();
+    paths.add(this.getClass().getResource("/inverted_index.bin").getPath());
+    InvertedIndex index = new InvertedIndex(paths);
+    index.load(LoadFlags.MMAP | LoadFlags.PREFETCH);
+    Assert.assertEquals(100, index.getNSongs());
+    Integer[] query = new TestUtils().test100EchoprintCodes().get(10);
+    QueryResult bestResult = index.query(Arrays.asList(query), 10, ComparisonFunctions.JACCARD).get(0);
+    Assert.assertEquals(10, bestResult.getIndex());
+    Assert.assertEquals(1.f, bestResult.getScore(), 0.001);
+    index.release();
+  }
+
+  @Test
+  /**
+   * A batch query returns the same results as the corresponding single queries.
+   */
+  public void testBatchQuerying() throws IOException, IndexLoadingException {
+    List<String> paths = new ArrayList<String>();
+    paths.add(this.getClass().getResource("/inverted_index.bin").getPath());
+    InvertedIndex index = new InvertedIndex(paths);
+    index.load();
+    List<List<Integer>> queries = new ArrayList<List<Integer>>();
+    for (Integer[] codes : new TestUtils().test100EchoprintCodes())
+      queries.add(Arrays.asList(codes));
+    List<List<QueryResult>> batchResults =
+            index.queryBatch(queries, 10, ComparisonFunctions.JACCARD);
+    Assert.assertEquals(queries.size(), batchResults.size());
+    for (int q = 0; q < queries.size(); q++) {
+      List<QueryResult> expected = index.query(queries.get(q), 10, ComparisonFunctions.JACCARD);
+      Assert.assertEquals(expected.size(), batchResults.get(q).size());
+      for (int i = 0; i < expected.size(); i++) {
+        Assert.assertEquals(expected.get(i).getIndex(), batchResults.get(q).get(i).getIndex());
+        Assert.assertEquals(expected.get(i).getScore(), batchResults.get(q).get(i).getScore(), 0.f);
+      }
+    }
+    index.release();
+  }
+
+  @Test
+  /**
+   * A query's statistics account for its codes and blocks, and add up in the
+   * process-wide counters.
+   */
+  public void testQueryStats() throws IOException, IndexLoadingException {
+    List<String> paths = new ArrayList<String>();
+    paths.add(this.getClass().getResource("/inverted_index.bin").getPath());
+    paths.add(this.getClass().getResource("/inverted_index.bin").getPath());
+    InvertedIndex index = new InvertedIndex(paths);
+    index.load();
+    InvertedIndex.resetQueryCounters();
+    Integer[] query = new TestUtils().test100EchoprintCodes().get(10);
+    QueryStats stats = new QueryStats();
+    List<QueryResult> results =
+            index.query(Arrays.asList(query), 10, ComparisonFunctions.JACCARD, stats);
+    Assert.assertEquals(10, results.get(0).getIndex());
+    Assert.assertEquals(query.length, stats.query_codes);
+    Assert.assertEquals(2, stats.blocks_scanned + stats.blocks_skipped);
+    Assert.assertTrue(stats.matched_codes > 0);
+    Assert.assertTrue(stats.postings_visited > 0);
+    QueryCounters counters = InvertedIndex.queryCounters();
+    Assert.assertEquals(1, counters.n_queries);
+    Assert.assertEquals(query.length, counters.query_codes);
+    index.release();
+  }
+
+  @Test
+  /**
+   * Deferring or skipping the codes held by every song of the test index still
+   * finds the song queried.
+   */
+  public void testFrequentCodes() throws IOException, IndexLoadingException {
+    List<String> paths = new ArrayList<String>();
+    paths.add(this.getClass().getResource("/inverted_index.bin").getPath());
+    InvertedIndex index = new InvertedIndex(paths);
+    index.load();
+    Integer[] query = new TestUtils().test100EchoprintCodes().get(10);
+    for (boolean skip : new boolean[]{false, true}) {
+      List<QueryResult> results =
+              index.query(Arrays.asList(query), 10, ComparisonFunctions.JACCARD, 0.5f, skip);
+      Assert.assertEquals(10, results.get(0).getIndex());
+    }
+    index.release();
+  }
+
+  @Test
+  /**
+   * An inserted song is found right away, before and after compaction; a deleted
+   * song is not returned anymore.
+   */
+  public void testUpdates() throws IOException, IndexLoadingException {
+    List<String> paths = new ArrayList<String>();
+    paths.add(this.getClass().getResource("/inverted_index.bin").getPath());
+    InvertedIndex index = new InvertedIndex(paths);
+    index.load();
+    List<Integer> codes = Arrays.asList(new TestUtils().test100EchoprintCodes().get(10));
+    Assert.assertEquals(100, index.insert(codes));
+    Assert.assertEquals(101, index.getNSongs());
+    index.delete(10);
+    QueryResult bestResult = index.query(codes, 10, ComparisonFunctions.JACCARD).get(0);
+    Assert.assertEquals(100, bestResult.getIndex());
+    index.compact();
+    List<QueryResult> results = index.query(codes, 10, ComparisonFunctions.JACCARD);
+    Assert.assertEquals(100, results.get(0).getIndex());
+    Assert.assertEquals(1.f, results.get(0).getScore(), 0.001);
+    for (QueryResult result : results)
+      Assert.assertTrue(result.getIndex() != 10);
+    index.release();
+  }
+
+  @Test
+  /**
+   * After a swap the queries run on the new index; a failed swap keeps the current one.
+   */
+  public void testSwap() throws IOException, IndexLoadingException {
+    List<String> paths = new ArrayList<String>();
+    paths.add(this.getClass().getResource("/inverted_index.bin").getPath());
+    InvertedIndex index = new InvertedIndex(paths);
+    index.load();
+    index.setNThreads(2);
+    List<Integer> codes = Arrays.asList(new TestUtils().test100EchoprintCodes().get(10));
+    index.insert(codes);
+    Assert.assertEquals(101, index.getNSongs());
+    index.swap(paths, LoadFlags.MMAP);
+    Assert.assertEquals(100, index.getNSongs());
+    QueryResult bestResult = index.query(codes, 10, ComparisonFunctions.JACCARD).get(0);
+    Assert.assertEquals(10, bestResult.getIndex());
+    try {
+      index.swap(Arrays.asList("this-file-does-not-exist"), 0);
+      Assert.fail();
+    } catch (IndexLoadingException e) {
+      Assert.assertEquals(100, index.getNSongs());
+    }
+    index.release();
+  }
+
   /**
    * Make sure the correct exception is thrown when the index cannot be loaded.
    */
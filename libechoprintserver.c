@@ -21,8 +21,38 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ECHOPRINT_X86_KERNELS
+#include <immintrin.h>
+#endif
 #include "libechoprintserver.h"
 
+// background compactions leave smaller delta segments alone, rather
+// than filling the index with tiny blocks
+#define ECHOPRINT_COMPACTION_MIN_SONGS 256
+
+// number of queries of a batch sharing a walk over each block
+#define ECHOPRINT_BATCH_GROUP_SIZE 16
+
+// blocks with this many times more codes than the query are
+// intersected with it by galloping instead of a linear merge
+#define ECHOPRINT_GALLOP_RATIO 8
+
+// blocks where the codeblocks matching the query hold at least one
+// posting per this many songs are scored by scanning all the counters
+// rather than a list of the touched songs
+#define ECHOPRINT_DENSE_RATIO 4
+
+// number of songs scored and filtered at once by the kernels below
+#define ECHOPRINT_FILTER_CHUNK 256
+
 
 int _cmpuint32(const void *a, const void *b)
 {
@@ -32,6 +62,14 @@ int _cmpuint32(const void *a, const void *b)
   return x - y;
 }
 
+int _cmpuint64(const void *a, const void *b)
+{
+  uint64_t x, y;
+  x = *((uint64_t *) a);
+  y = *((uint64_t *) b);
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
 void _sequence_to_set_inplace(uint32_t *seq, uint32_t *length)
 {
   uint32_t i, j;
@@ -52,371 +90,4109 @@ void _sequence_to_set_inplace(uint32_t *seq, uint32_t *length)
 }
 
 
-// length of output array is index_block->n_songs
-void echoprint_inverted_index_block_similarity(
-  uint32_t query_length, uint32_t *query,
-  EchoprintInvertedIndexBlock *index_block,
-  float *output, similarity_function sim)
+// encode n increasing song indices as deltas with Stream VByte: a
+// control byte for each group of four values (2 bits each: number of
+// bytes minus one), followed by the little-endian data bytes. Return
+// the number of bytes written (at most (n + 3) / 4 + 4 * n).
+uint32_t _streamvbyte_encode_deltas(
+  const uint32_t *values, uint32_t n, uint8_t *out)
+{
+  uint8_t *control = out;
+  uint8_t *data = out + (n + 3) / 4;
+  uint32_t k, previous = 0;
+  memset(control, 0, (n + 3) / 4);
+  for(k = 0; k < n; k++)
+  {
+    uint32_t delta = values[k] - previous;
+    uint32_t length = delta < (1U << 8) ? 1 :
+      (delta < (1U << 16) ? 2 : (delta < (1U << 24) ? 3 : 4));
+    previous = values[k];
+    control[k >> 2] |= (length - 1) << ((k & 3) * 2);
+    while(length--)
+    {
+      *data++ = delta & 0xff;
+      delta >>= 8;
+    }
+  }
+  return data - out;
+}
+
+void _streamvbyte_decode_deltas(const uint8_t *in, uint32_t n, uint32_t *out)
 {
+  const uint8_t *control = in;
+  const uint8_t *data = in + (n + 3) / 4;
+  uint32_t k, value = 0;
+  for(k = 0; k < n; k++)
+  {
+    uint32_t length = ((control[k >> 2] >> ((k & 3) * 2)) & 3) + 1;
+    uint32_t delta = data[0];
+    if(length > 1)
+      delta |= (uint32_t) data[1] << 8;
+    if(length > 2)
+      delta |= (uint32_t) data[2] << 16;
+    if(length > 3)
+      delta |= (uint32_t) data[3] << 24;
+    data += length;
+    value += delta;
+    out[k] = value;
+  }
+}
+
+// song indices of codeblock c, whatever the postings format; `buffer`
+// must hold code_lengths[c] elements. Return code_lengths[c].
+uint32_t _decode_codeblock(
+  EchoprintInvertedIndexBlock *block, uint32_t c, uint32_t *buffer)
+{
+  uint32_t n, length = block->code_lengths[c];
+  if(block->postings_format == ECHOPRINT_POSTINGS_STREAMVBYTE)
+    _streamvbyte_decode_deltas(
+      block->postings + block->postings_offsets[c], length, buffer);
+  else if(block->postings_format == ECHOPRINT_POSTINGS_RAW32)
+    memcpy(buffer, block->song_indices32 + block->code_offsets[c],
+           sizeof(uint32_t) * length);
+  else
+  {
+    uint16_t *song_indices = block->song_indices + block->code_offsets[c];
+    for(n = 0; n < length; n++)
+      buffer[n] = song_indices[n];
+  }
+  return length;
+}
 
-  int n, i, j, offset;
+// similarity of a song of `song_length` codes sharing `count` of them
+// with a query of `query_length` (distinct) codes
+float _similarity(uint32_t query_length, uint32_t song_length,
+                  uint32_t count, similarity_function sim)
+{
+  float den;
+  float num = count;
+  switch (sim)
+  {
+  case JACCARD:
+    den = (float) (query_length + song_length - num);
+    break;
+  case SET_INT:
+    den = 1.0;
+    break;
+  case SET_INT_NORM_LENGTH_FIRST:
+  default:
+    den = query_length;
+    break;
+  }
+  return num / den;
+}
 
-  for(n=0; n < index_block->n_songs; n++)
-    output[n] = 0;
+/*
+  Score filtering kernels: compute the similarity of n songs from
+  their match counts and keep (as offsets in [0, n) and scores) those
+  scoring at least `threshold`, in order. The vectorized versions give
+  the same (IEEE) scores as _similarity; the best one supported by the
+  CPU is picked at run time, unless the ECHOPRINT_KERNEL environment
+  variable names one of "scalar", "sse2" or "avx2". The 128-bit kernel
+  only needs SSE2, like the hex decoding kernel.
+ */
+typedef uint32_t (*EchoprintFilterKernel)(
+  const uint32_t *counts, const uint32_t *song_lengths, uint32_t n,
+  uint32_t query_length, similarity_function sim, float threshold,
+  uint32_t *candidates, float *candidate_scores);
 
-  i = 0;        // index of the codeblock
-  j = 0;        // index of the query
-  offset = 0;   // base pointer in index_block->song_indices
-  while(j < query_length && i < index_block->n_codes)
+uint32_t _filter_scores_scalar(
+  const uint32_t *counts, const uint32_t *song_lengths, uint32_t n,
+  uint32_t query_length, similarity_function sim, float threshold,
+  uint32_t *candidates, float *candidate_scores)
+{
+  uint32_t s, n_candidates = 0;
+  for(s = 0; s < n; s++)
   {
-    uint32_t codeblock_length = index_block->code_lengths[i];
-    uint32_t qc = query[j];
-    uint32_t ic = index_block->codes[i];
-    if(qc == ic)
+    float score = _similarity(query_length, song_lengths[s], counts[s], sim);
+    if(score >= threshold)
     {
-      for(n = 0; n < codeblock_length; n++)
-      {
-        uint16_t song_index = index_block->song_indices[offset + n];
-        output[song_index]++;
-      }
-      i++;
-      j++;
-      offset += codeblock_length;
+      candidates[n_candidates] = s;
+      candidate_scores[n_candidates++] = score;
     }
+  }
+  return n_candidates;
+}
+
+#ifdef ECHOPRINT_X86_KERNELS
+
+__attribute__((target("sse2")))
+uint32_t _filter_scores_sse2(
+  const uint32_t *counts, const uint32_t *song_lengths, uint32_t n,
+  uint32_t query_length, similarity_function sim, float threshold,
+  uint32_t *candidates, float *candidate_scores)
+{
+  uint32_t s, k, n_tail, n_candidates = 0;
+  __m128i ql = _mm_set1_epi32((int) query_length);
+  __m128 ql_f = _mm_set1_ps((float) query_length);
+  __m128 t = _mm_set1_ps(threshold);
+  float scores[4];
+  for(s = 0; s + 4 <= n; s += 4)
+  {
+    __m128 num = _mm_cvtepi32_ps(
+      _mm_loadu_si128((const __m128i *) (counts + s)));
+    __m128 score;
+    int mask;
+    if(sim == JACCARD)
+      score = _mm_div_ps(num, _mm_sub_ps(_mm_cvtepi32_ps(_mm_add_epi32(
+        ql, _mm_loadu_si128((const __m128i *) (song_lengths + s)))), num));
+    else if(sim == SET_INT)
+      score = num;
     else
+      score = _mm_div_ps(num, ql_f);
+    mask = _mm_movemask_ps(_mm_cmpge_ps(score, t));
+    if(mask == 0)
+      continue;
+    _mm_storeu_ps(scores, score);
+    while(mask)
     {
-      if(qc < ic)
-        j++;
-      else
-      {
-        i++;
-        offset += codeblock_length;
-      }
+      k = __builtin_ctz(mask);
+      candidates[n_candidates] = s + k;
+      candidate_scores[n_candidates++] = scores[k];
+      mask &= mask - 1;
     }
   }
+  n_tail = _filter_scores_scalar(
+    counts + s, song_lengths + s, n - s, query_length, sim, threshold,
+    candidates + n_candidates, candidate_scores + n_candidates);
+  for(k = 0; k < n_tail; k++)
+    candidates[n_candidates + k] += s;
+  return n_candidates + n_tail;
+}
 
-  for(n=0; n < index_block->n_songs; n++)
+__attribute__((target("avx2")))
+uint32_t _filter_scores_avx2(
+  const uint32_t *counts, const uint32_t *song_lengths, uint32_t n,
+  uint32_t query_length, similarity_function sim, float threshold,
+  uint32_t *candidates, float *candidate_scores)
+{
+  uint32_t s, k, n_tail, n_candidates = 0;
+  __m256i ql = _mm256_set1_epi32((int) query_length);
+  __m256 ql_f = _mm256_set1_ps((float) query_length);
+  __m256 t = _mm256_set1_ps(threshold);
+  float scores[8];
+  for(s = 0; s + 8 <= n; s += 8)
   {
-    float den;
-    float num = output[n];
-    switch (sim)
+    __m256 num = _mm256_cvtepi32_ps(
+      _mm256_loadu_si256((const __m256i *) (counts + s)));
+    __m256 score;
+    int mask;
+    if(sim == JACCARD)
+      score = _mm256_div_ps(num, _mm256_sub_ps(_mm256_cvtepi32_ps(
+        _mm256_add_epi32(ql, _mm256_loadu_si256(
+                           (const __m256i *) (song_lengths + s)))), num));
+    else if(sim == SET_INT)
+      score = num;
+    else
+      score = _mm256_div_ps(num, ql_f);
+    mask = _mm256_movemask_ps(_mm256_cmp_ps(score, t, _CMP_GE_OQ));
+    if(mask == 0)
+      continue;
+    _mm256_storeu_ps(scores, score);
+    while(mask)
     {
-    case JACCARD:
-      den = (float) (query_length + index_block->song_lengths[n] - num);
-      break;
-    case SET_INT:
-      den = 1.0;
-      break;
-    case SET_INT_NORM_LENGTH_FIRST:
-      den = query_length;
-      break;
+      k = __builtin_ctz(mask);
+      candidates[n_candidates] = s + k;
+      candidate_scores[n_candidates++] = scores[k];
+      mask &= mask - 1;
     }
-    output[n] = num / den;
   }
+  n_tail = _filter_scores_scalar(
+    counts + s, song_lengths + s, n - s, query_length, sim, threshold,
+    candidates + n_candidates, candidate_scores + n_candidates);
+  for(k = 0; k < n_tail; k++)
+    candidates[n_candidates + k] += s;
+  return n_candidates + n_tail;
+}
+
+#endif
+
+static EchoprintFilterKernel _filter_kernel = _filter_scores_scalar;
+static pthread_once_t _filter_kernel_once = PTHREAD_ONCE_INIT;
+
+void _select_filter_kernel(void)
+{
+#ifdef ECHOPRINT_X86_KERNELS
+  const char *name = getenv("ECHOPRINT_KERNEL");
+  __builtin_cpu_init();
+  if(name != 0 && strcmp(name, "scalar") == 0)
+    return;
+  if(__builtin_cpu_supports("avx2") &&
+     (name == 0 || strcmp(name, "avx2") == 0))
+    _filter_kernel = _filter_scores_avx2;
+  else if(__builtin_cpu_supports("sse2"))
+    _filter_kernel = _filter_scores_sse2;
+#endif
+}
 
+EchoprintFilterKernel _get_filter_kernel(void)
+{
+  pthread_once(&_filter_kernel_once, _select_filter_kernel);
+  return _filter_kernel;
 }
 
-// shift arrays' slices one position to the right, starting from i
-void shift_outputs_right(
-  int i, int len, uint32_t *indices, float *scores)
+// first position p >= i such that codes[p] >= code (n_codes if none):
+// exponential search from i, then binary search within the last step
+uint32_t _gallop_to(
+  uint32_t *codes, uint32_t i, uint32_t n_codes, uint32_t code)
 {
-  int n;
-  for(n = len-1; n > i; n--)
+  uint32_t step, lo, hi;
+  if(i >= n_codes || codes[i] >= code)
+    return i;
+  lo = i;         // codes[lo] < code
+  step = 1;
+  while(lo + step < n_codes && codes[lo + step] < code)
+  {
+    lo += step;
+    step <<= 1;
+  }
+  hi = lo + step < n_codes ? lo + step : n_codes;   // codes[hi] >= code
+  while(hi - lo > 1)
+  {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if(codes[mid] < code)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return hi;
+}
+
+/*
+  Code directory: a two-level table over the code space. Bucket b
+  covers codes [b << shift, (b + 1) << shift) and code_directory[b] is
+  the position of the first code of the block not smaller than
+  b << shift, so a code is looked up by scanning the (typically one
+  or two) codes between code_directory[b] and code_directory[b + 1].
+  The shift is chosen to have about as many buckets as codes; when the
+  codes are dense the shift is 0 and the lookup is a single access.
+ */
+void _build_code_directory(EchoprintInvertedIndexBlock *block)
+{
+  uint32_t b, i, shift, n_buckets;
+  uint64_t code_space;
+  if(block->n_codes == 0)
+    return;
+  code_space = (uint64_t) block->codes[block->n_codes - 1] + 1;
+  shift = 0;
+  while((code_space >> shift) > block->n_codes)
+    shift++;
+  n_buckets = (uint32_t) ((code_space + (1ULL << shift) - 1) >> shift);
+  block->code_directory =
+    (uint32_t *) malloc(sizeof(uint32_t) * (n_buckets + 1));
+  i = 0;
+  for(b = 0; b < n_buckets; b++)
   {
-    indices[n] = indices[n-1];
-    scores[n] = scores[n-1];
+    while(i < block->n_codes && (block->codes[i] >> shift) < b)
+      i++;
+    block->code_directory[b] = i;
   }
+  block->code_directory[n_buckets] = block->n_codes;
+  block->code_directory_shift = shift;
+  block->code_directory_n_buckets = n_buckets;
 }
 
-// index of first element in scores smaller than value
-// (scores is sorted descending)
-int first_index_smaller_than(
-  float *scores, int len, float value)
+// how the codes of a sorted list of `n_keys` codes are located in the
+// block's codes: directory lookup if available, galloping if the block
+// is much larger than the list, linear merge otherwise
+#define ECHOPRINT_SEARCH_MERGE 0
+#define ECHOPRINT_SEARCH_GALLOP 1
+#define ECHOPRINT_SEARCH_DIRECTORY 2
+
+int _search_strategy(EchoprintInvertedIndexBlock *index_block, uint32_t n_keys)
 {
-  int i;
-  for(i = len; i > 0; i--)
-    if(scores[i-1] > value)
-      break;
-  return i;
+  if(index_block->code_directory)
+    return ECHOPRINT_SEARCH_DIRECTORY;
+  if(index_block->n_codes > (uint64_t) n_keys * ECHOPRINT_GALLOP_RATIO)
+    return ECHOPRINT_SEARCH_GALLOP;
+  return ECHOPRINT_SEARCH_MERGE;
 }
 
+// position of `code` in the block's codes, n_codes if absent. Codes
+// are searched in increasing order: *cursor is the position where the
+// search starts (merge and galloping) and is moved past smaller codes.
+uint32_t _find_code(EchoprintInvertedIndexBlock *index_block,
+                    uint32_t *cursor, uint32_t code, int strategy)
+{
+  uint32_t i, end, b;
+  switch(strategy)
+  {
+  case ECHOPRINT_SEARCH_DIRECTORY:
+    b = code >> index_block->code_directory_shift;
+    if(b >= index_block->code_directory_n_buckets)
+      return index_block->n_codes;
+    i = index_block->code_directory[b];
+    end = index_block->code_directory[b + 1];
+    while(i < end && index_block->codes[i] < code)
+      i++;
+    return i < end && index_block->codes[i] == code ?
+      i : index_block->n_codes;
+  case ECHOPRINT_SEARCH_GALLOP:
+    i = _gallop_to(index_block->codes, *cursor, index_block->n_codes, code);
+    break;
+  default:
+    i = *cursor;
+    while(i < index_block->n_codes && index_block->codes[i] < code)
+      i++;
+  }
+  *cursor = i;
+  return i < index_block->n_codes && index_block->codes[i] == code ?
+    i : index_block->n_codes;
+}
 
-// output_{indices, scores} have length n_results;
-// return effective number returned (might be < n_results for very small index)
-uint32_t echoprint_inverted_index_query(
-  uint32_t query_length, uint32_t *query,
-  EchoprintInvertedIndex *index,
-  uint32_t n_results,
-  uint32_t *output_indices,
-  float *output_scores,
-  similarity_function sim)
+/*
+  Bounded min-heap holding the best results seen so far, the worst of
+  them at the root, so that a candidate that does not beat it is
+  rejected in constant time. Score ties are won by the larger song
+  index, i.e. by the song that comes last when the index is scanned
+  in order.
+ */
+typedef struct _EchoprintTopK
 {
-  int b, n, i;
-  int max_block_n_songs, song_index_base;
-  float *tmp_scores;
+  uint32_t capacity;
+  uint32_t size;
+  uint32_t *indices;
+  float *scores;
+  float min_score;    // candidates scoring less are never inserted
+} EchoprintTopK;
 
-  max_block_n_songs = 0;
-  for(b = 0; b < index->n_blocks; b++)
-    max_block_n_songs = max_block_n_songs > index->blocks[b].n_songs ?
-      max_block_n_songs : index->blocks[b].n_songs;
+// whether result a ranks strictly before result b
+int _ranks_before(
+  float score_a, uint32_t index_a, float score_b, uint32_t index_b)
+{
+  return score_a > score_b || (score_a == score_b && index_a > index_b);
+}
 
-  tmp_scores = (float *) malloc(sizeof(float) * max_block_n_songs);
+void _topk_init(EchoprintTopK *topk, uint32_t capacity,
+                uint32_t *indices, float *scores, float min_score)
+{
+  topk->capacity = capacity;
+  topk->size = 0;
+  topk->indices = indices;
+  topk->scores = scores;
+  topk->min_score = min_score;
+}
 
-  for(n = 0; n < n_results; n++)
+void _topk_sift_down(EchoprintTopK *topk, uint32_t i)
+{
+  uint32_t child;
+  uint32_t index = topk->indices[i];
+  float score = topk->scores[i];
+  for(;;)
   {
-    output_indices[n] = n;
-    output_scores[n] = -1.;
+    child = 2 * i + 1;
+    if(child >= topk->size)
+      break;
+    // descend towards the worse child
+    if(child + 1 < topk->size &&
+       _ranks_before(topk->scores[child], topk->indices[child],
+                     topk->scores[child + 1], topk->indices[child + 1]))
+      child++;
+    if(!_ranks_before(score, index,
+                      topk->scores[child], topk->indices[child]))
+      break;
+    topk->indices[i] = topk->indices[child];
+    topk->scores[i] = topk->scores[child];
+    i = child;
   }
+  topk->indices[i] = index;
+  topk->scores[i] = score;
+}
 
-  _sequence_to_set_inplace(query, &query_length);
-
-  song_index_base = 0;
-  for(b = 0; b < index->n_blocks; b++)
+void _topk_push(EchoprintTopK *topk, uint32_t index, float score)
+{
+  uint32_t i, parent;
+  if(!(score >= topk->min_score))
+    return;
+  if(topk->size < topk->capacity)
   {
-    echoprint_inverted_index_block_similarity(
-      query_length, query, index->blocks + b, tmp_scores, sim);
-    for(i = 0; i < index->blocks[b].n_songs; i++)
+    i = topk->size++;
+    while(i > 0)
     {
-      float ith_score = tmp_scores[i];
-      int ith_pos = first_index_smaller_than(
-        output_scores, n_results, ith_score);
-      if(ith_pos < n_results)
-      {
-        shift_outputs_right(
-          ith_pos, n_results, output_indices, output_scores);
-        output_indices[ith_pos] = song_index_base + i;
-        output_scores[ith_pos] = ith_score;
-      }
+      parent = (i - 1) / 2;
+      if(!_ranks_before(topk->scores[parent], topk->indices[parent],
+                        score, index))
+        break;
+      topk->indices[i] = topk->indices[parent];
+      topk->scores[i] = topk->scores[parent];
+      i = parent;
     }
-    song_index_base += index->blocks[b].n_songs;
+    topk->indices[i] = index;
+    topk->scores[i] = score;
   }
+  else if(topk->capacity > 0 &&
+          _ranks_before(score, index, topk->scores[0], topk->indices[0]))
+  {
+    topk->indices[0] = index;
+    topk->scores[0] = score;
+    _topk_sift_down(topk, 0);
+  }
+}
 
-  int n_effective_results = 0;
-  for(n = 0; n < n_results; n++)
-    if(output_scores[n] >= 0.)
-      n_effective_results++;
+// sort the results by decreasing rank, in place; unused slots get a
+// negative score. Return the number of results.
+uint32_t _topk_finish(EchoprintTopK *topk)
+{
+  uint32_t n, n_results = topk->size;
+  while(topk->size > 1)
+  {
+    uint32_t index = topk->indices[0];
+    float score = topk->scores[0];
+    topk->size--;
+    topk->indices[0] = topk->indices[topk->size];
+    topk->scores[0] = topk->scores[topk->size];
+    topk->indices[topk->size] = index;
+    topk->scores[topk->size] = score;
+    _topk_sift_down(topk, 0);
+  }
+  for(n = n_results; n < topk->capacity; n++)
+  {
+    topk->indices[n] = n;
+    topk->scores[n] = -1.;
+  }
+  topk->size = n_results;
+  return n_results;
+}
 
-  free(tmp_scores);
-  return n_effective_results;
+// the score a song must at least have to possibly enter the heap
+float _topk_threshold(EchoprintTopK *topk)
+{
+  if(topk->capacity > 0 && topk->size == topk->capacity)
+    return topk->scores[0];
+  return topk->min_score;
 }
 
-void _load_echoprint_inverted_index_block(
-  FILE *fp, EchoprintInvertedIndexBlock *block)
+float _min_score(const EchoprintQueryOptions *options)
 {
-  int n;
-  int n_tot_song_indices;
-  fseek(fp, 0L, SEEK_SET);
+  return options ? options->min_score : 0.;
+}
 
-  fread(&(block->n_codes), sizeof(uint32_t), 1, fp);
-  fread(&(block->n_songs), sizeof(uint32_t), 1, fp);
+int _topk_contains(EchoprintTopK *topk, uint32_t index)
+{
+  uint32_t n;
+  for(n = 0; n < topk->size; n++)
+    if(topk->indices[n] == index)
+      return 1;
+  return 0;
+}
 
-  block->codes = (uint32_t *) malloc(sizeof(uint32_t) * block->n_codes);
-  fread(block->codes, sizeof(uint32_t), block->n_codes, fp);
-  block->code_lengths = (uint32_t *) malloc(sizeof(uint32_t) * block->n_codes);
-  fread(block->code_lengths, sizeof(uint32_t), block->n_codes, fp);
-  block->song_lengths = (uint32_t *) malloc(sizeof(uint32_t) * block->n_songs);
-  fread(block->song_lengths, sizeof(uint32_t), block->n_songs, fp);
 
-  n_tot_song_indices = 0;
-  for(n = 0; n < block->n_codes; n++)
-    n_tot_song_indices += block->code_lengths[n];
-  block->song_indices =
-    (uint16_t *) malloc(sizeof(uint16_t) * n_tot_song_indices);
-  fread(block->song_indices, sizeof(uint16_t), n_tot_song_indices, fp);
+/*
+  Songs inserted since loading (the delta segment, numbered after the
+  songs of the blocks) and deleted songs (a bitmap over all the song
+  indices, allocated on the first deletion). `lock` is held shared by
+  queries and exclusively by updates, which also protects the blocks
+  array of the index from compactions appending to it. Both take
+  `gate` first, so that a steady flow of queries cannot starve
+  updates.
+ */
+struct _EchoprintIndexUpdates
+{
+  pthread_rwlock_t lock;
+  pthread_mutex_t gate;
+  uint32_t n_songs;          // delta songs
+  uint32_t capacity;
+  uint32_t **songs_codes;    // sorted, distinct
+  uint32_t *song_lengths;
+  uint64_t *deleted;         // bitmap, or 0
+  uint32_t n_deleted_words;
+  uint32_t n_deleted;
+  int load_flags;            // applied to the blocks built by compaction
+  pthread_mutex_t compaction_lock;
+  pthread_t compaction_thread;
+  int compaction_running;
+  uint32_t compaction_period_ms;
+  int compaction_stopping;
+  pthread_mutex_t compaction_stop_lock;
+  pthread_cond_t compaction_stop;
+};
+
+void _read_lock(EchoprintIndexUpdates *updates)
+{
+  pthread_mutex_lock(&updates->gate);
+  pthread_rwlock_rdlock(&updates->lock);
+  pthread_mutex_unlock(&updates->gate);
 }
 
-// does not free block itself
-void echoprint_inverted_index_free_block(
-  EchoprintInvertedIndexBlock *block)
+// waits for running queries, holding new ones back meanwhile
+void _write_lock(EchoprintIndexUpdates *updates)
 {
-  free(block->codes);
-  free(block->code_lengths);
-  free(block->song_lengths);
-  free(block->song_indices);
+  pthread_mutex_lock(&updates->gate);
+  pthread_rwlock_wrlock(&updates->lock);
+  pthread_mutex_unlock(&updates->gate);
 }
 
-EchoprintInvertedIndex * load_echoprint_inverted_index(FILE **fps, int n_files)
+void _unlock(EchoprintIndexUpdates *updates)
 {
-  int n;
-  EchoprintInvertedIndex * index =
-    (EchoprintInvertedIndex *) malloc(sizeof(EchoprintInvertedIndex));
-  index->n_blocks = n_files;
-  index->blocks = (EchoprintInvertedIndexBlock *)
-    malloc(sizeof(EchoprintInvertedIndexBlock) * index->n_blocks);
-  for(n = 0; n < n_files; n++)
-    _load_echoprint_inverted_index_block(fps[n], index->blocks + n);
-  return index;
+  pthread_rwlock_unlock(&updates->lock);
 }
 
-void echoprint_inverted_index_free(EchoprintInvertedIndex *index)
+int _is_deleted(EchoprintIndexUpdates *updates, uint32_t song_index)
 {
-  int n;
-  for(n = 0; n < index->n_blocks; n++)
-    echoprint_inverted_index_free_block(index->blocks + n);
-  free(index->blocks);
-  free(index);
+  return updates->n_deleted > 0 &&
+    (song_index >> 6) < updates->n_deleted_words &&
+    (updates->deleted[song_index >> 6] >> (song_index & 63)) & 1;
 }
 
-EchoprintInvertedIndex * echoprint_inverted_index_load_from_paths(
-  char **paths, int n_files)
+uint32_t _n_block_songs(EchoprintInvertedIndex *index)
 {
-  int n;
-  int all_files_opened = 1;
-  FILE **fps = (FILE **) malloc(sizeof(FILE*) * n_files);
-  for(n = 0; n < n_files; n++)
+  uint32_t b, n_songs = 0;
+  for(b = 0; b < index->n_blocks; b++)
+    n_songs += index->blocks[b].n_songs;
+  return n_songs;
+}
+
+// number of codes shared by two sorted sequences of distinct codes
+uint32_t _intersection_size(uint32_t *a, uint32_t length_a,
+                            uint32_t *b, uint32_t length_b)
+{
+  uint32_t i = 0, j = 0, count = 0;
+  while(i < length_a && j < length_b)
   {
-    fps[n] = fopen(paths[n], "r");
-    if(fps[n] == 0)
-      all_files_opened = 0;
+    if(a[i] < b[j])
+      i++;
+    else if(a[i] > b[j])
+      j++;
+    else
+    {
+      count++;
+      i++;
+      j++;
+    }
   }
-  EchoprintInvertedIndex *epii = 0;
-  if(all_files_opened)
-    epii = load_echoprint_inverted_index(fps, n_files);
-  for(n = 0; n < n_files; n++)
-    if(fps[n] != 0)
-      fclose(fps[n]);
-  free(fps);
-  return epii;
+  return count;
 }
 
-
-void echoprint_inverted_index_block_serialize(
-  EchoprintInvertedIndexBlock *block,
-  FILE *fp)
+// the delta segment is expected to stay small (it is compacted to
+// blocks), so each of its songs is merged with the query
+void _query_delta(EchoprintIndexUpdates *updates, uint32_t song_index_base,
+                  uint32_t query_length, uint32_t *query,
+                  similarity_function sim, EchoprintTopK *topk)
 {
-  int n, song_indices_length;
-  song_indices_length = 0;
-  for(n = 0; n < block->n_codes; n++)
-    song_indices_length += block->code_lengths[n];
-  fwrite(&(block->n_codes), sizeof(uint32_t), 1, fp);
-  fwrite(&(block->n_songs), sizeof(uint32_t), 1, fp);
-  fwrite(block->codes, sizeof(uint32_t), block->n_codes, fp);
-  fwrite(block->code_lengths, sizeof(uint32_t), block->n_codes, fp);
-  fwrite(block->song_lengths, sizeof(uint32_t), block->n_songs, fp);
-  fwrite(block->song_indices, sizeof(uint16_t), song_indices_length, fp);
+  uint32_t s, count;
+  for(s = 0; s < updates->n_songs; s++)
+  {
+    if(_is_deleted(updates, song_index_base + s))
+      continue;
+    count = _intersection_size(query, query_length, updates->songs_codes[s],
+                               updates->song_lengths[s]);
+    if(count > 0)
+      _topk_push(topk, song_index_base + s,
+                 _similarity(query_length, updates->song_lengths[s],
+                             count, sim));
+  }
 }
 
-
-// `output` is malloc-ed; `sequences` and `sequence_lengths` are
-// modified in-place
-void _inplace_sort_and_merge(uint32_t **sequences,
-                             uint32_t *sequence_lengths,
-                             uint32_t n_sequences,
-                             uint32_t **output,
-                             uint32_t *output_length,
-                             int code_sequences_already_sorted_distinct)
+// songs sharing no code with the query are never pushed, yet they
+// rank (with a zero score, larger indices first) after all the
+// matching ones: when fewer songs than the capacity matched, and
+// hence all of them are in the heap, complete it with those
+void _topk_push_unmatched(EchoprintTopK *topk, EchoprintInvertedIndex *index,
+                          uint32_t query_length, similarity_function sim)
 {
-  uint32_t n, i, out_len;
-  uint32_t *out;
-  out_len = 0;
-  for(n = 0; n < n_sequences; n++)
+  int b;
+  uint32_t s, song_index_base;
+  EchoprintIndexUpdates *updates = index->updates;
+  if(topk->size >= topk->capacity || !(0. >= topk->min_score))
+    return;
+  song_index_base = _n_block_songs(index);
+  for(s = updates->n_songs; s > 0; s--)
   {
-    if(!code_sequences_already_sorted_distinct)
-      _sequence_to_set_inplace(sequences[n], sequence_lengths + n);
-    out_len += sequence_lengths[n];
+    if(topk->size >= topk->capacity)
+      return;
+    if(!_is_deleted(updates, song_index_base + s - 1) &&
+       !_topk_contains(topk, song_index_base + s - 1))
+      _topk_push(topk, song_index_base + s - 1,
+                 _similarity(query_length, updates->song_lengths[s - 1],
+                             0, sim));
   }
-  out = (uint32_t *) malloc(sizeof(uint32_t) * out_len);
-  i = 0;
-  for(n = 0; n < n_sequences; n++)
+  for(b = index->n_blocks - 1; b >= 0; b--)
   {
-    uint32_t len_n = sequence_lengths[n];
-    memcpy(out + i, sequences[n], sizeof(uint32_t) * len_n);
-    i += len_n;
+    EchoprintInvertedIndexBlock *block = index->blocks + b;
+    song_index_base -= block->n_songs;
+    for(s = block->n_songs; s > 0; s--)
+    {
+      if(topk->size >= topk->capacity)
+        return;
+      if(!_is_deleted(updates, song_index_base + s - 1) &&
+         !_topk_contains(topk, song_index_base + s - 1))
+        _topk_push(topk, song_index_base + s - 1,
+                   _similarity(query_length, block->song_lengths[s - 1],
+                               0, sim));
+    }
   }
-  _sequence_to_set_inplace(out, &out_len);
-  *output_length = out_len;
-  *output = out;
 }
 
-void echoprint_inverted_index_block_from_song_codes(
-  uint32_t **songs_codes,
-  uint32_t *song_lengths,
-  uint32_t n_songs,
-  EchoprintInvertedIndexBlock *output_block,
-  int code_sequences_already_sorted_distinct)
+
+/*
+  Per-block count of the codes each song shares with the query. When
+  the matching codeblocks hold few postings compared to the number of
+  songs, the songs hit are listed in `touched` when their counter
+  leaves zero, so that scoring the block and resetting the counters
+  afterwards costs time proportional to the postings visited rather
+  than to the number of songs. Otherwise (`dense`) all the counters
+  are scanned.
+ */
+typedef struct _EchoprintAccumulator
 {
-  uint32_t n_codes, c, i, code_lengths_sum;
-  uint32_t *codes, *code_lengths, *code_offsets;
-  uint16_t *song_indices;
+  uint32_t *counts;     // one per song, all zero between blocks
+  uint32_t *touched;
+  uint32_t n_touched;
+  int dense;
+  uint64_t *matches;    // (length << 32 | codeblock) of the codeblocks
+                        // of the current block matching the query
+} EchoprintAccumulator;
 
-  _inplace_sort_and_merge(songs_codes, song_lengths, n_songs,
-                          &codes, &n_codes, code_sequences_already_sorted_distinct);
+void _accumulator_init(EchoprintAccumulator *acc, uint32_t max_n_songs,
+                       uint32_t query_length)
+{
+  acc->counts = (uint32_t *) calloc(max_n_songs > 0 ? max_n_songs : 1,
+                                    sizeof(uint32_t));
+  acc->touched = (uint32_t *) malloc(
+    sizeof(uint32_t) * (max_n_songs > 0 ? max_n_songs : 1));
+  acc->n_touched = 0;
+  acc->dense = 0;
+  acc->matches = (uint64_t *) malloc(
+    sizeof(uint64_t) * (query_length > 0 ? query_length : 1));
+}
+
+void _accumulator_free(EchoprintAccumulator *acc)
+{
+  free(acc->counts);
+  free(acc->touched);
+  free(acc->matches);
+}
+
+void _accumulate_song(EchoprintAccumulator *acc, uint32_t song_index)
+{
+  if(acc->counts[song_index]++ == 0)
+    acc->touched[acc->n_touched++] = song_index;
+}
 
-  code_lengths = (uint32_t *) malloc(sizeof(uint32_t) * n_codes);
-  for(i = 0; i < n_codes; i++)
-    code_lengths[i] = 0;
-  for(i = 0; i < n_songs; i++)
+// add the postings of codeblock c to `counts`, appending the songs
+// seen for the first time to `touched` unless it is 0; return the new
+// number of touched songs
+uint32_t _count_codeblock(
+  EchoprintInvertedIndexBlock *block, uint32_t c, uint32_t *counts,
+  uint32_t *touched, uint32_t n_touched, uint32_t *postings_buffer)
+{
+  uint32_t n, s, length;
+  if(block->postings_format == ECHOPRINT_POSTINGS_RAW16)
+  {
+    uint16_t *song_indices = block->song_indices + block->code_offsets[c];
+    length = block->code_lengths[c];
+    if(touched)
+      for(n = 0; n < length; n++)
+      {
+        s = song_indices[n];
+        if(counts[s]++ == 0)
+          touched[n_touched++] = s;
+      }
+    else
+      for(n = 0; n < length; n++)
+        counts[song_indices[n]]++;
+  }
+  else
   {
-    int offset = 0;
-    for(c = 0; c < song_lengths[i]; c++)
+    // 32-bit postings are read in place, compressed ones decoded
+    uint32_t *postings = postings_buffer;
+    if(block->postings_format == ECHOPRINT_POSTINGS_RAW32)
     {
-      while(codes[offset] != songs_codes[i][c])
-        offset++;
-      code_lengths[offset]++;
+      postings = block->song_indices32 + block->code_offsets[c];
+      length = block->code_lengths[c];
     }
+    else
+      length = _decode_codeblock(block, c, postings_buffer);
+    if(touched)
+      for(n = 0; n < length; n++)
+      {
+        s = postings[n];
+        if(counts[s]++ == 0)
+          touched[n_touched++] = s;
+      }
+    else
+      for(n = 0; n < length; n++)
+        counts[postings[n]]++;
   }
+  return n_touched;
+}
 
-  code_lengths_sum = 0;
-  for(c = 0; c < n_codes; c++)
-    code_lengths_sum += code_lengths[c];
-  song_indices = (uint16_t *) malloc(
-    sizeof(uint16_t) * code_lengths_sum);
+// add codeblock c to the counters of the songs already counted only
+// (deferred frequent codes), scanning it
+void _count_codeblock_found(
+  EchoprintInvertedIndexBlock *block, uint32_t c, uint32_t *counts,
+  uint32_t *postings_buffer)
+{
+  uint32_t n, length = block->code_lengths[c];
+  if(block->postings_format == ECHOPRINT_POSTINGS_RAW16)
+  {
+    uint16_t *song_indices = block->song_indices + block->code_offsets[c];
+    for(n = 0; n < length; n++)
+      counts[song_indices[n]] += counts[song_indices[n]] != 0;
+    return;
+  }
+  if(block->postings_format == ECHOPRINT_POSTINGS_RAW32)
+    postings_buffer = block->song_indices32 + block->code_offsets[c];
+  else
+    _decode_codeblock(block, c, postings_buffer);
+  for(n = 0; n < length; n++)
+    counts[postings_buffer[n]] += counts[postings_buffer[n]] != 0;
+}
 
-  code_offsets = (uint32_t *) malloc(sizeof(uint32_t) * n_codes);
-  code_offsets[0] = 0;
-  for(c = 1; c < n_codes; c++)
-    code_offsets[c] = code_offsets[c-1] + code_lengths[c-1];
-  for(i = 0; i < n_songs; i++)
+// add codeblock c to the counters of the touched songs only, binary
+// searching them in it
+void _count_codeblock_lookups(
+  EchoprintInvertedIndexBlock *block, uint32_t c, uint32_t *counts,
+  uint32_t *touched, uint32_t n_touched, uint32_t *postings_buffer)
+{
+  uint32_t n, lo, hi, mid, s, length = block->code_lengths[c];
+  uint16_t *song_indices = 0;
+  if(block->postings_format == ECHOPRINT_POSTINGS_RAW16)
+    song_indices = block->song_indices + block->code_offsets[c];
+  else if(block->postings_format == ECHOPRINT_POSTINGS_RAW32)
+    postings_buffer = block->song_indices32 + block->code_offsets[c];
+  else
+    _decode_codeblock(block, c, postings_buffer);
+  for(n = 0; n < n_touched; n++)
   {
-    int offset = 0;
-    for(c = 0; c < song_lengths[i]; c++)
+    s = touched[n];
+    lo = 0;
+    hi = length;
+    while(lo < hi)
     {
-      uint32_t code = songs_codes[i][c];
-      while(codes[offset] != code)
-        offset++;
-      song_indices[code_offsets[offset]] = i;
-      code_offsets[offset]++;
+      mid = lo + (hi - lo) / 2;
+      if((song_indices ? song_indices[mid] : postings_buffer[mid]) < s)
+        lo = mid + 1;
+      else
+        hi = mid;
     }
+    if(lo < length &&
+       (song_indices ? song_indices[lo] : postings_buffer[lo]) == s)
+      counts[s]++;
   }
-  free(code_offsets);
+}
 
-  output_block->n_codes = n_codes;
-  output_block->n_songs = n_songs;
-  output_block->codes = codes;
-  output_block->code_lengths = code_lengths;
-  output_block->song_lengths = (uint32_t *) malloc(sizeof(uint32_t) * n_songs);
-  memcpy(output_block->song_lengths, song_lengths, sizeof(uint32_t) * n_songs);
-  output_block->song_indices = song_indices;
+// count parking the songs of a dense block that deferred codes must
+// not count, above any number of codes
+#define ECHOPRINT_UNFOUND 0x80000000U
+
+// codeblocks longer than this hold frequent codes (see
+// ECHOPRINT_FREQUENT_CODES_DEFER); a code of a single song never is
+uint32_t _frequent_code_limit(const EchoprintQueryOptions *options,
+                              EchoprintInvertedIndexBlock *block)
+{
+  uint32_t limit;
+  if(options == 0 || !(options->max_code_frequency > 0.) ||
+     options->max_code_frequency >= 1.)
+    return UINT32_MAX;
+  limit = (uint32_t) (options->max_code_frequency * block->n_songs);
+  return limit > 1 ? limit : 1;
 }
 
+// upper bound on the score of a song of the block sharing at most
+// `count` codes with the query: the score grows with the count and
+// decreases with the song length, which is at least max(count,
+// min_song_length)
+float _score_bound(uint32_t query_length, uint32_t count,
+                   EchoprintInvertedIndexBlock *block, similarity_function sim)
+{
+  return _similarity(
+    query_length, count > block->min_song_length ?
+    count : block->min_song_length, count, sim);
+}
 
-uint32_t echoprint_inverted_index_get_n_songs(
-  EchoprintInvertedIndex *index)
+int _log2_ceil(uint32_t x)
 {
-  uint32_t n_total, b;
-  n_total = 0;
-  for(b = 0; b < index->n_blocks; b++)
-    n_total += index->blocks[b].n_songs;
-  return n_total;
+  int n = 0;
+  while(n < 32 && (1ULL << n) < x)
+    n++;
+  return n;
 }
 
-int echoprint_inverted_index_build_write_block(
-  uint32_t **block_songs_codes,
-  uint32_t *block_song_lengths,
-  uint32_t n_songs,
-  char *path_out,
-  int code_sequences_already_sorted_distinct)
+// count the codes of `query` (sorted, distinct, at most as many as
+// given to _accumulator_init) found in each song of the block that
+// may score at least `threshold` (other songs might be partially
+// counted, or not at all); codeblocks longer than `frequent_limit`
+// are skipped, or only counted for the songs found by the others,
+// which are counted first. postings_buffer (used to
+// decode compressed codeblocks) must hold n_songs elements. The work
+// done is added to `stats`.
+void _accumulate_block(
+  uint32_t query_length, uint32_t *query,
+  EchoprintInvertedIndexBlock *index_block, similarity_function sim,
+  float threshold, uint32_t frequent_limit, int skip_frequent,
+  EchoprintAccumulator *acc, uint32_t *postings_buffer,
+  EchoprintQueryStats *stats)
 {
-  FILE *fout;
-  EchoprintInvertedIndexBlock block;
-  fout = fopen(path_out, "w");
-  if(fout == 0)
-    return 1;
-  echoprint_inverted_index_block_from_song_codes(
-    block_songs_codes, block_song_lengths, n_songs, &block,
-    code_sequences_already_sorted_distinct);
-  echoprint_inverted_index_block_serialize(&block, fout);
-  fclose(fout);
-  echoprint_inverted_index_free_block(&block);
+  uint32_t i, j, c, m, k, s, lo, hi, n_matches, n_essential, n_frequent;
+  uint64_t n_postings, n_essential_postings, n_frequent_postings;
+  int strategy;
+
+  // skip the block if even a song sharing all the query's codes
+  // could not make it
+  k = query_length < index_block->max_song_length ?
+    query_length : index_block->max_song_length;
+  if(_score_bound(query_length, k, index_block, sim) < threshold)
+  {
+    stats->blocks_skipped++;
+    return;
+  }
+
+  // locate the matching codeblocks first, to know how many postings
+  // are going to be visited
+  strategy = _search_strategy(index_block, query_length);
+  i = 0;        // search cursor in the codeblocks
+  n_matches = 0;
+  n_frequent = 0;
+  n_postings = 0;
+  for(j = 0; j < query_length && i < index_block->n_codes; j++)
+  {
+    c = _find_code(index_block, &i, query[j], strategy);
+    if(c == index_block->n_codes)
+      continue;
+    if(index_block->code_lengths[c] > frequent_limit)
+    {
+      stats->frequent_codes++;
+      if(skip_frequent)
+      {
+        stats->matched_codes++;
+        continue;
+      }
+      n_frequent++;
+    }
+    acc->matches[n_matches++] =
+      ((uint64_t) index_block->code_lengths[c] << 32) | c;
+    n_postings += index_block->code_lengths[c];
+  }
+  stats->matched_codes += n_matches;
+  k = n_matches < index_block->max_song_length ?
+    n_matches : index_block->max_song_length;
+  if(n_matches == 0 || _score_bound(query_length, k, index_block, sim) <
+     threshold)
+  {
+    stats->blocks_skipped++;
+    return;
+  }
+  stats->blocks_scanned++;
+
+  // songs found in at most k of the matching codeblocks score less
+  // than the threshold (max-score pruning): only the songs of the
+  // other, shorter, codeblocks are candidates, and the k longest
+  // codeblocks can be binary searched for the candidates instead of
+  // being scanned when that is cheaper. Deferred frequent codeblocks,
+  // the longest, are never scanned for new songs.
+  lo = 0;
+  hi = n_matches;   // _score_bound(hi) >= threshold
+  while(hi - lo > 1)
+  {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if(_score_bound(query_length, mid, index_block, sim) < threshold)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  k = lo;
+  n_essential = n_matches;
+  n_essential_postings = n_postings;
+  if(k > 0 || n_frequent > 0)
+  {
+    qsort(acc->matches, n_matches, sizeof(uint64_t), _cmpuint64);
+    // the shortest codeblocks among the k longest are cheaper to scan
+    n_essential = n_matches - (k > n_frequent ? k : n_frequent);
+    n_essential_postings = 0;
+    for(m = 0; m < n_essential; m++)
+      n_essential_postings += acc->matches[m] >> 32;
+    for(; n_essential < n_matches - n_frequent; n_essential++)
+    {
+      uint64_t length = acc->matches[n_essential] >> 32;
+      if(n_essential_postings * _log2_ceil(length) < length)
+        break;
+      n_essential_postings += length;
+    }
+  }
+
+  // so are the deferred codeblocks cheaper to scan (for the songs
+  // found) than to search
+  n_frequent_postings = 0;
+  for(m = n_matches - n_frequent; m < n_matches; m++)
+  {
+    uint64_t length = acc->matches[m] >> 32;
+    if(n_essential_postings * _log2_ceil(length) >= length)
+      n_frequent_postings += length;
+  }
+  acc->dense = (n_essential_postings + n_frequent_postings) *
+    ECHOPRINT_DENSE_RATIO >= index_block->n_songs;
+  if(acc->dense)
+    n_essential = n_matches - n_frequent;
+  for(m = 0; m < n_essential; m++)
+  {
+    acc->n_touched = _count_codeblock(
+      index_block, (uint32_t) acc->matches[m], acc->counts,
+      acc->dense ? 0 : acc->touched, acc->n_touched, postings_buffer);
+    stats->postings_visited += index_block->code_lengths[
+      (uint32_t) acc->matches[m]];
+  }
+  if(acc->dense && n_frequent > 0)
+  {
+    // the songs not found by the other codes are parked out of reach
+    // of the deferred codes, which are then scanned as usual
+    for(s = 0; s < index_block->n_songs; s++)
+      acc->counts[s] = acc->counts[s] ? acc->counts[s] : ECHOPRINT_UNFOUND;
+    for(; m < n_matches; m++)
+    {
+      _count_codeblock(index_block, (uint32_t) acc->matches[m], acc->counts,
+                       0, 0, postings_buffer);
+      stats->postings_visited += index_block->code_lengths[
+        (uint32_t) acc->matches[m]];
+    }
+    for(s = 0; s < index_block->n_songs; s++)
+      acc->counts[s] = acc->counts[s] < ECHOPRINT_UNFOUND ? acc->counts[s] : 0;
+  }
+  for(; m < n_matches; m++)
+  {
+    uint64_t length = acc->matches[m] >> 32;
+    // deferred codeblocks are scanned for the songs found when that is
+    // cheaper than searching them
+    if(m >= n_matches - n_frequent &&
+       length < (uint64_t) acc->n_touched * _log2_ceil(length))
+    {
+      _count_codeblock_found(index_block, (uint32_t) acc->matches[m],
+                             acc->counts, postings_buffer);
+      stats->postings_visited += length;
+      continue;
+    }
+    _count_codeblock_lookups(
+      index_block, (uint32_t) acc->matches[m], acc->counts,
+      acc->touched, acc->n_touched, postings_buffer);
+    stats->postings_searched += acc->n_touched;
+  }
+}
+
+// push the touched songs of the block to the top results and reset
+// the accumulator for the next block
+void _accumulator_push(
+  EchoprintAccumulator *acc, EchoprintInvertedIndexBlock *block,
+  uint32_t query_length, similarity_function sim,
+  uint32_t song_index_base, EchoprintIndexUpdates *updates,
+  EchoprintTopK *topk)
+{
+  uint32_t n, s, n_candidates;
+  uint32_t candidates[ECHOPRINT_FILTER_CHUNK];
+  float candidate_scores[ECHOPRINT_FILTER_CHUNK];
+  if(acc->dense)
+  {
+    // untouched songs score 0, as in the original ranking; the songs
+    // that cannot enter the heap are filtered out a chunk at a time
+    EchoprintFilterKernel filter = _get_filter_kernel();
+    for(s = 0; s < block->n_songs; s += ECHOPRINT_FILTER_CHUNK)
+    {
+      uint32_t length = block->n_songs - s < ECHOPRINT_FILTER_CHUNK ?
+        block->n_songs - s : ECHOPRINT_FILTER_CHUNK;
+      n_candidates = filter(
+        acc->counts + s, block->song_lengths + s, length, query_length, sim,
+        _topk_threshold(topk), candidates, candidate_scores);
+      for(n = 0; n < n_candidates; n++)
+        if(!_is_deleted(updates, song_index_base + s + candidates[n]))
+          _topk_push(topk, song_index_base + s + candidates[n],
+                     candidate_scores[n]);
+    }
+    memset(acc->counts, 0, sizeof(uint32_t) * block->n_songs);
+  }
+  else
+    for(n = 0; n < acc->n_touched; n++)
+    {
+      s = acc->touched[n];
+      if(!_is_deleted(updates, song_index_base + s))
+        _topk_push(topk, song_index_base + s,
+                   _similarity(query_length, block->song_lengths[s],
+                               acc->counts[s], sim));
+      acc->counts[s] = 0;
+    }
+  acc->n_touched = 0;
+  acc->dense = 0;
+}
+
+
+/*
+  Thread pool owned by an index (see
+  echoprint_inverted_index_set_n_threads). Queries push tasks to a
+  shared FIFO and wait for them on a latch, so several queries can be
+  served concurrently by the same pool.
+ */
+
+typedef struct _EchoprintTask
+{
+  void (*run)(void *);
+  void *arg;
+  struct _EchoprintTask *next;
+} EchoprintTask;
+
+struct _EchoprintThreadPool
+{
+  int n_threads;
+  pthread_t *threads;
+  pthread_mutex_t lock;
+  pthread_cond_t has_tasks;
+  EchoprintTask *head;
+  EchoprintTask *tail;
+  int stopping;
+};
+
+typedef struct _EchoprintLatch
+{
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int remaining;
+} EchoprintLatch;
+
+void _latch_init(EchoprintLatch *latch, int count)
+{
+  pthread_mutex_init(&latch->lock, 0);
+  pthread_cond_init(&latch->done, 0);
+  latch->remaining = count;
+}
+
+void _latch_count_down(EchoprintLatch *latch)
+{
+  pthread_mutex_lock(&latch->lock);
+  if(--latch->remaining == 0)
+    pthread_cond_broadcast(&latch->done);
+  pthread_mutex_unlock(&latch->lock);
+}
+
+void _latch_wait_and_destroy(EchoprintLatch *latch)
+{
+  pthread_mutex_lock(&latch->lock);
+  while(latch->remaining > 0)
+    pthread_cond_wait(&latch->done, &latch->lock);
+  pthread_mutex_unlock(&latch->lock);
+  pthread_mutex_destroy(&latch->lock);
+  pthread_cond_destroy(&latch->done);
+}
+
+void *_thread_pool_worker(void *arg)
+{
+  EchoprintThreadPool *pool = (EchoprintThreadPool *) arg;
+  EchoprintTask *task;
+  pthread_mutex_lock(&pool->lock);
+  for(;;)
+  {
+    while(pool->head == 0 && !pool->stopping)
+      pthread_cond_wait(&pool->has_tasks, &pool->lock);
+    if(pool->head == 0)
+      break;
+    task = pool->head;
+    pool->head = task->next;
+    if(pool->head == 0)
+      pool->tail = 0;
+    pthread_mutex_unlock(&pool->lock);
+    task->run(task->arg);
+    pthread_mutex_lock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+void _thread_pool_submit(EchoprintThreadPool *pool, EchoprintTask *task)
+{
+  task->next = 0;
+  pthread_mutex_lock(&pool->lock);
+  if(pool->tail)
+    pool->tail->next = task;
+  else
+    pool->head = task;
+  pool->tail = task;
+  pthread_cond_signal(&pool->has_tasks);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+EchoprintThreadPool *_thread_pool_new(int n_threads)
+{
+  int n;
+  EchoprintThreadPool *pool =
+    (EchoprintThreadPool *) malloc(sizeof(EchoprintThreadPool));
+  pool->threads = (pthread_t *) malloc(sizeof(pthread_t) * n_threads);
+  pthread_mutex_init(&pool->lock, 0);
+  pthread_cond_init(&pool->has_tasks, 0);
+  pool->head = 0;
+  pool->tail = 0;
+  pool->stopping = 0;
+  pool->n_threads = 0;
+  for(n = 0; n < n_threads; n++)
+    if(pthread_create(pool->threads + n, 0, _thread_pool_worker, pool) == 0)
+      pool->n_threads++;
+  return pool;
+}
+
+// waits for queued tasks to be run
+void _thread_pool_free(EchoprintThreadPool *pool)
+{
+  int n;
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->has_tasks);
+  pthread_mutex_unlock(&pool->lock);
+  for(n = 0; n < pool->n_threads; n++)
+    pthread_join(pool->threads[n], 0);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->has_tasks);
+  free(pool->threads);
+  free(pool);
+}
+
+int echoprint_inverted_index_set_n_threads(
+  EchoprintInvertedIndex *index, int n_threads)
+{
+  if(index->thread_pool)
+  {
+    _thread_pool_free(index->thread_pool);
+    index->thread_pool = 0;
+  }
+  if(n_threads > 1)
+  {
+    index->thread_pool = _thread_pool_new(n_threads - 1);
+    if(index->thread_pool->n_threads == 0)
+    {
+      _thread_pool_free(index->thread_pool);
+      index->thread_pool = 0;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+// a contiguous range of blocks scored by one thread, with its own
+// scratch space (owned by a query context and kept across queries)
+// and top results
+typedef struct _EchoprintQuerySlice
+{
+  EchoprintTask task;
+  EchoprintLatch *latch;
+  EchoprintInvertedIndex *index;
+  uint32_t query_length;
+  uint32_t *query;
+  similarity_function sim;
+  const EchoprintQueryOptions *options;
+  uint32_t first_block;
+  uint32_t end_block;
+  uint32_t song_index_base;   // global index of first song in first_block
+  EchoprintTopK topk;
+  EchoprintAccumulator acc;
+  uint32_t *postings_buffer;
+  uint32_t *result_indices;   // of topk, when not the output itself
+  float *result_scores;
+  uint32_t songs_capacity;    // of acc.counts, acc.touched and
+                              // postings_buffer
+  uint32_t codes_capacity;    // of acc.matches
+  uint32_t results_capacity;
+  EchoprintQueryStats stats;  // blocks and postings of the slice only
+} EchoprintQuerySlice;
+
+// capacity for at least `needed` elements, growing geometrically
+uint32_t _grown_capacity(uint32_t capacity, uint32_t needed)
+{
+  if(needed <= capacity)
+    return capacity;
+  return needed > 2 * capacity ? needed : 2 * capacity;
+}
+
+// make the scratch space of a slice (zeroed when first used) large
+// enough for a query; the counters of the accumulator stay zero
+void _query_slice_reserve(EchoprintQuerySlice *slice, uint32_t max_n_songs,
+                          uint32_t query_length, uint32_t n_results)
+{
+  if(max_n_songs > slice->songs_capacity)
+  {
+    free(slice->acc.counts);
+    free(slice->acc.touched);
+    free(slice->postings_buffer);
+    slice->songs_capacity = max_n_songs;
+    slice->acc.counts = (uint32_t *) calloc(max_n_songs, sizeof(uint32_t));
+    slice->acc.touched = (uint32_t *) malloc(sizeof(uint32_t) * max_n_songs);
+    slice->postings_buffer =
+      (uint32_t *) malloc(sizeof(uint32_t) * max_n_songs);
+  }
+  if(query_length > slice->codes_capacity)
+  {
+    free(slice->acc.matches);
+    slice->codes_capacity = _grown_capacity(slice->codes_capacity,
+                                            query_length);
+    slice->acc.matches =
+      (uint64_t *) malloc(sizeof(uint64_t) * slice->codes_capacity);
+  }
+  if(n_results > slice->results_capacity)
+  {
+    free(slice->result_indices);
+    free(slice->result_scores);
+    slice->results_capacity = n_results;
+    slice->result_indices = (uint32_t *) malloc(sizeof(uint32_t) * n_results);
+    slice->result_scores = (float *) malloc(sizeof(float) * n_results);
+  }
+  slice->acc.n_touched = 0;
+  slice->acc.dense = 0;
+}
+
+void _query_slice(EchoprintQuerySlice *slice)
+{
+  int b;
+  uint32_t song_index_base = slice->song_index_base;
+  for(b = slice->first_block; b < slice->end_block; b++)
+  {
+    EchoprintInvertedIndexBlock *block = slice->index->blocks + b;
+    _accumulate_block(slice->query_length, slice->query, block, slice->sim,
+                      _topk_threshold(&slice->topk),
+                      _frequent_code_limit(slice->options, block),
+                      slice->options && slice->options->frequent_codes ==
+                      ECHOPRINT_FREQUENT_CODES_SKIP,
+                      &slice->acc, slice->postings_buffer, &slice->stats);
+    _accumulator_push(&slice->acc, block, slice->query_length, slice->sim,
+                      song_index_base, slice->index->updates, &slice->topk);
+    song_index_base += block->n_songs;
+  }
+}
+
+void _query_slice_task(void *arg)
+{
+  EchoprintQuerySlice *slice = (EchoprintQuerySlice *) arg;
+  _query_slice(slice);
+  _latch_count_down(slice->latch);
+}
+
+/*
+  Process-wide query statistics, and the trace hook, guarded by
+  `_query_counters_lock`.
+ */
+static pthread_mutex_t _query_counters_lock = PTHREAD_MUTEX_INITIALIZER;
+static EchoprintQueryCounters _query_counters;
+static EchoprintQueryTraceHook _query_trace_hook;
+static void *_query_trace_hook_arg;
+
+double _now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+void _count_query(const EchoprintQueryStats *stats, uint32_t query_length,
+                  const uint32_t *query)
+{
+  int b = 0;
+  double microseconds = stats->total_seconds * 1e6;
+  EchoprintQueryTraceHook hook;
+  void *hook_arg;
+  while(b < ECHOPRINT_LATENCY_BUCKETS - 1 && microseconds >= (double) (1u << b))
+    b++;
+  pthread_mutex_lock(&_query_counters_lock);
+  _query_counters.n_queries++;
+  _query_counters.query_codes += stats->query_codes;
+  _query_counters.distinct_codes += stats->distinct_codes;
+  _query_counters.matched_codes += stats->matched_codes;
+  _query_counters.frequent_codes += stats->frequent_codes;
+  _query_counters.blocks_scanned += stats->blocks_scanned;
+  _query_counters.blocks_skipped += stats->blocks_skipped;
+  _query_counters.postings_visited += stats->postings_visited;
+  _query_counters.postings_searched += stats->postings_searched;
+  _query_counters.total_seconds += stats->total_seconds;
+  _query_counters.latency_histogram[b]++;
+  hook = _query_trace_hook;
+  hook_arg = _query_trace_hook_arg;
+  pthread_mutex_unlock(&_query_counters_lock);
+  if(hook)
+    hook(stats, query_length, query, hook_arg);
+}
+
+void echoprint_query_counters_get(EchoprintQueryCounters *counters)
+{
+  pthread_mutex_lock(&_query_counters_lock);
+  *counters = _query_counters;
+  pthread_mutex_unlock(&_query_counters_lock);
+}
+
+void echoprint_query_counters_reset(void)
+{
+  pthread_mutex_lock(&_query_counters_lock);
+  memset(&_query_counters, 0, sizeof(EchoprintQueryCounters));
+  pthread_mutex_unlock(&_query_counters_lock);
+}
+
+void echoprint_set_query_trace_hook(EchoprintQueryTraceHook hook, void *arg)
+{
+  pthread_mutex_lock(&_query_counters_lock);
+  _query_trace_hook = hook;
+  _query_trace_hook_arg = arg;
+  pthread_mutex_unlock(&_query_counters_lock);
+}
+
+/*
+  Query scratch space: the distinct codes of the query, and one slice
+  per thread scoring the blocks (see EchoprintQuerySlice). The
+  functions without a context use the calling thread's own, created
+  on its first query and freed when it exits.
+ */
+struct _EchoprintQueryContext
+{
+  uint32_t *query;
+  uint32_t query_capacity;
+  EchoprintQuerySlice *slices;
+  int n_slices;              // allocated
+};
+
+EchoprintQueryContext *echoprint_query_context_new(void)
+{
+  return (EchoprintQueryContext *) calloc(1, sizeof(EchoprintQueryContext));
+}
+
+void echoprint_query_context_free(EchoprintQueryContext *context)
+{
+  int s;
+  if(context == 0)
+    return;
+  for(s = 0; s < context->n_slices; s++)
+  {
+    free(context->slices[s].acc.counts);
+    free(context->slices[s].acc.touched);
+    free(context->slices[s].acc.matches);
+    free(context->slices[s].postings_buffer);
+    free(context->slices[s].result_indices);
+    free(context->slices[s].result_scores);
+  }
+  free(context->slices);
+  free(context->query);
+  free(context);
+}
+
+static pthread_key_t _thread_query_context_key;
+static pthread_once_t _thread_query_context_once = PTHREAD_ONCE_INIT;
+
+void _thread_query_context_free(void *context)
+{
+  echoprint_query_context_free((EchoprintQueryContext *) context);
+}
+
+void _thread_query_context_key_create(void)
+{
+  pthread_key_create(&_thread_query_context_key, _thread_query_context_free);
+}
+
+EchoprintQueryContext *_thread_query_context(void)
+{
+  EchoprintQueryContext *context;
+  pthread_once(&_thread_query_context_once, _thread_query_context_key_create);
+  context = (EchoprintQueryContext *)
+    pthread_getspecific(_thread_query_context_key);
+  if(context == 0)
+  {
+    context = echoprint_query_context_new();
+    pthread_setspecific(_thread_query_context_key, context);
+  }
+  return context;
+}
+
+// make room for `n_slices` slices and a query of `query_length` codes
+void _query_context_reserve(EchoprintQueryContext *context, int n_slices,
+                            uint32_t query_length)
+{
+  if(n_slices > context->n_slices)
+  {
+    context->slices = (EchoprintQuerySlice *) realloc(
+      context->slices, sizeof(EchoprintQuerySlice) * n_slices);
+    memset(context->slices + context->n_slices, 0,
+           sizeof(EchoprintQuerySlice) * (n_slices - context->n_slices));
+    context->n_slices = n_slices;
+  }
+  if(query_length >= context->query_capacity)
+  {
+    free(context->query);
+    context->query_capacity = _grown_capacity(context->query_capacity,
+                                              query_length + 1);
+    context->query =
+      (uint32_t *) malloc(sizeof(uint32_t) * context->query_capacity);
+  }
+}
+
+// output_{indices, scores} have length n_results;
+// return effective number returned (might be < n_results for very small index)
+uint32_t echoprint_inverted_index_query(
+  uint32_t query_length, const uint32_t *query,
+  EchoprintInvertedIndex *index,
+  uint32_t n_results,
+  uint32_t *output_indices,
+  float *output_scores,
+  similarity_function sim)
+{
+  return echoprint_inverted_index_query_with_context(
+    _thread_query_context(), query_length, query, index, n_results,
+    output_indices, output_scores, sim, 0);
+}
+
+uint32_t echoprint_inverted_index_query_with_options(
+  uint32_t query_length, const uint32_t *query,
+  EchoprintInvertedIndex *index,
+  uint32_t n_results,
+  uint32_t *output_indices,
+  float *output_scores,
+  similarity_function sim,
+  const EchoprintQueryOptions *options)
+{
+  return echoprint_inverted_index_query_with_context(
+    _thread_query_context(), query_length, query, index, n_results,
+    output_indices, output_scores, sim, options);
+}
+
+uint32_t echoprint_inverted_index_query_with_context(
+  EchoprintQueryContext *context,
+  uint32_t query_length, const uint32_t *query,
+  EchoprintInvertedIndex *index,
+  uint32_t n_results,
+  uint32_t *output_indices,
+  float *output_scores,
+  similarity_function sim,
+  const EchoprintQueryOptions *options)
+{
+  int b, n, s, n_slices;
+  int song_index_base;
+  uint32_t *distinct_query;
+  EchoprintQuerySlice *slices;
+  EchoprintTopK topk;
+  EchoprintLatch latch;
+  EchoprintQueryStats stats;
+  double start, phase_start;
+
+  start = _now();
+  memset(&stats, 0, sizeof(EchoprintQueryStats));
+  stats.query_codes = query_length;
+  _read_lock(index->updates);
+
+  // one slice per thread (the calling one included), but never more
+  // slices than blocks; a single slice fills the output directly
+  n_slices = index->thread_pool ? index->thread_pool->n_threads + 1 : 1;
+  if(n_slices > index->n_blocks)
+    n_slices = index->n_blocks > 0 ? index->n_blocks : 1;
+  _query_context_reserve(context, n_slices, query_length);
+  slices = context->slices;
+
+  phase_start = _now();
+  distinct_query = context->query;
+  memcpy(distinct_query, query, sizeof(uint32_t) * query_length);
+  _sequence_to_set_inplace(distinct_query, &query_length);
+  stats.distinct_codes = query_length;
+  stats.dedup_seconds = _now() - phase_start;
+  _topk_init(&topk, n_results, output_indices, output_scores,
+             _min_score(options));
+
+  song_index_base = 0;
+  b = 0;
+  for(s = 0; s < n_slices; s++)
+  {
+    EchoprintQuerySlice *slice = slices + s;
+    _query_slice_reserve(slice, index->max_block_n_songs, query_length,
+                         n_slices == 1 ? 0 : n_results);
+    slice->task.run = _query_slice_task;
+    slice->task.arg = slice;
+    slice->latch = &latch;
+    slice->index = index;
+    slice->query_length = query_length;
+    slice->query = distinct_query;
+    slice->sim = sim;
+    slice->options = options;
+    slice->first_block = b;
+    slice->end_block = (uint32_t)
+      (((uint64_t) index->n_blocks * (s + 1)) / n_slices);
+    slice->song_index_base = song_index_base;
+    if(n_slices == 1)
+      slice->topk = topk;
+    else
+      _topk_init(&slice->topk, n_results, slice->result_indices,
+                 slice->result_scores, topk.min_score);
+    memset(&slice->stats, 0, sizeof(EchoprintQueryStats));
+    for(; b < slice->end_block; b++)
+      song_index_base += index->blocks[b].n_songs;
+  }
+
+  phase_start = _now();
+  if(n_slices == 1)
+  {
+    _query_slice(slices);
+    topk = slices[0].topk;
+  }
+  else
+  {
+    _latch_init(&latch, n_slices - 1);
+    for(s = 1; s < n_slices; s++)
+      _thread_pool_submit(index->thread_pool, &(slices[s].task));
+    _query_slice(slices);
+    _latch_wait_and_destroy(&latch);
+    stats.scoring_seconds = _now() - phase_start;
+
+    phase_start = _now();
+    for(s = 0; s < n_slices; s++)
+      for(n = 0; n < slices[s].topk.size; n++)
+        _topk_push(&topk, slices[s].topk.indices[n],
+                   slices[s].topk.scores[n]);
+    stats.topk_seconds = _now() - phase_start;
+    phase_start = _now();
+  }
+  _query_delta(index->updates, _n_block_songs(index), query_length,
+               distinct_query, sim, &topk);
+  stats.delta_songs = index->updates->n_songs;
+  stats.scoring_seconds += _now() - phase_start;
+  phase_start = _now();
+  _topk_push_unmatched(&topk, index, query_length, sim);
+  _unlock(index->updates);
+
+  for(s = 0; s < n_slices; s++)
+  {
+    stats.matched_codes += slices[s].stats.matched_codes;
+    stats.frequent_codes += slices[s].stats.frequent_codes;
+    stats.blocks_scanned += slices[s].stats.blocks_scanned;
+    stats.blocks_skipped += slices[s].stats.blocks_skipped;
+    stats.postings_visited += slices[s].stats.postings_visited;
+    stats.postings_searched += slices[s].stats.postings_searched;
+  }
+
+  n = _topk_finish(&topk);
+  stats.topk_seconds += _now() - phase_start;
+  stats.total_seconds = _now() - start;
+  if(options && options->stats)
+    *(options->stats) = stats;
+  _count_query(&stats, query_length, distinct_query);
+  return n;
+}
+
+// a group of (at most ECHOPRINT_BATCH_GROUP_SIZE) queries from a
+// batch, scored together block by block
+typedef struct _EchoprintQueryGroup
+{
+  EchoprintTask task;
+  EchoprintLatch *latch;
+  EchoprintInvertedIndex *index;
+  similarity_function sim;
+  uint32_t n_queries;
+  uint32_t *query_lengths;   // lengths of the (distinct) query codes
+  uint64_t *keys;            // (code << 32 | query), sorted
+  uint32_t n_keys;
+  uint32_t n_results;
+  float min_score;
+  const EchoprintQueryOptions *options;
+  uint32_t *output_indices;  // n_queries * n_results
+  float *output_scores;
+  uint32_t *output_n_results;
+  uint32_t max_block_n_songs;
+} EchoprintQueryGroup;
+
+// same as _query_delta for all the queries of the group at once,
+// counting the codes of each delta song against the group's keys
+void _query_group_delta(EchoprintQueryGroup *group, uint32_t song_index_base,
+                        EchoprintTopK *topks)
+{
+  uint32_t s, i, j, q;
+  EchoprintIndexUpdates *updates = group->index->updates;
+  uint32_t *counts;
+  if(updates->n_songs == 0)
+    return;
+  counts = (uint32_t *) calloc(group->n_queries, sizeof(uint32_t));
+  for(s = 0; s < updates->n_songs; s++)
+  {
+    uint32_t *codes = updates->songs_codes[s];
+    uint32_t length = updates->song_lengths[s];
+    if(_is_deleted(updates, song_index_base + s))
+      continue;
+    i = 0;
+    j = 0;
+    while(i < length && j < group->n_keys)
+    {
+      uint32_t code = (uint32_t) (group->keys[j] >> 32);
+      if(codes[i] < code)
+        i++;
+      else if(codes[i] > code)
+        j++;
+      else
+        counts[(uint32_t) group->keys[j++]]++;
+    }
+    for(q = 0; q < group->n_queries; q++)
+      if(counts[q] > 0)
+      {
+        _topk_push(topks + q, song_index_base + s,
+                   _similarity(group->query_lengths[q], length, counts[q],
+                               group->sim));
+        counts[q] = 0;
+      }
+  }
+  free(counts);
+}
+
+// add the postings of codeblock c (decoded in postings_buffer) to the
+// queries of the group holding keys j to k - 1 that are active for
+// the block; only to the songs already found with `found_only`
+void _scatter_codeblock(EchoprintQueryGroup *group,
+                        EchoprintInvertedIndexBlock *block, uint32_t c,
+                        int j, int k, int *active,
+                        EchoprintAccumulator *accs, uint32_t *postings_buffer,
+                        int found_only)
+{
+  uint32_t n, length = _decode_codeblock(block, c, postings_buffer);
+  int m;
+  for(n = 0; n < length; n++)
+  {
+    uint32_t song_index = postings_buffer[n];
+    for(m = j; m < k; m++)
+    {
+      EchoprintAccumulator *acc = accs + (uint32_t) group->keys[m];
+      if(!active[(uint32_t) group->keys[m]])
+        continue;
+      if(!found_only)
+        _accumulate_song(acc, song_index);
+      else if(acc->counts[song_index] != 0)
+        acc->counts[song_index]++;
+    }
+  }
+}
+
+void _query_group(EchoprintQueryGroup *group)
+{
+  int b, j, k, q, d, strategy, skip_frequent, n_deferred;
+  uint32_t i;
+  uint32_t song_index_base, n_songs, frequent_limit;
+  EchoprintAccumulator *accs;
+  uint32_t *postings_buffer;
+  uint32_t *deferred;   // (codeblock, first key) of deferred codes
+  EchoprintTopK *topks;
+  int *active, n_active;
+
+  skip_frequent = group->options &&
+    group->options->frequent_codes == ECHOPRINT_FREQUENT_CODES_SKIP;
+  deferred = (uint32_t *) malloc(sizeof(uint32_t) * 2 * (group->n_keys + 1));
+  active = (int *) malloc(sizeof(int) * group->n_queries);
+  accs = (EchoprintAccumulator *)
+    malloc(sizeof(EchoprintAccumulator) * group->n_queries);
+  for(q = 0; q < group->n_queries; q++)
+    _accumulator_init(accs + q, group->max_block_n_songs, 0);
+  postings_buffer = (uint32_t *) malloc(
+    sizeof(uint32_t) * group->max_block_n_songs);
+  topks = (EchoprintTopK *) malloc(sizeof(EchoprintTopK) * group->n_queries);
+  for(q = 0; q < group->n_queries; q++)
+    _topk_init(topks + q, group->n_results,
+               group->output_indices + q * group->n_results,
+               group->output_scores + q * group->n_results,
+               group->min_score);
+
+  song_index_base = 0;
+  for(b = 0; b < group->index->n_blocks; b++)
+  {
+    EchoprintInvertedIndexBlock *block = group->index->blocks + b;
+    n_songs = block->n_songs;
+    frequent_limit = _frequent_code_limit(group->options, block);
+
+    // queries for which no song of the block can make it skip it
+    n_active = 0;
+    for(q = 0; q < group->n_queries; q++)
+    {
+      uint32_t query_length = group->query_lengths[q];
+      uint32_t count = query_length < block->max_song_length ?
+        query_length : block->max_song_length;
+      active[q] = !(_score_bound(query_length, count, block, group->sim) <
+                    _topk_threshold(topks + q));
+      n_active += active[q];
+    }
+    if(n_active == 0)
+    {
+      song_index_base += n_songs;
+      continue;
+    }
+
+    // single walk of the block's codes against the codes of all the
+    // queries; each matching codeblock is read once and scattered to
+    // every query containing the code. Deferred frequent codeblocks
+    // are scattered last, to the songs the others found.
+    strategy = _search_strategy(block, group->n_keys);
+    i = 0;
+    j = 0;
+    n_deferred = 0;
+    while(j < group->n_keys && i < block->n_codes)
+    {
+      uint32_t qc = (uint32_t) (group->keys[j] >> 32);
+      uint32_t c = _find_code(block, &i, qc, strategy);
+      k = j + 1;
+      while(k < group->n_keys && (uint32_t) (group->keys[k] >> 32) == qc)
+        k++;
+      if(c < block->n_codes && block->code_lengths[c] > frequent_limit)
+      {
+        if(!skip_frequent)
+        {
+          deferred[2 * n_deferred] = c;
+          deferred[2 * n_deferred++ + 1] = j;
+        }
+      }
+      else if(c < block->n_codes)
+        _scatter_codeblock(group, block, c, j, k, active, accs,
+                           postings_buffer, 0);
+      j = k;
+    }
+    for(d = 0; d < n_deferred; d++)
+    {
+      uint32_t qc;
+      j = deferred[2 * d + 1];
+      qc = (uint32_t) (group->keys[j] >> 32);
+      for(k = j + 1;
+          k < group->n_keys && (uint32_t) (group->keys[k] >> 32) == qc; k++)
+        ;
+      _scatter_codeblock(group, block, deferred[2 * d], j, k, active, accs,
+                         postings_buffer, 1);
+    }
+
+    for(q = 0; q < group->n_queries; q++)
+      _accumulator_push(accs + q, block, group->query_lengths[q],
+                        group->sim, song_index_base, group->index->updates,
+                        topks + q);
+    song_index_base += n_songs;
+  }
+
+  _query_group_delta(group, song_index_base, topks);
+  for(q = 0; q < group->n_queries; q++)
+  {
+    _topk_push_unmatched(topks + q, group->index,
+                         group->query_lengths[q], group->sim);
+    group->output_n_results[q] = _topk_finish(topks + q);
+    _accumulator_free(accs + q);
+  }
+  free(topks);
+  free(postings_buffer);
+  free(accs);
+  free(active);
+  free(deferred);
+}
+
+void _query_group_task(void *arg)
+{
+  EchoprintQueryGroup *group = (EchoprintQueryGroup *) arg;
+  _query_group(group);
+  _latch_count_down(group->latch);
+}
+
+void echoprint_inverted_index_query_batch(
+  uint32_t n_queries,
+  const uint32_t *query_lengths,
+  const uint32_t *queries,
+  EchoprintInvertedIndex *index,
+  uint32_t n_results,
+  uint32_t *output_indices,
+  float *output_scores,
+  uint32_t *output_n_results,
+  similarity_function sim,
+  const EchoprintQueryOptions *options)
+{
+  int g, n, q, n_groups;
+  uint64_t query_offset;
+  uint32_t *distinct_codes;
+  EchoprintQueryGroup *groups;
+  EchoprintLatch latch;
+
+  if(n_queries == 0)
+    return;
+
+  _read_lock(index->updates);
+
+  n_groups = (n_queries + ECHOPRINT_BATCH_GROUP_SIZE - 1) /
+    ECHOPRINT_BATCH_GROUP_SIZE;
+  groups = (EchoprintQueryGroup *)
+    malloc(sizeof(EchoprintQueryGroup) * n_groups);
+
+  query_offset = 0;
+  for(g = 0; g < n_groups; g++)
+  {
+    EchoprintQueryGroup *group = groups + g;
+    uint32_t first_query = g * ECHOPRINT_BATCH_GROUP_SIZE;
+    uint64_t n_keys;
+    group->task.run = _query_group_task;
+    group->task.arg = group;
+    group->latch = &latch;
+    group->index = index;
+    group->sim = sim;
+    group->n_queries = n_queries - first_query < ECHOPRINT_BATCH_GROUP_SIZE ?
+      n_queries - first_query : ECHOPRINT_BATCH_GROUP_SIZE;
+    group->n_results = n_results;
+    group->min_score = _min_score(options);
+    group->options = options;
+    group->output_indices = output_indices + first_query * n_results;
+    group->output_scores = output_scores + first_query * n_results;
+    group->output_n_results = output_n_results + first_query;
+    group->max_block_n_songs = index->max_block_n_songs;
+    group->query_lengths = (uint32_t *)
+      malloc(sizeof(uint32_t) * group->n_queries);
+
+    n_keys = 0;
+    for(q = 0; q < group->n_queries; q++)
+      n_keys += query_lengths[first_query + q];
+    group->keys = (uint64_t *) malloc(sizeof(uint64_t) * n_keys);
+    group->n_keys = 0;
+    for(q = 0; q < group->n_queries; q++)
+    {
+      uint32_t length = query_lengths[first_query + q];
+      distinct_codes = (uint32_t *) malloc(sizeof(uint32_t) * length);
+      memcpy(distinct_codes, queries + query_offset,
+             sizeof(uint32_t) * length);
+      query_offset += length;
+      _sequence_to_set_inplace(distinct_codes, &length);
+      group->query_lengths[q] = length;
+      for(n = 0; n < length; n++)
+        group->keys[group->n_keys++] =
+          ((uint64_t) distinct_codes[n] << 32) | q;
+      free(distinct_codes);
+    }
+    qsort(group->keys, group->n_keys, sizeof(uint64_t), _cmpuint64);
+  }
+
+  if(index->thread_pool == 0 || n_groups == 1)
+    for(g = 0; g < n_groups; g++)
+      _query_group(groups + g);
+  else
+  {
+    _latch_init(&latch, n_groups - 1);
+    for(g = 1; g < n_groups; g++)
+      _thread_pool_submit(index->thread_pool, &(groups[g].task));
+    _query_group(groups);
+    _latch_wait_and_destroy(&latch);
+  }
+  _unlock(index->updates);
+
+  for(g = 0; g < n_groups; g++)
+  {
+    free(groups[g].query_lengths);
+    free(groups[g].keys);
+  }
+  free(groups);
+}
+
+/*
+  Block file formats. Version 1 (the original) has no header: n_codes,
+  n_songs, codes, code_lengths, song_lengths and the uint16_t song
+  indices. Version 2 starts with ECHOPRINT_BLOCK_MAGIC, the version,
+  the postings format, n_codes and n_songs. With Stream VByte postings
+  they are followed by codes, code_lengths, the size in bytes of each
+  encoded codeblock, song_lengths and the encoded codeblocks, padded
+  with ECHOPRINT_POSTINGS_PADDING zero bytes so that decoders may read
+  a little past the last codeblock. With 32-bit raw postings they are
+  followed by codes, code_lengths, song_lengths and the uint32_t song
+  indices.
+ */
+#define ECHOPRINT_BLOCK_MAGIC 0x4b4c4245   // "EBLK"
+#define ECHOPRINT_BLOCK_VERSION 2
+#define ECHOPRINT_BLOCK_HEADER_LENGTH 5
+#define ECHOPRINT_POSTINGS_PADDING 16
+
+/*
+  Consolidated index: see echoprint_inverted_index_consolidate. The
+  header and sections are written as these structs, whose fields are
+  all naturally aligned (so without padding); the arrays of section b
+  (ECHOPRINT_CONTAINER_N_ARRAYS of them, in the order below) follow
+  the section table, each at a multiple of ECHOPRINT_CONTAINER_ALIGNMENT
+  bytes from the start of the file.
+ */
+#define ECHOPRINT_CONTAINER_MAGIC 0x58444945   // "EIDX"
+#define ECHOPRINT_CONTAINER_VERSION 1
+#define ECHOPRINT_CONTAINER_ALIGNMENT 64
+#define ECHOPRINT_CONTAINER_N_ARRAYS 5
+#define ECHOPRINT_CONTAINER_CODES 0
+#define ECHOPRINT_CONTAINER_CODE_LENGTHS 1
+#define ECHOPRINT_CONTAINER_SONG_LENGTHS 2
+#define ECHOPRINT_CONTAINER_POSTINGS_SIZES 3  // Stream VByte only
+#define ECHOPRINT_CONTAINER_POSTINGS 4
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t n_blocks;
+  uint32_t n_songs;
+  uint64_t file_length;
+  uint64_t sections_offset;
+  uint32_t sections_checksum;   // CRC-32 of the section table
+  uint32_t header_checksum;     // CRC-32 of the fields above
+  uint32_t reserved[6];         // 0, up to ECHOPRINT_CONTAINER_ALIGNMENT
+} EchoprintContainerHeader;
+
+typedef struct
+{
+  uint32_t postings_format;
+  uint32_t n_codes;
+  uint32_t n_songs;
+  uint32_t song_index_base;     // index of the block's first song
+  uint64_t offsets[ECHOPRINT_CONTAINER_N_ARRAYS];
+  uint64_t lengths[ECHOPRINT_CONTAINER_N_ARRAYS];   // in bytes
+  uint32_t checksum;            // CRC-32 of the arrays, in order
+  uint32_t reserved;
+} EchoprintContainerSection;
+
+// prefix sums of the code lengths: codeblock n spans
+// song_indices[code_offsets[n]] to song_indices[code_offsets[n + 1]]
+void _compute_code_offsets(EchoprintInvertedIndexBlock *block)
+{
+  uint32_t n;
+  block->code_offsets =
+    (uint64_t *) malloc(sizeof(uint64_t) * (block->n_codes + 1));
+  block->code_offsets[0] = 0;
+  for(n = 0; n < block->n_codes; n++)
+    block->code_offsets[n + 1] =
+      block->code_offsets[n] + block->code_lengths[n];
+}
+
+// shortest and longest songs of the block (0 for empty blocks), used to
+// bound the scores the block's songs can reach
+void _compute_song_length_bounds(EchoprintInvertedIndexBlock *block)
+{
+  uint32_t n;
+  block->min_song_length = block->n_songs > 0 ? block->song_lengths[0] : 0;
+  block->max_song_length = block->min_song_length;
+  for(n = 1; n < block->n_songs; n++)
+  {
+    if(block->song_lengths[n] < block->min_song_length)
+      block->min_song_length = block->song_lengths[n];
+    if(block->song_lengths[n] > block->max_song_length)
+      block->max_song_length = block->song_lengths[n];
+  }
+}
+
+// point the block arrays into `data`, the contents of a block file
+// (either version); return 0 if all ok, 1 if the data is invalid or
+// truncated
+int _parse_echoprint_inverted_index_block(
+  uint8_t *data, size_t length, EchoprintInvertedIndexBlock *block)
+{
+  uint32_t n;
+  uint32_t *words = (uint32_t *) data;
+  uint32_t *postings_sizes;
+  size_t n_words = length / sizeof(uint32_t);
+  size_t expected_words;
+
+  memset(block, 0, sizeof(EchoprintInvertedIndexBlock));
+  if(n_words < 2)
+    return 1;
+  if(words[0] != ECHOPRINT_BLOCK_MAGIC)
+  {
+    block->postings_format = ECHOPRINT_POSTINGS_RAW16;
+    block->n_codes = words[0];
+    block->n_songs = words[1];
+    words += 2;
+    n_words -= 2;
+    expected_words = 2 * (size_t) block->n_codes + block->n_songs;
+    if(expected_words > n_words)
+      return 1;
+    block->codes = words;
+    block->code_lengths = block->codes + block->n_codes;
+    block->song_lengths = block->code_lengths + block->n_codes;
+    block->song_indices = (uint16_t *) (block->song_lengths + block->n_songs);
+    _compute_code_offsets(block);
+    if(sizeof(uint16_t) * block->code_offsets[block->n_codes] >
+       length - ((uint8_t *) block->song_indices - data))
+    {
+      free(block->code_offsets);
+      return 1;
+    }
+    return 0;
+  }
+
+  if(n_words < ECHOPRINT_BLOCK_HEADER_LENGTH ||
+     words[1] != ECHOPRINT_BLOCK_VERSION ||
+     (words[2] != ECHOPRINT_POSTINGS_STREAMVBYTE &&
+      words[2] != ECHOPRINT_POSTINGS_RAW32))
+    return 1;
+  block->postings_format = words[2];
+  block->n_codes = words[3];
+  block->n_songs = words[4];
+  words += ECHOPRINT_BLOCK_HEADER_LENGTH;
+  n_words -= ECHOPRINT_BLOCK_HEADER_LENGTH;
+  if(block->postings_format == ECHOPRINT_POSTINGS_RAW32)
+  {
+    expected_words = 2 * (size_t) block->n_codes + block->n_songs;
+    if(expected_words > n_words)
+      return 1;
+    block->codes = words;
+    block->code_lengths = block->codes + block->n_codes;
+    block->song_lengths = block->code_lengths + block->n_codes;
+    block->song_indices32 = block->song_lengths + block->n_songs;
+    _compute_code_offsets(block);
+    if(block->code_offsets[block->n_codes] > n_words - expected_words)
+    {
+      free(block->code_offsets);
+      return 1;
+    }
+    return 0;
+  }
+  expected_words = 3 * (size_t) block->n_codes + block->n_songs;
+  if(expected_words > n_words)
+    return 1;
+  block->codes = words;
+  block->code_lengths = block->codes + block->n_codes;
+  postings_sizes = block->code_lengths + block->n_codes;
+  block->song_lengths = postings_sizes + block->n_codes;
+  block->postings = (uint8_t *) (block->song_lengths + block->n_songs);
+  block->postings_offsets =
+    (uint64_t *) malloc(sizeof(uint64_t) * (block->n_codes + 1));
+  block->postings_offsets[0] = 0;
+  for(n = 0; n < block->n_codes; n++)
+    block->postings_offsets[n + 1] =
+      block->postings_offsets[n] + postings_sizes[n];
+  if(block->postings_offsets[block->n_codes] + ECHOPRINT_POSTINGS_PADDING >
+     length - (block->postings - data))
+  {
+    free(block->postings_offsets);
+    return 1;
+  }
+  _compute_code_offsets(block);
+  return 0;
+}
+
+// read the whole file in a malloc-ed buffer, aligned like a mapping
+// would be on ECHOPRINT_CONTAINER_ALIGNMENT bytes; return 0 if all ok,
+// 1 otherwise
+int _read_file(FILE *fp, uint8_t **data, size_t *length)
+{
+  long file_length;
+  if(fseek(fp, 0L, SEEK_END) != 0 || (file_length = ftell(fp)) < 0)
+    return 1;
+  fseek(fp, 0L, SEEK_SET);
+  if(posix_memalign((void **) data, ECHOPRINT_CONTAINER_ALIGNMENT,
+                    file_length > 0 ? file_length : 1))
+    return 1;
+  if(fread(*data, 1, file_length, fp) != (size_t) file_length)
+  {
+    free(*data);
+    return 1;
+  }
+  *length = (size_t) file_length;
+  return 0;
+}
+
+// map the whole file read-only (see ECHOPRINT_LOAD_PREFETCH); return
+// 0 if all ok, 1 if the file is empty or cannot be mapped
+int _map_file(FILE *fp, int flags, void **mapping, size_t *length)
+{
+  int mmap_flags;
+  struct stat st;
+
+  if(fstat(fileno(fp), &st) != 0 || st.st_size <= 0)
+    return 1;
+  *length = (size_t) st.st_size;
+
+  mmap_flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+  if(flags & ECHOPRINT_LOAD_PREFETCH)
+    mmap_flags |= MAP_POPULATE;
+#endif
+  *mapping = mmap(0, *length, PROT_READ, mmap_flags, fileno(fp), 0);
+  if(*mapping == MAP_FAILED)
+    return 1;
+  if(flags & ECHOPRINT_LOAD_PREFETCH)
+    madvise(*mapping, *length, MADV_WILLNEED);
+  return 0;
+}
+
+// read the whole file in memory, the block arrays pointing into it;
+// return 0 if all ok, 1 otherwise
+int _load_echoprint_inverted_index_block(
+  FILE *fp, EchoprintInvertedIndexBlock *block)
+{
+  size_t length;
+  uint8_t *data;
+  if(_read_file(fp, &data, &length))
+    return 1;
+  if(_parse_echoprint_inverted_index_block(data, length, block))
+  {
+    free(data);
+    return 1;
+  }
+  block->file_data = data;
+  return 0;
+}
+
+// the block arrays point into a read-only mapping of the whole file;
+// return 0 if all ok, 1 if the file cannot be mapped or is truncated
+int _map_echoprint_inverted_index_block(
+  FILE *fp, EchoprintInvertedIndexBlock *block, int flags)
+{
+  size_t length;
+  void *mapping;
+  if(_map_file(fp, flags, &mapping, &length))
+    return 1;
+  if(_parse_echoprint_inverted_index_block(
+       (uint8_t *) mapping, length, block))
+  {
+    munmap(mapping, length);
+    return 1;
+  }
+  block->mapping = mapping;
+  block->mapping_length = length;
+  return 0;
+}
+
+// does not free block itself
+void echoprint_inverted_index_free_block(
+  EchoprintInvertedIndexBlock *block)
+{
+  free(block->code_offsets);
+  free(block->postings_offsets);
+  free(block->code_directory);
+  if(block->mapping)
+    munmap(block->mapping, block->mapping_length);
+  else if(block->file_data)
+    free(block->file_data);
+  else if(block->container == 0)
+  {
+    free(block->codes);
+    free(block->code_lengths);
+    free(block->song_lengths);
+    free(block->song_indices);
+    free(block->song_indices32);
+  }
+}
+
+EchoprintIndexUpdates *_updates_new(int load_flags)
+{
+  EchoprintIndexUpdates *updates =
+    (EchoprintIndexUpdates *) calloc(1, sizeof(EchoprintIndexUpdates));
+  pthread_rwlock_init(&updates->lock, 0);
+  pthread_mutex_init(&updates->gate, 0);
+  pthread_mutex_init(&updates->compaction_lock, 0);
+  pthread_mutex_init(&updates->compaction_stop_lock, 0);
+  pthread_cond_init(&updates->compaction_stop, 0);
+  updates->load_flags = load_flags;
+  return updates;
+}
+
+void _updates_free(EchoprintIndexUpdates *updates)
+{
+  uint32_t s;
+  for(s = 0; s < updates->n_songs; s++)
+    free(updates->songs_codes[s]);
+  free(updates->songs_codes);
+  free(updates->song_lengths);
+  free(updates->deleted);
+  pthread_rwlock_destroy(&updates->lock);
+  pthread_mutex_destroy(&updates->gate);
+  pthread_mutex_destroy(&updates->compaction_lock);
+  pthread_mutex_destroy(&updates->compaction_stop_lock);
+  pthread_cond_destroy(&updates->compaction_stop);
+  free(updates);
+}
+
+// CRC-32 of `length` bytes continuing `crc` (0 to start), in chunks
+// that fit zlib's length type
+uint32_t _crc32(uint32_t crc, const uint8_t *data, uint64_t length)
+{
+  uInt chunk;
+  while(length > 0)
+  {
+    chunk = length > (1U << 30) ? (1U << 30) : (uInt) length;
+    crc = (uint32_t) crc32(crc, data, chunk);
+    data += chunk;
+    length -= chunk;
+  }
+  return crc;
+}
+
+// whether `fp` holds a consolidated index; leaves it at its start
+int _is_container(FILE *fp)
+{
+  uint32_t magic;
+  int found = fread(&magic, sizeof(uint32_t), 1, fp) == 1 &&
+    magic == ECHOPRINT_CONTAINER_MAGIC;
+  fseek(fp, 0L, SEEK_SET);
+  return found;
+}
+
+// return 0 if `data` starts with a valid header and section table, 1
+// otherwise
+int _check_container_header(uint8_t *data, size_t length)
+{
+  EchoprintContainerHeader *header = (EchoprintContainerHeader *) data;
+  if(length < sizeof(EchoprintContainerHeader) ||
+     header->magic != ECHOPRINT_CONTAINER_MAGIC ||
+     header->header_checksum != _crc32(
+       0, data, offsetof(EchoprintContainerHeader, header_checksum)) ||
+     header->version != ECHOPRINT_CONTAINER_VERSION ||
+     header->file_length != length ||
+     header->sections_offset % ECHOPRINT_CONTAINER_ALIGNMENT != 0 ||
+     header->sections_offset > length ||
+     (length - header->sections_offset) / sizeof(EchoprintContainerSection)
+     < header->n_blocks)
+    return 1;
+  return header->sections_checksum != _crc32(
+    0, data + header->sections_offset,
+    sizeof(EchoprintContainerSection) * (uint64_t) header->n_blocks);
+}
+
+// point the block arrays into the consolidated index `data` as laid
+// out by `section`; return 0 if all ok, 1 if the section is invalid or
+// (unless ECHOPRINT_LOAD_NO_CHECKSUMS) its arrays are corrupted
+int _parse_container_section(
+  uint8_t *data, size_t length, EchoprintContainerSection *section,
+  EchoprintInvertedIndexBlock *block, int flags)
+{
+  uint32_t a, n, crc = 0;
+  uint32_t *postings_sizes;
+  uint64_t postings_length;
+  int streamvbyte =
+    section->postings_format == ECHOPRINT_POSTINGS_STREAMVBYTE;
+
+  memset(block, 0, sizeof(EchoprintInvertedIndexBlock));
+  if(section->postings_format != ECHOPRINT_POSTINGS_RAW16 &&
+     section->postings_format != ECHOPRINT_POSTINGS_RAW32 && !streamvbyte)
+    return 1;
+  for(a = 0; a < ECHOPRINT_CONTAINER_N_ARRAYS; a++)
+    if(section->offsets[a] % ECHOPRINT_CONTAINER_ALIGNMENT != 0 ||
+       section->offsets[a] > length ||
+       section->lengths[a] > length - section->offsets[a])
+      return 1;
+  if(section->lengths[ECHOPRINT_CONTAINER_CODES] !=
+     sizeof(uint32_t) * (uint64_t) section->n_codes ||
+     section->lengths[ECHOPRINT_CONTAINER_CODE_LENGTHS] !=
+     sizeof(uint32_t) * (uint64_t) section->n_codes ||
+     section->lengths[ECHOPRINT_CONTAINER_SONG_LENGTHS] !=
+     sizeof(uint32_t) * (uint64_t) section->n_songs ||
+     section->lengths[ECHOPRINT_CONTAINER_POSTINGS_SIZES] !=
+     (streamvbyte ? sizeof(uint32_t) * (uint64_t) section->n_codes : 0))
+    return 1;
+  if(!(flags & ECHOPRINT_LOAD_NO_CHECKSUMS))
+  {
+    for(a = 0; a < ECHOPRINT_CONTAINER_N_ARRAYS; a++)
+      crc = _crc32(crc, data + section->offsets[a], section->lengths[a]);
+    if(crc != section->checksum)
+      return 1;
+  }
+
+  block->postings_format = section->postings_format;
+  block->n_codes = section->n_codes;
+  block->n_songs = section->n_songs;
+  block->codes =
+    (uint32_t *) (data + section->offsets[ECHOPRINT_CONTAINER_CODES]);
+  block->code_lengths =
+    (uint32_t *) (data + section->offsets[ECHOPRINT_CONTAINER_CODE_LENGTHS]);
+  block->song_lengths =
+    (uint32_t *) (data + section->offsets[ECHOPRINT_CONTAINER_SONG_LENGTHS]);
+  block->container = data;
+  _compute_code_offsets(block);
+  postings_length = block->code_offsets[block->n_codes];
+  if(block->postings_format == ECHOPRINT_POSTINGS_RAW16)
+  {
+    block->song_indices =
+      (uint16_t *) (data + section->offsets[ECHOPRINT_CONTAINER_POSTINGS]);
+    postings_length *= sizeof(uint16_t);
+  }
+  else if(block->postings_format == ECHOPRINT_POSTINGS_RAW32)
+  {
+    block->song_indices32 =
+      (uint32_t *) (data + section->offsets[ECHOPRINT_CONTAINER_POSTINGS]);
+    postings_length *= sizeof(uint32_t);
+  }
+  else
+  {
+    postings_sizes = (uint32_t *)
+      (data + section->offsets[ECHOPRINT_CONTAINER_POSTINGS_SIZES]);
+    block->postings = data + section->offsets[ECHOPRINT_CONTAINER_POSTINGS];
+    block->postings_offsets =
+      (uint64_t *) malloc(sizeof(uint64_t) * (block->n_codes + 1));
+    block->postings_offsets[0] = 0;
+    for(n = 0; n < block->n_codes; n++)
+      block->postings_offsets[n + 1] =
+        block->postings_offsets[n] + postings_sizes[n];
+    postings_length = block->postings_offsets[block->n_codes] +
+      ECHOPRINT_POSTINGS_PADDING;
+  }
+  if(section->lengths[ECHOPRINT_CONTAINER_POSTINGS] != postings_length)
+  {
+    free(block->code_offsets);
+    free(block->postings_offsets);
+    return 1;
+  }
+  return 0;
+}
+
+// load a consolidated index with a single read or mapping, the blocks
+// pointing into it; return 0 if it cannot be read or is invalid
+EchoprintInvertedIndex * _load_container(FILE *fp, int flags)
+{
+  uint8_t *data;
+  void *mapping;
+  size_t length;
+  uint32_t b, n_songs = 0;
+  EchoprintContainerHeader *header;
+  EchoprintContainerSection *sections;
+  EchoprintInvertedIndex *index;
+
+  if(flags & ECHOPRINT_LOAD_MMAP)
+  {
+    if(_map_file(fp, flags, &mapping, &length))
+      return 0;
+    data = (uint8_t *) mapping;
+  }
+  else if(_read_file(fp, &data, &length))
+    return 0;
+  index = (EchoprintInvertedIndex *) calloc(1, sizeof(EchoprintInvertedIndex));
+  index->container = data;
+  index->container_length = length;
+  index->container_mapped = (flags & ECHOPRINT_LOAD_MMAP) != 0;
+  index->updates = _updates_new(flags);
+  if(_check_container_header(data, length))
+  {
+    echoprint_inverted_index_free(index);
+    return 0;
+  }
+
+  header = (EchoprintContainerHeader *) data;
+  sections = (EchoprintContainerSection *) (data + header->sections_offset);
+  index->blocks = (EchoprintInvertedIndexBlock *)
+    malloc(sizeof(EchoprintInvertedIndexBlock) * (header->n_blocks + 1));
+  for(b = 0; b < header->n_blocks; b++)
+  {
+    // song indices are global, so the blocks must follow each other
+    if(sections[b].song_index_base != n_songs ||
+       _parse_container_section(
+         data, length, sections + b, index->blocks + b, flags))
+    {
+      echoprint_inverted_index_free(index);
+      return 0;
+    }
+    index->n_blocks++;
+    n_songs += sections[b].n_songs;
+    _compute_song_length_bounds(index->blocks + b);
+    if(flags & ECHOPRINT_LOAD_CODE_DIRECTORY)
+      _build_code_directory(index->blocks + b);
+    if(index->blocks[b].n_songs > index->max_block_n_songs)
+      index->max_block_n_songs = index->blocks[b].n_songs;
+  }
+  if(n_songs != header->n_songs)
+  {
+    echoprint_inverted_index_free(index);
+    return 0;
+  }
+  return index;
+}
+
+EchoprintInvertedIndex * load_echoprint_inverted_index(
+  FILE **fps, int n_files, int flags)
+{
+  int n, m;
+  EchoprintInvertedIndex * index;
+  if(n_files == 1 && _is_container(fps[0]))
+    return _load_container(fps[0], flags);
+  index = (EchoprintInvertedIndex *) calloc(1, sizeof(EchoprintInvertedIndex));
+  index->n_blocks = n_files;
+  index->blocks = (EchoprintInvertedIndexBlock *)
+    malloc(sizeof(EchoprintInvertedIndexBlock) * index->n_blocks);
+  for(n = 0; n < n_files; n++)
+  {
+    if(flags & ECHOPRINT_LOAD_MMAP ?
+       _map_echoprint_inverted_index_block(fps[n], index->blocks + n, flags) :
+       _load_echoprint_inverted_index_block(fps[n], index->blocks + n))
+    {
+      for(m = 0; m < n; m++)
+        echoprint_inverted_index_free_block(index->blocks + m);
+      free(index->blocks);
+      free(index);
+      return 0;
+    }
+    _compute_song_length_bounds(index->blocks + n);
+    if(flags & ECHOPRINT_LOAD_CODE_DIRECTORY)
+      _build_code_directory(index->blocks + n);
+    if(index->blocks[n].n_songs > index->max_block_n_songs)
+      index->max_block_n_songs = index->blocks[n].n_songs;
+  }
+  index->updates = _updates_new(flags);
+  return index;
+}
+
+void echoprint_inverted_index_free(EchoprintInvertedIndex *index)
+{
+  int n;
+  echoprint_inverted_index_start_compaction(index, 0);
+  if(index->thread_pool)
+    _thread_pool_free(index->thread_pool);
+  for(n = 0; n < index->n_blocks; n++)
+    echoprint_inverted_index_free_block(index->blocks + n);
+  free(index->blocks);
+  if(index->container_mapped)
+    munmap(index->container, index->container_length);
+  else
+    free(index->container);
+  _updates_free(index->updates);
+  free(index);
+}
+
+/*
+  Versions of the index behind a handle, the current one first, then
+  the swapped out ones still pinned by queries.
+ */
+typedef struct _EchoprintIndexVersion
+{
+  EchoprintInvertedIndex *index;
+  uint32_t n_readers;
+  struct _EchoprintIndexVersion *next;
+} EchoprintIndexVersion;
+
+struct _EchoprintInvertedIndexHandle
+{
+  pthread_mutex_t lock;
+  EchoprintIndexVersion *versions;
+};
+
+EchoprintIndexVersion *_index_version_new(EchoprintInvertedIndex *index)
+{
+  EchoprintIndexVersion *version =
+    (EchoprintIndexVersion *) malloc(sizeof(EchoprintIndexVersion));
+  if(version == 0)
+    return 0;
+  version->index = index;
+  version->n_readers = 0;
+  version->next = 0;
+  return version;
+}
+
+EchoprintInvertedIndexHandle * echoprint_inverted_index_handle_new(
+  EchoprintInvertedIndex *index)
+{
+  EchoprintInvertedIndexHandle *handle = (EchoprintInvertedIndexHandle *)
+    malloc(sizeof(EchoprintInvertedIndexHandle));
+  if(handle == 0)
+    return 0;
+  handle->versions = _index_version_new(index);
+  if(handle->versions == 0)
+  {
+    free(handle);
+    return 0;
+  }
+  pthread_mutex_init(&handle->lock, 0);
+  return handle;
+}
+
+EchoprintInvertedIndex * echoprint_inverted_index_handle_acquire(
+  EchoprintInvertedIndexHandle *handle)
+{
+  EchoprintInvertedIndex *index;
+  pthread_mutex_lock(&handle->lock);
+  handle->versions->n_readers++;
+  index = handle->versions->index;
+  pthread_mutex_unlock(&handle->lock);
+  return index;
+}
+
+void echoprint_inverted_index_handle_release(
+  EchoprintInvertedIndexHandle *handle,
+  EchoprintInvertedIndex *index)
+{
+  EchoprintIndexVersion **link, *retired = 0;
+  pthread_mutex_lock(&handle->lock);
+  for(link = &handle->versions; *link; link = &(*link)->next)
+    if((*link)->index == index)
+    {
+      if(--(*link)->n_readers == 0 && *link != handle->versions)
+      {
+        retired = *link;
+        *link = retired->next;
+      }
+      break;
+    }
+  pthread_mutex_unlock(&handle->lock);
+  // freeing a version can take a while: not while holding the lock
+  if(retired)
+  {
+    echoprint_inverted_index_free(retired->index);
+    free(retired);
+  }
+}
+
+int echoprint_inverted_index_handle_swap(
+  EchoprintInvertedIndexHandle *handle,
+  EchoprintInvertedIndex *index)
+{
+  EchoprintIndexVersion *version, *retired = 0;
+  version = _index_version_new(index);
+  if(version == 0)
+    return 1;
+  pthread_mutex_lock(&handle->lock);
+  version->next = handle->versions;
+  handle->versions = version;
+  if(version->next->n_readers == 0)
+  {
+    retired = version->next;
+    version->next = retired->next;
+  }
+  pthread_mutex_unlock(&handle->lock);
+  if(retired)
+  {
+    echoprint_inverted_index_free(retired->index);
+    free(retired);
+  }
+  return 0;
+}
+
+void echoprint_inverted_index_handle_free(
+  EchoprintInvertedIndexHandle *handle)
+{
+  EchoprintIndexVersion *version, *next;
+  for(version = handle->versions; version; version = next)
+  {
+    next = version->next;
+    echoprint_inverted_index_free(version->index);
+    free(version);
+  }
+  pthread_mutex_destroy(&handle->lock);
+  free(handle);
+}
+
+EchoprintInvertedIndex * echoprint_inverted_index_load_from_paths(
+  char **paths, int n_files)
+{
+  return echoprint_inverted_index_load_from_paths_with_flags(
+    paths, n_files, 0);
+}
+
+EchoprintInvertedIndex * echoprint_inverted_index_load_from_paths_with_flags(
+  char **paths, int n_files, int flags)
+{
+  int n;
+  int all_files_opened = 1;
+  FILE **fps = (FILE **) malloc(sizeof(FILE*) * n_files);
+  for(n = 0; n < n_files; n++)
+  {
+    fps[n] = fopen(paths[n], "r");
+    if(fps[n] == 0)
+      all_files_opened = 0;
+  }
+  EchoprintInvertedIndex *epii = 0;
+  if(all_files_opened)
+    epii = load_echoprint_inverted_index(fps, n_files, flags);
+  for(n = 0; n < n_files; n++)
+    if(fps[n] != 0)
+      fclose(fps[n]);
+  free(fps);
+  return epii;
+}
+
+
+// version 2 file with 32-bit raw postings; `block` must hold raw
+// postings of either width
+void _block_serialize_raw32(EchoprintInvertedIndexBlock *block, FILE *fp)
+{
+  uint32_t c, header[ECHOPRINT_BLOCK_HEADER_LENGTH];
+  uint32_t *buffer;
+  header[0] = ECHOPRINT_BLOCK_MAGIC;
+  header[1] = ECHOPRINT_BLOCK_VERSION;
+  header[2] = ECHOPRINT_POSTINGS_RAW32;
+  header[3] = block->n_codes;
+  header[4] = block->n_songs;
+  fwrite(header, sizeof(uint32_t), ECHOPRINT_BLOCK_HEADER_LENGTH, fp);
+  fwrite(block->codes, sizeof(uint32_t), block->n_codes, fp);
+  fwrite(block->code_lengths, sizeof(uint32_t), block->n_codes, fp);
+  fwrite(block->song_lengths, sizeof(uint32_t), block->n_songs, fp);
+  if(block->postings_format == ECHOPRINT_POSTINGS_RAW32)
+  {
+    fwrite(block->song_indices32, sizeof(uint32_t),
+           block->code_offsets[block->n_codes], fp);
+    return;
+  }
+  buffer = (uint32_t *) malloc(sizeof(uint32_t) * (block->n_songs + 1));
+  for(c = 0; c < block->n_codes; c++)
+    fwrite(buffer, sizeof(uint32_t), _decode_codeblock(block, c, buffer), fp);
+  free(buffer);
+}
+
+// version 1 file, or version 2 for blocks too large for 16-bit postings
+void echoprint_inverted_index_block_serialize(
+  EchoprintInvertedIndexBlock *block,
+  FILE *fp)
+{
+  uint64_t song_indices_length = block->code_offsets[block->n_codes];
+  if(block->postings_format == ECHOPRINT_POSTINGS_RAW32)
+  {
+    _block_serialize_raw32(block, fp);
+    return;
+  }
+  fwrite(&(block->n_codes), sizeof(uint32_t), 1, fp);
+  fwrite(&(block->n_songs), sizeof(uint32_t), 1, fp);
+  fwrite(block->codes, sizeof(uint32_t), block->n_codes, fp);
+  fwrite(block->code_lengths, sizeof(uint32_t), block->n_codes, fp);
+  fwrite(block->song_lengths, sizeof(uint32_t), block->n_songs, fp);
+  fwrite(block->song_indices, sizeof(uint16_t), song_indices_length, fp);
+}
+
+// version 2 file, postings compressed with Stream VByte; `block` must
+// hold raw postings (as built by
+// echoprint_inverted_index_block_from_song_codes)
+void echoprint_inverted_index_block_serialize_compressed(
+  EchoprintInvertedIndexBlock *block,
+  FILE *fp)
+{
+  uint32_t c, header[ECHOPRINT_BLOCK_HEADER_LENGTH];
+  uint32_t *postings_sizes, *buffer;
+  uint8_t *postings, *out;
+  uint8_t padding[ECHOPRINT_POSTINGS_PADDING];
+
+  postings = (uint8_t *) malloc(
+    (block->n_codes + 3) / 4 * 4 + 4 * block->code_offsets[block->n_codes]
+    + 1);
+  postings_sizes = (uint32_t *) malloc(sizeof(uint32_t) * block->n_codes);
+  buffer = (uint32_t *) malloc(sizeof(uint32_t) * (block->n_songs + 1));
+  out = postings;
+  for(c = 0; c < block->n_codes; c++)
+  {
+    postings_sizes[c] = _streamvbyte_encode_deltas(
+      buffer, _decode_codeblock(block, c, buffer), out);
+    out += postings_sizes[c];
+  }
+  memset(padding, 0, ECHOPRINT_POSTINGS_PADDING);
+
+  header[0] = ECHOPRINT_BLOCK_MAGIC;
+  header[1] = ECHOPRINT_BLOCK_VERSION;
+  header[2] = ECHOPRINT_POSTINGS_STREAMVBYTE;
+  header[3] = block->n_codes;
+  header[4] = block->n_songs;
+  fwrite(header, sizeof(uint32_t), ECHOPRINT_BLOCK_HEADER_LENGTH, fp);
+  fwrite(block->codes, sizeof(uint32_t), block->n_codes, fp);
+  fwrite(block->code_lengths, sizeof(uint32_t), block->n_codes, fp);
+  fwrite(postings_sizes, sizeof(uint32_t), block->n_codes, fp);
+  fwrite(block->song_lengths, sizeof(uint32_t), block->n_songs, fp);
+  fwrite(postings, 1, out - postings, fp);
+  fwrite(padding, 1, ECHOPRINT_POSTINGS_PADDING, fp);
+
+  free(buffer);
+  free(postings_sizes);
+  free(postings);
+}
+
+
+// `offset` rounded up to a multiple of ECHOPRINT_CONTAINER_ALIGNMENT
+uint64_t _container_align(uint64_t offset)
+{
+  return (offset + ECHOPRINT_CONTAINER_ALIGNMENT - 1) /
+    ECHOPRINT_CONTAINER_ALIGNMENT * ECHOPRINT_CONTAINER_ALIGNMENT;
+}
+
+// the arrays of the consolidated index section of `block`, whose
+// Stream VByte codeblock sizes are `postings_sizes` (0 if raw)
+void _container_arrays(
+  EchoprintInvertedIndexBlock *block, uint32_t *postings_sizes,
+  uint8_t **arrays, uint64_t *lengths)
+{
+  uint64_t n_postings = block->code_offsets[block->n_codes];
+  arrays[ECHOPRINT_CONTAINER_CODES] = (uint8_t *) block->codes;
+  lengths[ECHOPRINT_CONTAINER_CODES] =
+    sizeof(uint32_t) * (uint64_t) block->n_codes;
+  arrays[ECHOPRINT_CONTAINER_CODE_LENGTHS] = (uint8_t *) block->code_lengths;
+  lengths[ECHOPRINT_CONTAINER_CODE_LENGTHS] =
+    sizeof(uint32_t) * (uint64_t) block->n_codes;
+  arrays[ECHOPRINT_CONTAINER_SONG_LENGTHS] = (uint8_t *) block->song_lengths;
+  lengths[ECHOPRINT_CONTAINER_SONG_LENGTHS] =
+    sizeof(uint32_t) * (uint64_t) block->n_songs;
+  arrays[ECHOPRINT_CONTAINER_POSTINGS_SIZES] = (uint8_t *) postings_sizes;
+  lengths[ECHOPRINT_CONTAINER_POSTINGS_SIZES] =
+    postings_sizes ? sizeof(uint32_t) * (uint64_t) block->n_codes : 0;
+  if(block->postings_format == ECHOPRINT_POSTINGS_RAW16)
+  {
+    arrays[ECHOPRINT_CONTAINER_POSTINGS] = (uint8_t *) block->song_indices;
+    lengths[ECHOPRINT_CONTAINER_POSTINGS] = sizeof(uint16_t) * n_postings;
+  }
+  else if(block->postings_format == ECHOPRINT_POSTINGS_RAW32)
+  {
+    arrays[ECHOPRINT_CONTAINER_POSTINGS] = (uint8_t *) block->song_indices32;
+    lengths[ECHOPRINT_CONTAINER_POSTINGS] = sizeof(uint32_t) * n_postings;
+  }
+  else
+  {
+    // the padding read past the last codeblock is part of the array
+    arrays[ECHOPRINT_CONTAINER_POSTINGS] = block->postings;
+    lengths[ECHOPRINT_CONTAINER_POSTINGS] =
+      block->postings_offsets[block->n_codes] + ECHOPRINT_POSTINGS_PADDING;
+  }
+}
+
+// write `length` bytes then zeros up to the next aligned offset,
+// `position` being the current one; return 0 if all ok, 1 otherwise
+int _write_aligned(FILE *fp, const void *data, uint64_t length,
+                   uint64_t *position)
+{
+  static const uint8_t zeros[ECHOPRINT_CONTAINER_ALIGNMENT] = {0};
+  uint64_t padding;
+  if(length > 0 && fwrite(data, 1, length, fp) != length)
+    return 1;
+  *position += length;
+  padding = _container_align(*position) - *position;
+  if(padding > 0 && fwrite(zeros, 1, padding, fp) != padding)
+    return 1;
+  *position += padding;
+  return 0;
+}
+
+int echoprint_inverted_index_consolidate(
+  char **paths,
+  int n_files,
+  char *path_out)
+{
+  EchoprintInvertedIndex *index;
+  EchoprintInvertedIndexBlock *block;
+  EchoprintContainerHeader header;
+  EchoprintContainerSection *sections;
+  uint32_t **postings_sizes;
+  uint32_t a, b, c;
+  uint8_t *arrays[ECHOPRINT_CONTAINER_N_ARRAYS];
+  uint64_t lengths[ECHOPRINT_CONTAINER_N_ARRAYS];
+  uint64_t offset, position = 0;
+  int error = 0;
+  FILE *fout;
+
+  index = echoprint_inverted_index_load_from_paths_with_flags(
+    paths, n_files, ECHOPRINT_LOAD_MMAP);
+  if(index == 0)
+    return 1;
+  fout = fopen(path_out, "w");
+  if(fout == 0)
+  {
+    echoprint_inverted_index_free(index);
+    return 1;
+  }
+
+  // lay the arrays out after the section table, checksumming them
+  sections = (EchoprintContainerSection *)
+    calloc(index->n_blocks + 1, sizeof(EchoprintContainerSection));
+  postings_sizes = (uint32_t **) calloc(index->n_blocks + 1, sizeof(uint32_t *));
+  memset(&header, 0, sizeof(EchoprintContainerHeader));
+  header.magic = ECHOPRINT_CONTAINER_MAGIC;
+  header.version = ECHOPRINT_CONTAINER_VERSION;
+  header.n_blocks = index->n_blocks;
+  header.sections_offset = _container_align(sizeof(EchoprintContainerHeader));
+  offset = _container_align(
+    header.sections_offset +
+    sizeof(EchoprintContainerSection) * (uint64_t) index->n_blocks);
+  for(b = 0; b < index->n_blocks; b++)
+  {
+    block = index->blocks + b;
+    if(block->postings_format == ECHOPRINT_POSTINGS_STREAMVBYTE)
+    {
+      postings_sizes[b] =
+        (uint32_t *) malloc(sizeof(uint32_t) * (block->n_codes + 1));
+      for(c = 0; c < block->n_codes; c++)
+        postings_sizes[b][c] = (uint32_t)
+          (block->postings_offsets[c + 1] - block->postings_offsets[c]);
+    }
+    _container_arrays(block, postings_sizes[b], arrays, lengths);
+    sections[b].postings_format = block->postings_format;
+    sections[b].n_codes = block->n_codes;
+    sections[b].n_songs = block->n_songs;
+    sections[b].song_index_base = header.n_songs;
+    for(a = 0; a < ECHOPRINT_CONTAINER_N_ARRAYS; a++)
+    {
+      sections[b].offsets[a] = offset;
+      sections[b].lengths[a] = lengths[a];
+      sections[b].checksum =
+        _crc32(sections[b].checksum, arrays[a], lengths[a]);
+      offset = _container_align(offset + lengths[a]);
+    }
+    header.n_songs += block->n_songs;
+  }
+  header.file_length = offset;
+  header.sections_checksum = _crc32(
+    0, (uint8_t *) sections,
+    sizeof(EchoprintContainerSection) * (uint64_t) index->n_blocks);
+  header.header_checksum = _crc32(
+    0, (uint8_t *) &header,
+    offsetof(EchoprintContainerHeader, header_checksum));
+
+  error = _write_aligned(
+    fout, &header, sizeof(EchoprintContainerHeader), &position);
+  error = error || _write_aligned(
+    fout, sections,
+    sizeof(EchoprintContainerSection) * (uint64_t) index->n_blocks,
+    &position);
+  for(b = 0; b < index->n_blocks && !error; b++)
+  {
+    _container_arrays(index->blocks + b, postings_sizes[b], arrays, lengths);
+    for(a = 0; a < ECHOPRINT_CONTAINER_N_ARRAYS && !error; a++)
+      error = _write_aligned(fout, arrays[a], lengths[a], &position);
+  }
+  if(fclose(fout) != 0)
+    error = 1;
+
+  for(b = 0; b < index->n_blocks; b++)
+    free(postings_sizes[b]);
+  free(postings_sizes);
+  free(sections);
+  echoprint_inverted_index_free(index);
+  return error;
+}
+
+/*
+  Block building. Postings are placed by a counting sort over the code
+  space: each song's codes are counted per bucket (code >> shift), the
+  counts give every (bucket, song range) its write position, and the
+  songs are scattered in order, so that each codeblock comes out sorted
+  by song. This is linear in the number of postings; song ranges are
+  counted and scattered in parallel.
+ */
+
+// buckets of the counting sort: codes below 1 << this (all the
+// echoprint ones) get a bucket each, wider codes share them and are
+// sorted within their bucket afterwards
+#define ECHOPRINT_BUILD_BUCKETS_LOG2 20
+
+typedef struct _EchoprintBuildSlice
+{
+  EchoprintTask task;
+  EchoprintLatch *latch;
+  void (*run)(struct _EchoprintBuildSlice *);
+  uint32_t **songs_codes;
+  uint32_t *song_lengths;
+  uint32_t first_song;
+  uint32_t end_song;
+  int code_sequences_already_sorted_distinct;
+  uint32_t max_code;
+  uint32_t shift;
+  uint32_t n_buckets;
+  uint64_t *positions;       // counts per bucket, then write positions
+  uint16_t *song_indices;    // scatter target when shift == 0, or
+  uint32_t *song_indices32;  // this one for blocks of too many songs
+  uint64_t *keys;            // (code << 32 | song) when shift > 0
+  uint64_t *bucket_offsets;  // start of each bucket in keys (n_buckets + 1)
+  uint32_t first_bucket;     // range of buckets sorted by this slice
+  uint32_t end_bucket;
+} EchoprintBuildSlice;
+
+void _build_slice_prepare(EchoprintBuildSlice *slice)
+{
+  uint32_t i, c;
+  slice->max_code = 0;
+  for(i = slice->first_song; i < slice->end_song; i++)
+  {
+    if(!slice->code_sequences_already_sorted_distinct)
+      _sequence_to_set_inplace(slice->songs_codes[i], slice->song_lengths + i);
+    for(c = 0; c < slice->song_lengths[i]; c++)
+      if(slice->songs_codes[i][c] > slice->max_code)
+        slice->max_code = slice->songs_codes[i][c];
+  }
+}
+
+void _build_slice_count(EchoprintBuildSlice *slice)
+{
+  uint32_t i, c;
+  slice->positions = (uint64_t *) calloc(slice->n_buckets, sizeof(uint64_t));
+  for(i = slice->first_song; i < slice->end_song; i++)
+    for(c = 0; c < slice->song_lengths[i]; c++)
+      slice->positions[slice->songs_codes[i][c] >> slice->shift]++;
+}
+
+void _build_slice_scatter(EchoprintBuildSlice *slice)
+{
+  uint32_t i, c, code;
+  for(i = slice->first_song; i < slice->end_song; i++)
+    for(c = 0; c < slice->song_lengths[i]; c++)
+    {
+      code = slice->songs_codes[i][c];
+      if(slice->shift > 0)
+        slice->keys[slice->positions[code >> slice->shift]++] =
+          ((uint64_t) code << 32) | i;
+      else if(slice->song_indices32)
+        slice->song_indices32[slice->positions[code]++] = i;
+      else
+        slice->song_indices[slice->positions[code]++] = (uint16_t) i;
+    }
+}
+
+void _build_slice_sort_buckets(EchoprintBuildSlice *slice)
+{
+  uint32_t b;
+  for(b = slice->first_bucket; b < slice->end_bucket; b++)
+    qsort(slice->keys + slice->bucket_offsets[b],
+          slice->bucket_offsets[b + 1] - slice->bucket_offsets[b],
+          sizeof(uint64_t), _cmpuint64);
+}
+
+void _build_slice_task(void *arg)
+{
+  EchoprintBuildSlice *slice = (EchoprintBuildSlice *) arg;
+  slice->run(slice);
+  _latch_count_down(slice->latch);
+}
+
+// run one phase on all the slices, the first one on the calling thread
+void _build_phase(EchoprintThreadPool *pool, EchoprintBuildSlice *slices,
+                  int n_slices, void (*run)(EchoprintBuildSlice *))
+{
+  int s;
+  EchoprintLatch latch;
+  for(s = 0; s < n_slices; s++)
+    slices[s].run = run;
+  if(n_slices == 1)
+  {
+    run(slices);
+    return;
+  }
+  _latch_init(&latch, n_slices - 1);
+  for(s = 1; s < n_slices; s++)
+  {
+    slices[s].task.run = _build_slice_task;
+    slices[s].task.arg = slices + s;
+    slices[s].latch = &latch;
+    _thread_pool_submit(pool, &(slices[s].task));
+  }
+  run(slices);
+  _latch_wait_and_destroy(&latch);
+}
+
+// `pool` (or 0) runs all but one of the song ranges
+void _block_from_song_codes(
+  uint32_t **songs_codes,
+  uint32_t *song_lengths,
+  uint32_t n_songs,
+  EchoprintInvertedIndexBlock *output_block,
+  int code_sequences_already_sorted_distinct,
+  EchoprintThreadPool *pool)
+{
+  int s, n_slices;
+  uint32_t b, c, n_buckets, n_codes, shift, max_code;
+  uint64_t n_postings, p, bucket_end;
+  uint32_t *codes, *code_lengths, *song_indices32;
+  uint16_t *song_indices;
+  uint64_t *keys, *bucket_offsets;
+  EchoprintBuildSlice *slices;
+  int wide = n_songs > ECHOPRINT_RAW16_MAX_SONGS;
+
+  n_slices = pool ? pool->n_threads + 1 : 1;
+  if(n_slices > n_songs)
+    n_slices = n_songs > 0 ? n_songs : 1;
+  slices = (EchoprintBuildSlice *)
+    malloc(sizeof(EchoprintBuildSlice) * n_slices);
+  for(s = 0; s < n_slices; s++)
+  {
+    slices[s].songs_codes = songs_codes;
+    slices[s].song_lengths = song_lengths;
+    slices[s].first_song = (uint32_t) (((uint64_t) n_songs * s) / n_slices);
+    slices[s].end_song = (uint32_t)
+      (((uint64_t) n_songs * (s + 1)) / n_slices);
+    slices[s].code_sequences_already_sorted_distinct =
+      code_sequences_already_sorted_distinct;
+  }
+  _build_phase(pool, slices, n_slices, _build_slice_prepare);
+
+  max_code = 0;
+  for(s = 0; s < n_slices; s++)
+    if(slices[s].max_code > max_code)
+      max_code = slices[s].max_code;
+  shift = 0;
+  while((max_code >> shift) >= (1u << ECHOPRINT_BUILD_BUCKETS_LOG2))
+    shift++;
+  n_buckets = (max_code >> shift) + 1;
+  for(s = 0; s < n_slices; s++)
+  {
+    slices[s].shift = shift;
+    slices[s].n_buckets = n_buckets;
+  }
+  _build_phase(pool, slices, n_slices, _build_slice_count);
+
+  // turn the counts into write positions, bucket by bucket then slice
+  // by slice (i.e. song order); also count the distinct codes when
+  // buckets are codes
+  bucket_offsets = (uint64_t *) malloc(sizeof(uint64_t) * (n_buckets + 1));
+  n_postings = 0;
+  n_codes = 0;
+  for(b = 0; b < n_buckets; b++)
+  {
+    bucket_offsets[b] = n_postings;
+    for(s = 0; s < n_slices; s++)
+    {
+      uint64_t count = slices[s].positions[b];
+      slices[s].positions[b] = n_postings;
+      n_postings += count;
+    }
+    if(n_postings > bucket_offsets[b])
+      n_codes++;
+  }
+  bucket_offsets[n_buckets] = n_postings;
+
+  song_indices = wide ? 0 :
+    (uint16_t *) malloc(sizeof(uint16_t) * (n_postings + 1));
+  song_indices32 = wide ?
+    (uint32_t *) malloc(sizeof(uint32_t) * (n_postings + 1)) : 0;
+  keys = shift == 0 ? 0 :
+    (uint64_t *) malloc(sizeof(uint64_t) * (n_postings + 1));
+  for(s = 0; s < n_slices; s++)
+  {
+    slices[s].song_indices = song_indices;
+    slices[s].song_indices32 = song_indices32;
+    slices[s].keys = keys;
+    slices[s].bucket_offsets = bucket_offsets;
+  }
+  _build_phase(pool, slices, n_slices, _build_slice_scatter);
+  for(s = 0; s < n_slices; s++)
+    free(slices[s].positions);
+
+  if(shift == 0)
+  {
+    codes = (uint32_t *) malloc(sizeof(uint32_t) * n_codes);
+    code_lengths = (uint32_t *) malloc(sizeof(uint32_t) * n_codes);
+    c = 0;
+    for(b = 0; b < n_buckets; b++)
+      if(bucket_offsets[b + 1] > bucket_offsets[b])
+      {
+        codes[c] = b;
+        code_lengths[c++] = (uint32_t)
+          (bucket_offsets[b + 1] - bucket_offsets[b]);
+      }
+  }
+  else
+  {
+    // sort each bucket by (code, song), buckets split evenly by
+    // postings among the slices, then read the codeblocks off the keys
+    b = 0;
+    for(s = 0; s < n_slices; s++)
+    {
+      bucket_end = (n_postings * (s + 1)) / n_slices;
+      slices[s].first_bucket = b;
+      while(b < n_buckets && (s == n_slices - 1 ||
+                              bucket_offsets[b + 1] <= bucket_end))
+        b++;
+      slices[s].end_bucket = b;
+    }
+    _build_phase(pool, slices, n_slices, _build_slice_sort_buckets);
+
+    n_codes = 0;
+    for(p = 0; p < n_postings; p++)
+      if(p == 0 || (keys[p] >> 32) != (keys[p - 1] >> 32))
+        n_codes++;
+    codes = (uint32_t *) malloc(sizeof(uint32_t) * n_codes);
+    code_lengths = (uint32_t *) malloc(sizeof(uint32_t) * n_codes);
+    c = 0;
+    for(p = 0; p < n_postings; p++)
+    {
+      if(p == 0 || (keys[p] >> 32) != (keys[p - 1] >> 32))
+      {
+        codes[c++] = (uint32_t) (keys[p] >> 32);
+        code_lengths[c - 1] = 0;
+      }
+      code_lengths[c - 1]++;
+      if(wide)
+        song_indices32[p] = (uint32_t) keys[p];
+      else
+        song_indices[p] = (uint16_t) keys[p];
+    }
+    free(keys);
+  }
+  free(bucket_offsets);
+  free(slices);
+
+  output_block->n_codes = n_codes;
+  output_block->codes = codes;
+  output_block->code_lengths = code_lengths;
+  _compute_code_offsets(output_block);
+  output_block->n_songs = n_songs;
+  output_block->song_lengths = (uint32_t *) malloc(sizeof(uint32_t) * n_songs);
+  memcpy(output_block->song_lengths, song_lengths, sizeof(uint32_t) * n_songs);
+  output_block->song_indices = song_indices;
+  output_block->song_indices32 = song_indices32;
+  _compute_song_length_bounds(output_block);
+  output_block->postings_format =
+    wide ? ECHOPRINT_POSTINGS_RAW32 : ECHOPRINT_POSTINGS_RAW16;
+  output_block->postings = 0;
+  output_block->postings_offsets = 0;
+  output_block->code_directory = 0;
+  output_block->file_data = 0;
+  output_block->mapping = 0;
+  output_block->mapping_length = 0;
+  output_block->container = 0;
+}
+
+void echoprint_inverted_index_block_from_song_codes(
+  uint32_t **songs_codes,
+  uint32_t *song_lengths,
+  uint32_t n_songs,
+  EchoprintInvertedIndexBlock *output_block,
+  int code_sequences_already_sorted_distinct)
+{
+  _block_from_song_codes(songs_codes, song_lengths, n_songs, output_block,
+                         code_sequences_already_sorted_distinct, 0);
+}
+
+
+uint32_t echoprint_inverted_index_get_n_songs(
+  EchoprintInvertedIndex *index)
+{
+  uint32_t n_total;
+  _read_lock(index->updates);
+  n_total = _n_block_songs(index) + index->updates->n_songs;
+  _unlock(index->updates);
+  return n_total;
+}
+
+uint32_t echoprint_inverted_index_insert(
+  EchoprintInvertedIndex *index,
+  uint32_t *codes,
+  uint32_t n_codes)
+{
+  uint32_t song_index, length = n_codes;
+  uint32_t *song_codes;
+  EchoprintIndexUpdates *updates = index->updates;
+
+  song_codes = (uint32_t *)
+    malloc(sizeof(uint32_t) * (n_codes > 0 ? n_codes : 1));
+  if(song_codes == 0)
+    return (uint32_t) -1;
+  memcpy(song_codes, codes, sizeof(uint32_t) * n_codes);
+  _sequence_to_set_inplace(song_codes, &length);
+
+  _write_lock(updates);
+  song_index = _n_block_songs(index) + updates->n_songs;
+  if(song_index == (uint32_t) -1)
+  {
+    _unlock(updates);
+    free(song_codes);
+    return (uint32_t) -1;
+  }
+  if(updates->n_songs == updates->capacity)
+  {
+    uint32_t capacity = updates->capacity > 0 ? 2 * updates->capacity : 16;
+    uint32_t **songs_codes = (uint32_t **)
+      realloc(updates->songs_codes, sizeof(uint32_t *) * capacity);
+    uint32_t *song_lengths;
+    if(songs_codes)
+      updates->songs_codes = songs_codes;
+    song_lengths = (uint32_t *)
+      realloc(updates->song_lengths, sizeof(uint32_t) * capacity);
+    if(song_lengths)
+      updates->song_lengths = song_lengths;
+    if(songs_codes == 0 || song_lengths == 0)
+    {
+      _unlock(updates);
+      free(song_codes);
+      return (uint32_t) -1;
+    }
+    updates->capacity = capacity;
+  }
+  updates->songs_codes[updates->n_songs] = song_codes;
+  updates->song_lengths[updates->n_songs] = length;
+  updates->n_songs++;
+  _unlock(updates);
+  return song_index;
+}
+
+int echoprint_inverted_index_delete(
+  EchoprintInvertedIndex *index,
+  uint32_t song_index)
+{
+  EchoprintIndexUpdates *updates = index->updates;
+  uint32_t word = song_index >> 6;
+  _write_lock(updates);
+  if(song_index >= _n_block_songs(index) + updates->n_songs)
+  {
+    _unlock(updates);
+    return 1;
+  }
+  if(word >= updates->n_deleted_words)
+  {
+    uint32_t n_words = 2 * word + 1;
+    uint64_t *deleted = (uint64_t *)
+      realloc(updates->deleted, sizeof(uint64_t) * n_words);
+    if(deleted == 0)
+    {
+      _unlock(updates);
+      return 1;
+    }
+    memset(deleted + updates->n_deleted_words, 0,
+           sizeof(uint64_t) * (n_words - updates->n_deleted_words));
+    updates->deleted = deleted;
+    updates->n_deleted_words = n_words;
+  }
+  if(!((updates->deleted[word] >> (song_index & 63)) & 1))
+  {
+    updates->deleted[word] |= 1ULL << (song_index & 63);
+    updates->n_deleted++;
+  }
+  _unlock(updates);
+  return 0;
+}
+
+// move the delta songs to new blocks if there are at least min_songs
+// of them
+int _compact(EchoprintInvertedIndex *index, uint32_t min_songs)
+{
+  EchoprintIndexUpdates *updates = index->updates;
+  EchoprintInvertedIndexBlock block, *blocks;
+  uint32_t s, n_songs;
+  uint32_t **songs_codes;
+  uint32_t *song_lengths;
+
+  // compactions are serialized, so that the delta songs copied below
+  // are still the first ones when the block is swapped in
+  pthread_mutex_lock(&updates->compaction_lock);
+  for(;;)
+  {
+    _read_lock(updates);
+    n_songs = updates->n_songs < ECHOPRINT_RAW16_MAX_SONGS ?
+      updates->n_songs : ECHOPRINT_RAW16_MAX_SONGS;
+    if(n_songs < min_songs)
+      n_songs = 0;
+    songs_codes = (uint32_t **) malloc(sizeof(uint32_t *) * (n_songs + 1));
+    song_lengths = (uint32_t *) malloc(sizeof(uint32_t) * (n_songs + 1));
+    memcpy(songs_codes, updates->songs_codes, sizeof(uint32_t *) * n_songs);
+    memcpy(song_lengths, updates->song_lengths, sizeof(uint32_t) * n_songs);
+    _unlock(updates);
+    if(n_songs == 0)
+      break;
+
+    // insertions only append to the delta and free nothing, so the
+    // codes can be read without the lock
+    echoprint_inverted_index_block_from_song_codes(
+      songs_codes, song_lengths, n_songs, &block, 1);
+    if(updates->load_flags & ECHOPRINT_LOAD_CODE_DIRECTORY)
+      _build_code_directory(&block);
+
+    _write_lock(updates);
+    blocks = (EchoprintInvertedIndexBlock *) realloc(
+      index->blocks,
+      sizeof(EchoprintInvertedIndexBlock) * (index->n_blocks + 1));
+    if(blocks == 0)
+    {
+      _unlock(updates);
+      echoprint_inverted_index_free_block(&block);
+      free(songs_codes);
+      free(song_lengths);
+      pthread_mutex_unlock(&updates->compaction_lock);
+      return 1;
+    }
+    index->blocks = blocks;
+    index->blocks[index->n_blocks++] = block;
+    if(block.n_songs > index->max_block_n_songs)
+      index->max_block_n_songs = block.n_songs;
+    updates->n_songs -= n_songs;
+    memmove(updates->songs_codes, updates->songs_codes + n_songs,
+            sizeof(uint32_t *) * updates->n_songs);
+    memmove(updates->song_lengths, updates->song_lengths + n_songs,
+            sizeof(uint32_t) * updates->n_songs);
+    _unlock(updates);
+
+    for(s = 0; s < n_songs; s++)
+      free(songs_codes[s]);
+    free(songs_codes);
+    free(song_lengths);
+  }
+  free(songs_codes);
+  free(song_lengths);
+  pthread_mutex_unlock(&updates->compaction_lock);
+  return 0;
+}
+
+int echoprint_inverted_index_compact(
+  EchoprintInvertedIndex *index)
+{
+  return _compact(index, 1);
+}
+
+void *_compaction_worker(void *arg)
+{
+  EchoprintInvertedIndex *index = (EchoprintInvertedIndex *) arg;
+  EchoprintIndexUpdates *updates = index->updates;
+  struct timespec deadline;
+  pthread_mutex_lock(&updates->compaction_stop_lock);
+  while(!updates->compaction_stopping)
+  {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += updates->compaction_period_ms / 1000;
+    deadline.tv_nsec += (long) (updates->compaction_period_ms % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    while(!updates->compaction_stopping &&
+          pthread_cond_timedwait(&updates->compaction_stop,
+                                 &updates->compaction_stop_lock,
+                                 &deadline) == 0)
+      ;
+    if(updates->compaction_stopping)
+      break;
+    pthread_mutex_unlock(&updates->compaction_stop_lock);
+    _compact(index, ECHOPRINT_COMPACTION_MIN_SONGS);
+    pthread_mutex_lock(&updates->compaction_stop_lock);
+  }
+  pthread_mutex_unlock(&updates->compaction_stop_lock);
+  return 0;
+}
+
+int echoprint_inverted_index_start_compaction(
+  EchoprintInvertedIndex *index,
+  uint32_t period_ms)
+{
+  EchoprintIndexUpdates *updates = index->updates;
+  if(updates->compaction_running)
+  {
+    pthread_mutex_lock(&updates->compaction_stop_lock);
+    updates->compaction_stopping = 1;
+    pthread_cond_broadcast(&updates->compaction_stop);
+    pthread_mutex_unlock(&updates->compaction_stop_lock);
+    pthread_join(updates->compaction_thread, 0);
+    updates->compaction_running = 0;
+  }
+  if(period_ms == 0)
+    return 0;
+  updates->compaction_stopping = 0;
+  updates->compaction_period_ms = period_ms;
+  if(pthread_create(&updates->compaction_thread, 0, _compaction_worker, index))
+    return 1;
+  updates->compaction_running = 1;
+  return 0;
+}
+
+int echoprint_inverted_index_build_write_block(
+  uint32_t **block_songs_codes,
+  uint32_t *block_song_lengths,
+  uint32_t n_songs,
+  char *path_out,
+  int code_sequences_already_sorted_distinct)
+{
+  return echoprint_inverted_index_build_write_block_with_format(
+    block_songs_codes, block_song_lengths, n_songs, path_out,
+    code_sequences_already_sorted_distinct, ECHOPRINT_POSTINGS_RAW16);
+}
+
+// build a block with `pool` (or 0) and write it out
+int _build_write_block(
+  uint32_t **block_songs_codes,
+  uint32_t *block_song_lengths,
+  uint32_t n_songs,
+  char *path_out,
+  int code_sequences_already_sorted_distinct,
+  int postings_format,
+  EchoprintThreadPool *pool)
+{
+  FILE *fout;
+  EchoprintInvertedIndexBlock block;
+  if(postings_format != ECHOPRINT_POSTINGS_RAW16 &&
+     postings_format != ECHOPRINT_POSTINGS_STREAMVBYTE &&
+     postings_format != ECHOPRINT_POSTINGS_RAW32)
+    return 1;
+  fout = fopen(path_out, "w");
+  if(fout == 0)
+    return 1;
+  _block_from_song_codes(
+    block_songs_codes, block_song_lengths, n_songs, &block,
+    code_sequences_already_sorted_distinct, pool);
+  if(postings_format == ECHOPRINT_POSTINGS_STREAMVBYTE)
+    echoprint_inverted_index_block_serialize_compressed(&block, fout);
+  else if(postings_format == ECHOPRINT_POSTINGS_RAW32)
+    _block_serialize_raw32(&block, fout);
+  else
+    echoprint_inverted_index_block_serialize(&block, fout);
+  fclose(fout);
+  echoprint_inverted_index_free_block(&block);
+  return 0;
+}
+
+int echoprint_inverted_index_build_write_block_with_format(
+  uint32_t **block_songs_codes,
+  uint32_t *block_song_lengths,
+  uint32_t n_songs,
+  char *path_out,
+  int code_sequences_already_sorted_distinct,
+  int postings_format)
+{
+  return _build_write_block(
+    block_songs_codes, block_song_lengths, n_songs, path_out,
+    code_sequences_already_sorted_distinct, postings_format, 0);
+}
+
+// every n_writers-th block, starting from first_block, built by one
+// thread
+typedef struct _EchoprintBlockWriter
+{
+  EchoprintTask task;
+  EchoprintLatch *latch;
+  uint32_t first_block;
+  uint32_t n_writers;
+  uint32_t n_blocks;
+  uint32_t ***blocks_songs_codes;
+  uint32_t **blocks_song_lengths;
+  uint32_t *blocks_n_songs;
+  char **paths_out;
+  int code_sequences_already_sorted_distinct;
+  int postings_format;
+  int error;
+} EchoprintBlockWriter;
+
+void _block_writer_run(EchoprintBlockWriter *writer)
+{
+  uint32_t b;
+  writer->error = 0;
+  for(b = writer->first_block; b < writer->n_blocks; b += writer->n_writers)
+    if(_build_write_block(
+         writer->blocks_songs_codes[b], writer->blocks_song_lengths[b],
+         writer->blocks_n_songs[b], writer->paths_out[b],
+         writer->code_sequences_already_sorted_distinct,
+         writer->postings_format, 0))
+      writer->error = 1;
+}
+
+void _block_writer_task(void *arg)
+{
+  EchoprintBlockWriter *writer = (EchoprintBlockWriter *) arg;
+  _block_writer_run(writer);
+  _latch_count_down(writer->latch);
+}
+
+int echoprint_inverted_index_build_write_blocks(
+  uint32_t n_blocks,
+  uint32_t ***blocks_songs_codes,
+  uint32_t **blocks_song_lengths,
+  uint32_t *blocks_n_songs,
+  char **paths_out,
+  int code_sequences_already_sorted_distinct,
+  int postings_format,
+  int n_threads)
+{
+  uint32_t w, n_writers;
+  int error;
+  EchoprintThreadPool *pool;
+  EchoprintBlockWriter *writers;
+  EchoprintLatch latch;
+
+  pool = n_threads > 1 ? _thread_pool_new(n_threads - 1) : 0;
+  if(pool && pool->n_threads == 0)
+  {
+    _thread_pool_free(pool);
+    pool = 0;
+  }
+  if(n_blocks == 1)
+  {
+    error = _build_write_block(
+      blocks_songs_codes[0], blocks_song_lengths[0], blocks_n_songs[0],
+      paths_out[0], code_sequences_already_sorted_distinct,
+      postings_format, pool);
+    if(pool)
+      _thread_pool_free(pool);
+    return error;
+  }
+
+  // several blocks: one thread per block rather than per song range
+  n_writers = pool ? pool->n_threads + 1 : 1;
+  if(n_writers > n_blocks)
+    n_writers = n_blocks > 0 ? n_blocks : 1;
+  writers = (EchoprintBlockWriter *)
+    malloc(sizeof(EchoprintBlockWriter) * n_writers);
+  for(w = 0; w < n_writers; w++)
+  {
+    writers[w].task.run = _block_writer_task;
+    writers[w].task.arg = writers + w;
+    writers[w].latch = &latch;
+    writers[w].first_block = w;
+    writers[w].n_writers = n_writers;
+    writers[w].n_blocks = n_blocks;
+    writers[w].blocks_songs_codes = blocks_songs_codes;
+    writers[w].blocks_song_lengths = blocks_song_lengths;
+    writers[w].blocks_n_songs = blocks_n_songs;
+    writers[w].paths_out = paths_out;
+    writers[w].code_sequences_already_sorted_distinct =
+      code_sequences_already_sorted_distinct;
+    writers[w].postings_format = postings_format;
+  }
+  _latch_init(&latch, n_writers - 1);
+  for(w = 1; w < n_writers; w++)
+    _thread_pool_submit(pool, &(writers[w].task));
+  _block_writer_run(writers);
+  _latch_wait_and_destroy(&latch);
+
+  error = 0;
+  for(w = 0; w < n_writers; w++)
+    error |= writers[w].error;
+  free(writers);
+  if(pool)
+    _thread_pool_free(pool);
+  return error;
+}
+
+
+/*
+  Forward index and temporal re-ranking.
+ */
+#define ECHOPRINT_FORWARD_MAGIC 0x44574645   // "EFWD"
+#define ECHOPRINT_FORWARD_VERSION 1
+#define ECHOPRINT_FORWARD_HEADER_LENGTH 4
+
+int _cmpint64(const void *a, const void *b)
+{
+  int64_t x, y;
+  x = *((int64_t *) a);
+  y = *((int64_t *) b);
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// point the block arrays into `data`, the contents of a forward index
+// file; return 0 if all ok, 1 if the data is invalid or truncated
+int _parse_forward_index_block(
+  uint8_t *data, size_t length, EchoprintForwardIndexBlock *block)
+{
+  uint32_t n;
+  uint32_t *header = (uint32_t *) data;
+  size_t pairs_start;
+
+  memset(block, 0, sizeof(EchoprintForwardIndexBlock));
+  if(length < ECHOPRINT_FORWARD_HEADER_LENGTH * sizeof(uint32_t) ||
+     header[0] != ECHOPRINT_FORWARD_MAGIC ||
+     header[1] != ECHOPRINT_FORWARD_VERSION)
+    return 1;
+  block->n_songs = header[2];
+  block->song_offsets =
+    (uint64_t *) (header + ECHOPRINT_FORWARD_HEADER_LENGTH);
+  pairs_start = ECHOPRINT_FORWARD_HEADER_LENGTH * sizeof(uint32_t) +
+    ((size_t) block->n_songs + 1) * sizeof(uint64_t);
+  if(pairs_start > length)
+    return 1;
+  block->pairs = (uint32_t *) (data + pairs_start);
+  for(n = 0; n < block->n_songs; n++)
+    if(block->song_offsets[n] > block->song_offsets[n + 1])
+      return 1;
+  if(block->song_offsets[0] != 0 ||
+     block->song_offsets[block->n_songs] >
+     (length - pairs_start) / (2 * sizeof(uint32_t)))
+    return 1;
+  return 0;
+}
+
+void _free_forward_index_block(EchoprintForwardIndexBlock *block)
+{
+  if(block->mapping)
+    munmap(block->mapping, block->mapping_length);
+  else
+    free(block->file_data);
+}
+
+EchoprintForwardIndex * echoprint_forward_index_load_from_paths(
+  char **paths,
+  int n_files,
+  int flags)
+{
+  int n, m;
+  FILE *fp;
+  size_t length;
+  void *data;
+  EchoprintForwardIndex *index =
+    (EchoprintForwardIndex *) malloc(sizeof(EchoprintForwardIndex));
+  index->n_blocks = n_files;
+  index->blocks = (EchoprintForwardIndexBlock *)
+    malloc(sizeof(EchoprintForwardIndexBlock) * (n_files > 0 ? n_files : 1));
+  for(n = 0; n < n_files; n++)
+  {
+    EchoprintForwardIndexBlock *block = index->blocks + n;
+    int failed = 1;
+    fp = fopen(paths[n], "r");
+    if(fp != 0)
+    {
+      if(flags & ECHOPRINT_LOAD_MMAP)
+      {
+        if(!_map_file(fp, flags, &data, &length))
+        {
+          failed = _parse_forward_index_block(
+            (uint8_t *) data, length, block);
+          if(failed)
+            munmap(data, length);
+          else
+          {
+            block->mapping = data;
+            block->mapping_length = length;
+          }
+        }
+      }
+      else if(!_read_file(fp, (uint8_t **) &data, &length))
+      {
+        failed = _parse_forward_index_block((uint8_t *) data, length, block);
+        if(failed)
+          free(data);
+        else
+          block->file_data = data;
+      }
+      fclose(fp);
+    }
+    if(failed)
+    {
+      for(m = 0; m < n; m++)
+        _free_forward_index_block(index->blocks + m);
+      free(index->blocks);
+      free(index);
+      return 0;
+    }
+  }
+  return index;
+}
+
+void echoprint_forward_index_free(
+  EchoprintForwardIndex *index)
+{
+  uint32_t n;
+  for(n = 0; n < index->n_blocks; n++)
+    _free_forward_index_block(index->blocks + n);
+  free(index->blocks);
+  free(index);
+}
+
+int echoprint_forward_index_build_write_block(
+  uint32_t **songs_codes,
+  uint32_t **songs_offsets,
+  uint32_t *song_lengths,
+  uint32_t n_songs,
+  char *path_out)
+{
+  uint32_t n, i, header[ECHOPRINT_FORWARD_HEADER_LENGTH];
+  uint64_t song_offset;
+  uint64_t *pairs;
+  FILE *fout = fopen(path_out, "wb");
+  if(!fout)
+    return 1;
+
+  header[0] = ECHOPRINT_FORWARD_MAGIC;
+  header[1] = ECHOPRINT_FORWARD_VERSION;
+  header[2] = n_songs;
+  header[3] = 0;
+  fwrite(header, sizeof(uint32_t), ECHOPRINT_FORWARD_HEADER_LENGTH, fout);
+  song_offset = 0;
+  fwrite(&song_offset, sizeof(uint64_t), 1, fout);
+  for(n = 0; n < n_songs; n++)
+  {
+    song_offset += song_lengths[n];
+    fwrite(&song_offset, sizeof(uint64_t), 1, fout);
+  }
+
+  for(n = 0; n < n_songs; n++)
+  {
+    pairs = (uint64_t *) malloc(
+      sizeof(uint64_t) * (song_lengths[n] > 0 ? song_lengths[n] : 1));
+    for(i = 0; i < song_lengths[n]; i++)
+      pairs[i] = ((uint64_t) songs_codes[n][i] << 32) | songs_offsets[n][i];
+    qsort(pairs, song_lengths[n], sizeof(uint64_t), _cmpuint64);
+    for(i = 0; i < song_lengths[n]; i++)
+    {
+      uint32_t pair[2];
+      pair[0] = (uint32_t) (pairs[i] >> 32);
+      pair[1] = (uint32_t) pairs[i];
+      fwrite(pair, sizeof(uint32_t), 2, fout);
+    }
+    free(pairs);
+  }
+  if(fclose(fout) != 0)
+    return 1;
+  return 0;
+}
+
+// (code, offset) pairs of a song given its global index; return 0 if
+// the forward index does not hold it
+int _forward_song_pairs(EchoprintForwardIndex *index, uint32_t song_index,
+                        uint32_t **pairs, uint64_t *n_pairs)
+{
+  uint32_t b;
+  for(b = 0; b < index->n_blocks; b++)
+  {
+    EchoprintForwardIndexBlock *block = index->blocks + b;
+    if(song_index < block->n_songs)
+    {
+      *pairs = block->pairs + 2 * block->song_offsets[song_index];
+      *n_pairs = block->song_offsets[song_index + 1] -
+        block->song_offsets[song_index];
+      return 1;
+    }
+    song_index -= block->n_songs;
+  }
+  return 0;
+}
+
+// offset differences of all the pairs of the song and of the query
+// (code << 32 | offset, sorted) sharing a code, grown in *diffs as
+// needed
+typedef struct _EchoprintDiffs
+{
+  int64_t *diffs;
+  uint64_t n_diffs;
+  uint64_t capacity;
+} EchoprintDiffs;
+
+void _diffs_push(EchoprintDiffs *diffs, int64_t diff)
+{
+  if(diffs->n_diffs == diffs->capacity)
+  {
+    diffs->capacity = diffs->capacity > 0 ? 2 * diffs->capacity : 1024;
+    diffs->diffs = (int64_t *) realloc(
+      diffs->diffs, sizeof(int64_t) * diffs->capacity);
+  }
+  diffs->diffs[diffs->n_diffs++] = diff;
+}
+
+// largest number of matching pairs whose offset differences lie within
+// ECHOPRINT_ALIGN_SLOP of each other
+uint32_t _align(uint64_t *query_pairs, uint32_t query_length,
+                uint32_t *song_pairs, uint64_t n_song_pairs,
+                EchoprintDiffs *diffs)
+{
+  uint64_t i, j, i_end, j_end, a, b, lo, best;
+
+  diffs->n_diffs = 0;
+  i = 0;
+  j = 0;
+  while(i < query_length && j < n_song_pairs)
+  {
+    uint32_t code = (uint32_t) (query_pairs[i] >> 32);
+    if(code < song_pairs[2 * j])
+      i++;
+    else if(code > song_pairs[2 * j])
+      j++;
+    else
+    {
+      i_end = i + 1;
+      while(i_end < query_length &&
+            (uint32_t) (query_pairs[i_end] >> 32) == code)
+        i_end++;
+      j_end = j + 1;
+      while(j_end < n_song_pairs && song_pairs[2 * j_end] == code)
+        j_end++;
+      for(a = i; a < i_end; a++)
+        for(b = j; b < j_end; b++)
+          _diffs_push(diffs, (int64_t) song_pairs[2 * b + 1] -
+                      (int64_t) (uint32_t) query_pairs[a]);
+      i = i_end;
+      j = j_end;
+    }
+  }
+
+  qsort(diffs->diffs, diffs->n_diffs, sizeof(int64_t), _cmpint64);
+  best = 0;
+  lo = 0;
+  for(a = 0; a < diffs->n_diffs; a++)
+  {
+    while(diffs->diffs[a] - diffs->diffs[lo] > ECHOPRINT_ALIGN_SLOP)
+      lo++;
+    if(a - lo + 1 > best)
+      best = a - lo + 1;
+  }
+  return (uint32_t) best;
+}
+
+typedef struct _EchoprintRerankedResult
+{
+  float score;
+  uint32_t rank;      // in the first stage
+  uint32_t index;
+} EchoprintRerankedResult;
+
+int _cmp_reranked(const void *a, const void *b)
+{
+  const EchoprintRerankedResult *x = (const EchoprintRerankedResult *) a;
+  const EchoprintRerankedResult *y = (const EchoprintRerankedResult *) b;
+  if(x->score != y->score)
+    return x->score > y->score ? -1 : 1;
+  return x->rank < y->rank ? -1 : (x->rank > y->rank ? 1 : 0);
+}
+
+uint32_t echoprint_inverted_index_query_rerank(
+  uint32_t query_length,
+  const uint32_t *query_codes,
+  const uint32_t *query_offsets,
+  EchoprintInvertedIndex *index,
+  EchoprintForwardIndex *forward_index,
+  uint32_t n_candidates,
+  uint32_t n_results,
+  uint32_t *output_indices,
+  float *output_scores,
+  similarity_function sim,
+  const EchoprintQueryOptions *options)
+{
+  uint32_t n, n_found;
+  uint32_t *candidates;
+  float *candidate_scores;
+  uint64_t *query_pairs;
+  EchoprintRerankedResult *reranked;
+  EchoprintDiffs diffs;
+
+  // first stage
+  candidates = (uint32_t *) malloc(
+    sizeof(uint32_t) * (n_candidates > 0 ? n_candidates : 1));
+  candidate_scores = (float *) malloc(
+    sizeof(float) * (n_candidates > 0 ? n_candidates : 1));
+  n_found = echoprint_inverted_index_query_with_options(
+    query_length, query_codes, index, n_candidates,
+    candidates, candidate_scores, sim, options);
+
+  // second stage
+  query_pairs = (uint64_t *) malloc(
+    sizeof(uint64_t) * (query_length > 0 ? query_length : 1));
+  for(n = 0; n < query_length; n++)
+    query_pairs[n] = ((uint64_t) query_codes[n] << 32) | query_offsets[n];
+  qsort(query_pairs, query_length, sizeof(uint64_t), _cmpuint64);
+  diffs.diffs = 0;
+  diffs.n_diffs = 0;
+  diffs.capacity = 0;
+  reranked = (EchoprintRerankedResult *) malloc(
+    sizeof(EchoprintRerankedResult) * (n_found > 0 ? n_found : 1));
+  for(n = 0; n < n_found; n++)
+  {
+    uint32_t *song_pairs;
+    uint64_t n_song_pairs;
+    reranked[n].rank = n;
+    reranked[n].index = candidates[n];
+    reranked[n].score = 0;
+    if(_forward_song_pairs(forward_index, candidates[n],
+                           &song_pairs, &n_song_pairs))
+      reranked[n].score = _align(query_pairs, query_length,
+                                 song_pairs, n_song_pairs, &diffs);
+  }
+  qsort(reranked, n_found, sizeof(EchoprintRerankedResult), _cmp_reranked);
+
+  if(n_found > n_results)
+    n_found = n_results;
+  for(n = 0; n < n_found; n++)
+  {
+    output_indices[n] = reranked[n].index;
+    output_scores[n] = reranked[n].score;
+  }
+  for(n = n_found; n < n_results; n++)
+  {
+    output_indices[n] = n;
+    output_scores[n] = -1.;
+  }
+
+  free(diffs.diffs);
+  free(reranked);
+  free(query_pairs);
+  free(candidates);
+  free(candidate_scores);
+  return n_found;
+}
+
+
+/*
+  Echoprint strings: URL-safe base64 of the zlib-compressed hex text,
+  whose first half holds the offsets and second half the codes, five
+  hex digits each.
+ */
+
+// 6-bit value of a URL-safe (or standard) base64 character, -1 for
+// characters to skip (padding, whitespace) and -2 for invalid ones
+int _base64_value(char ch)
+{
+  if(ch >= 'A' && ch <= 'Z')
+    return ch - 'A';
+  if(ch >= 'a' && ch <= 'z')
+    return ch - 'a' + 26;
+  if(ch >= '0' && ch <= '9')
+    return ch - '0' + 52;
+  if(ch == '-' || ch == '+')
+    return 62;
+  if(ch == '_' || ch == '/')
+    return 63;
+  if(ch == '=' || ch == '\n' || ch == '\r' || ch == ' ' || ch == '\t')
+    return -1;
+  return -2;
+}
+
+// decode base64 into a malloc-ed buffer; return its length, or -1 if
+// the input is invalid
+long _base64_decode(const char *in, size_t length, uint8_t **out)
+{
+  size_t i;
+  long n = 0;
+  uint32_t bits = 0;
+  int n_bits = 0, value;
+  *out = (uint8_t *) malloc(length / 4 * 3 + 3);
+  for(i = 0; i < length; i++)
+  {
+    value = _base64_value(in[i]);
+    if(value == -2)
+    {
+      free(*out);
+      return -1;
+    }
+    if(value == -1)
+      continue;
+    bits = (bits << 6) | value;
+    n_bits += 6;
+    if(n_bits >= 8)
+    {
+      n_bits -= 8;
+      (*out)[n++] = (uint8_t) (bits >> n_bits);
+    }
+  }
+  return n;
+}
+
+// inflate zlib data into a malloc-ed buffer; return its length, or -1
+long _inflate(const uint8_t *in, size_t length, char **out)
+{
+  z_stream stream;
+  size_t capacity = length * 4 + 64;
+  int status;
+  memset(&stream, 0, sizeof(stream));
+  if(inflateInit(&stream) != Z_OK)
+    return -1;
+  *out = (char *) malloc(capacity);
+  stream.next_in = (Bytef *) in;
+  stream.avail_in = length;
+  do
+  {
+    if(stream.total_out == capacity)
+    {
+      capacity *= 2;
+      *out = (char *) realloc(*out, capacity);
+    }
+    stream.next_out = (Bytef *) (*out + stream.total_out);
+    stream.avail_out = capacity - stream.total_out;
+    status = inflate(&stream, Z_NO_FLUSH);
+  } while(status == Z_OK);
+  inflateEnd(&stream);
+  if(status != Z_STREAM_END)
+  {
+    free(*out);
+    return -1;
+  }
+  return (long) stream.total_out;
+}
+
+/*
+  Hex digits to their values, checking them, 16 or 32 at a time with
+  SSE2 or AVX2 (picked at run time as the filter kernels are) and one
+  at a time for the rest. Return 0 if all ok, 1 if a digit is invalid.
+ */
+typedef int (*EchoprintHexKernel)(const char *hex, size_t n, uint8_t *out);
+
+int _hex_to_nibbles_scalar(const char *hex, size_t n, uint8_t *out)
+{
+  size_t i;
+  for(i = 0; i < n; i++)
+  {
+    char ch = hex[i];
+    if(ch >= '0' && ch <= '9')
+      out[i] = ch - '0';
+    else if((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f')
+      out[i] = (ch | 0x20) - 'a' + 10;
+    else
+      return 1;
+  }
   return 0;
 }
+
+#ifdef ECHOPRINT_X86_KERNELS
+
+// ASCII only: bytes >= 0x80 are negative and fail both range checks
+__attribute__((target("sse2")))
+int _hex_to_nibbles_sse2(const char *hex, size_t n, uint8_t *out)
+{
+  size_t i;
+  __m128i zero = _mm_set1_epi8('0'), a = _mm_set1_epi8('a');
+  __m128i case_bit = _mm_set1_epi8(0x20), minus_one = _mm_set1_epi8(-1);
+  __m128i ten = _mm_set1_epi8(10), six = _mm_set1_epi8(6);
+  for(i = 0; i + 16 <= n; i += 16)
+  {
+    __m128i ch = _mm_loadu_si128((const __m128i *) (hex + i));
+    __m128i digit = _mm_sub_epi8(ch, zero);
+    __m128i letter = _mm_sub_epi8(_mm_or_si128(ch, case_bit), a);
+    __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(digit, minus_one),
+                                     _mm_cmplt_epi8(digit, ten));
+    __m128i is_letter = _mm_and_si128(_mm_cmpgt_epi8(letter, minus_one),
+                                      _mm_cmplt_epi8(letter, six));
+    if(_mm_movemask_epi8(_mm_or_si128(is_digit, is_letter)) != 0xffff)
+      return 1;
+    _mm_storeu_si128((__m128i *) (out + i), _mm_or_si128(
+      _mm_and_si128(is_digit, digit),
+      _mm_andnot_si128(is_digit, _mm_add_epi8(letter, ten))));
+  }
+  return _hex_to_nibbles_scalar(hex + i, n - i, out + i);
+}
+
+__attribute__((target("avx2")))
+int _hex_to_nibbles_avx2(const char *hex, size_t n, uint8_t *out)
+{
+  size_t i;
+  __m256i zero = _mm256_set1_epi8('0'), a = _mm256_set1_epi8('a');
+  __m256i case_bit = _mm256_set1_epi8(0x20), minus_one = _mm256_set1_epi8(-1);
+  __m256i ten = _mm256_set1_epi8(10), six = _mm256_set1_epi8(6);
+  for(i = 0; i + 32 <= n; i += 32)
+  {
+    __m256i ch = _mm256_loadu_si256((const __m256i *) (hex + i));
+    __m256i digit = _mm256_sub_epi8(ch, zero);
+    __m256i letter = _mm256_sub_epi8(_mm256_or_si256(ch, case_bit), a);
+    __m256i is_digit = _mm256_and_si256(_mm256_cmpgt_epi8(digit, minus_one),
+                                        _mm256_cmpgt_epi8(ten, digit));
+    __m256i is_letter = _mm256_and_si256(
+      _mm256_cmpgt_epi8(letter, minus_one), _mm256_cmpgt_epi8(six, letter));
+    if(_mm256_movemask_epi8(_mm256_or_si256(is_digit, is_letter)) != -1)
+      return 1;
+    _mm256_storeu_si256((__m256i *) (out + i), _mm256_or_si256(
+      _mm256_and_si256(is_digit, digit),
+      _mm256_andnot_si256(is_digit, _mm256_add_epi8(letter, ten))));
+  }
+  return _hex_to_nibbles_sse2(hex + i, n - i, out + i);
+}
+
+#endif
+
+static EchoprintHexKernel _hex_kernel = _hex_to_nibbles_scalar;
+static pthread_once_t _hex_kernel_once = PTHREAD_ONCE_INIT;
+
+void _select_hex_kernel(void)
+{
+#ifdef ECHOPRINT_X86_KERNELS
+  const char *name = getenv("ECHOPRINT_KERNEL");
+  __builtin_cpu_init();
+  if(name != 0 && strcmp(name, "scalar") == 0)
+    return;
+  if(__builtin_cpu_supports("avx2") &&
+     (name == 0 || strcmp(name, "avx2") == 0))
+    _hex_kernel = _hex_to_nibbles_avx2;
+  else if(__builtin_cpu_supports("sse2"))
+    _hex_kernel = _hex_to_nibbles_sse2;
+#endif
+}
+
+// the nibbles of consecutive numbers of (at most) five hex digits
+void _combine_nibbles(const uint8_t *nibbles, size_t length, uint32_t *out,
+                      uint32_t max_out)
+{
+  size_t i;
+  uint32_t n;
+  for(i = 0, n = 0; i + 5 <= length && n < max_out; i += 5, n++)
+    out[n] = ((uint32_t) nibbles[i] << 16) | ((uint32_t) nibbles[i + 1] << 12)
+      | ((uint32_t) nibbles[i + 2] << 8) | ((uint32_t) nibbles[i + 3] << 4)
+      | nibbles[i + 4];
+  if(i < length && n < max_out)
+  {
+    // shorter last number
+    for(out[n] = 0; i < length; i++)
+      out[n] = (out[n] << 4) | nibbles[i];
+  }
+}
+
+long echoprint_decode(
+  const char *echoprint,
+  size_t length,
+  uint32_t *output_codes,
+  uint32_t *output_offsets,
+  uint32_t max_codes)
+{
+  uint8_t *compressed, *nibbles;
+  char *hex;
+  long compressed_length, hex_length, half, n_codes;
+
+  compressed_length = _base64_decode(echoprint, length, &compressed);
+  if(compressed_length < 0)
+    return -1;
+  hex_length = _inflate(compressed, compressed_length, &hex);
+  free(compressed);
+  if(hex_length < 0)
+    return -1;
+  half = hex_length / 2;
+  n_codes = (hex_length - half + 4) / 5;
+  pthread_once(&_hex_kernel_once, _select_hex_kernel);
+  nibbles = (uint8_t *) malloc(hex_length + 1);
+  if((half + 4) / 5 != n_codes || _hex_kernel(hex, hex_length, nibbles))
+    n_codes = -1;
+  else
+  {
+    _combine_nibbles(nibbles, half, output_offsets, max_codes);
+    _combine_nibbles(nibbles + half, hex_length - half, output_codes,
+                     max_codes);
+  }
+  free(nibbles);
+  free(hex);
+  return n_codes;
+}
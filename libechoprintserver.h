@@ -20,6 +20,57 @@
  */
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
+
+/**
+   Flags for `echoprint_inverted_index_load_from_paths_with_flags`.
+
+   ECHOPRINT_LOAD_MMAP maps each block file read-only instead of
+   copying it to the heap: the block arrays point straight into the
+   mapping, so processes loading the same files share the page cache.
+
+   ECHOPRINT_LOAD_PREFETCH (only meaningful together with
+   ECHOPRINT_LOAD_MMAP) asks the kernel to read the whole mapping in
+   at load time rather than faulting pages in on the first queries.
+
+   ECHOPRINT_LOAD_CODE_DIRECTORY builds, for each block, a table
+   mapping codes to codeblocks (about 8 bytes per distinct code), so
+   that each query code is located with one lookup rather than by
+   searching the sorted codes.
+
+   ECHOPRINT_LOAD_NO_CHECKSUMS skips checking the arrays of a
+   consolidated index against their checksums (see
+   `echoprint_inverted_index_consolidate`), so that a mapped index is
+   not read in whole at load time; its header and section table are
+   always checked.
+ */
+#define ECHOPRINT_LOAD_MMAP 1
+#define ECHOPRINT_LOAD_PREFETCH 2
+#define ECHOPRINT_LOAD_CODE_DIRECTORY 4
+#define ECHOPRINT_LOAD_NO_CHECKSUMS 8
+
+/**
+   Encodings of the song indices of an index block.
+
+   ECHOPRINT_POSTINGS_RAW16 stores them as uint16_t; blocks using it
+   are written in the original (version 1, headerless) file format.
+
+   ECHOPRINT_POSTINGS_STREAMVBYTE stores each codeblock as the deltas
+   between consecutive song indices, coded with Stream VByte (2-bit
+   byte lengths grouped in control bytes, then the data bytes), which
+   is decoded on the fly at query time. Blocks using it are written in
+   the version 2 file format, which starts with a header.
+
+   ECHOPRINT_POSTINGS_RAW32 stores them as uint32_t, in a version 2
+   file. Blocks of more than ECHOPRINT_RAW16_MAX_SONGS songs are built
+   with it, and written with it when raw postings are asked for, so
+   that a block can hold millions of songs; Stream VByte blocks may be
+   that large too.
+ */
+#define ECHOPRINT_POSTINGS_RAW16 0
+#define ECHOPRINT_POSTINGS_STREAMVBYTE 1
+#define ECHOPRINT_POSTINGS_RAW32 2
+#define ECHOPRINT_RAW16_MAX_SONGS 65535
 
 typedef enum
 {
@@ -31,8 +82,10 @@ typedef enum
 
 /**
    A part of an inverted index. Each block is serialized to disk in a
-   different file; the serialization format is just a contiguous
-   memory dump of all the data in the struct in order.
+   different file; the (version 1) serialization format is just a
+   contiguous memory dump of all the data in the struct in order. See
+   ECHOPRINT_POSTINGS_STREAMVBYTE for the compressed (version 2)
+   format.
 
    For each distinc code, a code block contains the sequence of
    indexes corresponding to songs in which the code appears. The
@@ -46,55 +99,403 @@ typedef struct _EchoprintInvertedIndexBlock
   uint32_t *codes;          // stores code of each codeblock (n_codes)
   uint32_t *code_lengths;   // length of each codeblock (n_codes)
   uint32_t *song_lengths;   // number of codes per song (n_songs)
-  uint16_t *song_indices;   // main data (SUM-OF code_lengths)
+  uint16_t *song_indices;   // main data (SUM-OF code_lengths), raw only
+  uint32_t *song_indices32; // same, for ECHOPRINT_POSTINGS_RAW32 blocks
+  uint64_t *code_offsets;   // start of each codeblock in song_indices,
+                            // (n_codes + 1, not serialized)
+  uint32_t postings_format; // ECHOPRINT_POSTINGS_*
+  uint8_t *postings;        // encoded codeblocks, when not raw
+  uint64_t *postings_offsets; // start of each codeblock in postings
+                            // (n_codes + 1, not serialized)
+  uint32_t *code_directory; // see ECHOPRINT_LOAD_CODE_DIRECTORY, or 0
+  uint32_t code_directory_shift;
+  uint32_t code_directory_n_buckets;
+  uint32_t min_song_length;  // shortest and longest song, bounding the
+  uint32_t max_song_length;  // scores of the block (not serialized)
+  void *file_data;          // file contents backing the arrays, or 0
+  void *mapping;            // mmap-ed file backing the arrays, or 0
+  size_t mapping_length;
+  void *container;          // consolidated index backing the arrays
+                            // (owned by the index), or 0
 } EchoprintInvertedIndexBlock;
 
+typedef struct _EchoprintThreadPool EchoprintThreadPool;
+typedef struct _EchoprintIndexUpdates EchoprintIndexUpdates;
+
 /**
    An inverted index is just an ordered sequence of inverted index
-   blocks.
+   blocks. It optionally owns a pool of threads used to score its
+   blocks in parallel, and it keeps the songs inserted or deleted
+   since loading (see `echoprint_inverted_index_insert`).
 */
 typedef struct _EchoprintInvertedIndex
 {
   uint32_t n_blocks;
   EchoprintInvertedIndexBlock *blocks;
+  uint32_t max_block_n_songs;         // of the largest block
+  EchoprintThreadPool *thread_pool;   // 0 when querying sequentially
+  EchoprintIndexUpdates *updates;     // delta songs, deletions and the
+                                      // lock guarding them and blocks
+  void *container;                    // consolidated index file contents
+  size_t container_length;            // or mapping, or 0
+  int container_mapped;
 } EchoprintInvertedIndex;
 
 /**
    Load an inverted index in memory. The order of `paths` is
-   significant.
+   significant. A single path may also be a consolidated index (see
+   `echoprint_inverted_index_consolidate`), which holds all the blocks.
  */
 EchoprintInvertedIndex * echoprint_inverted_index_load_from_paths(
   char **paths,
   int n_files);
 
 /**
-   Frees an inverted index (and all its blocks).
+   Same as `echoprint_inverted_index_load_from_paths`, `flags` being a
+   combination of the ECHOPRINT_LOAD_* values. Returns 0 if any file
+   cannot be opened or (when mapping) is truncated, or if a
+   consolidated index is invalid or fails its checksums.
+ */
+EchoprintInvertedIndex * echoprint_inverted_index_load_from_paths_with_flags(
+  char **paths,
+  int n_files,
+  int flags);
+
+/**
+   Write the blocks of the index made of the block files `paths` (in
+   order, in any of their formats) to `path_out` as a single
+   consolidated index, which loads with one read or mapping and no
+   per-block parsing. It is made of a 64-byte header (magic "EIDX",
+   version, number of blocks and songs, file length, offset and
+   CRC-32 of the section table, CRC-32 of the header), then one
+   section per block (postings format, n_codes, n_songs, index of its
+   first song in the whole index, the offsets and lengths in bytes of
+   its codes, code_lengths, song_lengths, Stream VByte codeblock sizes
+   and postings arrays, and the CRC-32 of those arrays), then the
+   arrays, each starting on a 64-byte boundary. Each block keeps its
+   postings format. Return 0 if all ok, 1 otherwise.
+ */
+int echoprint_inverted_index_consolidate(
+  char **paths,
+  int n_files,
+  char *path_out);
+
+/**
+   Frees an inverted index (and all its blocks), whichever way it was
+   loaded.
  */
 void echoprint_inverted_index_free(
   EchoprintInvertedIndex *index);
 
+/**
+   A handle to the current version of an index, letting servers
+   replace it under live traffic. Each query pins the current version
+   with `echoprint_inverted_index_handle_acquire` and unpins it with
+   `echoprint_inverted_index_handle_release`;
+   `echoprint_inverted_index_handle_swap` makes another index current
+   at once, and each version is freed when its last query releases it.
+ */
+typedef struct _EchoprintInvertedIndexHandle EchoprintInvertedIndexHandle;
+
+/**
+   Create a handle whose current version is `index`, which the handle
+   now owns. Returns 0 on failure.
+ */
+EchoprintInvertedIndexHandle * echoprint_inverted_index_handle_new(
+  EchoprintInvertedIndex *index);
+
+/**
+   Pin and return the current version of the index. It stays valid,
+   even if swapped out meanwhile, until released.
+ */
+EchoprintInvertedIndex * echoprint_inverted_index_handle_acquire(
+  EchoprintInvertedIndexHandle *handle);
+
+/**
+   Unpin a version returned by `echoprint_inverted_index_handle_acquire`,
+   freeing it if it is no longer current and no one else pins it.
+ */
+void echoprint_inverted_index_handle_release(
+  EchoprintInvertedIndexHandle *handle,
+  EchoprintInvertedIndex *index);
+
+/**
+   Make `index` (which the handle now owns, and which must not be
+   owned by any other handle) the current version: queries acquiring
+   the handle from now on use it, running ones finish on the previous
+   version, which is freed by the last of them. Return 0 if all ok, 1
+   otherwise (in which case `index` is left to the caller).
+ */
+int echoprint_inverted_index_handle_swap(
+  EchoprintInvertedIndexHandle *handle,
+  EchoprintInvertedIndex *index);
+
+/**
+   Free a handle and the versions it owns; no version may be pinned.
+ */
+void echoprint_inverted_index_handle_free(
+  EchoprintInvertedIndexHandle *handle);
+
 /**
    Perform a query on the whole index.  Results (indices and jaccard
    similarities) are stored in the `output` and `output_scores`
    parameters, which must hold `n_results` elements.  Returns the
    number of results actually returned (just in the unrealistic case
-   that the index size is smaller than n_results).
+   that the index size is smaller than n_results). `query` is left
+   untouched; the scratch space of the query is that of the calling
+   thread's own query context, kept until the thread exits.
  */
 uint32_t echoprint_inverted_index_query(
   uint32_t query_length,
-  uint32_t *query,
+  const uint32_t *query,
   EchoprintInvertedIndex *index,
   uint32_t n_results,
   uint32_t *output_indices,
   float *output_scores,
   similarity_function sim);
 
+typedef struct _EchoprintQueryStats EchoprintQueryStats;
+
+/**
+   Codes held by more than `max_code_frequency` of the songs of a
+   block are frequent there. A code's document frequency in a block
+   is the length of its codeblock (`code_lengths`), written when the
+   block is built. Frequent codes cost the most postings and tell
+   songs apart the least. With ECHOPRINT_FREQUENT_CODES_DEFER they
+   are only counted for the songs found by the other codes of the
+   query, whose scores stay exact; songs sharing only frequent codes
+   with the query score 0. With ECHOPRINT_FREQUENT_CODES_SKIP they
+   are ignored, and scores count the other codes only. Inserted songs
+   are always compared with all the codes.
+ */
+#define ECHOPRINT_FREQUENT_CODES_DEFER 0
+#define ECHOPRINT_FREQUENT_CODES_SKIP 1
+
+/**
+   Optional query parameters. A zero-initialized struct (or a null
+   pointer where one is accepted) gives the default behaviour.
+ */
+typedef struct _EchoprintQueryOptions
+{
+  float min_score;    // songs scoring less are never returned
+  EchoprintQueryStats *stats;  // filled in with the query's statistics
+                               // when not 0
+  float max_code_frequency;    // fraction of the songs of a block, 0
+                               // (or 1 and above) for no frequent codes
+  int frequent_codes;          // ECHOPRINT_FREQUENT_CODES_*
+} EchoprintQueryOptions;
+
+/**
+   What a query did and where its time went, filled in when
+   `EchoprintQueryOptions.stats` is set. Codes matched and postings
+   are summed over the blocks; a block is skipped when no song of it
+   could score enough to enter the results. Times are in seconds:
+   dedup is the removal of duplicate query codes, scoring covers the
+   blocks and the delta segment, top-k the merge of the results of
+   the threads and their final ordering.
+ */
+struct _EchoprintQueryStats
+{
+  uint32_t query_codes;       // as given
+  uint32_t distinct_codes;    // once duplicates are removed
+  uint32_t matched_codes;
+  uint32_t frequent_codes;    // matched codes deferred or skipped
+  uint32_t blocks_scanned;
+  uint32_t blocks_skipped;
+  uint32_t delta_songs;       // inserted songs compared with the query
+  uint64_t postings_visited;  // song indices read from codeblocks
+  uint64_t postings_searched; // songs looked up in long codeblocks
+  double dedup_seconds;
+  double scoring_seconds;
+  double topk_seconds;
+  double total_seconds;
+};
+
+/**
+   Same as `echoprint_inverted_index_query`, with the optional
+   parameters in `options` (which may be 0). Fewer than `n_results`
+   results are returned when fewer songs reach `options->min_score`.
+ */
+uint32_t echoprint_inverted_index_query_with_options(
+  uint32_t query_length,
+  const uint32_t *query,
+  EchoprintInvertedIndex *index,
+  uint32_t n_results,
+  uint32_t *output_indices,
+  float *output_scores,
+  similarity_function sim,
+  const EchoprintQueryOptions *options);
+
+/**
+   Scratch space of queries: the deduplicated query codes, and the
+   score counters, decoding buffer and top results of each thread
+   scoring the blocks. It grows to fit the largest index, query and
+   number of results it has been used with, so that once warmed up a
+   query using it allocates no memory. A context may be used by one
+   query at a time, on any index; a service would typically create
+   one per worker thread.
+ */
+typedef struct _EchoprintQueryContext EchoprintQueryContext;
+
+EchoprintQueryContext *echoprint_query_context_new(void);
+
+void echoprint_query_context_free(EchoprintQueryContext *context);
+
+/**
+   Same as `echoprint_inverted_index_query_with_options`, using the
+   scratch space of `context`.
+ */
+uint32_t echoprint_inverted_index_query_with_context(
+  EchoprintQueryContext *context,
+  uint32_t query_length,
+  const uint32_t *query,
+  EchoprintInvertedIndex *index,
+  uint32_t n_results,
+  uint32_t *output_indices,
+  float *output_scores,
+  similarity_function sim,
+  const EchoprintQueryOptions *options);
+
+/**
+   Perform `n_queries` queries at once. The codes of all queries are
+   concatenated in `queries`, `query_lengths` holds the length of each
+   query; neither is modified. Results of query q are stored at
+   `output_indices + q * n_results` and `output_scores + q *
+   n_results`, their effective number at `output_n_results[q]`.
+
+   Queries are scored in small groups: each block is walked once per
+   group, and its codeblocks are read once for all the queries of the
+   group containing the code, so that the block stays in cache. When
+   the index has a thread pool, groups are scored concurrently.
+   Results are the same as those of
+   `echoprint_inverted_index_query_with_options`, frequent codes
+   included; `options` may be 0, and `options->stats` is not filled
+   in.
+ */
+void echoprint_inverted_index_query_batch(
+  uint32_t n_queries,
+  const uint32_t *query_lengths,
+  const uint32_t *queries,
+  EchoprintInvertedIndex *index,
+  uint32_t n_results,
+  uint32_t *output_indices,
+  float *output_scores,
+  uint32_t *output_n_results,
+  similarity_function sim,
+  const EchoprintQueryOptions *options);
+
+/**
+   Totals of the statistics of all the queries made by the process
+   (`echoprint_inverted_index_query` and
+   `echoprint_inverted_index_query_with_options`, batches excepted)
+   since it started or since the last reset. `latency_histogram[b]`
+   counts the queries that took less than 2^b microseconds (and at
+   least 2^(b-1) for b > 0); the last bucket also holds the slower
+   ones.
+ */
+#define ECHOPRINT_LATENCY_BUCKETS 32
+
+typedef struct _EchoprintQueryCounters
+{
+  uint64_t n_queries;
+  uint64_t query_codes;
+  uint64_t distinct_codes;
+  uint64_t matched_codes;
+  uint64_t frequent_codes;
+  uint64_t blocks_scanned;
+  uint64_t blocks_skipped;
+  uint64_t postings_visited;
+  uint64_t postings_searched;
+  double total_seconds;
+  uint64_t latency_histogram[ECHOPRINT_LATENCY_BUCKETS];
+} EchoprintQueryCounters;
+
+void echoprint_query_counters_get(EchoprintQueryCounters *counters);
+
+void echoprint_query_counters_reset(void);
+
+/**
+   A function called at the end of every query counted above, from
+   the thread that made it, with the query's statistics and its
+   distinct codes (valid only during the call), e.g. to log the
+   fingerprints of slow queries. It must not query an index itself.
+   `echoprint_set_query_trace_hook(0, 0)` removes it.
+ */
+typedef void (*EchoprintQueryTraceHook)(
+  const EchoprintQueryStats *stats,
+  uint32_t query_length,
+  const uint32_t *query,
+  void *arg);
+
+void echoprint_set_query_trace_hook(
+  EchoprintQueryTraceHook hook,
+  void *arg);
+
+/**
+   Make queries on `index` use up to `n_threads` threads (the calling
+   thread plus n_threads - 1 workers owned by the index): the blocks
+   are split in contiguous slices, scored concurrently and the top
+   results of each slice are merged. Results are identical to the
+   sequential ones. A value <= 1 stops the workers. Must not be called
+   while queries are running on the index. Return 0 if all ok, 1
+   otherwise.
+ */
+int echoprint_inverted_index_set_n_threads(
+  EchoprintInvertedIndex *index,
+  int n_threads);
+
 /**
-   Get total number of songs in the index
+   Get total number of songs in the index, inserted ones included
  */
 uint32_t echoprint_inverted_index_get_n_songs(
   EchoprintInvertedIndex *index);
 
+/**
+   Add a song to a loaded index and return its index, which follows
+   those of all the songs already in it. The codes (which are copied,
+   not modified) go to an in-memory delta segment that queries scan
+   after the blocks; `echoprint_inverted_index_compact` turns it into
+   regular blocks. Returns (uint32_t) -1 if the song cannot be added.
+
+   Insertions, deletions and compactions may run concurrently with
+   queries: queries hold a shared lock on the index, updates an
+   exclusive one for the short time it takes to publish them.
+ */
+uint32_t echoprint_inverted_index_insert(
+  EchoprintInvertedIndex *index,
+  uint32_t *codes,
+  uint32_t n_codes);
+
+/**
+   Mark song `song_index` as deleted: queries no longer return it,
+   other songs keep their indices. Return 0 if all ok, 1 if there is
+   no such song.
+ */
+int echoprint_inverted_index_delete(
+  EchoprintInvertedIndex *index,
+  uint32_t song_index);
+
+/**
+   Move the delta segment to new blocks (of at most 65535 songs)
+   appended to the index, so that inserted songs are searched as
+   efficiently as loaded ones; song indices do not change. The blocks
+   are built without holding the index lock, queries only wait for
+   them to be swapped in. Return 0 if all ok, 1 otherwise.
+ */
+int echoprint_inverted_index_compact(
+  EchoprintInvertedIndex *index);
+
+/**
+   Compact the index from a background thread owned by the index
+   every `period_ms` milliseconds, when the delta segment holds enough
+   songs (a few hundred) to be worth a block; 0 stops the thread
+   (which is also stopped when the index is freed). Return 0 if all
+   ok, 1 otherwise.
+ */
+int echoprint_inverted_index_start_compaction(
+  EchoprintInvertedIndex *index,
+  uint32_t period_ms);
+
 /**
    Construct an inverted index block from data and write it out to
    disk. Return 0 if all ok, 1 otherwise.
@@ -105,3 +506,126 @@ int echoprint_inverted_index_build_write_block(
   uint32_t n_songs,
   char *path_out,
   int code_sequences_already_sorted_distinct);
+
+/**
+   Same as `echoprint_inverted_index_build_write_block`, encoding the
+   song indices with `postings_format` (one of the
+   ECHOPRINT_POSTINGS_* values). Both file versions can be loaded.
+ */
+int echoprint_inverted_index_build_write_block_with_format(
+  uint32_t **block_songs_codes,
+  uint32_t *block_song_lengths,
+  uint32_t n_songs,
+  char *path_out,
+  int code_sequences_already_sorted_distinct,
+  int postings_format);
+
+/**
+   Build and write `n_blocks` blocks (block `b` made of the
+   `blocks_n_songs[b]` songs of `blocks_songs_codes[b]`, written to
+   `paths_out[b]`) as by
+   `echoprint_inverted_index_build_write_block_with_format`, on up to
+   `n_threads` threads: a single block is split by songs among them,
+   several blocks are built one per thread. Return 0 if all ok, 1
+   otherwise.
+ */
+int echoprint_inverted_index_build_write_blocks(
+  uint32_t n_blocks,
+  uint32_t ***blocks_songs_codes,
+  uint32_t **blocks_song_lengths,
+  uint32_t *blocks_n_songs,
+  char **paths_out,
+  int code_sequences_already_sorted_distinct,
+  int postings_format,
+  int n_threads);
+
+/**
+   A forward index block: the (code, offset) pairs of each song of the
+   corresponding inverted index block, sorted by code then offset.
+   Serialized as a header (magic, version, n_songs, 0) followed by
+   `song_offsets` and `pairs`, all naturally aligned, so that a mapped
+   file is used in place.
+ */
+typedef struct _EchoprintForwardIndexBlock
+{
+  uint32_t n_songs;
+  uint64_t *song_offsets;   // start of each song's pairs (n_songs + 1)
+  uint32_t *pairs;          // code, offset, code, offset... (2 * total)
+  void *file_data;          // file contents backing the arrays, or 0
+  void *mapping;            // mmap-ed file backing the arrays, or 0
+  size_t mapping_length;
+} EchoprintForwardIndexBlock;
+
+/**
+   A forward index has one block per block of the inverted index it
+   goes with, holding the same songs in the same order.
+ */
+typedef struct _EchoprintForwardIndex
+{
+  uint32_t n_blocks;
+  EchoprintForwardIndexBlock *blocks;
+} EchoprintForwardIndex;
+
+/**
+   Load a forward index, `flags` being a combination of
+   ECHOPRINT_LOAD_MMAP and ECHOPRINT_LOAD_PREFETCH. Returns 0 if any
+   file cannot be opened or is invalid.
+ */
+EchoprintForwardIndex * echoprint_forward_index_load_from_paths(
+  char **paths,
+  int n_files,
+  int flags);
+
+void echoprint_forward_index_free(
+  EchoprintForwardIndex *index);
+
+/**
+   Write a forward index block holding the given songs, each made of
+   `song_lengths[n]` codes and their offsets (as decoded from an
+   echoprint string). Return 0 if all ok, 1 otherwise.
+ */
+int echoprint_forward_index_build_write_block(
+  uint32_t **songs_codes,
+  uint32_t **songs_offsets,
+  uint32_t *song_lengths,
+  uint32_t n_songs,
+  char *path_out);
+
+/**
+   Two-stage query: the best `n_candidates` songs of a regular query
+   (with `sim` and `options`) are re-ranked by temporal alignment with
+   the query. The score of a candidate is the largest number of its
+   (code, offset) pairs matching query pairs with the same offset
+   difference, give or take ECHOPRINT_ALIGN_SLOP; ties keep the
+   first-stage order. The best `n_results` candidates are returned as
+   in `echoprint_inverted_index_query`. The query arrays are not
+   modified.
+ */
+#define ECHOPRINT_ALIGN_SLOP 2
+
+uint32_t echoprint_inverted_index_query_rerank(
+  uint32_t query_length,
+  const uint32_t *query_codes,
+  const uint32_t *query_offsets,
+  EchoprintInvertedIndex *index,
+  EchoprintForwardIndex *forward_index,
+  uint32_t n_candidates,
+  uint32_t n_results,
+  uint32_t *output_indices,
+  float *output_scores,
+  similarity_function sim,
+  const EchoprintQueryOptions *options);
+
+/**
+   Decode an echoprint string, as output by `echoprint-codegen`, into
+   its codes and their offsets. Up to `max_codes` of each are stored in
+   `output_codes` and `output_offsets`; the return value is the number
+   of codes in the string (call again with larger buffers if it is
+   more than `max_codes`), or -1 if the string is invalid.
+ */
+long echoprint_decode(
+  const char *echoprint,
+  size_t length,
+  uint32_t *output_codes,
+  uint32_t *output_offsets,
+  uint32_t max_codes);
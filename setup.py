@@ -23,7 +23,8 @@
 from distutils.core import setup, Extension
 
 c_ext = Extension("echoprint_server_c",
-                  ["libechoprintserver.c", "echoprint_server_python.c"])
+                  ["libechoprintserver.c", "echoprint_server_python.c"],
+                  libraries=['z'])
 
 setup(
     name='echoprint_server',
@@ -0,0 +1,69 @@
+#!/usr/bin/env python
+# encoding: utf-8
+'''
+ * Copyright (c) 2016 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+'''
+# Time the build of index blocks made of the test fingerprints, run
+# from the repository root:
+#
+#     python test/benchmark_build.py [n_songs] [threads ...]
+#
+# Songs are the 100 test fingerprints over and over (the same lists,
+# to keep the Python memory use low), built as a single block then
+# split in four blocks. The timings include the conversion of the
+# songs from Python. The test fingerprints are long (about 5000
+# distinct codes each): a full block of 65535 songs takes a few GB.
+import os
+import sys
+import time
+import shutil
+import tempfile
+from echoprint_server import decode_echoprint
+from echoprint_server.lib import _create_index_blocks, POSTINGS_RAW16
+
+CODES_DIR = 'testdata/echoprint-strings'
+
+
+def benchmark_songs(n_songs):
+    paths = [os.path.join(CODES_DIR, f) for f in sorted(os.listdir(CODES_DIR))
+             if f.endswith('.echoprint')]
+    songs = [decode_echoprint(open(p).read().strip())[1] for p in paths]
+    return [songs[i % len(songs)] for i in xrange(n_songs)]
+
+
+if __name__ == '__main__':
+    n_songs = int(sys.argv[1]) if len(sys.argv) > 1 else 20000
+    all_threads = [int(t) for t in sys.argv[2:]] or [1, 2, 4]
+    songs = benchmark_songs(n_songs)
+    n_postings = sum(len(set(codes)) for codes in songs)
+    temp_dir = tempfile.mkdtemp()
+    print '%d songs, %d postings' % (n_songs, n_postings)
+    for n_blocks in [1, 4]:
+        paths = [os.path.join(temp_dir, 'block_%d' % b)
+                 for b in xrange(n_blocks)]
+        blocks = [songs[b * n_songs / n_blocks:(b + 1) * n_songs / n_blocks]
+                  for b in xrange(n_blocks)]
+        for threads in all_threads:
+            t = time.time()
+            _create_index_blocks(blocks, paths, POSTINGS_RAW16, threads)
+            elapsed = time.time() - t
+            print '%d block(s), %d thread(s): %.3f s, %.1f M postings/s' % \
+                (n_blocks, threads, elapsed, n_postings / elapsed / 1e6)
+    shutil.rmtree(temp_dir)
@@ -0,0 +1,109 @@
+#!/usr/bin/env python
+# encoding: utf-8
+'''
+ * Copyright (c) 2016 Spotify AB.
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+'''
+# Accuracy and latency of queries deferring or skipping frequent
+# codes (max_code_frequency), on the test fingerprints, run from the
+# repository root:
+#
+#     python test/benchmark_frequent_codes.py [n_songs] [n_queries]
+#
+# The index holds the 100 test fingerprints over and over, in blocks
+# of 65535 songs. Each query is 10% of the codes of a song plus as
+# many codes of other songs; it is found when its first result is a
+# copy of that song. Agreement is the fraction of queries whose first
+# result is (a copy of) the same song as when all codes are scored.
+import os
+import sys
+import random
+import shutil
+import tempfile
+from echoprint_server import decode_echoprint, create_inverted_index, \
+    load_inverted_index, query_inverted_index_with_stats
+
+CODES_DIR = 'testdata/echoprint-strings'
+FREQUENCIES = [0.5, 0.1, 0.05, 0.03, 0.02]
+
+
+def test_songs():
+    paths = [os.path.join(CODES_DIR, f) for f in sorted(os.listdir(CODES_DIR))
+             if f.endswith('.echoprint')]
+    return [decode_echoprint(open(p).read().strip())[1] for p in paths]
+
+
+def make_queries(songs, n_queries):
+    queries = []
+    for _ in xrange(n_queries):
+        s = random.randrange(len(songs))
+        window = len(songs[s]) / 10 + 1
+        start = random.randrange(len(songs[s]) - window + 1)
+        noise = [random.choice(songs[random.randrange(len(songs))])
+                 for _ in xrange(window)]
+        queries.append((s, songs[s][start:start + window] + noise))
+    return queries
+
+
+def run(index, queries, n_distinct, **options):
+    found, seconds, postings, frequent, first_songs = 0, 0., 0, 0, []
+    for s, query in queries:
+        results, stats = query_inverted_index_with_stats(
+            query, index, 'jaccard', **options)
+        first_songs.append(results[0]['index'] % n_distinct)
+        found += first_songs[-1] == s
+        seconds += stats['total_seconds']
+        postings += stats['postings_visited'] + stats['postings_searched']
+        frequent += stats['frequent_codes']
+    return found, seconds, postings, frequent, first_songs
+
+
+if __name__ == '__main__':
+    n_songs = int(sys.argv[1]) if len(sys.argv) > 1 else 20000
+    n_queries = int(sys.argv[2]) if len(sys.argv) > 2 else 500
+    random.seed(1)
+    songs = test_songs()
+    queries = make_queries(songs, n_queries)
+    temp_dir = tempfile.mkdtemp()
+    path = os.path.join(temp_dir, 'index')
+    create_inverted_index((songs[i % len(songs)] for i in xrange(n_songs)),
+                          path)
+    paths = [os.path.join(temp_dir, f) for f in sorted(os.listdir(temp_dir))]
+    index = load_inverted_index(paths)
+    print '%d songs, %d queries' % (n_songs, n_queries)
+    print '%-18s %8s %8s %9s %12s %9s' % (
+        'max_code_frequency', 'found', 'agree', 'mean ms', 'postings',
+        'frequent')
+    run(index, queries, len(songs))  # warm up
+    exact = None
+    for frequency in [0.] + FREQUENCIES:
+        for skip in [False, True] if frequency > 0 else [False]:
+            found, seconds, postings, frequent, first_songs = run(
+                index, queries, len(songs), max_code_frequency=frequency,
+                skip_frequent_codes=skip)
+            if exact is None:
+                exact = first_songs
+            agree = sum(a == b for a, b in zip(first_songs, exact))
+            name = '%g %s' % (frequency, 'skip' if skip else 'defer') \
+                if frequency > 0 else 'all codes'
+            print '%-18s %7.1f%% %7.1f%% %9.3f %12d %9.1f' % (
+                name, 100. * found / n_queries, 100. * agree / n_queries,
+                seconds * 1e3 / n_queries, postings / n_queries,
+                float(frequent) / n_queries)
+    shutil.rmtree(temp_dir)
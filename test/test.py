@@ -21,13 +21,35 @@
  * under the License.
 '''
 import unittest
+import sys
 import shutil
 import random
 import os
 import tempfile
+import struct
+import time
+import threading
+import base64
+import zlib
+import ctypes
+import array
+import json
+import socket
+import subprocess
+import urllib
+import urllib2
 from itertools import islice
 from echoprint_server import load_inverted_index, inverted_index_size, \
-    decode_echoprint, create_inverted_index, query_inverted_index
+    decode_echoprint, create_inverted_index, query_inverted_index, \
+    query_inverted_index_batch, inverted_index_set_threads, \
+    create_forward_index, load_forward_index, query_inverted_index_rerank, \
+    create_inverted_and_forward_index, \
+    inverted_index_insert, inverted_index_delete, inverted_index_compact, \
+    inverted_index_start_compaction, load_index_handle, index_handle_swap, \
+    query_inverted_index_with_stats, query_counters, reset_query_counters, \
+    consolidate_inverted_index, \
+    LOAD_MMAP, LOAD_PREFETCH, LOAD_CODE_DIRECTORY, LOAD_NO_CHECKSUMS
+from echoprint_server_c import _create_index_blocks, POSTINGS_RAW32
 
 
 class TestLoadIndex(unittest.TestCase):
@@ -38,6 +60,99 @@ class TestLoadIndex(unittest.TestCase):
         index = load_inverted_index(index_block_paths)
         self.assertEquals(inverted_index_size(index), 100)
 
+    def test_load_index_mmap(self):
+        # a memory-mapped index answers queries exactly like a loaded one
+        index_block_paths = ['testdata/inverted_index.bin']
+        index = load_inverted_index(index_block_paths)
+        mapped_index = load_inverted_index(
+            index_block_paths, LOAD_MMAP | LOAD_PREFETCH)
+        self.assertEquals(inverted_index_size(mapped_index), 100)
+        for codes in islice(codes_gen(), 10):
+            self.assertEquals(
+                query_inverted_index(codes, mapped_index, 'jaccard'),
+                query_inverted_index(codes, index, 'jaccard'))
+
+    def test_load_index_code_directory(self):
+        # code lookup tables do not change the results
+        index_block_paths = ['testdata/inverted_index.bin']
+        index = load_inverted_index(index_block_paths)
+        for flags in [LOAD_CODE_DIRECTORY, LOAD_CODE_DIRECTORY | LOAD_MMAP]:
+            directory_index = load_inverted_index(index_block_paths, flags)
+            for codes in islice(codes_gen(), 10):
+                for sim in ['jaccard', 'set_int']:
+                    self.assertEquals(
+                        query_inverted_index(codes, directory_index, sim),
+                        query_inverted_index(codes, index, sim))
+            self.assertEquals(
+                query_inverted_index([0, 1, 2 ** 31], directory_index,
+                                     'set_int'),
+                query_inverted_index([0, 1, 2 ** 31], index, 'set_int'))
+
+    def test_load_index_mmap_truncated(self):
+        # a truncated block file is rejected rather than mapped
+        temp_dir = tempfile.mkdtemp()
+        truncated_path = os.path.join(temp_dir, 'truncated')
+        with open(truncated_path, 'w') as f:
+            f.write(open('testdata/inverted_index.bin').read()[:1000])
+        self.assertRaises(Exception, load_inverted_index,
+                          [truncated_path], LOAD_MMAP)
+        shutil.rmtree(temp_dir)
+
+    def test_load_consolidated_index(self):
+        '''
+        Blocks of every format consolidated into a single file answer
+        queries like the block files, whichever way it is loaded, and
+        corrupted or truncated files are rejected.
+        '''
+        temp_dir = tempfile.mkdtemp()
+        path = os.path.join(temp_dir, 'index')
+        songs = list(codes_gen())
+        create_inverted_index(songs[:40], path + '_raw16')
+        create_inverted_index(songs[40:70], path + '_compressed',
+                              compressed=True)
+        _create_index_blocks([songs[70:]], [path + '_raw32'],
+                             POSTINGS_RAW32)
+        block_paths = [path + '_raw16', path + '_compressed',
+                       path + '_raw32']
+        consolidated_path = path + '.eidx'
+        consolidate_inverted_index(block_paths, consolidated_path)
+        data = open(consolidated_path).read()
+        magic, version, n_blocks, n_songs = struct.unpack('<4I', data[:16])
+        self.assertEquals((magic, version, n_blocks, n_songs),
+                          (0x58444945, 1, 3, 100))
+        self.assertEquals(len(data) % 64, 0)
+        offsets = struct.unpack('<5Q', data[64 + 16:64 + 56])
+        self.assertTrue(all(offset % 64 == 0 for offset in offsets))
+        index = load_inverted_index(block_paths)
+        for flags in [0, LOAD_MMAP | LOAD_PREFETCH, LOAD_CODE_DIRECTORY,
+                      LOAD_MMAP | LOAD_NO_CHECKSUMS]:
+            consolidated = load_inverted_index([consolidated_path], flags)
+            self.assertEquals(inverted_index_size(consolidated), 100)
+            for codes in songs[::9]:
+                self.assertEquals(
+                    query_inverted_index(codes, consolidated, 'jaccard'),
+                    query_inverted_index(codes, index, 'jaccard'))
+
+        # the consolidated file converts to itself
+        consolidate_inverted_index([consolidated_path], path + '.copy')
+        self.assertTrue(open(path + '.copy').read() == data)
+
+        corrupted_path = path + '.corrupted'
+        for position in [8, 64 + 4, len(data) - 200]:
+            with open(corrupted_path, 'w') as f:
+                f.write(data[:position] + chr(ord(data[position]) ^ 1) +
+                        data[position + 1:])
+            self.assertRaises(Exception, load_inverted_index,
+                              [corrupted_path])
+            self.assertRaises(Exception, load_inverted_index,
+                              [corrupted_path], LOAD_MMAP)
+        # only the arrays go unchecked
+        load_inverted_index([corrupted_path], LOAD_NO_CHECKSUMS)
+        with open(corrupted_path, 'w') as f:
+            f.write(data[:len(data) / 2])
+        self.assertRaises(Exception, load_inverted_index, [corrupted_path])
+        shutil.rmtree(temp_dir)
+
 
 class TestDecoding(unittest.TestCase):
 
@@ -48,15 +163,45 @@ class TestDecoding(unittest.TestCase):
             'testdata/echoprint_codes.txt').read().split(',')]
         self.assertEquals(decode_echoprint(codestring)[1], expected_codes)
 
+    def test_decode_echoprint_reference(self):
+        '''
+        The native decoder matches a plain Python one on all the test
+        strings, and rejects invalid strings.
+        '''
+        def reference(codestring):
+            unzipped = zlib.decompress(base64.urlsafe_b64decode(codestring))
+            N = len(unzipped)
+            return ([int(unzipped[i:i + 5], 16) for i in xrange(0, N / 2, 5)],
+                    [int(unzipped[i:i + 5], 16) for i in xrange(N / 2, N, 5)])
+        CODES_DIR = 'testdata/echoprint-strings'
+        for f in os.listdir(CODES_DIR):
+            codestring = open(os.path.join(CODES_DIR, f)).read().strip()
+            self.assertEquals(decode_echoprint(codestring),
+                              reference(codestring))
+        hex_codes = '0001f00a2b' * 4
+        self.assertEquals(
+            decode_echoprint(base64.urlsafe_b64encode(zlib.compress(
+                hex_codes + hex_codes.upper()))),
+            ([0x0001f, 0x00a2b] * 4, [0x0001f, 0x00a2b] * 4))
+        for invalid in ['', 'not base64 !', base64.urlsafe_b64encode('xyz'),
+                        base64.urlsafe_b64encode(zlib.compress('0001g' * 8))]:
+            self.assertRaises(ValueError, decode_echoprint, invalid)
 
-def codes_gen():
-    # read the codes for 100 songs
+
+def offsets_codes_gen():
+    # read the offsets and codes for 100 songs
     CODES_DIR = 'testdata/echoprint-strings'
     code_files = [f for f in sorted(os.listdir(CODES_DIR))
                   if f.endswith('.echoprint')]
     for f in code_files:
         codestr = open(os.path.join(CODES_DIR, f)).read().strip()
-        yield decode_echoprint(codestr)[1]
+        yield decode_echoprint(codestr)
+
+
+def codes_gen():
+    # read the codes for 100 songs
+    for offsets, codes in offsets_codes_gen():
+        yield codes
 
 
 class TestIndexMaking(unittest.TestCase):
@@ -70,6 +215,171 @@ class TestIndexMaking(unittest.TestCase):
                         open('testdata/inverted_index.bin').read())
         shutil.rmtree(temp_dir)
 
+    def test_make_compressed_inverted_index(self):
+        '''
+        With long posting lists a compressed index is smaller than the
+        raw one, and it answers queries identically whether read or
+        memory-mapped.
+        '''
+        temp_dir = tempfile.mkdtemp()
+        raw_path = os.path.join(temp_dir, 'raw')
+        compressed_path = os.path.join(temp_dir, 'compressed')
+        songs = [random.sample(xrange(10000), random.randint(200, 600))
+                 for _ in xrange(1000)]
+        create_inverted_index(songs, raw_path)
+        create_inverted_index(songs, compressed_path, compressed=True)
+        self.assertTrue(os.path.getsize(compressed_path) <
+                        os.path.getsize(raw_path))
+        raw_index = load_inverted_index([raw_path])
+        for flags in [0, LOAD_MMAP, LOAD_CODE_DIRECTORY]:
+            compressed_index = load_inverted_index([compressed_path], flags)
+            self.assertEquals(inverted_index_size(compressed_index), 1000)
+            for codes in songs[:20]:
+                self.assertEquals(
+                    query_inverted_index(codes, compressed_index, 'jaccard'),
+                    query_inverted_index(codes, raw_index, 'jaccard'))
+        shutil.rmtree(temp_dir)
+
+    def test_make_inverted_index_threads(self):
+        '''
+        Blocks built on several threads, one or several at once and
+        with codes wider than the counting sort buckets, are identical
+        to the ones built on a single thread, which are serialized as
+        expected.
+        '''
+        def block_bytes(songs):
+            songs = [sorted(set(codes)) for codes in songs]
+            codes = sorted(set(c for song in songs for c in song))
+            postings = dict((c, []) for c in codes)
+            for i, song in enumerate(songs):
+                for c in song:
+                    postings[c].append(i)
+            return struct.pack(
+                '<II%dI%dI%dI%dH' % (len(codes), len(codes), len(songs),
+                                     sum(map(len, songs))),
+                len(codes), len(songs), *(
+                    codes + [len(postings[c]) for c in codes] +
+                    map(len, songs) + sum((postings[c] for c in codes), [])))
+
+        temp_dir = tempfile.mkdtemp()
+        path = os.path.join(temp_dir, 'index')
+        create_inverted_index(list(codes_gen()), path, threads=4)
+        self.assertTrue(open(path).read() ==
+                        open('testdata/inverted_index.bin').read())
+        wide_songs = [[random.randint(0, 2 ** 32 - 1) for _ in xrange(50)] +
+                      [random.randint(0, 100) for _ in xrange(50)]
+                      for _ in xrange(300)]
+        create_inverted_index(wide_songs, path, threads=3)
+        self.assertTrue(open(path).read() == block_bytes(wide_songs))
+        shutil.rmtree(temp_dir)
+
+    def test_make_inverted_index_buffers(self):
+        '''
+        Songs given as buffers of 32-bit codes, used in place when
+        sorted, give the same blocks as lists of codes.
+        '''
+        temp_dir = tempfile.mkdtemp()
+        path = os.path.join(temp_dir, 'index')
+        all_codes = [sorted(set(codes)) for codes in codes_gen()]
+        buffers = [(ctypes.c_uint32 * len(codes))(*codes)
+                   for codes in all_codes]
+        create_inverted_index(all_codes, path + '_list')
+        create_inverted_index(buffers, path + '_copied')
+        create_inverted_index(buffers, path + '_sorted', presorted=True)
+        for suffix in ['_copied', '_sorted']:
+            self.assertTrue(open(path + suffix).read() ==
+                            open(path + '_list').read())
+        self.assertEquals(list(buffers[0]), all_codes[0])
+        self.assertRaises(TypeError, create_inverted_index,
+                          [['not a code']], path)
+        shutil.rmtree(temp_dir)
+
+    def test_make_inverted_index_several_blocks(self):
+        temp_dir = tempfile.mkdtemp()
+        path = os.path.join(temp_dir, 'index')
+        songs = [random.sample(xrange(1000), 3) for _ in xrange(150000)]
+        create_inverted_index(songs, path + '_1')
+        create_inverted_index(songs, path + '_4', threads=4)
+        for block in ['_0000', '_0001', '_0002']:
+            self.assertTrue(open(path + '_1' + block).read() ==
+                            open(path + '_4' + block).read())
+        index = load_inverted_index(
+            [path + '_4' + block for block in ['_0000', '_0001', '_0002']])
+        self.assertEqual(inverted_index_size(index), 150000)
+        shutil.rmtree(temp_dir)
+
+    def test_make_large_inverted_index_block(self):
+        '''
+        Blocks of more than 65535 songs are written with 32-bit postings
+        (or compressed) and answer queries like the same songs split in
+        several blocks.
+        '''
+        temp_dir = tempfile.mkdtemp()
+        path = os.path.join(temp_dir, 'index')
+        songs = [random.sample(xrange(1000), 3) for _ in xrange(70000)]
+        create_inverted_index(songs, path + '_split')
+        create_inverted_index(songs, path + '_raw', max_block_songs=70000)
+        create_inverted_index(songs, path + '_raw4', threads=4,
+                              max_block_songs=70000)
+        create_inverted_index(songs, path + '_compressed', compressed=True,
+                              max_block_songs=70000)
+        self.assertFalse(os.path.exists(path + '_raw_0000'))
+        self.assertTrue(open(path + '_raw').read() ==
+                        open(path + '_raw4').read())
+        header = struct.unpack('<5I', open(path + '_raw').read(20))
+        self.assertEquals(header[:3], (0x4b4c4245, 2, 2))
+        self.assertEquals(header[4], 70000)
+        split_index = load_inverted_index(
+            [path + '_split_0000', path + '_split_0001'])
+        queries = [songs[i] + random.sample(xrange(1000), 2)
+                   for i in [0, 65534, 65535, 65536, 69999]]
+        for suffix in ['_raw', '_compressed']:
+            for flags in [0, LOAD_MMAP, LOAD_CODE_DIRECTORY]:
+                index = load_inverted_index([path + suffix], flags)
+                self.assertEquals(inverted_index_size(index), 70000)
+                for query in queries:
+                    self.assertEquals(
+                        query_inverted_index(query, index, 'jaccard', 20),
+                        query_inverted_index(query, split_index, 'jaccard',
+                                             20))
+        shutil.rmtree(temp_dir)
+
+    def test_build_tool(self):
+        '''
+        echoprint-inverted-index-build, found in the CMake build
+        directory given by ECHOPRINT_BUILD_DIR (default: build), writes
+        the same files as create_inverted_index from the echoprint
+        strings, in one block or several; skipped if it has not been
+        built.
+        '''
+        tool = os.path.join(os.environ.get('ECHOPRINT_BUILD_DIR', 'build'),
+                            'echoprint-inverted-index-build')
+        if not os.path.exists(tool):
+            self.skipTest('echoprint-inverted-index-build not built')
+        CODES_DIR = 'testdata/echoprint-strings'
+        inputs = [os.path.join(CODES_DIR, f)
+                  for f in sorted(os.listdir(CODES_DIR))
+                  if f.endswith('.echoprint')]
+        all_codes = list(codes_gen())
+        temp_dir = tempfile.mkdtemp()
+        path = os.path.join(temp_dir, 'index')
+        with open(os.devnull, 'w') as devnull:
+            self.assertEquals(subprocess.call(
+                [tool, path + '_tool'] + inputs, stderr=devnull), 0)
+            self.assertEquals(subprocess.call(
+                [tool, '-b', '30', '-t', '3', path + '_tool_split'] + inputs,
+                stderr=devnull), 0)
+        create_inverted_index(all_codes, path)
+        create_inverted_index(all_codes, path + '_split', max_block_songs=30)
+        self.assertFalse(os.path.exists(path + '_tool_0000'))
+        self.assertTrue(open(path + '_tool').read() == open(path).read())
+        self.assertFalse(os.path.exists(path + '_tool_split'))
+        for block in ['_0000', '_0001', '_0002', '_0003']:
+            self.assertTrue(open(path + '_tool_split' + block).read() ==
+                            open(path + '_split' + block).read())
+        self.assertFalse(os.path.exists(path + '_tool_split_0004'))
+        shutil.rmtree(temp_dir)
+
 
 class TestIndexQuerying(unittest.TestCase):
 
@@ -128,6 +438,627 @@ class TestIndexQuerying(unittest.TestCase):
 
         shutil.rmtree(temp_dir)
 
+    def test_short_queries(self):
+        '''
+        Queries of a few dozen codes against a block with hundreds of
+        times more codes, where the query codes are found by galloping
+        rather than merging, score every matching song like a reference
+        Jaccard similarity, whether or not the block has a code
+        directory.
+        '''
+        def jaccard_similarity(a, b):
+            a = set(a)
+            b = set(b)
+            return float(len(a & b)) / float(len(a | b))
+
+        temp_dir = tempfile.mkdtemp()
+        path = os.path.join(temp_dir, 'index')
+        songs = [random.sample(xrange(200000), random.randint(200, 600))
+                 for _ in xrange(2000)]
+        create_inverted_index(songs, path)
+        index = load_inverted_index([path])
+        directory_index = load_inverted_index([path], LOAD_CODE_DIRECTORY)
+        for _ in xrange(50):
+            song = random.choice(songs)
+            n_codes = random.randint(20, 50)
+            query = random.sample(song, n_codes / 2) + \
+                random.sample(xrange(200000), n_codes - n_codes / 2)
+            expected = [jaccard_similarity(query, s) for s in songs]
+            n_matching = sum(1 for score in expected if score > 0)
+            results = query_inverted_index(query, index, 'jaccard',
+                                           n_results=n_matching)
+            self.assertEquals(len(results), n_matching)
+            for res in results:
+                self.assertAlmostEqual(res['score'],
+                                       expected[res['index']], 5)
+            self.assertTrue(results[-1]['score'] > 0)
+            self.assertEquals(
+                query_inverted_index(query, directory_index, 'jaccard',
+                                     n_results=n_matching), results)
+        shutil.rmtree(temp_dir)
+
+    def test_filter_kernels(self):
+        '''
+        The scalar, SSE2 and AVX2 score filtering kernels, forced with
+        ECHOPRINT_KERNEL in a process each (the kernel is picked once per
+        process), give the same results and scores, for every similarity
+        and with or without a minimum score. Kernels the CPU lacks fall
+        back to the next one.
+        '''
+        script = '''
+import sys, json, random
+from echoprint_server import load_inverted_index, query_inverted_index, \\
+    query_inverted_index_batch
+random.seed(1)
+index = load_inverted_index([sys.argv[1]])
+queries = [random.sample(xrange(1000), random.randint(20, 400))
+           for _ in xrange(30)]
+results = []
+for sim in ['jaccard', 'set_int', 'set_int_norm_length_first']:
+    for min_score in [0., 0.1, 50.]:
+        results.append([query_inverted_index(query, index, sim, min_score,
+                                             n_results=37)
+                        for query in queries])
+    results.append(query_inverted_index_batch(queries, index, sim,
+                                              n_results=37))
+print json.dumps(results)
+'''
+        temp_dir = tempfile.mkdtemp()
+        path = os.path.join(temp_dir, 'index')
+        # 1003 songs: the vectorized loops leave a scalar tail
+        create_inverted_index(
+            [random.sample(xrange(1000), random.randint(100, 600))
+             for _ in xrange(1003)], path)
+        outputs = {}
+        for kernel in ['scalar', 'sse2', 'avx2']:
+            env = dict(os.environ, ECHOPRINT_KERNEL=kernel)
+            outputs[kernel] = subprocess.check_output(
+                [sys.executable, '-c', script, path], env=env)
+        results = json.loads(outputs['scalar'])
+        self.assertTrue(all(len(r) == 37 for r in results[0]))
+        self.assertTrue(any(r['score'] > 0 for r in results[0][0]))
+        self.assertEquals(outputs['sse2'], outputs['scalar'])
+        self.assertEquals(outputs['avx2'], outputs['scalar'])
+        shutil.rmtree(temp_dir)
+
+    def test_few_matching_songs(self):
+        '''
+        When fewer songs than results share codes with the query, the
+        remaining results are the other songs with a zero score, last
+        songs first.
+        '''
+        inverted_index = load_inverted_index(['testdata/inverted_index.bin'])
+        codes = list(islice(codes_gen(), 3))[2]
+        results = query_inverted_index(
+            [codes[0], 1 << 30], inverted_index, 'set_int')
+        matching = [r for r in results if r['score'] > 0]
+        self.assertTrue(2 in [r['index'] for r in matching])
+        self.assertEquals(
+            [r['index'] for r in results[len(matching):]],
+            [i for i in range(99, -1, -1)
+             if i not in [r['index'] for r in matching]][
+                 :len(results) - len(matching)])
+        self.assertEquals(
+            [r['score'] for r in results[len(matching):]],
+            [0.] * (len(results) - len(matching)))
+
+    def test_min_score(self):
+        '''
+        A minimum score drops the lower-scoring results and keeps the
+        ranking of the others.
+        '''
+        inverted_index = load_inverted_index(['testdata/inverted_index.bin'])
+        for codes in islice(codes_gen(), 10):
+            results = query_inverted_index(codes, inverted_index, 'jaccard')
+            cutoff = results[3]['score']
+            expected = [r for r in results if r['score'] >= cutoff]
+            self.assertEquals(query_inverted_index(
+                codes, inverted_index, 'jaccard', cutoff), expected)
+        self.assertEquals(query_inverted_index(
+            [1, 2, 3], inverted_index, 'jaccard', 0.5), [])
+
+    def test_score_bound_pruning(self):
+        '''
+        Skipping the blocks and codeblocks that cannot make it to the
+        results does not change them: compare with an exhaustive
+        ranking (scores rounded to single precision like the library).
+        '''
+        def as_float32(x):
+            return struct.unpack('f', struct.pack('f', x))[0]
+
+        temp_dir = tempfile.mkdtemp()
+        songs, paths = [], []
+        for b in range(3):
+            block_songs = [random.sample(xrange(2000), random.randint(50, 400))
+                           for _ in xrange(100)]
+            paths.append(os.path.join(temp_dir, 'block%d' % b))
+            create_inverted_index(block_songs, paths[-1])
+            songs.extend(block_songs)
+        inverted_index = load_inverted_index(paths)
+
+        for _ in range(20):
+            song = random.choice(songs)
+            query = set(random.sample(song, len(song) / 2) +
+                        random.sample(xrange(2000), 100))
+            for min_score in [0., 0.2]:
+                expected = sorted(
+                    [(-as_float32(float(len(query & set(s))) /
+                                  len(query | set(s))), -i)
+                     for i, s in enumerate(songs)])
+                expected = [(-i, -score) for score, i in expected
+                            if -score >= min_score][:10]
+                results = query_inverted_index(
+                    list(query), inverted_index, 'jaccard', min_score)
+                self.assertEquals(
+                    [(r['index'], r['score']) for r in results], expected)
+        shutil.rmtree(temp_dir)
+
+    def test_frequent_codes(self):
+        '''
+        Frequent codes, when skipped, are not counted; when deferred,
+        the scores of the songs found stay exact. Single and batch
+        queries agree in both cases.
+        '''
+        def ranking(query, songs):
+            expected = sorted((-float(len(query & set(s))), -i)
+                              for i, s in enumerate(songs))
+            return [(-i, -score) for score, i in expected][:10]
+
+        temp_dir = tempfile.mkdtemp()
+        path = os.path.join(temp_dir, 'index')
+        # codes 0 to 3 are held by (nearly) all the songs
+        frequent = set([0, 1, 2, 3])
+        songs = [random.sample(xrange(10, 5000), random.randint(20, 60)) +
+                 [0, 1, 2] + ([3] if i % 4 else []) for i in xrange(400)]
+        create_inverted_index(songs, path)
+        index = load_inverted_index([path])
+        queries = []
+        for _ in range(20):
+            song = random.choice(songs)
+            query = set(random.sample(song, len(song) / 2) + list(frequent) +
+                        random.sample(xrange(10, 5000), 20))
+            queries.append(list(query))
+            results, stats = query_inverted_index_with_stats(
+                list(query), index, 'set_int', max_code_frequency=0.5,
+                skip_frequent_codes=True)
+            self.assertEquals(stats['frequent_codes'], 4)
+            self.assertEquals([(r['index'], r['score']) for r in results],
+                              ranking(query - frequent, songs))
+            results, stats = query_inverted_index_with_stats(
+                list(query), index, 'set_int', max_code_frequency=0.5)
+            self.assertEquals(stats['frequent_codes'], 4)
+            self.assertEquals([(r['index'], r['score']) for r in results],
+                              ranking(query, songs))
+        self.assertEquals(
+            query_inverted_index_batch(queries, index, 'set_int',
+                                       max_code_frequency=0.5,
+                                       skip_frequent_codes=True),
+            [query_inverted_index(query, index, 'set_int',
+                                  max_code_frequency=0.5,
+                                  skip_frequent_codes=True)
+             for query in queries])
+        self.assertEquals(
+            query_inverted_index_batch(queries, index, 'set_int',
+                                       n_results=400, max_code_frequency=0.5),
+            [query_inverted_index(query, index, 'set_int', n_results=400,
+                                  max_code_frequency=0.5)
+             for query in queries])
+        shutil.rmtree(temp_dir)
+
+    def test_parallel_querying(self):
+        '''
+        Querying a multi-block index with several threads returns
+        exactly the same results as querying it sequentially.
+        '''
+        index_block_paths = ['testdata/inverted_index.bin'] * 5
+        inverted_index = load_inverted_index(index_block_paths)
+        parallel_inverted_index = load_inverted_index(index_block_paths)
+        inverted_index_set_threads(parallel_inverted_index, 3)
+        for sim in ['jaccard', 'set_int', 'set_int_norm_length_first']:
+            for codes in islice(codes_gen(), 20):
+                self.assertEquals(
+                    query_inverted_index(
+                        codes, parallel_inverted_index, sim),
+                    query_inverted_index(codes, inverted_index, sim))
+
+    def test_batch_querying(self):
+        '''
+        A batch query returns, for each query, the same results as
+        the corresponding single query, with or without threads.
+        '''
+        inverted_index = load_inverted_index(
+            ['testdata/inverted_index.bin'] * 3)
+        all_codes = list(codes_gen())
+        expected = [query_inverted_index(codes, inverted_index, 'jaccard')
+                    for codes in all_codes]
+        self.assertEquals(query_inverted_index_batch(
+            all_codes, inverted_index, 'jaccard'), expected)
+        inverted_index_set_threads(inverted_index, 4)
+        self.assertEquals(query_inverted_index_batch(
+            all_codes, inverted_index, 'jaccard'), expected)
+        self.assertEquals(query_inverted_index_batch(
+            [], inverted_index, 'jaccard'), [])
+
+    def test_query_arguments(self):
+        '''
+        Queries accept buffers of 32-bit codes and return up to
+        n_results results, as dicts or arrays.
+        '''
+        inverted_index = load_inverted_index(['testdata/inverted_index.bin'])
+        for codes in islice(codes_gen(), 10):
+            expected = query_inverted_index(
+                codes, inverted_index, 'jaccard', n_results=20)
+            self.assertEquals(
+                expected[:10],
+                query_inverted_index(codes, inverted_index, 'jaccard'))
+            for query in [(ctypes.c_uint32 * len(codes))(*codes),
+                          (ctypes.c_int32 * len(codes))(*codes),
+                          tuple(long(c) for c in codes)]:
+                self.assertEquals(query_inverted_index(
+                    query, inverted_index, 'jaccard', n_results=20), expected)
+            indices, scores = query_inverted_index(
+                codes, inverted_index, 'jaccard', n_results=20,
+                as_arrays=True)
+            self.assertEquals(indices, array.array(
+                'I', [r['index'] for r in expected]))
+            self.assertEquals(scores, array.array(
+                'f', [r['score'] for r in expected]))
+            self.assertEquals(
+                query_inverted_index_batch(
+                    [codes], inverted_index, 'jaccard', n_results=20,
+                    as_arrays=True),
+                [(indices, scores)])
+        self.assertRaises(ValueError, query_inverted_index, codes,
+                          inverted_index, 'jaccard', n_results=0)
+        self.assertRaises(TypeError, query_inverted_index, ['not a code'],
+                          inverted_index, 'jaccard')
+
+    def test_query_input_untouched(self):
+        '''
+        Queries read the caller's codes in place without reordering or
+        deduplicating them, whatever the number of threads and results.
+        '''
+        inverted_index = load_inverted_index(
+            ['testdata/inverted_index.bin'] * 3)
+        for threads in [1, 3]:
+            inverted_index_set_threads(inverted_index, threads)
+            for n_results, codes in enumerate(islice(codes_gen(), 20)):
+                codes = codes[::-1] + codes[:5]
+                query = (ctypes.c_uint32 * len(codes))(*codes)
+                results = query_inverted_index(
+                    query, inverted_index, 'jaccard', n_results=n_results + 1)
+                self.assertEquals(list(query), codes)
+                self.assertEquals(results, query_inverted_index(
+                    sorted(set(codes)), inverted_index, 'jaccard',
+                    n_results=n_results + 1))
+
+    def test_concurrent_querying(self):
+        '''
+        Queries from several Python threads, which run without the GIL,
+        return the same results as sequential ones.
+        '''
+        inverted_index = load_inverted_index(
+            ['testdata/inverted_index.bin'] * 3)
+        all_codes = list(islice(codes_gen(), 50))
+        expected = [query_inverted_index(codes, inverted_index, 'set_int')
+                    for codes in all_codes]
+        results = [None] * len(all_codes)
+
+        def query(first):
+            for n in xrange(first, len(all_codes), 4):
+                results[n] = query_inverted_index(
+                    all_codes[n], inverted_index, 'set_int')
+        threads = [threading.Thread(target=query, args=(first,))
+                   for first in xrange(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEquals(results, expected)
+
+    def test_query_stats(self):
+        '''
+        A query's statistics account for its codes and blocks, and add
+        up in the process-wide counters; they do not change the
+        results.
+        '''
+        inverted_index = load_inverted_index(
+            ['testdata/inverted_index.bin'] * 3)
+        inverted_index_set_threads(inverted_index, 2)
+        reset_query_counters()
+        all_codes = list(islice(codes_gen(), 10))
+        for codes in all_codes:
+            results, stats = query_inverted_index_with_stats(
+                codes + codes[:10], inverted_index, 'jaccard')
+            self.assertEquals(
+                results, query_inverted_index(codes, inverted_index,
+                                              'jaccard'))
+            self.assertEquals(stats['query_codes'], len(codes) + 10)
+            self.assertEquals(stats['distinct_codes'], len(set(codes)))
+            self.assertTrue(0 < stats['matched_codes'] <=
+                            3 * stats['distinct_codes'])
+            self.assertEquals(
+                stats['blocks_scanned'] + stats['blocks_skipped'], 3)
+            self.assertTrue(stats['postings_visited'] > 0)
+            self.assertTrue(stats['total_seconds'] >= stats['dedup_seconds'] +
+                            stats['scoring_seconds'])
+        counters = query_counters()
+        self.assertEquals(counters['n_queries'], 2 * len(all_codes))
+        self.assertEquals(sum(counters['latency_histogram']),
+                          2 * len(all_codes))
+        self.assertEquals(
+            counters['query_codes'],
+            sum(2 * len(codes) + 10 for codes in all_codes))
+        reset_query_counters()
+        self.assertEquals(query_counters()['n_queries'], 0)
+
+
+class TestReranking(unittest.TestCase):
+
+    def test_rerank(self):
+        '''
+        An excerpt of a song, with its offsets shifted and random codes
+        added, is found by the two-stage query with all of its codes
+        aligned, whether the forward index is read or mapped and
+        whether the query is given as lists or buffers.
+        '''
+        temp_dir = tempfile.mkdtemp()
+        forward_index_path = os.path.join(temp_dir, 'forward')
+        songs = list(offsets_codes_gen())
+        create_forward_index(songs, forward_index_path)
+        inverted_index = load_inverted_index(['testdata/inverted_index.bin'])
+        for flags in [0, LOAD_MMAP]:
+            forward_index = load_forward_index([forward_index_path], flags)
+            for i, (offsets, codes) in enumerate(songs[:10]):
+                start = len(codes) / 3
+                excerpt = range(start, start + len(codes) / 4)
+                query_offsets = [offsets[n] + 1000
+                                 for n in excerpt] + range(200)
+                query_codes = [codes[n] for n in excerpt] + \
+                    random.sample(xrange(1 << 20), 200)
+                query = list(query_codes)
+                results = query_inverted_index_rerank(
+                    query_codes, query_offsets, inverted_index,
+                    forward_index, 'jaccard', 20)
+                self.assertEquals(query_codes, query)   # not modified
+                self.assertEquals(results[0]['index'], i)
+                self.assertTrue(results[0]['score'] >= len(excerpt))
+                self.assertTrue(results[1]['score'] < len(excerpt) / 2)
+                self.assertEquals(
+                    query_inverted_index_rerank(
+                        array.array('I', query_codes),
+                        array.array('I', query_offsets), inverted_index,
+                        forward_index, 'jaccard', 20, n_results=3),
+                    results[:3])
+        self.assertRaises(ValueError, query_inverted_index_rerank,
+                          [1, 2], [1], inverted_index, forward_index,
+                          'jaccard')
+        self.assertRaises(ValueError, query_inverted_index_rerank,
+                          [1], [1], inverted_index, forward_index,
+                          'jaccard', 0)
+        shutil.rmtree(temp_dir)
+
+    def test_create_inverted_and_forward_index(self):
+        '''
+        Both indices written from a single pass over the songs are the
+        ones written separately, in one block or several.
+        '''
+        temp_dir = tempfile.mkdtemp()
+        path = os.path.join(temp_dir, 'index')
+        songs = list(offsets_codes_gen())
+        for block_songs, blocks in [(100, ['']),
+                                    (30, ['_0000', '_0001', '_0002',
+                                          '_0003'])]:
+            create_inverted_index((codes for offsets, codes in songs),
+                                  path, max_block_songs=block_songs)
+            create_forward_index(songs, path + '_fwd',
+                                 max_block_songs=block_songs)
+            create_inverted_and_forward_index(
+                iter(songs), path + '_both', path + '_both_fwd', threads=2,
+                max_block_songs=block_songs)
+            for block in blocks:
+                self.assertTrue(open(path + '_both' + block).read() ==
+                                open(path + block).read())
+                self.assertTrue(open(path + '_both_fwd' + block).read() ==
+                                open(path + '_fwd' + block).read())
+        shutil.rmtree(temp_dir)
+
+
+class TestUpdates(unittest.TestCase):
+
+    def test_insert_compact(self):
+        '''
+        Songs inserted in an index holding the first half of the test
+        songs are found as if the index held all of them, before and
+        after compacting the index.
+        '''
+        temp_dir = tempfile.mkdtemp()
+        half_index_path = os.path.join(temp_dir, 'half')
+        songs = list(codes_gen())
+        create_inverted_index(songs[:50], half_index_path)
+        full_index = load_inverted_index(['testdata/inverted_index.bin'])
+        expected = [query_inverted_index(codes, full_index, 'jaccard')
+                    for codes in songs]
+        for flags in [0, LOAD_CODE_DIRECTORY]:
+            inverted_index = load_inverted_index([half_index_path], flags)
+            for i, codes in enumerate(songs[50:]):
+                self.assertEqual(
+                    inverted_index_insert(inverted_index, codes), 50 + i)
+            self.assertEqual(inverted_index_size(inverted_index), 100)
+            for compact in [False, True]:
+                if compact:
+                    inverted_index_compact(inverted_index)
+                    self.assertEqual(inverted_index_size(inverted_index), 100)
+                self.assertEqual(
+                    [query_inverted_index(codes, inverted_index, 'jaccard')
+                     for codes in songs], expected)
+                self.assertEqual(query_inverted_index_batch(
+                    songs, inverted_index, 'jaccard'), expected)
+        shutil.rmtree(temp_dir)
+
+    def test_delete(self):
+        '''
+        Deleted songs, loaded or inserted, are never returned, and
+        the other songs keep their indices.
+        '''
+        songs = list(codes_gen())
+        inverted_index = load_inverted_index(['testdata/inverted_index.bin'])
+        for codes in songs[:10]:
+            inverted_index_insert(inverted_index, codes)
+        deleted = set(range(0, 110, 3))
+        for i in deleted:
+            inverted_index_delete(inverted_index, i)
+        self.assertRaises(IndexError, inverted_index_delete,
+                          inverted_index, 110)
+        for compact in [False, True]:
+            if compact:
+                inverted_index_compact(inverted_index)
+            for i, codes in enumerate(songs + songs[:10]):
+                results = query_inverted_index(
+                    codes, inverted_index, 'jaccard')
+                self.assertFalse(
+                    deleted & set(r['index'] for r in results))
+                if i not in deleted:
+                    self.assertEqual(results[0]['score'], 1.)
+                    self.assertEqual(results[0]['index'] % 100, i % 100)
+
+    def test_background_compaction(self):
+        '''
+        Songs inserted while queries run are compacted in the
+        background without changing the results.
+        '''
+        songs = list(codes_gen())
+        inverted_index = load_inverted_index(['testdata/inverted_index.bin'])
+        inverted_index_start_compaction(inverted_index, 1)
+        for i, codes in enumerate(songs):
+            self.assertEqual(
+                inverted_index_insert(inverted_index, codes), 100 + i)
+            results = query_inverted_index(codes, inverted_index, 'jaccard')
+            self.assertEqual(sorted(r['index'] for r in results[:2]),
+                             [i, 100 + i])
+        time.sleep(0.05)
+        inverted_index_start_compaction(inverted_index, 0)
+        self.assertEqual(inverted_index_size(inverted_index), 200)
+        for i, codes in enumerate(songs):
+            results = query_inverted_index(codes, inverted_index, 'jaccard')
+            self.assertEqual([r['index'] for r in results[:2]],
+                             [100 + i, i])
+
+
+class TestIndexHandle(unittest.TestCase):
+
+    def test_swap(self):
+        '''
+        An index handle is queried like an index; swapping in another
+        index, while queries run from another thread, changes the
+        results of the following queries only.
+        '''
+        temp_dir = tempfile.mkdtemp()
+        half_index_path = os.path.join(temp_dir, 'half')
+        songs = list(codes_gen())
+        create_inverted_index(songs[:50], half_index_path)
+        handle = load_index_handle(['testdata/inverted_index.bin'])
+        self.assertEqual(inverted_index_size(handle), 100)
+        self.assertEqual(query_inverted_index(songs[70], handle, 'jaccard')[0],
+                         {'index': 70, 'score': 1.})
+        index_handle_swap(handle, [half_index_path], LOAD_MMAP, 2)
+        self.assertEqual(inverted_index_size(handle), 50)
+        self.assertNotEqual(
+            query_inverted_index(songs[70], handle, 'jaccard')[0]['index'],
+            70)
+        self.assertRaises(Exception, index_handle_swap, handle,
+                          ['this-file-does-not-exist'])
+        self.assertEqual(inverted_index_size(handle), 50)
+
+        def swap():
+            for n in xrange(20):
+                index_handle_swap(
+                    handle, [half_index_path] if n % 2 else
+                    ['testdata/inverted_index.bin'])
+        swapper = threading.Thread(target=swap)
+        swapper.start()
+        while swapper.is_alive():
+            for i, codes in enumerate(songs[:50]):
+                self.assertEqual(
+                    query_inverted_index(codes, handle, 'jaccard')[0],
+                    {'index': i, 'score': 1.})
+        swapper.join()
+        self.assertEqual(inverted_index_size(handle), 50)
+        shutil.rmtree(temp_dir)
+
+
+class TestRouter(unittest.TestCase):
+    '''
+    End-to-end test of echoprint-http-server, found in the CMake build
+    directory given by ECHOPRINT_BUILD_DIR (default: build); skipped
+    if it has not been built.
+    '''
+
+    def setUp(self):
+        self.server = os.path.join(
+            os.environ.get('ECHOPRINT_BUILD_DIR', 'build'),
+            'echoprint-http-server')
+        if not os.path.exists(self.server):
+            self.skipTest('echoprint-http-server not built')
+        self.processes = []
+
+    def tearDown(self):
+        for process in self.processes:
+            if process.poll() is None:
+                process.kill()
+                process.wait()
+
+    def start(self, *args):
+        s = socket.socket()
+        s.bind(('127.0.0.1', 0))
+        port = s.getsockname()[1]
+        s.close()
+        self.processes.append(subprocess.Popen(
+            [self.server, '-w', '2', '-p', str(port)] + list(args),
+            stdout=open(os.devnull, 'w'), stderr=subprocess.STDOUT))
+        for attempt in range(100):
+            try:
+                socket.create_connection(('127.0.0.1', port)).close()
+                return port
+            except socket.error:
+                time.sleep(0.05)
+        self.fail('server did not start')
+
+    def query(self, port, method, echoprint, n_results):
+        return json.loads(urllib2.urlopen(
+            'http://127.0.0.1:%d/query/%s' % (port, method),
+            urllib.urlencode({'echoprint': echoprint,
+                              'results': n_results})).read())
+
+    def test_router(self):
+        '''
+        Routing to two shards holding a block each returns the results
+        of a server holding both blocks; with a shard down, those of
+        the others, marked as partial.
+        '''
+        index_path = 'testdata/inverted_index.bin'
+        single = self.start(index_path, index_path)
+        shards = [self.start('-b', '0', index_path),
+                  self.start('-b', '100', index_path)]
+        router = self.start('-s', ','.join(
+            '127.0.0.1:%d' % port for port in shards))
+        codes_dir = 'testdata/echoprint-strings'
+        for f in sorted(os.listdir(codes_dir))[:10]:
+            echoprint = open(os.path.join(codes_dir, f)).read().strip()
+            for method in ['jaccard', 'set_int', 'set_int_norm_length_first']:
+                self.assertEquals(
+                    self.query(router, method, echoprint, 25),
+                    self.query(single, method, echoprint, 25))
+
+        self.processes[2].kill()
+        self.processes[2].wait()
+        response = self.query(router, 'jaccard', echoprint, 10)
+        self.assertTrue(response['partial'])
+        self.assertEquals(response['failed_shards'], [1])
+        self.assertEquals(response['results'],
+                          self.query(shards[0], 'jaccard', echoprint, 10)[
+                              'results'])
+
 
 class TestMemoryLeaks(unittest.TestCase):
 